@@ -5,8 +5,13 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum stack_error_e {
     STACK_OK,
     STACK_ALLOCATION_ERROR,
@@ -19,12 +24,255 @@ typedef enum stack_error_e {
     STACK_CORRUPTION_ERROR,
 } STACK_ERROR;
 
+/**
+ * Protection features and storage options that can be turned on for each Stack individually
+ */
+typedef enum stack_flags_e {
+    STACK_NO_PROTECTION = 0,
+    STACK_USE_CANARY = 1u << 0,
+    STACK_USE_DATA_CANARY = 1u << 1,
+    STACK_USE_HASH_FAST = 1u << 2,
+    /// Implies #STACK_USE_HASH_FAST
+    STACK_USE_HASH_FULL = 1u << 3,
+    STACK_USE_POISON = 1u << 4,
+    STACK_USE_LOG = 1u << 5,
+    STACK_USE_ALL = (1u << 6) - 1,
+    /// Store elements in a list of fixed-size segments instead of one contiguous buffer.
+    /// Growing never copies elements, and pointers to them stay valid until they are popped
+    STACK_SEGMENTED = 1u << 6,
+    /// Map the elements on their own, between two inaccessible guard pages, so that overflowing them faults immediately.
+    /// Capacity is rounded up to fill whole pages. Replaces #STACK_USE_DATA_CANARY, and can't be combined with #STACK_SEGMENTED
+    STACK_GUARD_PAGES = 1u << 7,
+    /// Leave checking the data hash, data canaries and poison to the scrubber (#stack_scrub) instead of doing it on every operation.
+    /// Operations that access the elements lock the Stack, so that the scrubber can check it from another thread
+    STACK_SCRUB = 1u << 8,
+    /// Set on Stacks opened by #stack_open_mapped, whose header and elements are kept in a memory-mapped file.
+    /// Capacity is rounded up to fill whole pages. Can't be passed to #stack_allocate_ex
+    STACK_MAPPED = 1u << 9,
+    /// Record the latency of every operation and of its verification, resizing, hashing and poisoning
+    /// in histograms that #stack_latency returns. Timed Stacks are always handled by StackLib, never inline
+    STACK_TIMED = 1u << 10,
+    /// Keep the elements in a mapping aligned to 2 MiB and advised to be backed by transparent huge pages
+    /// once they take at least 2 MiB, so that each TLB entry and page fault covers 2 MiB instead of a page.
+    /// Smaller buffers come from the allocator. Ignored with #STACK_SEGMENTED, #STACK_GUARD_PAGES and #STACK_MAPPED
+    STACK_HUGE_PAGES = 1u << 11,
+    /// Fault in the pages of the capacity reserved by #stack_reserve when it's reserved,
+    /// so that pushing up to it takes no page faults
+    STACK_PREFAULT = 1u << 12,
+} STACK_FLAGS;
+
+/**
+ * Strategies that decide when a Stack grows and shrinks its capacity
+ */
+typedef enum stack_resize_policy_e {
+    /// Grow and shrink geometrically, but shrink only after the Stack has been
+    /// at most shrink_threshold full for shrink_delay consecutive operations
+    STACK_RESIZE_GEOMETRIC,
+    /// Grow geometrically and never shrink
+    STACK_RESIZE_NEVER_SHRINK,
+    /// Grow geometrically, and every shrink_delay operations shrink to fit
+    /// the largest size the Stack had during those operations
+    STACK_RESIZE_IDLE_SHRINK,
+    /// Let a user-supplied callback choose the capacity
+    STACK_RESIZE_CUSTOM,
+} STACK_RESIZE_POLICY;
+
+/**
+ * \brief Choose a Stack's new capacity
+ *
+ * \param[in] data The callback_data of the Stack's #StackResizePolicy
+ * \param[in] capacity The Stack's current capacity
+ * \param[in] new_size The number of elements the Stack must be able to hold
+ * \param[in] min_capacity The Stack's minimum capacity
+ *
+ * \return The Stack's new capacity.
+ *         Values less than new_size or min_capacity are raised to the larger of the two
+ */
+typedef size_t (*stack_resize_callback)(void* data, size_t capacity, size_t new_size, size_t min_capacity);
+
+typedef struct stack_resize_policy_t {
+    STACK_RESIZE_POLICY kind;
+    /// Factor capacity is multiplied by when growing, must be greater than 1
+    double grow_factor;
+    /// Factor capacity is multiplied by when shrinking, must be between 0 and 1
+    double shrink_factor;
+    /// Part of capacity that must be unused for shrinking, must be less than shrink_factor
+    double shrink_threshold;
+    /// Number of operations shrinking is delayed by
+    size_t shrink_delay;
+    /// Used by #STACK_RESIZE_CUSTOM
+    stack_resize_callback callback;
+    void* callback_data;
+} StackResizePolicy;
+
+/**
+ * Counters of the resizes a Stack has done since it was allocated
+ */
+typedef struct stack_resize_stats_t {
+    size_t grow_count;
+    size_t shrink_count;
+    /// Number of element bytes copied because the Stack's data had to be moved
+    size_t bytes_copied;
+} StackResizeStats;
+
+/**
+ * Schedules for the expensive part of a Stack's verification, the data hash and poison checks.
+ * Metadata, metadata canaries and data canaries are checked on every operation regardless of the schedule
+ */
+typedef enum stack_verify_mode_e {
+    /// Check the data on every operation. The data hash check rehashes every element, so it takes time proportional to the size
+    STACK_VERIFY_ALWAYS,
+    /// Check the data on every period-th operation
+    STACK_VERIFY_EVERY_NTH,
+    /// Check the data only while the checks take at most time_budget of the time passing
+    STACK_VERIFY_TIME_BUDGET,
+    /// Check the data hash on every operation, but only amortized_bytes of the poison,
+    /// continuing where the last operation left off
+    STACK_VERIFY_AMORTIZED,
+    /// Check only the top block of the data hash and one other block in round-robin order on every operation,
+    /// and amortized_bytes of the poison, so that verification takes the same time whatever the size.
+    /// Tampering deep in the Stack is found after a number of operations proportional to its size
+    STACK_VERIFY_ROUND_ROBIN,
+} STACK_VERIFY_MODE;
+
+typedef struct stack_verify_policy_t {
+    STACK_VERIFY_MODE mode;
+    /// Used by #STACK_VERIFY_EVERY_NTH, must be at least 1
+    size_t period;
+    /// Used by #STACK_VERIFY_TIME_BUDGET, must be greater than 0 and at most 1
+    double time_budget;
+    /// Used by #STACK_VERIFY_AMORTIZED and #STACK_VERIFY_ROUND_ROBIN, must be at least 1
+    size_t amortized_bytes;
+} StackVerifyPolicy;
+
+/**
+ * Which of a Stack's elements #stack_dump_ex prints, and how much it may print
+ */
+typedef struct stack_dump_options_t {
+    /// Index of the first element to print
+    size_t first;
+    /// Number of elements to print from first on, SIZE_MAX to print up to the capacity
+    size_t count;
+    /// Don't print the unused capacity past the Stack's size
+    bool live_only;
+    /// Print a run of at least this many poisoned unused elements as one line, 0 to print every element
+    size_t poison_run;
+    /// Stop printing elements once this many bytes of them have been printed, 0 for no limit
+    size_t max_bytes;
+} StackDumpOptions;
+
+/**
+ * When a mapped Stack's file is written back to disk with msync
+ */
+typedef enum stack_sync_mode_e {
+    /// Leave writing the file back to the OS.
+    /// The file still survives the process crashing, as the pages stay in the page cache
+    STACK_SYNC_NEVER,
+    /// Write the file back after every period-th operation that changes the Stack
+    STACK_SYNC_EVERY_NTH,
+    /// Write the file back after every operation that changes the Stack
+    STACK_SYNC_ALWAYS,
+} STACK_SYNC_MODE;
+
+/**
+ * Counters of the operations a Stack has done since it was allocated
+ */
+typedef struct stack_stats_t {
+    /// Number of elements pushed, including by #stack_push_n
+    size_t push_count;
+    /// Number of elements poped, including by #stack_pop_n
+    size_t pop_count;
+    /// Number of elements peeked at, including by #stack_top_n
+    size_t top_count;
+    size_t grow_count;
+    size_t shrink_count;
+    /// Number of element bytes copied because the Stack's data had to be moved
+    size_t bytes_copied;
+    /// Only Stacks with protection features are verified
+    size_t verify_count;
+    size_t verify_fail_count;
+    /// Largest number of elements the Stack has held
+    size_t peak_size;
+    /// Number of Stacks the counters were collected from
+    size_t stack_count;
+} StackStats;
+
+/**
+ * Operations, and phases of operations, whose latency timed Stacks record
+ */
+typedef enum stack_latency_kind_e {
+    STACK_LATENCY_PUSH,
+    STACK_LATENCY_POP,
+    STACK_LATENCY_TOP,
+    STACK_LATENCY_PUSH_N,
+    STACK_LATENCY_POP_N,
+    STACK_LATENCY_TOP_N,
+    STACK_LATENCY_REWIND,
+    STACK_LATENCY_RESERVE,
+    /// Verifications done by any operation
+    STACK_LATENCY_VERIFY,
+    /// Changes of capacity, including moving the elements and poisoning the new ones
+    STACK_LATENCY_RESIZE,
+    /// Updates of the metadata hash and the data hash
+    STACK_LATENCY_REHASH,
+    /// Poisoning of unused elements
+    STACK_LATENCY_POISON,
+    STACK_LATENCY_KINDS,
+} STACK_LATENCY_KIND;
+
+/// Latencies are bucketed like in HDR histograms: every power of 2 nanoseconds is split into
+/// STACK_LATENCY_SUB_BUCKETS equal buckets, so that the values in a bucket are within 12.5% of each other.
+/// Latencies of 2^40 ns or more all fall into the last bucket
+enum {
+    STACK_LATENCY_SUB_BUCKETS = 8,
+    STACK_LATENCY_BUCKETS = 38 * STACK_LATENCY_SUB_BUCKETS,
+};
+
+/**
+ * Latency histogram of one kind of operation
+ */
+typedef struct stack_latency_t {
+    /// Number of latencies recorded
+    size_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    /// Number of latencies that fell into each bucket, see #stack_latency_bucket_limit
+    size_t buckets[STACK_LATENCY_BUCKETS];
+} StackLatency;
+
+/// Size of a buffer that is large enough to hold any string returned by #stack_get_options
+enum { STACK_OPTIONS_STRING_SIZE = 256 };
+
 typedef struct stack_t Stack;
 
+/**
+ * Source of the memory of a Stack's header and storage.
+ * Sizes of the allocations being resized and freed are passed back to the allocator
+ */
+typedef struct stack_allocator_t {
+    /// Return NULL if the memory can't be allocated
+    void* (*allocate)(void* data, size_t size);
+    /// Allocate if p is NULL. Return NULL and leave p allocated if the memory can't be reallocated
+    void* (*reallocate)(void* data, void* p, size_t old_size, size_t new_size);
+    void (*free)(void* data, void* p, size_t size);
+    /// Passed to each of the functions
+    void* data;
+} StackAllocator;
+
+/// Bump allocator whose memory is all released at once by #stack_arena_reset
+typedef struct stack_arena_t StackArena;
+
+/// Allocator that keeps freed memory in lists of size classes for reuse
+typedef struct stack_pool_t StackPool;
+
 /**
  * \brief Get list of protection features that this implementation was compiled with
  *
  * \return String describing protection features that this implementation was compiled with
+ *
+ * \remark These are the protection features used by Stacks allocated with #stack_allocate.
+ *         Call #stack_get_options to find out which protection features a particular Stack uses
  */
 char const* get_stack_compilation_options();
 
@@ -39,6 +287,191 @@ char const* get_stack_compilation_options();
  */
 Stack* stack_allocate(size_t stk_elem_sz);
 
+/**
+ * \brief Allocate a new Stack with the given protection features
+ *
+ * \param[in] stk_elem_sz The size of the type of element this Stack will store
+ * \param[in] flags Bitwise OR of #STACK_FLAGS values to turn on for this Stack
+ *
+ * \return Pointer to new Stack, or NULL if an error occured
+ *
+ * \remark Operations on a Stack allocated with #STACK_NO_PROTECTION do no checking at all,
+ *         and neither do operations on a Stack allocated with only #STACK_GUARD_PAGES.
+ *         Free the returned pointer by calling #stack_free
+ */
+Stack* stack_allocate_ex(size_t stk_elem_sz, unsigned flags);
+
+/**
+ * \brief Allocate a new Stack whose memory comes from an allocator
+ *
+ * \param[in] allocator The allocator to use for the Stack's header and storage, or NULL to use malloc
+ * \param[in] stk_elem_sz The size of the type of element this Stack will store
+ * \param[in] flags Bitwise OR of #STACK_FLAGS values to turn on for this Stack
+ *
+ * \return Pointer to new Stack, or NULL if an error occured
+ *
+ * \remark The allocator is copied into the Stack, and its data must stay valid until the Stack is freed.
+ *         Protection features work the same way in allocator memory.
+ *         Elements of a Stack with #STACK_GUARD_PAGES are mapped separately and don't come from the allocator,
+ *         and neither do those of a Stack with #STACK_HUGE_PAGES once they take at least 2 MiB
+ */
+Stack* stack_allocate_in(StackAllocator const* allocator, size_t stk_elem_sz, unsigned flags);
+
+/**
+ * \brief Allocate a new Stack that keeps a chosen number of elements in the same allocation as its header
+ *
+ * \param[in] allocator The allocator to use for the Stack's header and storage, or NULL to use malloc
+ * \param[in] stk_elem_sz The size of the type of element this Stack will store
+ * \param[in] flags Bitwise OR of #STACK_FLAGS values to turn on for this Stack
+ * \param[in] embedded_capacity The number of elements to keep with the header, or 0 to keep none there
+ *
+ * \return Pointer to new Stack, or NULL if an error occured
+ *
+ * \remark The other allocation functions embed as many elements as fit in 256 bytes.
+ *         Capacities below the default capacity of 10 elements leave the Stack without embedded storage,
+ *         and so do #STACK_SEGMENTED, #STACK_GUARD_PAGES and #STACK_MAPPED.
+ *         Free the returned pointer by calling #stack_free
+ */
+Stack* stack_allocate_embedded(StackAllocator const* allocator, size_t stk_elem_sz, unsigned flags,
+                               size_t embedded_capacity);
+
+/**
+ * \brief Open a Stack that is kept in a memory-mapped file, creating the file if it doesn't exist
+ *
+ * \param[in] path The file to keep the Stack in
+ * \param[in] stk_elem_sz The size of the type of element this Stack will store
+ *
+ * \return Pointer to the Stack, or NULL if the file can't be opened or doesn't hold a valid Stack
+ *
+ * \remark Uses the protection features of #stack_allocate
+ */
+Stack* stack_open_mapped(char const* path, size_t stk_elem_sz);
+
+/**
+ * \brief Open a Stack with the given protection features that is kept in a memory-mapped file
+ *
+ * \param[in] path The file to keep the Stack in
+ * \param[in] stk_elem_sz The size of the type of element this Stack will store
+ * \param[in] flags Bitwise OR of #STACK_FLAGS values to turn on for this Stack
+ *
+ * \return Pointer to the Stack, or NULL if the file can't be opened or doesn't hold a valid Stack
+ *
+ * \remark An existing file is mapped as is, without reading its elements, and must have been created
+ *         with the same element size and flags. Its header is checked, and so are its data hash and poison
+ *         if the Stack uses them, before the Stack is returned.
+ *         Changes are written to the mapping as they are made, and the header is updated after every operation.
+ *         #STACK_USE_DATA_CANARY, #STACK_GUARD_PAGES and #STACK_SEGMENTED are ignored.
+ *         Close the Stack by calling #stack_free, which keeps the file
+ */
+Stack* stack_open_mapped_ex(char const* path, size_t stk_elem_sz, unsigned flags);
+
+/**
+ * \brief Set when a mapped Stack's file is written back to disk
+ *
+ * \param[in] stk The mapped Stack whose sync policy to set
+ * \param[in] mode When to write the file back
+ * \param[in] period Used by #STACK_SYNC_EVERY_NTH, must be at least 1
+ *
+ * \remark The default is #STACK_SYNC_NEVER.
+ *         If the Stack is not mapped or the policy is invalid, the Stack's error is set to #STACK_OPERATION_ERROR
+ */
+void stack_set_sync_policy(Stack* stk, STACK_SYNC_MODE mode, size_t period);
+
+/**
+ * \brief Write a mapped Stack's file back to disk now
+ *
+ * \param[in] stk The mapped Stack to write back
+ *
+ * \return false if the Stack is not mapped or the file couldn't be written back
+ */
+bool stack_sync(Stack* stk);
+
+/**
+ * \brief Create an arena
+ *
+ * \param[in] block_size Size of the blocks the arena allocates from, or 0 for the default size
+ *
+ * \return Pointer to new arena, or NULL if an error occured
+ *
+ * \remark An arena must only be used by one thread at a time
+ */
+StackArena* stack_arena_create(size_t block_size);
+
+/**
+ * \brief Release all memory allocated from an arena at once
+ *
+ * \param[in] arena The arena to reset
+ *
+ * \remark Stacks allocated in the arena become invalid and must not be used or freed.
+ *         The arena's blocks are kept for later allocations
+ */
+void stack_arena_reset(StackArena* arena);
+
+/**
+ * \brief Free an arena and all memory allocated from it
+ *
+ * \param[in] arena The arena to free
+ *
+ * \remark This function accepts NULL
+ */
+void stack_arena_destroy(StackArena* arena);
+
+/**
+ * \brief Get an allocator that allocates from an arena, to be passed to #stack_allocate_in
+ *
+ * \param[in] arena The arena to allocate from
+ *
+ * \return The arena's allocator
+ */
+StackAllocator stack_arena_allocator(StackArena* arena);
+
+/**
+ * \brief Create a pool
+ *
+ * \return Pointer to new pool, or NULL if an error occured
+ *
+ * \remark A pool must only be used by one thread at a time
+ */
+StackPool* stack_pool_create();
+
+/**
+ * \brief Free a pool
+ *
+ * \param[in] pool The pool to free
+ *
+ * \remark Stacks allocated from the pool must be freed first. This function accepts NULL
+ */
+void stack_pool_destroy(StackPool* pool);
+
+/**
+ * \brief Get an allocator that allocates from a pool, to be passed to #stack_allocate_in
+ *
+ * \param[in] pool The pool to allocate from
+ *
+ * \return The pool's allocator
+ */
+StackAllocator stack_pool_allocator(StackPool* pool);
+
+/**
+ * \brief Get the protection features a Stack uses
+ *
+ * \param[in] stk The Stack whose protection features to query
+ *
+ * \return Bitwise OR of #STACK_FLAGS values
+ */
+unsigned stack_get_flags(Stack* stk);
+
+/**
+ * \brief Get list of protection features a Stack uses
+ *
+ * \param[in] stk The Stack whose protection features to query
+ * \param[out] str Buffer to write the list to
+ * \param[in] str_sz Size of str; #STACK_OPTIONS_STRING_SIZE is always enough
+ *
+ * \return str
+ */
+char* stack_get_options(Stack* stk, char* str, size_t str_sz);
+
 /**
  * \brief Push a new element to a Stack
  *
@@ -74,6 +507,87 @@ void* stack_pop(Stack* stk, void* elem_p);
  */
 void* stack_top(Stack* stk, void* elem_p);
 
+/**
+ * \brief Push several elements to a Stack
+ *
+ * \param[in] stk The Stack to push to
+ * \param[in] elems Pointer to an array of elements to push
+ * \param[in] num The number of elements to push
+ *
+ * \return elems if the elements were succefully pushed to the stack, NULL otherwise
+ *
+ * \remark The elements are pushed in array order, so elems[num - 1] ends up on top.
+ *         Either all or none of the elements are pushed
+ */
+void const* stack_push_n(Stack* stk, void const* elems, size_t num);
+
+/**
+ * \brief Pop several elements from a Stack
+ *
+ * \param[in] stk The Stack to pop from
+ * \param[in] elems Pointer to an array to store the result in
+ * \param[in] num The number of elements to pop
+ *
+ * \return elems if the elements were succefully poped from the stack, NULL otherwise
+ *
+ * \remark The elements are stored in the order they were pushed in, so the former top element ends up in elems[num - 1].
+ *         Poping more elements than a Stack holds will result in an error and no elements being poped
+ */
+void* stack_pop_n(Stack* stk, void* elems, size_t num);
+
+/**
+ * \brief Peek at a Stack's top elements
+ *
+ * \param[in] stk The Stack to peek into
+ * \param[in] elems Pointer to an array to store the result in
+ * \param[in] num The number of elements to read
+ *
+ * \return elems if the elements were succefully read from the stack, NULL otherwise
+ *
+ * \remark The elements are stored in the same order as by #stack_pop_n.
+ *         Peeking at more elements than a Stack holds will result in an error
+ */
+void* stack_top_n(Stack* stk, void* elems, size_t num);
+
+/// A Stack's size when #stack_mark was called, which #stack_rewind pops back down to
+typedef size_t StackMark;
+
+/**
+ * \brief Mark a Stack's current top, so that the elements pushed after it can be poped at once by #stack_rewind
+ *
+ * \param[in] stk The Stack to mark
+ *
+ * \return The mark, which must be released with #stack_release.
+ *         If there is no memory to keep track of the mark, the Stack's error is set and it isn't marked
+ *
+ * \remark A Stack doesn't shrink while it has marks that haven't been released,
+ *         so that poping speculatively pushed elements never reallocates its storage
+ */
+StackMark stack_mark(Stack* stk);
+
+/**
+ * \brief Pop every element pushed after a mark
+ *
+ * \param[in] stk The Stack to rewind
+ * \param[in] mark A mark returned by #stack_mark that hasn't been released
+ *
+ * \remark The elements are poped in one step, without being copied out.
+ *         The mark stays valid, so the Stack can be rewound to it again.
+ *         Rewinding to a mark that isn't outstanding or to more elements than the Stack holds will result in an error
+ */
+void stack_rewind(Stack* stk, StackMark mark);
+
+/**
+ * \brief Release a mark returned by #stack_mark, keeping the elements pushed after it
+ *
+ * \param[in] stk The Stack the mark was returned for
+ * \param[in] mark The mark to release
+ *
+ * \remark Marks are released in the reverse order they were made in.
+ *         Releasing a mark that isn't the innermost outstanding one will result in an error
+ */
+void stack_release(Stack* stk, StackMark mark);
+
 /**
  * \brief Get the number of elements currently stored in a Stack
  *
@@ -110,18 +624,268 @@ bool stack_empty(Stack* stk);
  * \return The Stack's new minimum capacity, 0 if an error occured
  *
  * \remark The Stack's minimum capacity will never be less than an 
- *         implementation defined minimum
+ *         implementation defined minimum.
+ *         A Stack with #STACK_PREFAULT faults in the pages of its capacity before returning
  */
 size_t stack_reserve(Stack* stk, size_t capacity);
 
+/**
+ * \brief Get the default settings of a resize policy
+ *
+ * \param[in] kind The resize policy whose settings to get
+ *
+ * \return Resize policy that can be adjusted and passed to #stack_set_resize_policy
+ *
+ * \remark Stacks are allocated with the defaults of #STACK_RESIZE_GEOMETRIC
+ */
+StackResizePolicy stack_resize_policy(STACK_RESIZE_POLICY kind);
+
+/**
+ * \brief Set the strategy a Stack uses to grow and shrink its capacity
+ *
+ * \param[in] stk The Stack whose resize policy to set
+ * \param[in] policy The new resize policy
+ *
+ * \remark The new policy takes effect from the Stack's next operation.
+ *         If the policy is invalid, the Stack's error is set to #STACK_OPERATION_ERROR
+ */
+void stack_set_resize_policy(Stack* stk, StackResizePolicy const* policy);
+
+/**
+ * \brief Get the strategy a Stack uses to grow and shrink its capacity
+ *
+ * \param[in] stk The Stack whose resize policy to query
+ *
+ * \return The Stack's resize policy
+ */
+StackResizePolicy stack_get_resize_policy(Stack* stk);
+
+/**
+ * \brief Get the default settings of a verification schedule
+ *
+ * \param[in] mode The verification schedule whose settings to get
+ *
+ * \return Verification policy that can be adjusted and passed to #stack_set_verify_policy
+ */
+StackVerifyPolicy stack_verify_policy(STACK_VERIFY_MODE mode);
+
+/**
+ * \brief Set how often a Stack checks its data
+ *
+ * \param[in] stk The Stack whose verification policy to set
+ * \param[in] policy The new verification policy
+ *
+ * \remark If the policy is invalid, the Stack's error is set to #STACK_OPERATION_ERROR
+ */
+void stack_set_verify_policy(Stack* stk, StackVerifyPolicy const* policy);
+
+/**
+ * \brief Get how often a Stack checks its data
+ *
+ * \param[in] stk The Stack whose verification policy to query
+ *
+ * \return The Stack's verification policy
+ */
+StackVerifyPolicy stack_get_verify_policy(Stack* stk);
+
+/**
+ * \brief Set the verification policy of Stacks allocated from now on
+ *
+ * \param[in] policy The new default verification policy
+ *
+ * \return false if the policy is invalid and was not set
+ *
+ * \remark Stacks that are already allocated keep their policies.
+ *          The initial default is #STACK_VERIFY_ALWAYS
+ */
+bool stack_set_default_verify_policy(StackVerifyPolicy const* policy);
+
+/**
+ * \brief Get the verification policy of Stacks allocated from now on
+ *
+ * \return The default verification policy
+ */
+StackVerifyPolicy stack_get_default_verify_policy();
+
+/**
+ * \brief Get the counters of the resizes a Stack has done
+ *
+ * \param[in] stk The Stack whose counters to query
+ *
+ * \return The Stack's resize counters
+ */
+StackResizeStats stack_get_resize_stats(Stack* stk);
+
+/**
+ * \brief Get the operation counters of a Stack
+ *
+ * \param[in] stk The Stack whose counters to query
+ * \param[out] stats The Stack's counters
+ *
+ * \remark Counters are kept for every Stack and are cheap to update.
+ *         This function may be called from any thread while the Stack is in use,
+ *         but may miss the latest operations that stack_generic.h did inline
+ */
+void stack_stats(Stack* stk, StackStats* stats);
+
+/**
+ * \brief Get the operation counters of all Stacks
+ *
+ * \param[out] stats The sums of the counters of all Stacks, including the ones that have been freed
+ *
+ * \remark peak_size is the largest peak size of any Stack,
+ *         and stack_count is the number of currently allocated Stacks.
+ *         This function may be called from any thread
+ */
+void stack_global_stats(StackStats* stats);
+
+/**
+ * \brief Get the latency histogram of one kind of operation of a Stack
+ *
+ * \param[in] stk The Stack whose latencies to query
+ * \param[in] kind The operation or phase to get the histogram of
+ * \param[out] latency The histogram, which is empty unless the Stack uses #STACK_TIMED
+ *
+ * \remark This function may be called from any thread while the Stack is in use
+ */
+void stack_latency(Stack* stk, STACK_LATENCY_KIND kind, StackLatency* latency);
+
+/**
+ * \brief Get the latency histogram of one kind of operation of all timed Stacks
+ *
+ * \param[in] kind The operation or phase to get the histogram of
+ * \param[out] latency The merged histograms of all Stacks that use #STACK_TIMED, including the ones that have been freed
+ *
+ * \remark This function may be called from any thread
+ */
+void stack_global_latency(STACK_LATENCY_KIND kind, StackLatency* latency);
+
+/**
+ * \brief Get a percentile of the latencies in a histogram
+ *
+ * \param[in] latency The histogram
+ * \param[in] percentile The percentile, from 0 to 100
+ *
+ * \return The largest latency in the bucket the percentile falls into, capped at max_ns, or 0 if the histogram is empty
+ */
+uint64_t stack_latency_percentile(StackLatency const* latency, double percentile);
+
+/**
+ * \brief Get the largest latency a histogram bucket holds
+ *
+ * \param[in] bucket The index of the bucket, less than #STACK_LATENCY_BUCKETS
+ *
+ * \return The largest latency in nanoseconds that falls into the bucket. The last bucket also holds all larger latencies
+ */
+uint64_t stack_latency_bucket_limit(size_t bucket);
+
+/**
+ * \brief Get the name of a kind of operation
+ *
+ * \param[in] kind The operation or phase
+ *
+ * \return The lowercase name of the operation, which is also the name of its USDT probes without the _begin or _done suffix
+ */
+char const* stack_latency_kind_name(STACK_LATENCY_KIND kind);
+
+/**
+ * \brief Report an error found by the scrubber
+ *
+ * \param[in] data The data passed to #stack_scrub or #stack_scrubber_start
+ * \param[in] stk The Stack the error was found in
+ * \param[in] error The error that was found
+ *
+ * \remark Called on the scrubbing thread while all Stacks are locked against being allocated and freed,
+ *         so it must not allocate, free or operate on Stacks
+ */
+typedef void (*stack_scrub_callback)(void* data, Stack* stk, STACK_ERROR error);
+
+/**
+ * \brief Check a slice of the data of every Stack that uses #STACK_SCRUB
+ *
+ * \param[in] callback Called for every error found, may be NULL
+ * \param[in] data Passed to callback
+ *
+ * \return The number of Stacks an error was found in
+ *
+ * \remark Each call continues where the previous one stopped, so that repeated calls eventually check every element.
+ *         A Stack an error was found in reports it from its next operation on.
+ *         This function may be called from any thread
+ */
+size_t stack_scrub(stack_scrub_callback callback, void* data);
+
+/**
+ * \brief Start a thread that calls #stack_scrub periodically
+ *
+ * \param[in] callback Called for every error found, may be NULL
+ * \param[in] data Passed to callback
+ * \param[in] interval_us Microseconds between passes
+ *
+ * \return false if the thread couldn't be started or is already running
+ */
+bool stack_scrubber_start(stack_scrub_callback callback, void* data, unsigned interval_us);
+
+/**
+ * \brief Stop the thread started by #stack_scrubber_start and wait for it to exit
+ *
+ * \remark Does nothing if the thread is not running
+ */
+void stack_scrubber_stop();
+
 /**
  * \brief Dump all of a Stack's contents into a file in human-readable form
  *
  * \param[in] stk The Stack whose contents to dump
  * \param[in] dump_file The file to dump into
+ *
+ * \remark Uses the options returned by #stack_dump_options
  */
 void stack_dump(Stack* stk, FILE* dump_file);
 
+/**
+ * \brief Get the default options of #stack_dump
+ *
+ * \return Options that print every element and summarize runs of poisoned unused elements,
+ *         which can be adjusted and passed to #stack_dump_ex
+ */
+StackDumpOptions stack_dump_options();
+
+/**
+ * \brief Dump a Stack's metadata and some of its elements into a file in human-readable form
+ *
+ * \param[in] stk The Stack whose contents to dump
+ * \param[in] dump_file The file to dump into
+ * \param[in] options Which elements to dump
+ */
+void stack_dump_ex(Stack* stk, FILE* dump_file, StackDumpOptions const* options);
+
+/**
+ * \brief Save a Stack's elements into a file in a compact binary form that #stack_load can read
+ *
+ * \param[in] stk The Stack to save
+ * \param[in] file The binary file to write to
+ *
+ * \return false if the Stack is corrupted or the file couldn't be written
+ *
+ * \remark Writes a header with the element size, size, flags and a checksum of the elements,
+ *         followed by the elements themselves from the bottom of the Stack up.
+ *         The checksum is computed from the elements, which are checked against the data hash
+ *         if the Stack keeps one, whatever its verification policy
+ */
+bool stack_save(Stack* stk, FILE* file);
+
+/**
+ * \brief Allocate a Stack from a file written by #stack_save
+ *
+ * \param[in] file The binary file to read from
+ *
+ * \return Pointer to the Stack, which has the saved Stack's element size, protection features and elements,
+ *         or NULL if the file doesn't hold a valid saved Stack or allocation fails
+ *
+ * \remark The file must have been saved on a machine with the same byte order and the same hash function
+ */
+Stack* stack_load(FILE* file);
+
 /** 
  * \brief Free a Stack allocated by #allocate_stack
  *
@@ -131,6 +895,26 @@ void stack_dump(Stack* stk, FILE* dump_file);
  */
 void stack_free(Stack* stk);
 
+/**
+ * \brief Set how many freed Stacks each thread keeps around for reuse
+ *
+ * \param[in] max_stacks The most Stacks a thread keeps, 0 to keep none
+ * \param[in] max_bytes The most bytes of Stacks and their storage a thread keeps
+ *
+ * \remark Stacks freed by #stack_free are kept by the freeing thread if they were allocated without an allocator,
+ *         don't use #STACK_SEGMENTED and pass verification.
+ *         #stack_allocate_ex then reuses one with the same element size and flags instead of allocating.
+ *         The defaults are 16 Stacks and 1 MiB. Stacks that are already kept are not freed by lowering the limits
+ */
+void stack_cache_set_limits(size_t max_stacks, size_t max_bytes);
+
+/**
+ * \brief Free the Stacks kept by the calling thread for reuse
+ *
+ * \remark Done automatically when a thread exits, and for the main thread when the process exits
+ */
+void stack_cache_drain();
+
 /**
  * \brief Get a Stack's current error code
  *
@@ -150,3 +934,107 @@ STACK_ERROR stack_get_error(Stack* stk);
  * \return String describing the error code
  */
 char const* stack_error_string(STACK_ERROR error);
+
+/**
+ * \brief The fields every Stack starts with, which the inline functions of stack_generic.h use
+ *
+ * \remark This is an implementation detail. Use the functions declared above instead of these fields
+ */
+typedef struct stack_inline_t {
+    unsigned long long front_canary;
+    void* data;
+    size_t size;
+    /// Elements may be pushed without calling into StackLib while size is less than this
+    size_t inline_max;
+    /// Elements may be poped without calling into StackLib while size is greater than this
+    size_t inline_min;
+    STACK_ERROR error;
+    /// Pushes, pops and peeks done inline, added to the Stack's counters by #stack_stats and #stack_global_stats
+    size_t inline_push_count;
+    size_t inline_pop_count;
+    size_t inline_top_count;
+    /// Largest size reached by an inline push
+    size_t inline_peak_size;
+} StackInline;
+
+/**
+ * A Stack that can be used by several threads at once without locking.
+ * Elements are kept in nodes that are pushed and poped with atomic compare-and-swap operations
+ * and are recycled instead of being freed
+ */
+typedef struct concurrent_stack_t ConcurrentStack;
+
+/// Protection features a ConcurrentStack supports.
+/// #STACK_USE_HASH_FULL stores a digest of each element, which is checked when the element is poped
+enum { STACK_CONCURRENT_FLAGS = STACK_USE_CANARY | STACK_USE_HASH_FULL };
+
+/**
+ * \brief Allocate a new ConcurrentStack with the given protection features
+ *
+ * \param[in] stk_elem_sz The size of the type of element this ConcurrentStack will store
+ * \param[in] flags Bitwise OR of #STACK_CONCURRENT_FLAGS values to turn on for this ConcurrentStack
+ *
+ * \return Pointer to new ConcurrentStack, or NULL if an error occured
+ *
+ * \remark Free the returned pointer by calling #concurrent_stack_free
+ */
+ConcurrentStack* concurrent_stack_allocate(size_t stk_elem_sz, unsigned flags);
+
+/**
+ * \brief Push a new element to a ConcurrentStack
+ *
+ * \param[in] stk The ConcurrentStack to push to
+ * \param[in] elem_p Pointer to the element to push
+ *
+ * \return #STACK_OK, or the error that occured
+ *
+ * \remark This function is thread-safe
+ */
+STACK_ERROR concurrent_stack_push(ConcurrentStack* stk, void const* elem_p);
+
+/**
+ * \brief Remove the top element from a ConcurrentStack
+ *
+ * \param[in] stk The ConcurrentStack to pop from
+ * \param[out] elem_p Pointer to where to store the poped element
+ *
+ * \return #STACK_OK, #STACK_OPERATION_ERROR if the ConcurrentStack is empty,
+ *         or the error that occured
+ *
+ * \remark This function is thread-safe.
+ *         There is no way to peek at the top element, since another thread could pop it at any time
+ */
+STACK_ERROR concurrent_stack_pop(ConcurrentStack* stk, void* elem_p);
+
+/**
+ * \brief Get the number of elements in a ConcurrentStack
+ *
+ * \param[in] stk The ConcurrentStack whose size to query
+ *
+ * \return The ConcurrentStack's size, which may already be out of date if other threads are using it
+ */
+size_t concurrent_stack_size(ConcurrentStack* stk);
+
+/**
+ * \brief Get a ConcurrentStack's error state
+ *
+ * \param[in] stk The ConcurrentStack whose error code to query
+ *
+ * \return #STACK_OK, or the first unrecoverable error that was detected.
+ *         Once an unrecoverable error is detected, all operations fail with it
+ */
+STACK_ERROR concurrent_stack_get_error(ConcurrentStack* stk);
+
+/**
+ * \brief Free a ConcurrentStack allocated by #concurrent_stack_allocate
+ *
+ * \param[in] stk The ConcurrentStack to free
+ *
+ * \remark No other thread may use the ConcurrentStack while it is being freed.
+ *         This function accepts NULL
+ */
+void concurrent_stack_free(ConcurrentStack* stk);
+
+#ifdef __cplusplus
+}
+#endif
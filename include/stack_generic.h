@@ -1,5 +1,7 @@
 #include "stack.h"
 
+#include <string.h>
+
 #ifndef STACK_ELEM_TYPE
 #error STACK_ELEM_TYPE not defined
 #endif
@@ -14,38 +16,107 @@ typedef struct CAT(OVERLOAD(stack), t) OVERLOAD(Stack);
 #define STACK_TYPE OVERLOAD(Stack)
 
 #define STACK_ALLOCATE OVERLOAD(StackAllocate)
+#define STACK_ALLOCATE_EX OVERLOAD(StackAllocateEx)
 #define STACK_FREE OVERLOAD(StackFree)
 #define STACK_PUSH OVERLOAD(StackPush)
 #define STACK_POP OVERLOAD(StackPop)
 #define STACK_TOP OVERLOAD(StackTop)
+#define STACK_PUSH_N OVERLOAD(StackPushN)
+#define STACK_POP_N OVERLOAD(StackPopN)
+#define STACK_TOP_N OVERLOAD(StackTopN)
+#define STACK_MARK OVERLOAD(StackMark)
+#define STACK_REWIND OVERLOAD(StackRewind)
+#define STACK_RELEASE OVERLOAD(StackRelease)
 #define STACK_SIZE OVERLOAD(StackSize)
 #define STACK_CAPACITY OVERLOAD(StackCapacity)
 #define STACK_EMPTY OVERLOAD(StackEmpty)
 #define STACK_RESERVE OVERLOAD(StackReserve)
 #define STACK_DUMP OVERLOAD(StackDump)
+#define STACK_DUMP_EX OVERLOAD(StackDumpEx)
 #define STACK_GET_ERROR OVERLOAD(StackGetError)
+#define STACK_GET_FLAGS OVERLOAD(StackGetFlags)
+#define STACK_SET_RESIZE_POLICY OVERLOAD(StackSetResizePolicy)
+#define STACK_GET_RESIZE_STATS OVERLOAD(StackGetResizeStats)
+#define STACK_SET_VERIFY_POLICY OVERLOAD(StackSetVerifyPolicy)
+#define STACK_STATS OVERLOAD(StackStats)
+#define STACK_LATENCY OVERLOAD(StackLatency)
 #define STACK_ERROR_STRING OVERLOAD(StackErrorString)
 
 static inline STACK_TYPE* STACK_ALLOCATE() {
     return (STACK_TYPE*) stack_allocate(sizeof(STACK_ELEM_TYPE));
 }
 
+static inline STACK_TYPE* STACK_ALLOCATE_EX(unsigned flags) {
+    return (STACK_TYPE*) stack_allocate_ex(sizeof(STACK_ELEM_TYPE), flags);
+}
+
+// Stacks with no protections are pushed to, poped from and peeked at inline
+// while their capacity doesn't need to change and their last operation succeeded; everything else is done by StackLib.
+// Inline operations are a bounds check and a typed access, and count themselves with plain increments
 static inline void STACK_PUSH(STACK_TYPE* stk, STACK_ELEM_TYPE elem) {
+    StackInline* inl = (StackInline*) stk;
+    if (inl->size < inl->inline_max) {
+        ((STACK_ELEM_TYPE*) inl->data)[inl->size++] = elem;
+        inl->inline_push_count++;
+        if (inl->size > inl->inline_peak_size) {
+            inl->inline_peak_size = inl->size;
+        }
+        return;
+    }
     stack_push((Stack*) stk, &elem);
 }
 
 static inline STACK_ELEM_TYPE STACK_POP(STACK_TYPE* stk) {
+    StackInline* inl = (StackInline*) stk;
+    if (inl->size > inl->inline_min) {
+        inl->inline_pop_count++;
+        return ((STACK_ELEM_TYPE*) inl->data)[--inl->size];
+    }
+    // Failed pops return a zeroed element
     STACK_ELEM_TYPE elem;
+    memset(&elem, 0, sizeof(elem));
     stack_pop((Stack*) stk, &elem);
     return elem;
 }
 
 static inline STACK_ELEM_TYPE STACK_TOP(STACK_TYPE* stk) {
+    StackInline* inl = (StackInline*) stk;
+    // Peeking doesn't resize, so only the inline limits being set matters
+    if (inl->size && inl->inline_max) {
+        inl->inline_top_count++;
+        return ((STACK_ELEM_TYPE*) inl->data)[inl->size - 1];
+    }
+    // Failed peeks return a zeroed element
     STACK_ELEM_TYPE elem;
+    memset(&elem, 0, sizeof(elem));
     stack_top((Stack*) stk, &elem);
     return elem;
 }
 
+static inline void STACK_PUSH_N(STACK_TYPE* stk, STACK_ELEM_TYPE const* elems, size_t num) {
+    stack_push_n((Stack*) stk, elems, num);
+}
+
+static inline STACK_ELEM_TYPE* STACK_POP_N(STACK_TYPE* stk, STACK_ELEM_TYPE* elems, size_t num) {
+    return (STACK_ELEM_TYPE*) stack_pop_n((Stack*) stk, elems, num);
+}
+
+static inline STACK_ELEM_TYPE* STACK_TOP_N(STACK_TYPE* stk, STACK_ELEM_TYPE* elems, size_t num) {
+    return (STACK_ELEM_TYPE*) stack_top_n((Stack*) stk, elems, num);
+}
+
+static inline StackMark STACK_MARK(STACK_TYPE* stk) {
+    return stack_mark((Stack*) stk);
+}
+
+static inline void STACK_REWIND(STACK_TYPE* stk, StackMark mark) {
+    stack_rewind((Stack*) stk, mark);
+}
+
+static inline void STACK_RELEASE(STACK_TYPE* stk, StackMark mark) {
+    stack_release((Stack*) stk, mark);
+}
+
 static inline size_t STACK_SIZE(STACK_TYPE* stk) {
     return stack_size((Stack*) stk);
 }
@@ -66,10 +137,38 @@ static inline void STACK_DUMP(STACK_TYPE* stk, FILE* file) {
     stack_dump((Stack*) stk, file);
 }
 
+static inline void STACK_DUMP_EX(STACK_TYPE* stk, FILE* file, StackDumpOptions const* options) {
+    stack_dump_ex((Stack*) stk, file, options);
+}
+
 static inline STACK_ERROR STACK_GET_ERROR(STACK_TYPE* stk) {
     return stack_get_error((Stack*) stk);
 }
 
+static inline unsigned STACK_GET_FLAGS(STACK_TYPE* stk) {
+    return stack_get_flags((Stack*) stk);
+}
+
+static inline void STACK_SET_RESIZE_POLICY(STACK_TYPE* stk, StackResizePolicy const* policy) {
+    stack_set_resize_policy((Stack*) stk, policy);
+}
+
+static inline StackResizeStats STACK_GET_RESIZE_STATS(STACK_TYPE* stk) {
+    return stack_get_resize_stats((Stack*) stk);
+}
+
+static inline void STACK_SET_VERIFY_POLICY(STACK_TYPE* stk, StackVerifyPolicy const* policy) {
+    stack_set_verify_policy((Stack*) stk, policy);
+}
+
+static inline void STACK_STATS(STACK_TYPE* stk, StackStats* stats) {
+    stack_stats((Stack*) stk, stats);
+}
+
+static inline void STACK_LATENCY(STACK_TYPE* stk, STACK_LATENCY_KIND kind, StackLatency* latency) {
+    stack_latency((Stack*) stk, kind, latency);
+}
+
 static inline char const* STACK_ERROR_STRING(STACK_ERROR err) {
     return stack_error_string(err);
 }
@@ -78,17 +177,31 @@ static inline void STACK_FREE(STACK_TYPE* stk) {
     stack_free((Stack*) stk);
 }
 
-#undef STACK_ALLOLOCATE
+#undef STACK_ALLOCATE
+#undef STACK_ALLOCATE_EX
 #undef STACK_FREE
 #undef STACK_PUSH
 #undef STACK_POP
 #undef STACK_TOP
+#undef STACK_PUSH_N
+#undef STACK_POP_N
+#undef STACK_TOP_N
+#undef STACK_MARK
+#undef STACK_REWIND
+#undef STACK_RELEASE
 #undef STACK_SIZE
 #undef STACK_CAPACITY
 #undef STACK_EMPTY
-#undef STACK_RESERVER
+#undef STACK_RESERVE
 #undef STACK_DUMP
+#undef STACK_DUMP_EX
 #undef STACK_GET_ERROR
+#undef STACK_GET_FLAGS
+#undef STACK_SET_RESIZE_POLICY
+#undef STACK_GET_RESIZE_STATS
+#undef STACK_SET_VERIFY_POLICY
+#undef STACK_STATS
+#undef STACK_LATENCY
 #undef STACK_ERROR_STRING
 
 #undef STACK_TYPE
@@ -0,0 +1,735 @@
+// getrusage and syscall are extensions
+#define _GNU_SOURCE
+
+#include "stack.h"
+#include "stack_hash.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BENCH_CYCLES
+#include <x86intrin.h>
+#endif
+
+#ifdef __linux__
+#define BENCH_PERF
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define ARR_LENGTH(arr) (sizeof(arr) / sizeof(*arr))
+
+// Default number of timed operations per benchmark
+enum { BENCH_OPS = 1u << 13 };
+// Number of operations done in a row before the Stack is brought back to its depth
+enum { BENCH_BATCH = 16 };
+// Number of elements pushed at once while filling a Stack to its depth
+enum { BENCH_FILL_CHUNK = 1u << 12 };
+
+static const size_t bench_elem_sizes[] = {1, 4, 16, 64, 256};
+
+static const size_t bench_depths[] = {
+    1u << 4,
+    1u << 10,
+    1u << 16,
+};
+
+// Storage and protection features that are combined with each other.
+// Logging is left out, since it measures the log file more than the Stack
+static const struct {
+    unsigned flag;
+    char const* name;
+} bench_flags[] = {
+    {STACK_USE_CANARY, "canary"},
+    {STACK_USE_DATA_CANARY, "data_canary"},
+    {STACK_USE_HASH_FAST, "hash_fast"},
+    {STACK_USE_HASH_FULL, "hash_full"},
+    {STACK_USE_POISON, "poison"},
+    {STACK_SEGMENTED, "segmented"},
+    {STACK_GUARD_PAGES, "guard_pages"},
+};
+
+typedef enum bench_workload_e {
+    BENCH_PUSH,
+    BENCH_POP,
+    BENCH_TOP,
+    BENCH_OSCILLATE,
+    BENCH_BULK,
+    BENCH_WORKLOAD_COUNT,
+} BENCH_WORKLOAD;
+
+static char const* const bench_workload_names[] = {
+    [BENCH_PUSH] = "push",
+    [BENCH_POP] = "pop",
+    [BENCH_TOP] = "top",
+    [BENCH_OSCILLATE] = "oscillate",
+    [BENCH_BULK] = "bulk",
+};
+
+// Input sizes of the hash benchmarks
+static const size_t bench_hash_sizes[] = {4, 16, 64, 256, 4096};
+// Bytes hashed by each hash benchmark
+enum { BENCH_HASH_BYTES = 1u << 26 };
+
+typedef enum bench_hash_e {
+    BENCH_HASH_ROTATE,
+    BENCH_HASH_WYHASH,
+    BENCH_HASH_CRC32C,
+    BENCH_HASH_COUNT,
+} BENCH_HASH;
+
+static char const* const bench_hash_names[] = {
+    [BENCH_HASH_ROTATE] = "rotate",
+    [BENCH_HASH_WYHASH] = "wyhash",
+    [BENCH_HASH_CRC32C] = "crc32c",
+};
+
+// Bytes of elements each paging benchmark pushes, enough for the page faults and TLB misses to add up
+enum { BENCH_PAGING_BYTES = 1u << 28 };
+enum { BENCH_PAGING_ELEM_SIZE = 16 };
+
+static const struct {
+    unsigned flags;
+    char const* name;
+} bench_paging_flags[] = {
+    {STACK_NO_PROTECTION, "none"},
+    {STACK_HUGE_PAGES, "huge_pages"},
+    {STACK_PREFAULT, "prefault"},
+    {STACK_HUGE_PAGES | STACK_PREFAULT, "huge_pages+prefault"},
+    {STACK_USE_POISON, "poison"},
+    {STACK_USE_POISON | STACK_HUGE_PAGES, "poison+huge_pages"},
+};
+
+typedef enum bench_paging_phase_e {
+    // Prefaulting Stacks reserve their whole depth first
+    BENCH_PAGING_RESERVE,
+    BENCH_PAGING_PUSH,
+    BENCH_PAGING_POP,
+    BENCH_PAGING_PHASE_COUNT,
+} BENCH_PAGING_PHASE;
+
+static char const* const bench_paging_phase_names[] = {
+    [BENCH_PAGING_RESERVE] = "reserve",
+    [BENCH_PAGING_PUSH] = "push",
+    [BENCH_PAGING_POP] = "pop",
+};
+
+typedef struct bench_paging_counters_t {
+    uint64_t ns;
+    size_t faults;
+    // Negative if the TLB misses can't be counted
+    long long tlb_misses;
+} BenchPagingCounters;
+
+typedef struct bench_options_t {
+    size_t ops;
+    // Benchmark the hash functions instead of the Stack operations
+    bool hash;
+    // Benchmark the page faults and TLB misses of a large Stack instead
+    bool paging;
+    // Only benchmarks whose name contains this are run
+    char const* filter;
+    char const* json_filename;
+    // Verification policy of the benchmarked Stacks
+    STACK_VERIFY_MODE verify_mode;
+    // Time the Stacks' operations and their phases with STACK_TIMED, and print the latency histograms at the end
+    bool phases;
+} BenchOptions;
+
+static char const* const bench_verify_mode_names[] = {
+    [STACK_VERIFY_ALWAYS] = "always",
+    [STACK_VERIFY_EVERY_NTH] = "nth",
+    [STACK_VERIFY_TIME_BUDGET] = "budget",
+    [STACK_VERIFY_AMORTIZED] = "amortized",
+    [STACK_VERIFY_ROUND_ROBIN] = "round_robin",
+};
+
+typedef struct bench_result_t {
+    double ops_per_sec;
+    double p50_ns;
+    double p99_ns;
+    // Number of times the Stack's storage was allocated or reallocated while the benchmark ran
+    size_t allocations;
+    size_t bytes_copied;
+} BenchResult;
+
+// Scratch space shared by all benchmarks
+typedef struct bench_state_t {
+    Stack* stk;
+    size_t elem_sz;
+    unsigned char* elems;
+    uint64_t* samples;
+    // Median cost of reading the clock, subtracted from each latency sample
+    uint64_t clock_overhead;
+} BenchState;
+
+uint64_t get_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+int compare_samples(void const* lhs_p, void const* rhs_p) {
+    uint64_t lhs = *(uint64_t const*) lhs_p;
+    uint64_t rhs = *(uint64_t const*) rhs_p;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/*
+ * Return the sample at the given percentile of sorted samples
+ */
+double percentile(uint64_t* samples, size_t num, double pct) {
+    assert(samples);
+    assert(num);
+
+    size_t i = (size_t) (pct / 100.0 * (double) (num - 1) + 0.5);
+    return (double) samples[i];
+}
+
+uint64_t measure_clock_overhead(uint64_t* samples, size_t num) {
+    for (size_t i = 0; i < num; i++) {
+        uint64_t start = get_time_ns();
+        samples[i] = get_time_ns() - start;
+    }
+    qsort(samples, num, sizeof(*samples), compare_samples);
+    return samples[num / 2];
+}
+
+char* flags_to_str(unsigned flags, char* str, size_t str_sz) {
+    assert(str);
+
+    str[0] = '\0';
+    size_t len = 0;
+    for (size_t i = 0; i < ARR_LENGTH(bench_flags); i++) {
+        // STACK_USE_HASH_FULL implies STACK_USE_HASH_FAST, so don't name both
+        if ((flags & bench_flags[i].flag) &&
+            !(bench_flags[i].flag == STACK_USE_HASH_FAST && (flags & STACK_USE_HASH_FULL))) {
+            len += snprintf(str + len, (len < str_sz) ? str_sz - len : 0, "%s%s", (len) ? "+" : "", bench_flags[i].name);
+        }
+    }
+    if (!len) {
+        snprintf(str, str_sz, "none");
+    }
+    return str;
+}
+
+/*
+ * Do one batch of a workload, recording the latency of each operation if samples is not NULL.
+ * The Stack has the same size before and after.
+ * Returns the number of operations done
+ */
+size_t bench_batch(BenchState* state, BENCH_WORKLOAD workload, uint64_t* samples) {
+    assert(state);
+
+    Stack* stk = state->stk;
+    unsigned char* elems = state->elems;
+    size_t elem_sz = state->elem_sz;
+    uint64_t start = 0;
+
+#define BENCH_TIMED(op, i)                                              \
+    do {                                                                \
+        if (samples) {                                                  \
+            start = get_time_ns();                                      \
+            op;                                                         \
+            samples[i] = get_time_ns() - start;                         \
+        } else {                                                        \
+            op;                                                         \
+        }                                                               \
+    } while (0)
+
+    switch (workload) {
+        case BENCH_PUSH:
+            for (size_t i = 0; i < BENCH_BATCH; i++) {
+                BENCH_TIMED(stack_push(stk, elems + i * elem_sz), i);
+            }
+            stack_pop_n(stk, elems, BENCH_BATCH);
+            return BENCH_BATCH;
+        case BENCH_POP:
+            stack_push_n(stk, elems, BENCH_BATCH);
+            for (size_t i = 0; i < BENCH_BATCH; i++) {
+                BENCH_TIMED(stack_pop(stk, elems + i * elem_sz), i);
+            }
+            return BENCH_BATCH;
+        case BENCH_TOP:
+            for (size_t i = 0; i < BENCH_BATCH; i++) {
+                BENCH_TIMED(stack_top(stk, elems + i * elem_sz), i);
+            }
+            return BENCH_BATCH;
+        case BENCH_OSCILLATE:
+            for (size_t i = 0; i < BENCH_BATCH; i += 2) {
+                BENCH_TIMED(stack_push(stk, elems + i * elem_sz), i);
+                BENCH_TIMED(stack_pop(stk, elems + i * elem_sz), i + 1);
+            }
+            return BENCH_BATCH;
+        case BENCH_BULK:
+            // Bulk operations can't be timed one element at a time, so each element gets an equal share
+            start = get_time_ns();
+            stack_push_n(stk, elems, BENCH_BATCH);
+            stack_pop_n(stk, elems, BENCH_BATCH);
+            if (samples) {
+                uint64_t per_elem = (get_time_ns() - start) / (2 * BENCH_BATCH);
+                for (size_t i = 0; i < 2 * BENCH_BATCH; i++) {
+                    samples[i] = per_elem + state->clock_overhead;
+                }
+            }
+            return 2 * BENCH_BATCH;
+        default:
+            assert(!"Unknown workload");
+            return 0;
+    }
+
+#undef BENCH_TIMED
+}
+
+/*
+ * Throughput is measured without reading the clock between operations,
+ * latencies in a separate pass that times every operation
+ */
+BenchResult bench_workload(BenchState* state, BENCH_WORKLOAD workload, size_t ops) {
+    assert(state);
+
+    BenchResult result = {0};
+    StackResizeStats stats_before = stack_get_resize_stats(state->stk);
+
+    size_t done = 0;
+    uint64_t start = get_time_ns();
+    while (done < ops) {
+        done += bench_batch(state, workload, NULL);
+    }
+    uint64_t time = get_time_ns() - start;
+    result.ops_per_sec = (time) ? done * 1e9 / (double) time : 0.0;
+
+    size_t num = 0;
+    while (num < ops) {
+        num += bench_batch(state, workload, state->samples + num);
+    }
+    for (size_t i = 0; i < num; i++) {
+        state->samples[i] = (state->samples[i] > state->clock_overhead) ? state->samples[i] - state->clock_overhead : 0;
+    }
+    qsort(state->samples, num, sizeof(*state->samples), compare_samples);
+    result.p50_ns = percentile(state->samples, num, 50.0);
+    result.p99_ns = percentile(state->samples, num, 99.0);
+
+    StackResizeStats stats_after = stack_get_resize_stats(state->stk);
+    result.allocations = (stats_after.grow_count - stats_before.grow_count) +
+                         (stats_after.shrink_count - stats_before.shrink_count);
+    result.bytes_copied = stats_after.bytes_copied - stats_before.bytes_copied;
+    assert(stack_get_error(state->stk) == STACK_OK);
+
+    return result;
+}
+
+void fill_stack(Stack* stk, size_t depth, unsigned char const* elems) {
+    while (stack_size(stk) < depth) {
+        size_t num = depth - stack_size(stk);
+        stack_push_n(stk, elems, (num < BENCH_FILL_CHUNK) ? num : BENCH_FILL_CHUNK);
+    }
+}
+
+void print_json_result(FILE* json, bool first, char const* name, BENCH_WORKLOAD workload,
+                       size_t elem_sz, size_t depth, unsigned flags, char const* flags_str,
+                       BenchResult const* result) {
+    fprintf(json,
+            "%s\n    {\"name\": \"%s\", \"workload\": \"%s\", \"elem_size\": %zu, \"depth\": %zu, "
+            "\"flags\": \"%s\", \"flags_value\": %u, \"ops_per_second\": %.0f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, "
+            "\"allocations\": %zu, \"bytes_copied\": %zu}",
+            (first) ? "" : ",", name, bench_workload_names[workload], elem_sz, depth,
+            flags_str, flags, result->ops_per_sec, result->p50_ns, result->p99_ns,
+            result->allocations, result->bytes_copied);
+}
+
+bool is_redundant_combination(unsigned flags) {
+    // STACK_USE_HASH_FULL implies STACK_USE_HASH_FAST, so it's enough to benchmark it once
+    if ((flags & STACK_USE_HASH_FULL) && !(flags & STACK_USE_HASH_FAST)) {
+        return true;
+    }
+    // Guard pages replace data canaries and can't be combined with segments
+    return (flags & STACK_GUARD_PAGES) && (flags & (STACK_USE_DATA_CANARY | STACK_SEGMENTED));
+}
+
+/*
+ * Print the percentiles of the latencies all timed Stacks recorded for each operation and phase
+ */
+void print_phase_latencies() {
+    printf("\n%-12s %12s %10s %10s %10s %12s\n", "phase", "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    for (unsigned k = 0; k < STACK_LATENCY_KINDS; k++) {
+        StackLatency latency;
+        stack_global_latency((STACK_LATENCY_KIND) k, &latency);
+        if (!latency.count) {
+            continue;
+        }
+        printf("%-12s %12zu %10llu %10llu %10llu %12llu\n", stack_latency_kind_name((STACK_LATENCY_KIND) k),
+               latency.count, (unsigned long long) stack_latency_percentile(&latency, 50.0),
+               (unsigned long long) stack_latency_percentile(&latency, 99.0),
+               (unsigned long long) stack_latency_percentile(&latency, 99.9), (unsigned long long) latency.max_ns);
+    }
+}
+
+int run_benchmarks(BenchOptions const* options) {
+    assert(options);
+
+    FILE* json = NULL;
+    if (options->json_filename) {
+        json = fopen(options->json_filename, "w");
+        if (!json) {
+            fprintf(stderr, "Failed to open %s\n", options->json_filename);
+            return 1;
+        }
+        fprintf(json, "{\n  \"context\": {\"library\": \"%s\", \"ops\": %zu, \"batch\": %d, \"verify\": \"%s\"},\n"
+                      "  \"benchmarks\": [",
+                get_stack_compilation_options(), options->ops, BENCH_BATCH,
+                bench_verify_mode_names[options->verify_mode]);
+    }
+    StackVerifyPolicy verify_policy = stack_verify_policy(options->verify_mode);
+    stack_set_default_verify_policy(&verify_policy);
+
+    BenchState state = {0};
+    size_t max_elem_sz = bench_elem_sizes[ARR_LENGTH(bench_elem_sizes) - 1];
+    state.elems = calloc(BENCH_FILL_CHUNK, max_elem_sz);
+    state.samples = malloc((options->ops + 2 * BENCH_BATCH) * sizeof(*state.samples));
+    assert(state.elems);
+    assert(state.samples);
+    state.clock_overhead = measure_clock_overhead(state.samples, options->ops);
+    for (size_t i = 0; i < BENCH_FILL_CHUNK * max_elem_sz; i++) {
+        state.elems[i] = (unsigned char) i;
+    }
+
+    printf("%-80s %15s %10s %10s %8s\n", "benchmark", "ops/s", "p50 ns", "p99 ns", "allocs");
+    bool first = true;
+    unsigned flag_combinations = 1u << ARR_LENGTH(bench_flags);
+    for (size_t e = 0; e < ARR_LENGTH(bench_elem_sizes); e++) {
+        for (size_t d = 0; d < ARR_LENGTH(bench_depths); d++) {
+            for (unsigned c = 0; c < flag_combinations; c++) {
+                unsigned flags = 0;
+                for (size_t f = 0; f < ARR_LENGTH(bench_flags); f++) {
+                    if (c & (1u << f)) {
+                        flags |= bench_flags[f].flag;
+                    }
+                }
+                if (is_redundant_combination(flags)) {
+                    continue;
+                }
+
+                char flags_str[128];
+                flags_to_str(flags, flags_str, sizeof(flags_str));
+                char names[BENCH_WORKLOAD_COUNT][256];
+                bool any = false;
+                for (unsigned w = 0; w < BENCH_WORKLOAD_COUNT; w++) {
+                    snprintf(names[w], sizeof(names[w]), "%s/elem:%zu/depth:%zu/flags:%s",
+                             bench_workload_names[w], bench_elem_sizes[e], bench_depths[d], flags_str);
+                    any |= !options->filter || strstr(names[w], options->filter);
+                }
+                if (!any) {
+                    continue;
+                }
+
+                // Workloads leave the Stack at its depth, so it's only filled once for all of them
+                state.elem_sz = bench_elem_sizes[e];
+                state.stk = stack_allocate_ex(state.elem_sz, flags | ((options->phases) ? STACK_TIMED : 0));
+                assert(state.stk);
+                fill_stack(state.stk, bench_depths[d], state.elems);
+
+                for (unsigned w = 0; w < BENCH_WORKLOAD_COUNT; w++) {
+                    if (options->filter && !strstr(names[w], options->filter)) {
+                        continue;
+                    }
+                    BenchResult result = bench_workload(&state, w, options->ops);
+                    printf("%-80s %15.0f %10.0f %10.0f %8zu\n", names[w],
+                           result.ops_per_sec, result.p50_ns, result.p99_ns, result.allocations);
+                    if (json) {
+                        print_json_result(json, first, names[w], w, state.elem_sz, bench_depths[d],
+                                          flags, flags_str, &result);
+                        first = false;
+                    }
+                }
+
+                stack_free(state.stk);
+            }
+        }
+    }
+
+    free(state.samples);
+    free(state.elems);
+    if (options->phases) {
+        print_phase_latencies();
+    }
+    if (json) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+    return 0;
+}
+
+/*
+ * Measure how many bytes per nanosecond, and per cycle where the cycle counter can be read,
+ * each hash function gets through. Like the elements of a Stack, each input is hashed with its own seed
+ * and the hashes are summed
+ */
+int run_hash_benchmarks(BenchOptions const* options) {
+    assert(options);
+
+    size_t max_size = bench_hash_sizes[ARR_LENGTH(bench_hash_sizes) - 1];
+    unsigned char* bytes = malloc(max_size);
+    assert(bytes);
+    for (size_t i = 0; i < max_size; i++) {
+        bytes[i] = (unsigned char) (i * 131 + 7);
+    }
+
+    printf("%-40s %12s %12s\n", "benchmark", "bytes/ns", "bytes/cycle");
+    for (unsigned h = 0; h < BENCH_HASH_COUNT; h++) {
+        for (size_t i = 0; i < ARR_LENGTH(bench_hash_sizes); i++) {
+            char name[64];
+            snprintf(name, sizeof(name), "hash/%s/bytes:%zu", bench_hash_names[h], bench_hash_sizes[i]);
+            if (options->filter && !strstr(name, options->filter)) {
+                continue;
+            }
+
+            size_t size = bench_hash_sizes[i];
+            size_t iterations = BENCH_HASH_BYTES / size;
+            hash_type hash_sum = 0;
+            uint64_t start = get_time_ns();
+#ifdef BENCH_CYCLES
+            uint64_t start_cycles = __rdtsc();
+#endif
+            // The hashes are inlined into their loops, as they are where the Stacks use them
+#define BENCH_HASH_LOOP(hash)                               \
+    for (size_t j = 0; j < iterations; j++) {               \
+        hash_sum += hash(bytes, size, HASH_INITIAL_VALUE ^ j); \
+    }
+            switch ((BENCH_HASH) h) {
+                case BENCH_HASH_ROTATE:
+                    BENCH_HASH_LOOP(stack_hash_rotate);
+                    break;
+                case BENCH_HASH_WYHASH:
+                    BENCH_HASH_LOOP(stack_hash_wyhash);
+                    break;
+                case BENCH_HASH_CRC32C:
+                case BENCH_HASH_COUNT:
+                    BENCH_HASH_LOOP(stack_hash_crc32c);
+                    break;
+            }
+#undef BENCH_HASH_LOOP
+#ifdef BENCH_CYCLES
+            double cycles = (double) (__rdtsc() - start_cycles);
+#endif
+            double ns = (double) (get_time_ns() - start);
+
+            double total = (double) iterations * (double) size;
+#ifdef BENCH_CYCLES
+            printf("%-40s %12.3f %12.3f\n", name, total / ns, total / cycles);
+#else
+            printf("%-40s %12.3f %12s\n", name, total / ns, "-");
+#endif
+            // Keep the hashes from being optimized away
+            if (hash_sum == 0) {
+                printf("\n");
+            }
+        }
+    }
+
+    free(bytes);
+    return 0;
+}
+
+/*
+ * Open a counter of the calling thread's data TLB load misses, returning -1 if they can't be counted
+ */
+int open_tlb_counter() {
+#ifdef BENCH_PERF
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+BenchPagingCounters read_paging_counters(int tlb_fd) {
+    BenchPagingCounters counters = {
+        .ns = get_time_ns(),
+        .faults = 0,
+        .tlb_misses = -1,
+    };
+    struct rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage)) {
+        counters.faults = (size_t) (usage.ru_minflt + usage.ru_majflt);
+    }
+#ifdef BENCH_PERF
+    uint64_t misses = 0;
+    if (tlb_fd >= 0 && read(tlb_fd, &misses, sizeof(misses)) == sizeof(misses)) {
+        counters.tlb_misses = (long long) misses;
+    }
+#endif
+    return counters;
+}
+
+/*
+ * Get the bytes of the process's anonymous memory that are backed by transparent huge pages, or 0 if that's unknown
+ */
+size_t get_huge_page_bytes() {
+    size_t kib = 0;
+    FILE* smaps = fopen("/proc/self/smaps_rollup", "r");
+    if (smaps) {
+        char line[256];
+        while (fgets(line, sizeof(line), smaps)) {
+            if (sscanf(line, "AnonHugePages: %zu kB", &kib) == 1) {
+                break;
+            }
+        }
+        fclose(smaps);
+    }
+    return kib * 1024;
+}
+
+/*
+ * Push a large Stack one element at a time and pop it the same way,
+ * counting the page faults and data TLB misses of each phase with each paging option
+ */
+int run_paging_benchmarks(BenchOptions const* options) {
+    assert(options);
+
+    int tlb_fd = open_tlb_counter();
+    if (tlb_fd < 0) {
+        fprintf(stderr, "Data TLB misses can't be counted here, perf_event_paranoid may be too high\n");
+    }
+    // Verifying all of a large Stack's poison on every operation would take far longer than the paging
+    StackVerifyPolicy verify_policy = stack_verify_policy(STACK_VERIFY_AMORTIZED);
+    stack_set_default_verify_policy(&verify_policy);
+
+    unsigned char elem[BENCH_PAGING_ELEM_SIZE] = {0};
+    size_t depth = BENCH_PAGING_BYTES / BENCH_PAGING_ELEM_SIZE;
+    printf("%-40s %10s %12s %14s %10s\n", "benchmark", "ms", "faults", "dTLB misses", "huge MiB");
+    for (size_t f = 0; f < ARR_LENGTH(bench_paging_flags); f++) {
+        char names[BENCH_PAGING_PHASE_COUNT][128];
+        bool any = false;
+        for (unsigned p = 0; p < BENCH_PAGING_PHASE_COUNT; p++) {
+            snprintf(names[p], sizeof(names[p]), "paging/%s/flags:%s", bench_paging_phase_names[p],
+                     bench_paging_flags[f].name);
+            any |= !options->filter || strstr(names[p], options->filter);
+        }
+        if (!any) {
+            continue;
+        }
+
+        Stack* stk = stack_allocate_ex(BENCH_PAGING_ELEM_SIZE, bench_paging_flags[f].flags);
+        assert(stk);
+        for (unsigned p = 0; p < BENCH_PAGING_PHASE_COUNT; p++) {
+            if (p == BENCH_PAGING_RESERVE && !(bench_paging_flags[f].flags & STACK_PREFAULT)) {
+                continue;
+            }
+            BenchPagingCounters before = read_paging_counters(tlb_fd);
+            switch ((BENCH_PAGING_PHASE) p) {
+                case BENCH_PAGING_RESERVE:
+                    stack_reserve(stk, depth);
+                    break;
+                case BENCH_PAGING_PUSH:
+                    for (size_t i = 0; i < depth; i++) {
+                        stack_push(stk, elem);
+                    }
+                    break;
+                case BENCH_PAGING_POP:
+                case BENCH_PAGING_PHASE_COUNT:
+                    for (size_t i = 0; i < depth; i++) {
+                        stack_pop(stk, elem);
+                    }
+                    break;
+            }
+            BenchPagingCounters after = read_paging_counters(tlb_fd);
+            // Measured while the Stack is at its largest
+            size_t huge_bytes = get_huge_page_bytes();
+            assert(stack_get_error(stk) == STACK_OK);
+            if (options->filter && !strstr(names[p], options->filter)) {
+                continue;
+            }
+
+            char misses[32] = "-";
+            if (after.tlb_misses >= 0 && before.tlb_misses >= 0) {
+                snprintf(misses, sizeof(misses), "%lld", after.tlb_misses - before.tlb_misses);
+            }
+            printf("%-40s %10.1f %12zu %14s %10zu\n", names[p], (double) (after.ns - before.ns) / 1e6,
+                   after.faults - before.faults, misses, huge_bytes >> 20);
+        }
+        stack_free(stk);
+    }
+
+#ifdef BENCH_PERF
+    if (tlb_fd >= 0) {
+        close(tlb_fd);
+    }
+#endif
+    return 0;
+}
+
+void print_usage(char const* program) {
+    fprintf(stderr,
+            "Usage: %s [--filter SUBSTRING] [--json FILE] [--ops N] [--verify always|nth|budget|amortized|round_robin] [--phases] [--hash] [--paging]\n"
+            "Benchmark names are workload/elem:SIZE/depth:DEPTH/flags:FEATURES\n"
+            "--phases also prints the latency percentiles of each operation and phase of the benchmarked Stacks\n"
+            "--hash benchmarks the hash functions instead, named hash/FUNCTION/bytes:SIZE\n"
+            "--paging counts the page faults and data TLB misses of a large Stack instead, named paging/PHASE/flags:OPTIONS\n",
+            program);
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options = {
+        .ops = BENCH_OPS,
+        .filter = NULL,
+        .json_filename = NULL,
+        .verify_mode = STACK_VERIFY_ALWAYS,
+        .hash = false,
+        .paging = false,
+        .phases = false,
+    };
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "--filter")) {
+            options.filter = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "--json")) {
+            options.json_filename = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "--ops")) {
+            options.ops = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--hash")) {
+            options.hash = true;
+        } else if (!strcmp(argv[i], "--paging")) {
+            options.paging = true;
+        } else if (!strcmp(argv[i], "--phases")) {
+            options.phases = true;
+        } else if (i + 1 < argc && !strcmp(argv[i], "--verify")) {
+            char const* mode_name = argv[++i];
+            size_t mode = 0;
+            while (mode < ARR_LENGTH(bench_verify_mode_names) && strcmp(mode_name, bench_verify_mode_names[mode])) {
+                mode++;
+            }
+            if (mode == ARR_LENGTH(bench_verify_mode_names)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            options.verify_mode = (STACK_VERIFY_MODE) mode;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!options.ops) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (options.paging) {
+        return run_paging_benchmarks(&options);
+    }
+    return (options.hash) ? run_hash_benchmarks(&options) : run_benchmarks(&options);
+}
@@ -0,0 +1,377 @@
+#include "stack.h"
+#include "stack_common.h"
+#include "stack_hash.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * ConcurrentStack is a Treiber stack.
+ * Nodes are addressed by 32 bit indices, and the head of the stack packs
+ * the top node's index together with a 32 bit tag that is incremented on every change,
+ * so that a head that was poped and pushed back in between is not mistaken for an unchanged one.
+ * Nodes are never freed while the ConcurrentStack exists, but are recycled through
+ * Treiber stacks of free nodes, so reading a node that another thread has just poped is always safe.
+ * Each thread recycles nodes through its own free list, so that the lists aren't contended,
+ * and each node records the size of the stack it tops, so that there is no shared size to update.
+ */
+
+typedef uint64_t tagged_index;
+#define NODE_NIL UINT32_MAX
+
+static inline tagged_index make_tagged(uint32_t index, uint32_t tag) {
+    return (uint64_t) tag << 32 | index;
+}
+
+static inline uint32_t tagged_index_of(tagged_index tagged) {
+    return (uint32_t) tagged;
+}
+
+static inline uint32_t tagged_tag_of(tagged_index tagged) {
+    return (uint32_t) (tagged >> 32);
+}
+
+// Chunk k holds 2^(k + NODE_CHUNK_SHIFT) nodes, so that a fixed table of chunks covers all indices
+enum {
+    NODE_CHUNK_SHIFT = 6,
+    NODE_CHUNK_COUNT = 32 - NODE_CHUNK_SHIFT + 1,
+};
+
+typedef struct concurrent_node_t {
+    atomic_uint_least32_t next;
+    // Number of elements from this node down, while it is in the stack
+    atomic_uint_least32_t depth;
+    hash_type digest;
+    // Followed by the element
+} ConcurrentNode;
+
+enum { CONCURRENT_BACKOFF_MAX = 1 << 10 };
+
+// Threads are spread over this many free lists
+enum { CONCURRENT_FREE_LISTS = 8 };
+
+// Free list heads are on cache lines of their own
+typedef struct concurrent_free_list_t {
+    _Alignas(64) _Atomic tagged_index head;
+} ConcurrentFreeList;
+
+static atomic_uint concurrent_thread_count = 0;
+// Free list of the calling thread, or UINT_MAX until it uses a ConcurrentStack
+static _Thread_local unsigned concurrent_thread_free_list = UINT_MAX;
+
+struct concurrent_stack_t {
+    canary_type front_canary;
+
+    size_t elem_sz;
+    size_t node_sz;
+    unsigned flags;
+    _Atomic STACK_ERROR error;
+
+    _Alignas(64) _Atomic tagged_index head;
+    ConcurrentFreeList free_lists[CONCURRENT_FREE_LISTS];
+    // Number of node indices that have been handed out
+    _Alignas(64) atomic_uint_least64_t node_count;
+    _Atomic(char*) chunks[NODE_CHUNK_COUNT];
+
+    canary_type back_canary;
+};
+
+#define CONCURRENT_STACK_USES(stk, flag) (((stk)->flags & (flag)) != 0)
+
+static inline void cpu_relax() {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/*
+ * Wait before retrying a failed compare-and-swap, for longer after each failure,
+ * so that contending threads spread out instead of failing over and over
+ */
+static inline void concurrent_backoff(unsigned* backoff) {
+    assert(backoff);
+
+    for (unsigned i = 0; i < *backoff; i++) {
+        cpu_relax();
+    }
+    if (*backoff < CONCURRENT_BACKOFF_MAX) {
+        *backoff *= 2;
+    }
+}
+
+static inline unsigned node_chunk(uint32_t index) {
+    uint64_t biased = (uint64_t) index + (1u << NODE_CHUNK_SHIFT);
+    return 63 - __builtin_clzll(biased) - NODE_CHUNK_SHIFT;
+}
+
+static inline size_t node_chunk_first(unsigned chunk) {
+    return ((size_t) 1 << (chunk + NODE_CHUNK_SHIFT)) - (1u << NODE_CHUNK_SHIFT);
+}
+
+static inline size_t node_chunk_size(unsigned chunk) {
+    return (size_t) 1 << (chunk + NODE_CHUNK_SHIFT);
+}
+
+static inline ConcurrentNode* concurrent_node(ConcurrentStack* stk, uint32_t index) {
+    assert(stk);
+
+    unsigned chunk = node_chunk(index);
+    char* nodes = atomic_load_explicit(&stk->chunks[chunk], memory_order_acquire);
+    assert(nodes);
+    return (ConcurrentNode*) (nodes + (index - node_chunk_first(chunk)) * stk->node_sz);
+}
+
+static inline void* concurrent_node_elem(ConcurrentNode* node) {
+    return node + 1;
+}
+
+static inline hash_type concurrent_node_digest(ConcurrentStack const* stk, uint32_t index, void const* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    return stack_hash_bytes(elem_p, stk->elem_sz, HASH_INITIAL_VALUE ^ (hash_type) index);
+}
+
+/*
+ * Push a node, recording the size of the stack it tops if count_depth is set
+ */
+static inline void concurrent_push_index(ConcurrentStack* stk, _Atomic tagged_index* head, uint32_t index, bool count_depth) {
+    assert(stk);
+    assert(head);
+
+    ConcurrentNode* node = concurrent_node(stk, index);
+    tagged_index old_head = atomic_load_explicit(head, memory_order_acquire);
+    unsigned backoff = 1;
+    while (true) {
+        uint32_t next = tagged_index_of(old_head);
+        atomic_store_explicit(&node->next, next, memory_order_relaxed);
+        if (count_depth) {
+            // The next node may have been poped and reused since head was read,
+            // but then the tag has changed and the compare-and-swap fails
+            uint32_t depth = (next == NODE_NIL) ? 0
+                                                : atomic_load_explicit(&concurrent_node(stk, next)->depth, memory_order_relaxed);
+            atomic_store_explicit(&node->depth, depth + 1, memory_order_relaxed);
+        }
+        tagged_index new_head = make_tagged(index, tagged_tag_of(old_head) + 1);
+        if (atomic_compare_exchange_weak_explicit(head, &old_head, new_head,
+                                                  memory_order_release, memory_order_acquire)) {
+            return;
+        }
+        concurrent_backoff(&backoff);
+    }
+}
+
+static inline uint32_t concurrent_pop_index(ConcurrentStack* stk, _Atomic tagged_index* head) {
+    assert(stk);
+    assert(head);
+
+    tagged_index old_head = atomic_load_explicit(head, memory_order_acquire);
+    unsigned backoff = 1;
+    while (true) {
+        uint32_t index = tagged_index_of(old_head);
+        if (index == NODE_NIL) {
+            return NODE_NIL;
+        }
+        // The node may have been poped and reused since head was read,
+        // but then the tag has changed and the compare-and-swap fails
+        uint32_t next = atomic_load_explicit(&concurrent_node(stk, index)->next, memory_order_relaxed);
+        tagged_index new_head = make_tagged(next, tagged_tag_of(old_head) + 1);
+        if (atomic_compare_exchange_weak_explicit(head, &old_head, new_head,
+                                                  memory_order_acquire, memory_order_acquire)) {
+            return index;
+        }
+        concurrent_backoff(&backoff);
+    }
+}
+
+/*
+ * Get the free list of the calling thread
+ */
+static inline ConcurrentFreeList* concurrent_free_list(ConcurrentStack* stk) {
+    assert(stk);
+
+    if (concurrent_thread_free_list == UINT_MAX) {
+        concurrent_thread_free_list =
+            atomic_fetch_add_explicit(&concurrent_thread_count, 1, memory_order_relaxed) % CONCURRENT_FREE_LISTS;
+    }
+    return &stk->free_lists[concurrent_thread_free_list];
+}
+
+/*
+ * Get a node from the calling thread's free list, or from another thread's, or hand out a new index,
+ * allocating its chunk if necessary
+ */
+static inline uint32_t concurrent_allocate_node(ConcurrentStack* stk) {
+    assert(stk);
+
+    ConcurrentFreeList* own_list = concurrent_free_list(stk);
+    uint32_t index = concurrent_pop_index(stk, &own_list->head);
+    for (unsigned i = 1; index == NODE_NIL && i < CONCURRENT_FREE_LISTS; i++) {
+        ConcurrentFreeList* list = &stk->free_lists[(own_list - stk->free_lists + i) % CONCURRENT_FREE_LISTS];
+        if (tagged_index_of(atomic_load_explicit(&list->head, memory_order_relaxed)) != NODE_NIL) {
+            index = concurrent_pop_index(stk, &list->head);
+        }
+    }
+    if (index != NODE_NIL) {
+        return index;
+    }
+
+    uint64_t new_index = atomic_fetch_add_explicit(&stk->node_count, 1, memory_order_relaxed);
+    if (new_index >= NODE_NIL) {
+        return NODE_NIL;
+    }
+    index = (uint32_t) new_index;
+    unsigned chunk = node_chunk(index);
+    if (!atomic_load_explicit(&stk->chunks[chunk], memory_order_acquire)) {
+        char* nodes = calloc(node_chunk_size(chunk), stk->node_sz);
+        if (!nodes) {
+            // This index is lost, but another thread may still allocate the chunk for the others
+            return NODE_NIL;
+        }
+        char* expected = NULL;
+        if (!atomic_compare_exchange_strong_explicit(&stk->chunks[chunk], &expected, nodes,
+                                                     memory_order_acq_rel, memory_order_acquire)) {
+            free(nodes);
+        }
+    }
+    return index;
+}
+
+/*
+ * Check the parts of a ConcurrentStack that no operation modifies
+ */
+static inline STACK_ERROR concurrent_stack_verify(ConcurrentStack* stk) {
+    assert(stk);
+
+    STACK_ERROR error = atomic_load_explicit(&stk->error, memory_order_relaxed);
+    if (error != STACK_OK) {
+        return error;
+    }
+    if (CONCURRENT_STACK_USES(stk, STACK_USE_CANARY) &&
+        (stk->front_canary != CANARY_VALUE || stk->back_canary != CANARY_VALUE)) {
+        error = STACK_METADATA_CANARY_OVERWRITE_ERROR;
+    } else if (!stk->elem_sz || stk->node_sz < sizeof(ConcurrentNode) + stk->elem_sz) {
+        error = STACK_CORRUPTION_ERROR;
+    }
+    if (error != STACK_OK) {
+        atomic_store_explicit(&stk->error, error, memory_order_relaxed);
+    }
+    return error;
+}
+
+ConcurrentStack* concurrent_stack_allocate(size_t stk_elem_sz, unsigned flags) {
+    assert(stk_elem_sz);
+    assert(!(flags & ~STACK_CONCURRENT_FLAGS));
+
+    // The atomics are aligned to separate cache lines, so that threads don't contend for them needlessly
+    size_t align = _Alignof(ConcurrentStack);
+    ConcurrentStack* stk = aligned_alloc(align, (sizeof(ConcurrentStack) + align - 1) / align * align);
+    if (!stk) {
+        return NULL;
+    }
+    memset(stk, 0, sizeof(*stk));
+    stk->flags = flags & STACK_CONCURRENT_FLAGS;
+    if (CONCURRENT_STACK_USES(stk, STACK_USE_CANARY)) {
+        stk->front_canary = CANARY_VALUE;
+        stk->back_canary = CANARY_VALUE;
+    }
+    stk->elem_sz = stk_elem_sz;
+    // Keep node headers aligned
+    align = sizeof(hash_type);
+    stk->node_sz = (sizeof(ConcurrentNode) + stk_elem_sz + align - 1) / align * align;
+    atomic_init(&stk->error, STACK_OK);
+    atomic_init(&stk->head, make_tagged(NODE_NIL, 0));
+    for (unsigned i = 0; i < CONCURRENT_FREE_LISTS; i++) {
+        atomic_init(&stk->free_lists[i].head, make_tagged(NODE_NIL, 0));
+    }
+    atomic_init(&stk->node_count, 0);
+    for (unsigned i = 0; i < NODE_CHUNK_COUNT; i++) {
+        atomic_init(&stk->chunks[i], NULL);
+    }
+
+    return stk;
+}
+
+STACK_ERROR concurrent_stack_push(ConcurrentStack* stk, void const* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    // Like Stacks, ConcurrentStacks with no protections are not verified
+    if (stk->flags) {
+        STACK_ERROR error = concurrent_stack_verify(stk);
+        if (error != STACK_OK) {
+            return error;
+        }
+    }
+
+    uint32_t index = concurrent_allocate_node(stk);
+    if (index == NODE_NIL) {
+        return STACK_ALLOCATION_ERROR;
+    }
+    ConcurrentNode* node = concurrent_node(stk, index);
+    memcpy(concurrent_node_elem(node), elem_p, stk->elem_sz);
+    if (CONCURRENT_STACK_USES(stk, STACK_USE_HASH_FULL)) {
+        node->digest = concurrent_node_digest(stk, index, elem_p);
+    }
+
+    concurrent_push_index(stk, &stk->head, index, true);
+
+    return STACK_OK;
+}
+
+STACK_ERROR concurrent_stack_pop(ConcurrentStack* stk, void* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    if (stk->flags) {
+        STACK_ERROR error = concurrent_stack_verify(stk);
+        if (error != STACK_OK) {
+            return error;
+        }
+    }
+
+    uint32_t index = concurrent_pop_index(stk, &stk->head);
+    if (index == NODE_NIL) {
+        return STACK_OPERATION_ERROR;
+    }
+
+    ConcurrentNode* node = concurrent_node(stk, index);
+    memcpy(elem_p, concurrent_node_elem(node), stk->elem_sz);
+    if (CONCURRENT_STACK_USES(stk, STACK_USE_HASH_FULL) &&
+        node->digest != concurrent_node_digest(stk, index, elem_p)) {
+        // The corrupted node is not recycled
+        atomic_store_explicit(&stk->error, STACK_DATA_HASH_ERROR, memory_order_relaxed);
+        return STACK_DATA_HASH_ERROR;
+    }
+
+    concurrent_push_index(stk, &concurrent_free_list(stk)->head, index, false);
+
+    return STACK_OK;
+}
+
+size_t concurrent_stack_size(ConcurrentStack* stk) {
+    assert(stk);
+
+    // The top node may be poped and reused while it's read, but then the size was out of date anyway
+    uint32_t index = tagged_index_of(atomic_load_explicit(&stk->head, memory_order_acquire));
+    return (index == NODE_NIL) ? 0 : atomic_load_explicit(&concurrent_node(stk, index)->depth, memory_order_relaxed);
+}
+
+STACK_ERROR concurrent_stack_get_error(ConcurrentStack* stk) {
+    assert(stk);
+
+    return concurrent_stack_verify(stk);
+}
+
+void concurrent_stack_free(ConcurrentStack* stk) {
+    if (stk) {
+        for (unsigned i = 0; i < NODE_CHUNK_COUNT; i++) {
+            free(atomic_load_explicit(&stk->chunks[i], memory_order_relaxed));
+        }
+        free(stk);
+    }
+}
@@ -0,0 +1,63 @@
+#include "stack_log.h"
+#include "stack_log_reader.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Format an element the same way the text log used to
+ */
+char* elem_digest_to_str(uint64_t digest, uint64_t elem_sz, char* str, size_t str_sz) {
+    assert(str);
+
+    if (elem_sz <= sizeof(digest)) {
+        snprintf(str, str_sz, "0x%.*" PRIX64, (int) (2 * elem_sz), digest);
+    } else {
+        snprintf(str, str_sz, "with digest 0x%.16" PRIX64, digest);
+    }
+    return str;
+}
+
+void print_record(StackLogHeader const* header, StackLogRecord const* record, FILE* out) {
+    assert(header);
+    assert(record);
+    assert(out);
+
+    int64_t since_open = (int64_t) (record->timestamp - header->monotonic);
+    time_t tm = (time_t) ((int64_t) (header->realtime / 1000000000u) + since_open / 1000000000);
+    char* time_str = ctime(&tm);
+    *(strchr(time_str, '\n')) = '\0';
+    fprintf(out, "%s: Stack at %p: ", time_str, (void*) (uintptr_t) record->stack);
+
+    if (record->event >= STACK_EVENT_COUNT) {
+        fprintf(out, "Unknown event %" PRIu32 "\n", record->event);
+        return;
+    }
+    char const* format = stack_log_events[record->event].format;
+    if (stack_log_events[record->event].args == STACK_LOG_ELEM_ARG) {
+        char elem_str[64];
+        fprintf(out, format, elem_digest_to_str(record->arg0, record->arg1, elem_str, sizeof(elem_str)));
+    } else {
+        fprintf(out, format, (size_t) record->arg0, (size_t) record->arg1);
+    }
+    fprintf(out, "\n");
+}
+
+/*
+ * Print the records that were written while the log was open once
+ */
+bool print_session(void* data, StackLogHeader const* header, StackLogEntry const* entries, size_t num) {
+    FILE* out = data;
+    for (size_t i = 0; i < num; i++) {
+        print_record(header, &entries[i].record, out);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    char const* log_filename = (argc > 1) ? argv[1] : STACK_LOG_FILENAME;
+    return stack_log_read(log_filename, print_session, stdout) ? 0 : 1;
+}
@@ -0,0 +1,597 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "stack.h"
+#include "stack_log.h"
+#include "stack_log_reader.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ARR_LENGTH(arr) (sizeof(arr) / sizeof(*arr))
+
+// Element size of Stacks whose log doesn't say, unless --elem-size is given
+enum { REPLAY_DEFAULT_ELEM_SIZE = 8 };
+// Initial number of slots of the table of Stack addresses, must be a power of 2
+enum { REPLAY_ADDRESSES_CAPACITY = 1u << 10 };
+
+// Storage and protection features the Stacks can be replayed with, named like StackBench's.
+// Logging is left out, since the replayed Stacks would append to the log being replayed
+static const struct {
+    unsigned flag;
+    char const* name;
+} replay_flags[] = {
+    {STACK_USE_CANARY, "canary"},
+    {STACK_USE_DATA_CANARY, "data_canary"},
+    {STACK_USE_HASH_FAST, "hash_fast"},
+    {STACK_USE_HASH_FULL, "hash_full"},
+    {STACK_USE_POISON, "poison"},
+    {STACK_SEGMENTED, "segmented"},
+    {STACK_GUARD_PAGES, "guard_pages"},
+    {STACK_SCRUB, "scrub"},
+    {STACK_TIMED, "timed"},
+    {STACK_HUGE_PAGES, "huge_pages"},
+    {STACK_PREFAULT, "prefault"},
+};
+
+static char const* const replay_verify_mode_names[] = {
+    [STACK_VERIFY_ALWAYS] = "always",
+    [STACK_VERIFY_EVERY_NTH] = "nth",
+    [STACK_VERIFY_TIME_BUDGET] = "budget",
+    [STACK_VERIFY_AMORTIZED] = "amortized",
+    [STACK_VERIFY_ROUND_ROBIN] = "round_robin",
+};
+
+static char const* const replay_policy_names[] = {
+    [STACK_RESIZE_GEOMETRIC] = "geometric",
+    [STACK_RESIZE_NEVER_SHRINK] = "never_shrink",
+    [STACK_RESIZE_IDLE_SHRINK] = "idle_shrink",
+};
+
+typedef enum replay_op_kind_e {
+    REPLAY_ALLOCATE,
+    REPLAY_FREE,
+    REPLAY_PUSH,
+    REPLAY_POP,
+    REPLAY_TOP,
+    REPLAY_PUSH_N,
+    REPLAY_POP_N,
+    REPLAY_TOP_N,
+    REPLAY_RESERVE,
+    REPLAY_MARK,
+    REPLAY_REWIND,
+    REPLAY_RELEASE,
+    REPLAY_SET_RESIZE_POLICY,
+} REPLAY_OP_KIND;
+
+// An operation on one of the captured Stacks, with its element, count, capacity, mark or policy
+typedef struct replay_op_t {
+    uint32_t stack;
+    uint32_t kind;
+    uint64_t arg;
+} ReplayOp;
+
+typedef struct replay_stack_t {
+    // 0 until the log says
+    size_t elem_sz;
+    // Set while the Stack is being replayed
+    Stack* stk;
+} ReplayStack;
+
+typedef struct replay_address_t {
+    uint64_t address;
+    // Index of the Stack that is allocated at the address, or SIZE_MAX if it has been freed
+    size_t stack;
+} ReplayAddress;
+
+typedef struct replay_trace_t {
+    ReplayOp* ops;
+    size_t op_count;
+    size_t op_capacity;
+    ReplayStack* stacks;
+    size_t stack_count;
+    size_t stack_capacity;
+
+    // Open addressing table of the Stacks of the session being read, by their address
+    ReplayAddress* addresses;
+    size_t address_count;
+    size_t address_capacity;
+
+    // Records the log dropped, whose operations can't be replayed
+    size_t dropped;
+    // Largest number of elements one bulk operation moves
+    size_t max_bulk;
+    bool out_of_memory;
+} ReplayTrace;
+
+typedef struct replay_options_t {
+    char const* log_filename;
+    unsigned flags;
+    // Resize policy of every replayed Stack instead of the captured ones, or -1
+    int policy;
+    STACK_VERIFY_MODE verify_mode;
+    size_t elem_sz;
+    size_t repeat;
+} ReplayOptions;
+
+typedef struct replay_result_t {
+    uint64_t ns;
+    // Operations that failed during the replay, such as pops of Stacks whose pushes the log dropped
+    size_t failed;
+    StackStats stats;
+} ReplayResult;
+
+uint64_t get_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+bool grow_array(void** array, size_t* capacity, size_t elem_sz) {
+    size_t new_capacity = (*capacity) ? 2 * *capacity : 1024;
+    void* new_array = realloc(*array, new_capacity * elem_sz);
+    if (!new_array) {
+        return false;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return true;
+}
+
+size_t address_slot(ReplayAddress const* addresses, size_t capacity, uint64_t address) {
+    // Stacks are at least 8 byte aligned, the low bits carry no information
+    size_t slot = (size_t) ((address >> 3) * 0x9E3779B97F4A7C15ull) & (capacity - 1);
+    while (addresses[slot].address && addresses[slot].address != address) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+/*
+ * Get the slot of an address in the table, adding it if it's not there yet
+ */
+ReplayAddress* find_address(ReplayTrace* trace, uint64_t address) {
+    assert(trace);
+    assert(address);
+
+    if (2 * (trace->address_count + 1) > trace->address_capacity) {
+        size_t new_capacity = (trace->address_capacity) ? 2 * trace->address_capacity : REPLAY_ADDRESSES_CAPACITY;
+        ReplayAddress* new_addresses = calloc(new_capacity, sizeof(*new_addresses));
+        if (!new_addresses) {
+            return NULL;
+        }
+        for (size_t i = 0; i < trace->address_capacity; i++) {
+            if (trace->addresses[i].address) {
+                new_addresses[address_slot(new_addresses, new_capacity, trace->addresses[i].address)] =
+                    trace->addresses[i];
+            }
+        }
+        free(trace->addresses);
+        trace->addresses = new_addresses;
+        trace->address_capacity = new_capacity;
+    }
+
+    ReplayAddress* entry = &trace->addresses[address_slot(trace->addresses, trace->address_capacity, address)];
+    if (!entry->address) {
+        entry->address = address;
+        entry->stack = SIZE_MAX;
+        trace->address_count++;
+    }
+    return entry;
+}
+
+bool add_op(ReplayTrace* trace, size_t stack, REPLAY_OP_KIND kind, uint64_t arg) {
+    assert(trace);
+
+    if (trace->op_count == trace->op_capacity &&
+        !grow_array((void**) &trace->ops, &trace->op_capacity, sizeof(*trace->ops))) {
+        return false;
+    }
+    trace->ops[trace->op_count++] = (ReplayOp) {.stack = (uint32_t) stack, .kind = kind, .arg = arg};
+    return true;
+}
+
+/*
+ * Start a new captured Stack at an address
+ */
+size_t add_stack(ReplayTrace* trace, ReplayAddress* entry, size_t elem_sz) {
+    assert(trace);
+    assert(entry);
+
+    if (trace->stack_count == trace->stack_capacity &&
+        !grow_array((void**) &trace->stacks, &trace->stack_capacity, sizeof(*trace->stacks))) {
+        return SIZE_MAX;
+    }
+    size_t stack = trace->stack_count++;
+    trace->stacks[stack] = (ReplayStack) {.elem_sz = elem_sz, .stk = NULL};
+    entry->stack = stack;
+    if (!add_op(trace, stack, REPLAY_ALLOCATE, 0)) {
+        return SIZE_MAX;
+    }
+    return stack;
+}
+
+/*
+ * Turn the operation a log record shows into a replayed operation, if it shows one
+ */
+bool add_record(ReplayTrace* trace, StackLogRecord const* record) {
+    assert(trace);
+    assert(record);
+
+    REPLAY_OP_KIND kind;
+    uint64_t arg = record->arg0;
+    switch (record->event) {
+        case STACK_EVENT_LOG_DROPPED:
+            trace->dropped += record->arg0;
+            return true;
+        case STACK_EVENT_ALLOCATE_DONE:
+            kind = REPLAY_ALLOCATE;
+            break;
+        case STACK_EVENT_FREE:
+            kind = REPLAY_FREE;
+            break;
+        case STACK_EVENT_PUSH_DONE:
+            kind = REPLAY_PUSH;
+            break;
+        case STACK_EVENT_POP_BEGIN:
+            kind = REPLAY_POP;
+            break;
+        case STACK_EVENT_TOP_BEGIN:
+            kind = REPLAY_TOP;
+            break;
+        case STACK_EVENT_PUSH_N_BEGIN:
+            kind = REPLAY_PUSH_N;
+            break;
+        case STACK_EVENT_POP_N_BEGIN:
+            kind = REPLAY_POP_N;
+            break;
+        case STACK_EVENT_TOP_N_BEGIN:
+            kind = REPLAY_TOP_N;
+            break;
+        case STACK_EVENT_RESERVE_DONE:
+            kind = REPLAY_RESERVE;
+            break;
+        case STACK_EVENT_MARK:
+            kind = REPLAY_MARK;
+            break;
+        case STACK_EVENT_REWIND_BEGIN:
+            kind = REPLAY_REWIND;
+            break;
+        case STACK_EVENT_RELEASE:
+        case STACK_EVENT_RELEASE_INVALID:
+            kind = REPLAY_RELEASE;
+            break;
+        case STACK_EVENT_SET_RESIZE_POLICY_DONE:
+            kind = REPLAY_SET_RESIZE_POLICY;
+            break;
+        default:
+            return true;
+    }
+
+    ReplayAddress* entry = find_address(trace, record->stack);
+    if (!entry) {
+        return false;
+    }
+    if (kind == REPLAY_ALLOCATE) {
+        // The Stack that was at the address was freed in records the log dropped
+        if (entry->stack != SIZE_MAX && !add_op(trace, entry->stack, REPLAY_FREE, 0)) {
+            return false;
+        }
+        return add_stack(trace, entry, record->arg0) != SIZE_MAX;
+    }
+    // Stacks allocated before the log was opened are replayed from empty
+    if (entry->stack == SIZE_MAX && add_stack(trace, entry, 0) == SIZE_MAX) {
+        return false;
+    }
+    size_t stack = entry->stack;
+    if (kind == REPLAY_FREE) {
+        entry->stack = SIZE_MAX;
+    }
+    ReplayStack* replay_stack = &trace->stacks[stack];
+    if (kind == REPLAY_PUSH && !replay_stack->elem_sz) {
+        replay_stack->elem_sz = record->arg1;
+    }
+    if (kind == REPLAY_PUSH_N || kind == REPLAY_POP_N || kind == REPLAY_TOP_N) {
+        // The element size may only be known later, so the buffer is sized for the largest elements
+        if ((size_t) arg > trace->max_bulk) {
+            trace->max_bulk = (size_t) arg;
+        }
+    }
+    return add_op(trace, stack, kind, arg);
+}
+
+bool add_session(void* data, StackLogHeader const* header, StackLogEntry const* entries, size_t num) {
+    ReplayTrace* trace = data;
+    (void) header;
+
+    for (size_t i = 0; i < num; i++) {
+        if (!add_record(trace, &entries[i].record)) {
+            trace->out_of_memory = true;
+            return false;
+        }
+    }
+    // Addresses are only meaningful within the session they were logged in
+    for (size_t i = 0; i < trace->address_capacity; i++) {
+        if (trace->addresses[i].address && trace->addresses[i].stack != SIZE_MAX &&
+            !add_op(trace, trace->addresses[i].stack, REPLAY_FREE, 0)) {
+            trace->out_of_memory = true;
+            return false;
+        }
+    }
+    memset(trace->addresses, 0, trace->address_capacity * sizeof(*trace->addresses));
+    trace->address_count = 0;
+    return true;
+}
+
+void free_trace(ReplayTrace* trace) {
+    free(trace->ops);
+    free(trace->stacks);
+    free(trace->addresses);
+}
+
+/*
+ * Replay every operation of the trace once. elems must hold the largest element of any Stack
+ * and the elements of the largest bulk operation
+ */
+ReplayResult replay(ReplayTrace* trace, ReplayOptions const* options, unsigned char* elems) {
+    assert(trace);
+    assert(options);
+    assert(elems);
+
+    // Stacks cached by the previous run would start with its capacities
+    stack_cache_drain();
+    ReplayResult result = {0};
+    StackStats before;
+    stack_global_stats(&before);
+    uint64_t start = get_time_ns();
+    for (size_t i = 0; i < trace->op_count; i++) {
+        ReplayOp const* op = &trace->ops[i];
+        ReplayStack* replay_stack = &trace->stacks[op->stack];
+        Stack* stk = replay_stack->stk;
+        bool ok = true;
+        switch ((REPLAY_OP_KIND) op->kind) {
+            case REPLAY_ALLOCATE:
+                stk = replay_stack->stk = stack_allocate_ex(replay_stack->elem_sz, options->flags);
+                ok = stk != NULL;
+                if (stk && options->policy >= 0) {
+                    StackResizePolicy policy = stack_resize_policy((STACK_RESIZE_POLICY) options->policy);
+                    stack_set_resize_policy(stk, &policy);
+                }
+                break;
+            case REPLAY_FREE:
+                stack_free(stk);
+                replay_stack->stk = NULL;
+                break;
+            case REPLAY_PUSH:
+                // Elements of up to 8 bytes are logged as they are, larger ones as a digest
+                memcpy(elems, &op->arg, (replay_stack->elem_sz < sizeof(op->arg)) ? replay_stack->elem_sz : sizeof(op->arg));
+                ok = stack_push(stk, elems) != NULL;
+                break;
+            case REPLAY_POP:
+                ok = stack_pop(stk, elems) != NULL;
+                break;
+            case REPLAY_TOP:
+                ok = stack_top(stk, elems) != NULL;
+                break;
+            case REPLAY_PUSH_N:
+                ok = stack_push_n(stk, elems, (size_t) op->arg) != NULL;
+                break;
+            case REPLAY_POP_N:
+                ok = stack_pop_n(stk, elems, (size_t) op->arg) != NULL;
+                break;
+            case REPLAY_TOP_N:
+                ok = stack_top_n(stk, elems, (size_t) op->arg) != NULL;
+                break;
+            case REPLAY_RESERVE:
+                ok = stack_reserve(stk, (size_t) op->arg) != 0;
+                break;
+            case REPLAY_MARK:
+                stack_mark(stk);
+                break;
+            case REPLAY_REWIND:
+                stack_rewind(stk, (StackMark) op->arg);
+                break;
+            case REPLAY_RELEASE:
+                stack_release(stk, (StackMark) op->arg);
+                break;
+            case REPLAY_SET_RESIZE_POLICY:
+                // Only the kind is logged, so the captured policies are replayed with their default parameters.
+                // Custom policies can't be replayed
+                if (options->policy < 0 && op->arg != STACK_RESIZE_CUSTOM) {
+                    StackResizePolicy policy = stack_resize_policy((STACK_RESIZE_POLICY) op->arg);
+                    stack_set_resize_policy(stk, &policy);
+                }
+                break;
+        }
+        result.failed += !ok;
+        // Allocation failures leave nothing to replay the Stack's operations on
+        if (!replay_stack->stk && op->kind != REPLAY_FREE) {
+            fprintf(stderr, "Failed to allocate a Stack\n");
+            break;
+        }
+    }
+    result.ns = get_time_ns() - start;
+
+    StackStats after;
+    stack_global_stats(&after);
+    result.stats.grow_count = after.grow_count - before.grow_count;
+    result.stats.shrink_count = after.shrink_count - before.shrink_count;
+    result.stats.bytes_copied = after.bytes_copied - before.bytes_copied;
+    result.stats.verify_count = after.verify_count - before.verify_count;
+    return result;
+}
+
+/*
+ * Print the percentiles of the latencies the replayed Stacks recorded for each operation and phase
+ */
+void print_phase_latencies() {
+    printf("\n%-12s %12s %10s %10s %10s %12s\n", "phase", "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    for (unsigned k = 0; k < STACK_LATENCY_KINDS; k++) {
+        StackLatency latency;
+        stack_global_latency((STACK_LATENCY_KIND) k, &latency);
+        if (!latency.count) {
+            continue;
+        }
+        printf("%-12s %12zu %10llu %10llu %10llu %12llu\n", stack_latency_kind_name((STACK_LATENCY_KIND) k),
+               latency.count, (unsigned long long) stack_latency_percentile(&latency, 50.0),
+               (unsigned long long) stack_latency_percentile(&latency, 99.0),
+               (unsigned long long) stack_latency_percentile(&latency, 99.9), (unsigned long long) latency.max_ns);
+    }
+}
+
+int run_replay(ReplayOptions const* options) {
+    assert(options);
+
+    ReplayTrace trace = {0};
+    bool read = stack_log_read(options->log_filename, add_session, &trace);
+    if (trace.out_of_memory) {
+        fprintf(stderr, "Out of memory\n");
+    }
+    if (!read || trace.out_of_memory) {
+        free_trace(&trace);
+        return 1;
+    }
+
+    size_t max_elem_sz = sizeof(uint64_t);
+    for (size_t i = 0; i < trace.stack_count; i++) {
+        if (!trace.stacks[i].elem_sz) {
+            trace.stacks[i].elem_sz = options->elem_sz;
+        }
+        if (trace.stacks[i].elem_sz > max_elem_sz) {
+            max_elem_sz = trace.stacks[i].elem_sz;
+        }
+    }
+    unsigned char* elems = calloc(trace.max_bulk + 1, max_elem_sz);
+    if (!elems) {
+        fprintf(stderr, "Out of memory\n");
+        free_trace(&trace);
+        return 1;
+    }
+
+    StackVerifyPolicy verify_policy = stack_verify_policy(options->verify_mode);
+    stack_set_default_verify_policy(&verify_policy);
+
+    printf("Replaying %zu operations on %zu Stacks from %s\n", trace.op_count, trace.stack_count, options->log_filename);
+    if (trace.dropped) {
+        printf("The log dropped %zu records, so some operations are missing\n", trace.dropped);
+    }
+    printf("%-6s %12s %15s %10s %10s %15s %10s %8s\n", "run", "ms", "ops/s", "grows", "shrinks", "bytes copied",
+           "verifies", "failed");
+    for (size_t r = 0; r < options->repeat; r++) {
+        ReplayResult result = replay(&trace, options, elems);
+        double seconds = (double) result.ns / 1e9;
+        printf("%-6zu %12.3f %15.0f %10zu %10zu %15zu %10zu %8zu\n", r + 1, seconds * 1e3,
+               (seconds > 0.0) ? (double) trace.op_count / seconds : 0.0, result.stats.grow_count,
+               result.stats.shrink_count, result.stats.bytes_copied, result.stats.verify_count, result.failed);
+    }
+    if (options->flags & STACK_TIMED) {
+        print_phase_latencies();
+    }
+
+    free(elems);
+    free_trace(&trace);
+    return 0;
+}
+
+/*
+ * Parse features joined with '+', like canary+poison, or none
+ */
+bool parse_flags(char const* str, unsigned* flags) {
+    assert(str);
+    assert(flags);
+
+    *flags = STACK_NO_PROTECTION;
+    if (!strcmp(str, "none")) {
+        return true;
+    }
+    while (*str) {
+        size_t len = strcspn(str, "+");
+        size_t i = 0;
+        while (i < ARR_LENGTH(replay_flags) &&
+               (strlen(replay_flags[i].name) != len || strncmp(str, replay_flags[i].name, len))) {
+            i++;
+        }
+        if (i == ARR_LENGTH(replay_flags)) {
+            return false;
+        }
+        *flags |= replay_flags[i].flag;
+        str += len + (str[len] == '+');
+    }
+    return true;
+}
+
+/*
+ * Find a name in a table of names, returning -1 if it's not there
+ */
+int find_name(char const* const* names, size_t num, char const* name) {
+    for (size_t i = 0; i < num; i++) {
+        if (names[i] && !strcmp(names[i], name)) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+void print_usage(char const* program) {
+    fprintf(stderr,
+            "Usage: %s [--flags FEATURES] [--policy geometric|never_shrink|idle_shrink]\n"
+            "       [--verify always|nth|budget|amortized|round_robin] [--elem-size N] [--repeat N] [LOG]\n"
+            "Replays the operations a binary Stack log recorded, %s by default, on new Stacks\n"
+            "FEATURES are none or any of canary, data_canary, hash_fast, hash_full, poison, segmented, guard_pages,\n"
+            "scrub, timed, huge_pages and prefault joined with '+'.\n"
+            "timed also prints the latency percentiles of each operation and phase\n"
+            "--policy replaces the resize policies the log recorded, and --elem-size is the element size of Stacks\n"
+            "whose log doesn't show it\n",
+            program, STACK_LOG_FILENAME);
+}
+
+int main(int argc, char* argv[]) {
+    ReplayOptions options = {
+        .log_filename = STACK_LOG_FILENAME,
+        .flags = STACK_NO_PROTECTION,
+        .policy = -1,
+        .verify_mode = STACK_VERIFY_ALWAYS,
+        .elem_sz = REPLAY_DEFAULT_ELEM_SIZE,
+        .repeat = 1,
+    };
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "--flags")) {
+            if (!parse_flags(argv[++i], &options.flags)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (i + 1 < argc && !strcmp(argv[i], "--policy")) {
+            options.policy = find_name(replay_policy_names, ARR_LENGTH(replay_policy_names), argv[++i]);
+            if (options.policy < 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (i + 1 < argc && !strcmp(argv[i], "--verify")) {
+            int mode = find_name(replay_verify_mode_names, ARR_LENGTH(replay_verify_mode_names), argv[++i]);
+            if (mode < 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            options.verify_mode = (STACK_VERIFY_MODE) mode;
+        } else if (i + 1 < argc && !strcmp(argv[i], "--elem-size")) {
+            options.elem_sz = strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "--repeat")) {
+            options.repeat = strtoul(argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-') {
+            options.log_filename = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!options.elem_sz || !options.repeat) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    return run_replay(&options);
+}
@@ -1,795 +1,4076 @@
 #include "stack.h"
+#include "stack_allocator.h"
+#include "stack_common.h"
+#include "stack_hash.h"
+#include "stack_log.h"
+#include "stack_probe.h"
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
 
-#if defined(USE_HASH_FAST) || defined(USE_HASH_FULL)
-#define USE_HASH
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define STACK_POISON_SIMD
+#include <immintrin.h>
 #endif
 
-#if defined(USE_CANARY) || defined(USE_DATA_CANARY)
-typedef unsigned long long canary_type;
-#define CANARY_VALUE 0xF072E3546BAD189Cull
-#endif
+enum { STACK_DEFAULT_CAPACITY = 10 };
+
+// Bytes before the header of a contiguous Stack that hold its elements while they fit, unless asked otherwise
+enum { STACK_EMBEDDED_SIZE = 256 };
+// Embedded elements are aligned for any type, as they would be in a buffer from malloc
+enum { STACK_EMBEDDED_ALIGN = _Alignof(max_align_t) };
+// Asks stack_allocate_storage for the embedded capacity that fits in STACK_EMBEDDED_SIZE bytes
+#define STACK_EMBEDDED_DEFAULT SIZE_MAX
+
+// Number of elements covered by one data hash block
+enum { STACK_HASH_BLOCK = 16 };
+
+// Number of outstanding marks a Stack first makes room for
+enum { STACK_MARK_CAPACITY = 4 };
+
+// Size of the elements of one segment of a segmented Stack
+enum { STACK_SEGMENT_SIZE = 1u << 12 };
+
+// Defaults of the verification policies
+enum {
+    STACK_VERIFY_PERIOD = 64,
+    STACK_VERIFY_AMORTIZED_BYTES = 1u << 12,
+};
+static const double STACK_VERIFY_DEFAULT_BUDGET = 0.05;
+// Time budgeted verification saves up at most this much time for the data checks, so that it can't check in bursts
+static const double STACK_VERIFY_MAX_CREDIT_NS = 1e6;
+
+// Bytes of data the scrubber checks in each Stack per pass
+enum { STACK_SCRUB_SLICE = 1u << 12 };
+
+enum {
+    STACK_KNOWN_FLAGS = STACK_USE_ALL | STACK_SEGMENTED | STACK_GUARD_PAGES | STACK_SCRUB | STACK_MAPPED | STACK_TIMED |
+                        STACK_HUGE_PAGES | STACK_PREFAULT
+};
+
+// Storage options whose capacity is rounded up to fill whole pages
+enum { STACK_PAGED_STORAGE = STACK_GUARD_PAGES | STACK_MAPPED };
+
+// Defaults of the sync policies
+enum { STACK_SYNC_PERIOD = 64 };
+
+// Freed Stacks are cached by capacity class, the log2 of their capacity over STACK_DEFAULT_CAPACITY
+enum {
+    STACK_CACHE_CLASSES = 8,
+    STACK_CACHE_MAX_STACKS = 16,
+    STACK_CACHE_MAX_BYTES = 1u << 20,
+};
 
-#ifdef USE_HASH
-typedef unsigned long long hash_type;
-#define HASH_INITIAL_VALUE 0x600D4A54ull
+// Storage options of Stacks that are still handled by the unchecked functions
+enum { STACK_UNCHECKED_STORAGE = STACK_GUARD_PAGES | STACK_HUGE_PAGES | STACK_PREFAULT };
+
+// Protection features of Stacks allocated by stack_allocate
+enum {
+    STACK_DEFAULT_FLAGS = STACK_NO_PROTECTION
+#ifdef USE_CANARY
+                          | STACK_USE_CANARY
+#endif
+#ifdef USE_DATA_CANARY
+                          | STACK_USE_DATA_CANARY
+#endif
+#ifdef USE_HASH_FAST
+                          | STACK_USE_HASH_FAST
+#endif
+#ifdef USE_HASH_FULL
+                          | STACK_USE_HASH_FULL
 #endif
+#ifdef USE_POISON
+                          | STACK_USE_POISON
+#endif
+#ifdef USE_LOG
+                          | STACK_USE_LOG
+#endif
+#ifdef USE_GUARD_PAGES
+                          | STACK_GUARD_PAGES
+#endif
+};
 
-enum { STACK_DEFAULT_CAPACITY = 10 };
+/*
+ * Mapped Stacks keep this header in the first page of their file, followed by their elements.
+ * It is rewritten after every operation, so that the file can be reopened as it was
+ */
+#define STACK_MAPPED_MAGIC 0x4B434154534D4D41ull
+enum { STACK_MAPPED_VERSION = 1 };
+
+/*
+ * Header of the files written by stack_save, followed by the elements from the bottom of the Stack up.
+ * Fields are in the byte order of the machine that saved the Stack
+ */
+#define STACK_SNAPSHOT_MAGIC 0x50414E534B415453ull
+enum { STACK_SNAPSHOT_VERSION = 1 };
+
+typedef struct stack_snapshot_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t elem_sz;
+    uint64_t size;
+    // Data hash of the elements, computed the same way whether or not the Stack uses data hashing
+    hash_type checksum;
+    // Hash of the fields above
+    hash_type header_hash;
+} StackSnapshotHeader;
+
+typedef struct stack_mapped_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    canary_type front_canary;
+    uint64_t elem_sz;
+    uint64_t size;
+    uint64_t capacity;
+    hash_type data_hash;
+    // Hash of the fields above
+    hash_type header_hash;
+    canary_type back_canary;
+} StackMappedHeader;
+
+/*
+ * Segmented Stacks store their elements in a list of fixed-size segments.
+ * Each segment is a single allocation that holds the segment's header,
+ * the hashes of its blocks, and its elements surrounded by data canaries.
+ * Segments never move, so growing a segmented Stack never copies its elements.
+ */
+typedef struct stack_segment_t {
+    struct stack_segment_t* prev;
+    struct stack_segment_t* next;
+    // Index of the segment's first element
+    size_t first;
+    // Hashes of the segment's blocks, or NULL if data hashing is off
+    hash_type* block_hashes;
+} StackSegment;
+
+/*
+ * Operation counters of a Stack, as returned by stack_stats.
+ * Counters are only written by the thread that uses the Stack, so they don't need atomic read-modify-writes,
+ * but are atomic so that other threads can read them
+ */
+typedef struct stack_counters_t {
+    atomic_size_t push_count;
+    atomic_size_t pop_count;
+    atomic_size_t top_count;
+    atomic_size_t grow_count;
+    atomic_size_t shrink_count;
+    atomic_size_t bytes_copied;
+    atomic_size_t verify_count;
+    atomic_size_t verify_fail_count;
+    atomic_size_t peak_size;
+} StackCounters;
+
+static inline void stack_count(atomic_size_t* counter, size_t num) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + num, memory_order_relaxed);
+}
+
+static inline void stack_count_peak(StackCounters* counters, size_t size) {
+    if (size > atomic_load_explicit(&counters->peak_size, memory_order_relaxed)) {
+        atomic_store_explicit(&counters->peak_size, size, memory_order_relaxed);
+    }
+}
 
-static size_t stack_global_count = 0;
+/*
+ * Latency histogram of one kind of operation of a timed Stack.
+ * Only the thread that uses the Stack records latencies, the fields are atomic so that other threads can read them
+ */
+typedef struct stack_histogram_t {
+    atomic_size_t count;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t min_ns;
+    _Atomic uint64_t max_ns;
+    atomic_size_t buckets[STACK_LATENCY_BUCKETS];
+} StackHistogram;
+
+static atomic_size_t stack_global_count = 0;
+// The fields up to error must match StackInline
 struct stack_t {
-#ifdef USE_CANARY
     canary_type front_canary;
-#endif
 
     void* data;
-    size_t elem_sz;
     size_t size;
+    size_t inline_max;
+    size_t inline_min;
+    STACK_ERROR error;
+    // Counted by the inline functions of stack_generic.h instead of counters
+    size_t inline_push_count;
+    size_t inline_pop_count;
+    size_t inline_top_count;
+    size_t inline_peak_size;
+
+    StackCounters counters;
+
+    size_t elem_sz;
     size_t capacity;
     size_t min_capacity;
-    STACK_ERROR error;
+    unsigned flags;
+    StackAllocator allocator;
+
+    StackResizePolicy resize_policy;
+    // Number of operations the pending shrink has been delayed by
+    size_t idle_ops;
+    // Largest size since the last idle shrink
+    size_t peak_size;
+    // Marks that haven't been released, innermost last. The Stack doesn't shrink while there are any
+    StackMark* marks;
+    size_t mark_count;
+    size_t mark_capacity;
+    // Histograms of each STACK_LATENCY_KIND of a timed Stack, or NULL
+    StackHistogram* histograms;
+    // Largest capacity whose buffer fits in the embedded storage before the header, 0 if there is none
+    size_t embedded_capacity;
 
-#ifdef USE_HASH
     hash_type metadata_hash;
-#ifdef USE_HASH_FULL
     hash_type data_hash;
-#endif
-#endif
+    hash_type* block_hashes;
+    // Number of allocated block hashes
+    size_t block_hash_capacity;
+    size_t hash_cursor;
+
+    StackVerifyPolicy verify_policy;
+    // Verifications since the data was last checked
+    size_t verify_ops;
+    // Time the data checks may still take, and when it was last topped up
+    double verify_credit_ns;
+    uint64_t verify_time_ns;
+    // Next unused element whose poison is checked by amortized verification
+    size_t poison_cursor;
+
+    StackSegment* segments;
+    // Segment close to the top, used as a starting point for looking up elements
+    StackSegment* top_segment;
+    // Segment holding the block at the hash cursor, or NULL if unknown
+    StackSegment* hash_segment;
+    size_t segment_capacity;
+
+    // Scrubbed Stacks only access their data while this is locked, so that the scrubber sees it in a consistent state
+    pthread_mutex_t scrub_mutex;
+    // Next element checked by the scrubber, and the segment holding it, or NULL if unknown
+    size_t scrub_cursor;
+    StackSegment* scrub_segment;
+    // Error found by the scrubber, picked up by the next verification
+    _Atomic STACK_ERROR scrub_error;
+
+    // File of a mapped Stack, and the start of its mapping, which holds the header
+    int map_fd;
+    StackMappedHeader* map_header;
+    STACK_SYNC_MODE sync_mode;
+    size_t sync_period;
+    // Operations since the file was last written back
+    size_t sync_ops;
+
+    // Links in the list of allocated Stacks, or in the list of Stacks of the arena the Stack is allocated in
+    struct stack_t* registry_next;
+    struct stack_t** registry_pprev;
 
-#ifdef USE_CANARY
     canary_type back_canary;
-#endif
 };
 
-unsigned char get_poison(void const* p) {
-    return (unsigned char) p;
-}
-
-bool is_poison(void const* p) {
-    return *(unsigned char*) p == get_poison(p);
-}
+#define STACK_USES(stk, flag) (((stk)->flags & (flag)) != 0)
+// Stacks with no protections are not verified
+#define STACK_UNCHECKED(stk) (((stk)->flags & ~STACK_UNCHECKED_STORAGE) == STACK_NO_PROTECTION)
 
-void write_poison(void* arr, size_t num) {
-    assert(arr);
+/*
+ * Set the error of a failed operation.
+ * The inline functions of stack_generic.h don't reset the error, so they must wait until an operation succeeds
+ */
+void stack_fail(Stack* stk, STACK_ERROR error) {
+    assert(stk);
+    assert(error != STACK_OK);
 
-    for (unsigned char* p = arr; p < (unsigned char*) arr + num; p++) {
-        *p = get_poison(p);
-    }
+    stk->error = error;
+    stk->inline_max = 0;
+    stk->inline_min = SIZE_MAX;
 }
 
-bool verify_poison(void const* arr, size_t num) {
-    assert(arr);
+#define STACK_SCRUB_LOCK(stk)                          \
+    do {                                               \
+        if (STACK_USES(stk, STACK_SCRUB)) {            \
+            pthread_mutex_lock(&(stk)->scrub_mutex);   \
+        }                                              \
+    } while (0)
+#define STACK_SCRUB_UNLOCK(stk)                        \
+    do {                                               \
+        if (STACK_USES(stk, STACK_SCRUB)) {            \
+            pthread_mutex_unlock(&(stk)->scrub_mutex); \
+        }                                              \
+    } while (0)
 
-    for (unsigned char const* p = arr; p < (unsigned char const*) arr + num; p++) {
-        if (!is_poison(p)) {
-            return false;
-        }
-    }
+#define STACK_ASSERT_INLINE_FIELD(field)                                                   \
+    _Static_assert(offsetof(Stack, field) == offsetof(StackInline, field) &&                \
+                   sizeof(((Stack*) NULL)->field) == sizeof(((StackInline*) NULL)->field), \
+                   "Stack field " #field " does not match StackInline")
+STACK_ASSERT_INLINE_FIELD(front_canary);
+STACK_ASSERT_INLINE_FIELD(data);
+STACK_ASSERT_INLINE_FIELD(size);
+STACK_ASSERT_INLINE_FIELD(inline_max);
+STACK_ASSERT_INLINE_FIELD(inline_min);
+STACK_ASSERT_INLINE_FIELD(error);
+STACK_ASSERT_INLINE_FIELD(inline_push_count);
+STACK_ASSERT_INLINE_FIELD(inline_pop_count);
+STACK_ASSERT_INLINE_FIELD(inline_top_count);
+STACK_ASSERT_INLINE_FIELD(inline_peak_size);
+#undef STACK_ASSERT_INLINE_FIELD
+
+/*
+ * Size of the mapping that holds capacity elements of a Stack with guard pages or of a mapped Stack
+ */
+size_t stack_paged_size(Stack const* stk, size_t capacity) {
+    assert(stk);
 
-    return true;
+    size_t page_size = stack_page_size();
+    return (capacity * stk->elem_sz + page_size - 1) / page_size * page_size;
 }
 
-#ifdef USE_HASH
-hash_type rotate_left(hash_type value) {
-    return value << 1 | value >> (sizeof(value) * CHAR_BIT - 1);
-}
+/*
+ * Capacity of a Stack with paged storage that fills the mapping it needs for capacity elements,
+ * so that no whole element fits between its last element and the end of the mapping
+ */
+size_t stack_paged_capacity(Stack const* stk, size_t capacity) {
+    assert(stk);
 
-#define ARR_LENGTH(arr) (sizeof(arr) / sizeof(*arr))
+    return stack_paged_size(stk, capacity) / stk->elem_sz;
+}
 
-hash_type stack_metadata_hash(Stack const* stk) {
+size_t stack_data_canary_size(Stack const* stk) {
     assert(stk);
 
-    const hash_type hash_parts[] = {(hash_type) stk->data, (hash_type) stk->elem_sz, (hash_type) stk->size, (hash_type) stk->capacity};
+    return STACK_USES(stk, STACK_USE_DATA_CANARY) ? sizeof(canary_type) : 0;
+}
 
-    hash_type hash_value = HASH_INITIAL_VALUE;
-    for (size_t i = 0; i < ARR_LENGTH(hash_parts); i++) {
-        hash_value = rotate_left(hash_value) ^ hash_parts[i];
-    }
-    return hash_value;
+/*
+ * Size of the buffer that holds capacity elements of a contiguous Stack and its data canaries
+ */
+size_t stack_data_size(Stack const* stk, size_t capacity) {
+    assert(stk);
+
+    return capacity * stk->elem_sz + 2 * stack_data_canary_size(stk);
 }
 
-hash_type stack_data_hash(Stack const* stk) {
+/*
+ * Check if a contiguous Stack's buffer of data_size bytes is a huge page mapping instead of coming from its allocator
+ */
+bool stack_huge_data(Stack const* stk, size_t data_size) {
     assert(stk);
 
-    hash_type hash_value = HASH_INITIAL_VALUE;
-    if (!stk->data) {
-        return hash_value;
+    return STACK_USES(stk, STACK_HUGE_PAGES) && data_size >= STACK_HUGE_PAGE_SIZE;
+}
+
+/*
+ * Capacity of the embedded storage of a Stack with the given element size and flags, or 0 if it has none.
+ * Capacities below the default capacity would never be used, so they leave the Stack without embedded storage
+ */
+size_t stack_embedded_capacity(size_t elem_sz, unsigned flags, size_t requested) {
+    assert(elem_sz);
+
+    // These keep their elements in segments or mappings of their own
+    if (flags & (STACK_SEGMENTED | STACK_GUARD_PAGES | STACK_MAPPED)) {
+        return 0;
     }
-    for (size_t i = 0; i < stk->capacity * stk->elem_sz; i++) {
-        hash_value = rotate_left(hash_value) ^ ((unsigned char const*) stk->data)[i];
+    size_t capacity = requested;
+    if (requested == STACK_EMBEDDED_DEFAULT) {
+        size_t canary_size = (flags & STACK_USE_DATA_CANARY) ? sizeof(canary_type) : 0;
+        capacity = (STACK_EMBEDDED_SIZE - 2 * canary_size) / elem_sz;
     }
-    return hash_value;
+    return (capacity >= STACK_DEFAULT_CAPACITY) ? capacity : 0;
 }
-#endif
 
-size_t elem_str_size(size_t stk_elem_sz) {
-    return CHAR_BIT / 4 * stk_elem_sz + 2;
+/*
+ * Offset of the buffer in the embedded storage, which pads the front data canary so that the elements are aligned
+ */
+size_t stack_embedded_lead(unsigned flags) {
+    size_t canary_size = (flags & STACK_USE_DATA_CANARY) ? sizeof(canary_type) : 0;
+    return (STACK_EMBEDDED_ALIGN - canary_size % STACK_EMBEDDED_ALIGN) % STACK_EMBEDDED_ALIGN;
 }
 
-char* elem_to_str(void const* p, char* str, size_t sz, size_t str_sz) {
-    assert(p);
-    assert(sz);
-
-    if (str_sz < elem_str_size(sz) + 1) {
-        return NULL;
+/*
+ * Size of the embedded storage of a Stack with the given element size, flags and embedded capacity.
+ * It ends where the header starts, so that the elements are next to the fields the inline functions of stack_generic.h use
+ */
+size_t stack_embedded_size(size_t elem_sz, unsigned flags, size_t embedded_capacity) {
+    if (!embedded_capacity) {
+        return 0;
     }
+    size_t canary_size = (flags & STACK_USE_DATA_CANARY) ? sizeof(canary_type) : 0;
+    size_t size = stack_embedded_lead(flags) + embedded_capacity * elem_sz + 2 * canary_size;
+    return (size + STACK_EMBEDDED_ALIGN - 1) / STACK_EMBEDDED_ALIGN * STACK_EMBEDDED_ALIGN;
+}
 
-    str[0] = '0';
-    str[1] = 'x';
-    // Prints in correct order only on little endian systems
-    unsigned char const* elem_p = p;
-    for (size_t i = 0; i < sz; i++) {
-        sprintf(str + 2 * (i + 1), "%.*X", CHAR_BIT / 4, elem_p[sz - i - 1]);
-    }
-    str[str_sz - 1] = '\0';
+/*
+ * Start of the allocation that holds a Stack's embedded storage and its header
+ */
+void* stack_header_start(Stack const* stk) {
+    assert(stk);
 
-    return str;
+    return (char*) stk - stack_embedded_size(stk->elem_sz, stk->flags, stk->embedded_capacity);
 }
 
-void stack_dump(Stack* stk, FILE* dump_file) {
+/*
+ * Size of the allocation that holds a Stack's embedded storage and its header
+ */
+size_t stack_header_size(Stack const* stk) {
     assert(stk);
-    assert(dump_file);
 
-    time_t tm = time(NULL);
-    fprintf(dump_file, "%s"
-                       "Dump for Stack at %p\n"
-                       "Stack status is: %d: %s\n",
-            ctime(&tm),
-            (void const*) stk,
-            stk->error, stack_error_string(stk->error));
+    return stack_embedded_size(stk->elem_sz, stk->flags, stk->embedded_capacity) + sizeof(*stk);
+}
 
-#if defined(USE_CANARY) || defined(USE_DATA_CANARY)
-    const int canary_field_width = sizeof(canary_type) * CHAR_BIT / 4;
-#endif
-#ifdef USE_HASH
-    const int hash_field_width = sizeof(hash_type) * CHAR_BIT / 4;
-#endif
+// Where the buffer of a contiguous Stack that isn't mapped is kept, which depends on its capacity
+typedef enum stack_buffer_e {
+    STACK_BUFFER_EMBEDDED,
+    STACK_BUFFER_ALLOCATED,
+    STACK_BUFFER_HUGE,
+} STACK_BUFFER;
 
-#ifdef USE_HASH
-    fprintf(dump_file, "Stack stored metadata hash is: %.*llX\n"
-                       "Stack actual metadata hash is: %.*llX\n",
-            hash_field_width, stk->metadata_hash,
-            hash_field_width, stack_metadata_hash(stk));
-#endif
-#ifdef USE_CANARY
-    fprintf(dump_file, "Stack default canary value is: %.*llX\n"
-                       "Stack front canary is:         %.*llX\n"
-                       "Stack back canary is:          %.*llX\n",
-            canary_field_width, CANARY_VALUE,
-            canary_field_width, stk->front_canary,
-            canary_field_width, stk->back_canary);
-#endif
-    fprintf(dump_file, "Stack element size is     %zu\n"
-                       "Stack minimum capacity is %zu\n"
-                       "Stack size is             %zu\n"
-                       "Stack capacity is         %zu\n"
-                       "Stack data is at: %p\n",
-            stk->elem_sz,
-            stk->min_capacity,
-            stk->size,
-            stk->capacity,
-            stk->data);
-    if (!stk->data) {
-        return;
-    }
+STACK_BUFFER stack_buffer_kind(Stack const* stk, size_t capacity) {
+    assert(stk);
 
-#ifdef USE_HASH_FULL
-    fprintf(dump_file, "Stack stored data hash is:          %.*llX\n"
-                       "Stack actual data hash is:          %.*llX\n",
-            hash_field_width, stk->data_hash,
-            hash_field_width, stack_data_hash(stk));
-#endif
-#ifdef USE_DATA_CANARY
-    fprintf(dump_file, "Stack default data canary value is: %.*llX\n"
-                       "Stack data front canary is:         %.*llX\n"
-                       "Stack data back canary is:          %.*llX\n",
-            canary_field_width, CANARY_VALUE,
-            canary_field_width, *((canary_type const*) stk->data - 1),
-            canary_field_width, *((canary_type const*) ((char const*) stk->data + stk->capacity * stk->elem_sz)));
-#endif
-    fprintf(dump_file, "Stack data is:\n");
-    char const* data = stk->data;
-    char elem_str[elem_str_size(stk->elem_sz) + 1];
-    for (size_t i = 0; i < stk->capacity; i++) {
-        if (!elem_to_str(data, elem_str, stk->elem_sz, sizeof(elem_str))) {
-            fprintf(dump_file, "Error dumping Stack data\n");
-            break;
-        }
-        if (i < stk->size) {
-            fprintf(dump_file, "[%lu]: ", i);
-        } else {
-            fprintf(dump_file, "(%lu): ", i);
-        }
-        fprintf(dump_file, "%s", elem_str);
-#ifdef USE_POISON
-        if (verify_poison(data, stk->elem_sz)) {
-            fprintf(dump_file, " (poison)");
-        }
-#endif
-        fprintf(dump_file, "\n");
-        data += stk->elem_sz;
+    if (capacity <= stk->embedded_capacity) {
+        return STACK_BUFFER_EMBEDDED;
     }
+    return stack_huge_data(stk, stack_data_size(stk, capacity)) ? STACK_BUFFER_HUGE : STACK_BUFFER_ALLOCATED;
 }
 
-static FILE* stack_global_log = NULL;
-#ifndef STACK_LOG_FILENAME
-#define STACK_LOG_FILENAME "stack_log"
-#endif
-
-#ifdef USE_LOG
-#include <stdarg.h>
-void stack_log(Stack* stk, char const* format, ...) {
+void* stack_buffer_allocate(Stack* stk, STACK_BUFFER kind, size_t size) {
     assert(stk);
-    assert(format);
 
-    if (!stack_global_log) {
-        return;
+    switch (kind) {
+        case STACK_BUFFER_EMBEDDED:
+            assert(stack_embedded_lead(stk->flags) + size <= stack_header_size(stk) - sizeof(*stk));
+            return (char*) stack_header_start(stk) + stack_embedded_lead(stk->flags);
+        case STACK_BUFFER_HUGE:
+            return stack_huge_map(size);
+        case STACK_BUFFER_ALLOCATED:
+        default:
+            return stk->allocator.allocate(stk->allocator.data, size);
     }
-    time_t tm = time(NULL);
-    char* time_str = ctime(&tm);
-    *(strchr(time_str, '\n')) = '\0';
-    fprintf(stack_global_log, "%s: Stack at %p: ", time_str, (void const*) stk);
+}
 
-    va_list args;
-    va_start(args, format);
-    vfprintf(stack_global_log, format, args);
-    va_end(args);
-    fprintf(stack_global_log, "\n");
+void stack_buffer_free(Stack* stk, STACK_BUFFER kind, void* buffer, size_t size) {
+    assert(stk);
+
+    switch (kind) {
+        case STACK_BUFFER_EMBEDDED:
+            // Freed with the header
+            break;
+        case STACK_BUFFER_HUGE:
+            stack_huge_unmap(buffer, size);
+            break;
+        case STACK_BUFFER_ALLOCATED:
+        default:
+            stk->allocator.free(stk->allocator.data, buffer, size);
+            break;
+    }
 }
-// ## before __VA_ARGS__ is a GCC/Clang/ICC extension
-#define STACK_LOG(stk, format, ...) stack_log(stk, format, ##__VA_ARGS__)
-#else
-#define STACK_LOG(stk, format, ...)
-#endif
 
-bool stack_error_recoverable(STACK_ERROR err) {
-    return err == STACK_OK || err == STACK_ALLOCATION_ERROR || err == STACK_OPERATION_ERROR;
+/*
+ * Get the size of a mapped Stack's file: a page for the header followed by the data
+ */
+size_t stack_mapped_size(Stack const* stk) {
+    assert(stk);
+
+    return stack_page_size() + stack_paged_size(stk, stk->capacity);
 }
 
-bool stack_error_valid(STACK_ERROR err) {
-    return err >= STACK_OK && err <= STACK_CORRUPTION_ERROR;
+hash_type stack_mapped_header_hash(StackMappedHeader const* header) {
+    assert(header);
+
+    return stack_hash_bytes(header, offsetof(StackMappedHeader, header_hash), HASH_INITIAL_VALUE);
 }
 
-void stack_verify(Stack* stk) {
+/*
+ * Write a mapped Stack's current state to the header of its file
+ */
+void stack_mapped_write_header(Stack const* stk) {
     assert(stk);
+    assert(stk->map_header);
+
+    StackMappedHeader* header = stk->map_header;
+    header->magic = STACK_MAPPED_MAGIC;
+    header->version = STACK_MAPPED_VERSION;
+    header->flags = stk->flags;
+    header->front_canary = CANARY_VALUE;
+    header->elem_sz = stk->elem_sz;
+    header->size = stk->size;
+    header->capacity = stk->capacity;
+    header->data_hash = stk->data_hash;
+    header->header_hash = stack_mapped_header_hash(header);
+    header->back_canary = CANARY_VALUE;
+}
 
-    STACK_LOG(stk, "Begin verification");
+// Protects the lists of allocated Stacks and arenas, the counters of freed Stacks and the default verification policy
+static pthread_mutex_t stack_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Stack* stack_registry = NULL;
+static StackArena* stack_arenas = NULL;
+static StackStats stack_retired_stats;
+static StackLatency stack_retired_latency[STACK_LATENCY_KINDS];
+// Verification policy of new Stacks, if it has been set
+static StackVerifyPolicy stack_default_verify_policy;
+static bool stack_default_verify_policy_set = false;
+
+/*
+ * Add a Stack's counters, and the operations the inline functions of stack_generic.h counted, to stats.
+ * The inline counts are plain fields, so when another thread uses the Stack they may be behind
+ */
+void stack_add_counters(StackStats* stats, Stack const* stk) {
+    assert(stats);
+    assert(stk);
 
-    if (!stk->data && stk->size > 0) {
-        stk->error = STACK_CORRUPTION_ERROR;
-        goto error;
+    StackCounters const* counters = &stk->counters;
+    stats->push_count += atomic_load_explicit(&counters->push_count, memory_order_relaxed) + stk->inline_push_count;
+    stats->pop_count += atomic_load_explicit(&counters->pop_count, memory_order_relaxed) + stk->inline_pop_count;
+    stats->top_count += atomic_load_explicit(&counters->top_count, memory_order_relaxed) + stk->inline_top_count;
+    stats->grow_count += atomic_load_explicit(&counters->grow_count, memory_order_relaxed);
+    stats->shrink_count += atomic_load_explicit(&counters->shrink_count, memory_order_relaxed);
+    stats->bytes_copied += atomic_load_explicit(&counters->bytes_copied, memory_order_relaxed);
+    stats->verify_count += atomic_load_explicit(&counters->verify_count, memory_order_relaxed);
+    stats->verify_fail_count += atomic_load_explicit(&counters->verify_fail_count, memory_order_relaxed);
+    size_t peak_size = atomic_load_explicit(&counters->peak_size, memory_order_relaxed);
+    if (stk->inline_peak_size > peak_size) {
+        peak_size = stk->inline_peak_size;
     }
-
-    if (stk->size > stk->capacity) {
-        stk->error = STACK_CORRUPTION_ERROR;
-        goto error;
+    if (peak_size > stats->peak_size) {
+        stats->peak_size = peak_size;
     }
+}
 
-    if (stk->capacity < STACK_DEFAULT_CAPACITY) {
-        stk->error = STACK_CORRUPTION_ERROR;
-        goto error;
-    }
+/*
+ * Add the latencies of one histogram to another
+ */
+void stack_merge_latency(StackLatency* latency, StackLatency const* other) {
+    assert(latency);
+    assert(other);
 
-    if (!stk->elem_sz) {
-        stk->error = STACK_CORRUPTION_ERROR;
-        goto error;
+    if (!other->count) {
+        return;
     }
-
-    if (!stack_error_valid(stk->error)) {
-        stk->error = STACK_CORRUPTION_ERROR;
-        goto error;
+    if (!latency->count || other->min_ns < latency->min_ns) {
+        latency->min_ns = other->min_ns;
     }
-
-#ifdef USE_HASH
-    if (stk->metadata_hash != stack_metadata_hash(stk)) {
-        stk->error = STACK_METADATA_HASH_ERROR;
-        goto error;
+    if (other->max_ns > latency->max_ns) {
+        latency->max_ns = other->max_ns;
     }
-#ifdef USE_HASH_FULL
-    if (stk->data_hash != stack_data_hash(stk)) {
-        stk->error = STACK_DATA_HASH_ERROR;
-        goto error;
+    latency->count += other->count;
+    latency->total_ns += other->total_ns;
+    for (size_t i = 0; i < STACK_LATENCY_BUCKETS; i++) {
+        latency->buckets[i] += other->buckets[i];
     }
-#endif
-#endif
+}
 
-#ifdef USE_CANARY
-    if (stk->front_canary != CANARY_VALUE || stk->back_canary != CANARY_VALUE) {
-        stk->error = STACK_METADATA_CANARY_OVERWRITE_ERROR;
-        goto error;
+/*
+ * Add the latencies a timed Stack recorded to latency
+ */
+void stack_add_latency(StackLatency* latency, StackHistogram const* histogram) {
+    assert(latency);
+    assert(histogram);
+
+    StackLatency recorded = {
+        .count = atomic_load_explicit(&histogram->count, memory_order_relaxed),
+        .total_ns = atomic_load_explicit(&histogram->total_ns, memory_order_relaxed),
+        .min_ns = atomic_load_explicit(&histogram->min_ns, memory_order_relaxed),
+        .max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed),
+    };
+    for (size_t i = 0; i < STACK_LATENCY_BUCKETS; i++) {
+        recorded.buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
     }
-#endif
+    stack_merge_latency(latency, &recorded);
+}
 
-#ifdef USE_DATA_CANARY
-    if (stk->data) {
-        const canary_type front_canary = *((canary_type const*) stk->data - 1);
-        char const* back_p = (char const*) stk->data + stk->capacity * stk->elem_sz;
-        const canary_type back_canary = *((canary_type const*) back_p);
-        if (front_canary != CANARY_VALUE || back_canary != CANARY_VALUE) {
-            stk->error = STACK_DATA_CANARY_OVERWRITE_ERROR;
-            goto error;
-        }
-    }
-#endif
+/*
+ * Keep the latencies of a Stack that is being freed in the global totals. The registry must be locked
+ */
+void stack_retire_latency(Stack const* stk) {
+    assert(stk);
 
-#ifdef USE_POISON
-    if (stk->data) {
-        size_t start_i = stk->size * stk->elem_sz;
-        size_t num = (stk->capacity - stk->size) * stk->elem_sz;
-        if (!verify_poison((char const*) stk->data + start_i, num)) {
-            stk->error = STACK_POISON_OVERWRITE_ERROR;
-            goto error;
+    if (stk->histograms) {
+        for (size_t i = 0; i < STACK_LATENCY_KINDS; i++) {
+            stack_add_latency(&stack_retired_latency[i], &stk->histograms[i]);
         }
     }
-#endif
-
-    STACK_LOG(stk, "Verification successful");
+}
 
-    return;
+/*
+ * Add a Stack to the list of allocated Stacks, or to its arena's list
+ */
+void stack_register(Stack* stk) {
+    assert(stk);
 
-error:
-    STACK_LOG(stk, "Verification failed");
-    if (stack_global_log) {
-        stack_dump(stk, stack_global_log);
+    StackArena* arena = stack_allocator_arena(&stk->allocator);
+    pthread_mutex_lock(&stack_registry_mutex);
+    Stack** list = (arena) ? &arena->stacks : &stack_registry;
+    stk->registry_pprev = list;
+    stk->registry_next = *list;
+    if (*list) {
+        (*list)->registry_pprev = &stk->registry_next;
     }
+    *list = stk;
+    pthread_mutex_unlock(&stack_registry_mutex);
 }
-#ifndef NDEBUG
-#define STACK_VERIFY(stk) stack_verify(stk)
-#define STACK_VERIFY_RETURN(stk, val)           \
-    STACK_VERIFY(stk);                          \
-    if (!stack_error_recoverable(stk->error)) { \
-        return val;                             \
+
+/*
+ * Remove a Stack from its list, keeping its counters in the global totals
+ */
+void stack_unregister(Stack* stk) {
+    assert(stk);
+
+    pthread_mutex_lock(&stack_registry_mutex);
+    stack_add_counters(&stack_retired_stats, stk);
+    stack_retire_latency(stk);
+    *stk->registry_pprev = stk->registry_next;
+    if (stk->registry_next) {
+        stk->registry_next->registry_pprev = stk->registry_pprev;
     }
-#else
-#define STACK_VERIFY(stk) \
-    do {                  \
-    } while (0)
-#define STACK_VERIFY_RETURN(stk, val) \
-    do {                              \
-    } while (0)
-#endif
+    pthread_mutex_unlock(&stack_registry_mutex);
+}
 
-char const* stack_error_string(STACK_ERROR error) {
-    switch (error) {
-        case STACK_OK:
-            return "No error";
-        case STACK_ALLOCATION_ERROR:
-            return "Internal memory allocation error";
-        case STACK_OPERATION_ERROR:
-            return "Invalid stack operation was requested by user";
+void stack_register_arena(StackArena* arena) {
+    assert(arena);
 
-#ifdef USE_CANARY
-        case STACK_METADATA_CANARY_OVERWRITE_ERROR:
-            return "One of the stack's metadata canaries have been overwritten. "
-                   "Metadata is probably corrupted";
-#endif
+    pthread_mutex_lock(&stack_registry_mutex);
+    arena->pprev = &stack_arenas;
+    arena->next = stack_arenas;
+    if (stack_arenas) {
+        stack_arenas->pprev = &arena->next;
+    }
+    stack_arenas = arena;
+    pthread_mutex_unlock(&stack_registry_mutex);
+}
 
-#ifdef USE_HASH
-        case STACK_METADATA_HASH_ERROR:
-            return "Stack metadata hash differs from the one stored. "
-                   "Metadata is probably corrupted";
-#endif
+void stack_unregister_arena(StackArena* arena) {
+    assert(arena);
 
-#ifdef USE_DATA_CANARY
-        case STACK_DATA_CANARY_OVERWRITE_ERROR:
-            return "One of the stack's data canaries have been overwritten. "
-                   "Data is possibly corrupted";
-#endif
+    pthread_mutex_lock(&stack_registry_mutex);
+    *arena->pprev = arena->next;
+    if (arena->next) {
+        arena->next->pprev = arena->pprev;
+    }
+    pthread_mutex_unlock(&stack_registry_mutex);
+}
 
-#ifdef USE_HASH_FULL
-        case STACK_DATA_HASH_ERROR:
-            return "Stack data hash differs from the one stored. "
-                   "Data is possibly corrupted";
-#endif
+void stack_release_arena_stacks(StackArena* arena) {
+    assert(arena);
 
-#ifdef USE_POISON
-        case STACK_POISON_OVERWRITE_ERROR:
-            return "Stack unused data memory has been overwritten. "
-                   "Data is possibly corrupted";
-#endif
+    pthread_mutex_lock(&stack_registry_mutex);
+    Stack* stacks = arena->stacks;
+    for (Stack const* stk = stacks; stk; stk = stk->registry_next) {
+        stack_add_counters(&stack_retired_stats, stk);
+        stack_retire_latency(stk);
+        stack_global_count--;
+    }
+    arena->stacks = NULL;
+    pthread_mutex_unlock(&stack_registry_mutex);
+
+    // The headers stay in the arena until it is reset, but anything outside of it must be released
+    for (Stack* stk = stacks; stk; stk = stk->registry_next) {
+        if (STACK_USES(stk, STACK_GUARD_PAGES)) {
+            stack_guarded_unmap(stk->data, stack_paged_size(stk, stk->capacity));
+        } else if (stk->data && stack_huge_data(stk, stack_data_size(stk, stk->capacity))) {
+            stack_huge_unmap((char*) stk->data - stack_data_canary_size(stk), stack_data_size(stk, stk->capacity));
+        }
+        if (STACK_USES(stk, STACK_SCRUB)) {
+            pthread_mutex_destroy(&stk->scrub_mutex);
+        }
+        if (STACK_USES(stk, STACK_USE_LOG)) {
+            stack_log_close();
+        }
+    }
+}
 
-        case STACK_CORRUPTION_ERROR:
-            return "Stack memory has been corrupted";
-        default:
-            return "Unknown error";
+// Back data canaries follow the last element, so they may be unaligned
+canary_type stack_read_back_canary(void const* p) {
+    assert(p);
+
+    canary_type canary;
+    memcpy(&canary, p, sizeof(canary));
+    return canary;
+}
+
+void stack_write_back_canary(void* p) {
+    assert(p);
+
+    const canary_type canary = CANARY_VALUE;
+    memcpy(p, &canary, sizeof(canary));
+}
+
+size_t stack_segment_block_hashes_size(Stack const* stk) {
+    assert(stk);
+
+    return STACK_USES(stk, STACK_USE_HASH_FULL) ? stk->segment_capacity / STACK_HASH_BLOCK * sizeof(hash_type) : 0;
+}
+
+size_t stack_segment_alloc_size(Stack const* stk) {
+    assert(stk);
+
+    return sizeof(StackSegment) + stack_segment_block_hashes_size(stk) +
+           stk->segment_capacity * stk->elem_sz + 2 * stack_data_canary_size(stk);
+}
+
+char* stack_segment_elems(Stack const* stk, StackSegment const* seg) {
+    assert(stk);
+    assert(seg);
+
+    return (char*) (seg + 1) + stack_segment_block_hashes_size(stk) + stack_data_canary_size(stk);
+}
+
+StackSegment* stack_segment_find(Stack const* stk, StackSegment* seg, size_t i) {
+    assert(stk);
+    assert(seg);
+
+    while (i < seg->first) {
+        seg = seg->prev;
     }
+    while (i >= seg->first + stk->segment_capacity) {
+        seg = seg->next;
+    }
+    return seg;
 }
 
-#define TO_STRING(name) #name
+/*
+ * A run is a range of elements that are stored contiguously in memory.
+ * Contiguous Stacks consist of a single run, while segmented Stacks have one run per segment.
+ */
+typedef struct stack_run_t {
+    // Index of the run's first element
+    size_t first;
+    // Number of elements in the run
+    size_t num;
+    char* elems;
+    // Hash of the block that contains the run's first element, or NULL if data hashing is off
+    hash_type* block_hashes;
+    // Segment the run belongs to, or NULL for contiguous Stacks
+    StackSegment* segment;
+} StackRun;
+
+StackRun stack_segment_run(Stack const* stk, StackSegment* seg, size_t i) {
+    assert(stk);
+    assert(seg);
+    assert(i >= seg->first && i < seg->first + stk->segment_capacity);
+
+    size_t offset = i - seg->first;
+    StackRun run = {
+        .first = i,
+        .num = stk->segment_capacity - offset,
+        .elems = stack_segment_elems(stk, seg) + offset * stk->elem_sz,
+        .block_hashes = seg->block_hashes ? seg->block_hashes + offset / STACK_HASH_BLOCK : NULL,
+        .segment = seg,
+    };
+    return run;
+}
 
-char const* get_stack_compilation_options() {
-    return "This stack was compiled with "
-#ifdef USE_CANARY
-        TO_STRING(USE_CANARY) " "
-#endif
-#ifdef USE_DATA_CANARY
-        TO_STRING(USE_DATA_CANARY) " "
-#endif
-#ifdef USE_HASH_FAST
-        TO_STRING(USE_HASH_FAST) " "
-#endif
-#ifdef USE_HASH_FULL
-        TO_STRING(USE_HASH_FULL) " "
-#endif
-#ifdef USE_POISON
-        TO_STRING(USE_POISON) " "
-#endif
-#ifdef USE_LOG
-        TO_STRING(USE_LOG) " with log file " STACK_LOG_FILENAME " "
+/*
+ * Get the run that starts at element i, searching for its segment starting from hint
+ */
+StackRun stack_run_near(Stack const* stk, StackSegment* hint, size_t i) {
+    assert(stk);
+    assert(i < stk->capacity);
+
+    if (STACK_USES(stk, STACK_SEGMENTED)) {
+        return stack_segment_run(stk, stack_segment_find(stk, hint ? hint : stk->top_segment, i), i);
+    }
+
+    StackRun run = {
+        .first = i,
+        .num = stk->capacity - i,
+        .elems = (char*) stk->data + i * stk->elem_sz,
+        .block_hashes = stk->block_hashes ? stk->block_hashes + i / STACK_HASH_BLOCK : NULL,
+        .segment = NULL,
+    };
+    return run;
+}
+
+StackRun stack_run(Stack const* stk, size_t i) {
+    return stack_run_near(stk, stk->top_segment, i);
+}
+
+void stack_run_next(Stack const* stk, StackRun* run) {
+    assert(stk);
+    assert(run);
+    assert(run->segment && run->segment->next);
+
+    *run = stack_segment_run(stk, run->segment->next, run->first + run->num);
+}
+
+hash_type* stack_run_block_hash(StackRun const* run, size_t j) {
+    assert(run);
+    assert(run->block_hashes);
+
+    return run->block_hashes + (run->first % STACK_HASH_BLOCK + j) / STACK_HASH_BLOCK;
+}
+
+void stack_copy_in(Stack* stk, size_t first, void const* elems, size_t num) {
+    assert(stk);
+
+    char const* src = elems;
+    StackRun run = stack_run(stk, first);
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        memcpy(run.elems, src, run_num * stk->elem_sz);
+        src += run_num * stk->elem_sz;
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+    if (run.segment) {
+        stk->top_segment = run.segment;
+    }
+}
+
+/*
+ * Fault in the pages of a Stack's elements, so that writing them takes no page faults
+ */
+void stack_prefault_elems(Stack const* stk, size_t first, size_t num) {
+    assert(stk);
+
+    if (!num) {
+        return;
+    }
+    StackRun run = stack_run(stk, first);
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        stack_prefault(run.elems, run_num * stk->elem_sz);
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+}
+
+void stack_copy_out(Stack* stk, size_t first, void* elems, size_t num) {
+    assert(stk);
+
+    char* dst = elems;
+    StackRun run = stack_run(stk, first);
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        memcpy(dst, run.elems, run_num * stk->elem_sz);
+        dst += run_num * stk->elem_sz;
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+    if (run.segment) {
+        stk->top_segment = run.segment;
+    }
+}
+
+/*
+ * Write num elements starting from first to file, one write per contiguous run
+ */
+bool stack_write_out(Stack const* stk, size_t first, FILE* file, size_t num) {
+    assert(stk);
+    assert(file);
+
+    StackRun run = num ? stack_run(stk, first) : (StackRun) {0};
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        if (fwrite(run.elems, stk->elem_sz, run_num, file) != run_num) {
+            return false;
+        }
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+    return true;
+}
+
+/*
+ * Read num elements from file into the Stack starting from first, one read per contiguous run
+ */
+bool stack_read_in(Stack* stk, size_t first, FILE* file, size_t num) {
+    assert(stk);
+    assert(file);
+
+    StackRun run = stack_run(stk, first);
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        if (fread(run.elems, stk->elem_sz, run_num, file) != run_num) {
+            return false;
+        }
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+    if (run.segment) {
+        stk->top_segment = run.segment;
+    }
+    return true;
+}
+
+unsigned char get_poison(void const* p) {
+    return (unsigned char) (uintptr_t) p;
+}
+
+bool is_poison(void const* p) {
+    return *(unsigned char*) p == get_poison(p);
+}
+
+void write_poison_scalar(void* arr, size_t num) {
+    assert(arr);
+
+    for (unsigned char* p = arr; p < (unsigned char*) arr + num; p++) {
+        *p = get_poison(p);
+    }
+}
+
+bool verify_poison_scalar(void const* arr, size_t num) {
+    assert(arr);
+
+    for (unsigned char const* p = arr; p < (unsigned char const*) arr + num; p++) {
+        if (!is_poison(p)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Since the poison value of a byte is the low byte of its address,
+// the poison for an aligned vector is the poison of its first byte plus 0, 1, 2...
+// and the poison for the next vector is that plus the vector's size
+#ifdef STACK_POISON_SIMD
+__attribute__((target("sse2"))) void write_poison_sse2(void* arr, size_t num) {
+    assert(arr);
+
+    unsigned char* p = arr;
+    unsigned char* const end = p + num;
+    for (; p < end && (uintptr_t) p % sizeof(__m128i); p++) {
+        *p = get_poison(p);
+    }
+
+    const __m128i step = _mm_set1_epi8(sizeof(__m128i));
+    __m128i poison = _mm_add_epi8(_mm_set1_epi8(get_poison(p)),
+                                  _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    for (; end - p >= (ptrdiff_t) sizeof(__m128i); p += sizeof(__m128i)) {
+        _mm_store_si128((__m128i*) p, poison);
+        poison = _mm_add_epi8(poison, step);
+    }
+
+    write_poison_scalar(p, end - p);
+}
+
+__attribute__((target("sse2"))) bool verify_poison_sse2(void const* arr, size_t num) {
+    assert(arr);
+
+    unsigned char const* p = arr;
+    unsigned char const* const end = p + num;
+    for (; p < end && (uintptr_t) p % sizeof(__m128i); p++) {
+        if (!is_poison(p)) {
+            return false;
+        }
+    }
+
+    const __m128i step = _mm_set1_epi8(sizeof(__m128i));
+    __m128i poison = _mm_add_epi8(_mm_set1_epi8(get_poison(p)),
+                                  _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    for (; end - p >= (ptrdiff_t) sizeof(__m128i); p += sizeof(__m128i)) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_load_si128((__m128i const*) p), poison);
+        if (_mm_movemask_epi8(eq) != 0xFFFF) {
+            return false;
+        }
+        poison = _mm_add_epi8(poison, step);
+    }
+
+    return verify_poison_scalar(p, end - p);
+}
+
+__attribute__((target("avx2"))) void write_poison_avx2(void* arr, size_t num) {
+    assert(arr);
+
+    unsigned char* p = arr;
+    unsigned char* const end = p + num;
+    for (; p < end && (uintptr_t) p % sizeof(__m256i); p++) {
+        *p = get_poison(p);
+    }
+
+    const __m256i step = _mm256_set1_epi8(sizeof(__m256i));
+    __m256i poison = _mm256_add_epi8(_mm256_set1_epi8(get_poison(p)),
+                                     _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                                      16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31));
+    for (; end - p >= (ptrdiff_t) sizeof(__m256i); p += sizeof(__m256i)) {
+        _mm256_store_si256((__m256i*) p, poison);
+        poison = _mm256_add_epi8(poison, step);
+    }
+
+    write_poison_scalar(p, end - p);
+}
+
+__attribute__((target("avx2"))) bool verify_poison_avx2(void const* arr, size_t num) {
+    assert(arr);
+
+    unsigned char const* p = arr;
+    unsigned char const* const end = p + num;
+    for (; p < end && (uintptr_t) p % sizeof(__m256i); p++) {
+        if (!is_poison(p)) {
+            return false;
+        }
+    }
+
+    const __m256i step = _mm256_set1_epi8(sizeof(__m256i));
+    __m256i poison = _mm256_add_epi8(_mm256_set1_epi8(get_poison(p)),
+                                     _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                                      16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31));
+    for (; end - p >= (ptrdiff_t) sizeof(__m256i); p += sizeof(__m256i)) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_load_si256((__m256i const*) p), poison);
+        if ((unsigned) _mm256_movemask_epi8(eq) != 0xFFFFFFFFu) {
+            return false;
+        }
+        poison = _mm256_add_epi8(poison, step);
+    }
+
+    return verify_poison_scalar(p, end - p);
+}
 #endif
-#if !defined(USE_CANARY) && !defined(USE_DATA_CANARY) && !defined(USE_HASH) && !defined(USE_POISON) && !defined(USE_LOG)
-                           "no protections"
+
+static void (*write_poison_impl)(void*, size_t) = write_poison_scalar;
+static bool (*verify_poison_impl)(void const*, size_t) = verify_poison_scalar;
+
+#ifdef STACK_POISON_SIMD
+__attribute__((constructor)) void select_poison_impl() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        write_poison_impl = write_poison_avx2;
+        verify_poison_impl = verify_poison_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        write_poison_impl = write_poison_sse2;
+        verify_poison_impl = verify_poison_sse2;
+    }
+}
 #endif
-        ;
+
+void write_poison(void* arr, size_t num) {
+    write_poison_impl(arr, num);
+}
+
+bool verify_poison(void const* arr, size_t num) {
+    return verify_poison_impl(arr, num);
+}
+
+hash_type stack_metadata_hash(Stack const* stk) {
+    assert(stk);
+
+    const hash_type hash_parts[] = {
+        (hash_type) stk->data,
+        (hash_type) stk->elem_sz,
+        (hash_type) stk->size,
+        (hash_type) stk->capacity,
+        (hash_type) stk->flags,
+        (hash_type) stk->block_hashes,
+        stk->data_hash,
+        (hash_type) stk->segments,
+        (hash_type) stk->segment_capacity,
+        (hash_type) stk->resize_policy.kind,
+        (hash_type) stk->resize_policy.shrink_delay,
+        (hash_type) stk->marks,
+        (hash_type) stk->mark_count,
+        (hash_type) stk->histograms,
+        (hash_type) stk->embedded_capacity,
+        (hash_type) (uintptr_t) stk->resize_policy.callback,
+        (hash_type) stk->resize_policy.callback_data,
+        (hash_type) stk->verify_policy.mode,
+        (hash_type) stk->verify_policy.period,
+        (hash_type) stk->verify_policy.amortized_bytes,
+        (hash_type) stk->map_header,
+        (hash_type) stk->sync_mode,
+        (hash_type) stk->sync_period,
+        (hash_type) stk->allocator.data,
+        (hash_type) (uintptr_t) stk->allocator.reallocate,
+    };
+
+    return stack_hash_bytes(hash_parts, sizeof(hash_parts), HASH_INITIAL_VALUE);
+}
+
+// The data hash is the sum of the hashes of all live elements.
+// Each element's hash depends on its position, so the sum is order-aware,
+// and pushing or poping an element only needs to add or subtract one term.
+// Partial sums are also kept for each block of STACK_HASH_BLOCK elements,
+// so that the data can be checked a block at a time.
+hash_type stack_elem_hash(Stack const* stk, void const* elem_p, size_t i) {
+    assert(stk);
+    assert(elem_p);
+
+    return stack_hash_bytes(elem_p, stk->elem_sz, HASH_INITIAL_VALUE ^ (hash_type) i);
+}
+
+size_t stack_hash_block_count(size_t capacity) {
+    return (capacity + STACK_HASH_BLOCK - 1) / STACK_HASH_BLOCK;
+}
+
+/*
+ * Compute the hash of the block that starts at the first element of run
+ */
+hash_type stack_block_hash(Stack const* stk, StackRun const* run) {
+    assert(stk);
+    assert(run);
+    assert(run->first % STACK_HASH_BLOCK == 0);
+
+    hash_type hash_value = 0;
+    size_t end = run->first + STACK_HASH_BLOCK;
+    if (end > stk->size) {
+        end = stk->size;
+    }
+    char const* elem_p = run->elems;
+    for (size_t i = run->first; i < end; i++) {
+        hash_value += stack_elem_hash(stk, elem_p, i);
+        elem_p += stk->elem_sz;
+    }
+    return hash_value;
+}
+
+hash_type stack_data_hash(Stack const* stk) {
+    assert(stk);
+
+    hash_type hash_value = 0;
+    if (!stk->data || !stk->size) {
+        return hash_value;
+    }
+    StackRun run = stack_run_near(stk, stk->segments, 0);
+    size_t num = stk->size;
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        for (size_t j = 0; j < run_num; j++) {
+            hash_value += stack_elem_hash(stk, run.elems + j * stk->elem_sz, run.first + j);
+        }
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+    return hash_value;
+}
+
+bool stack_block_hash_valid(Stack const* stk, StackRun const* run) {
+    assert(stk);
+    assert(run);
+    assert(run->block_hashes);
+
+    return *run->block_hashes == stack_block_hash(stk, run);
+}
+
+bool stack_segment_canaries_valid(Stack const* stk, StackSegment const* seg) {
+    assert(stk);
+    assert(seg);
+
+    char const* elems = stack_segment_elems(stk, seg);
+    const canary_type front_canary = *((canary_type const*) elems - 1);
+    const canary_type back_canary = stack_read_back_canary(elems + stk->segment_capacity * stk->elem_sz);
+    return front_canary == CANARY_VALUE && back_canary == CANARY_VALUE;
+}
+
+bool stack_data_canaries_valid(Stack const* stk) {
+    assert(stk);
+    assert(stk->data);
+
+    const canary_type front_canary = *((canary_type const*) stk->data - 1);
+    const canary_type back_canary = stack_read_back_canary((char const*) stk->data + stk->capacity * stk->elem_sz);
+    return front_canary == CANARY_VALUE && back_canary == CANARY_VALUE;
+}
+
+bool stack_poison_valid(Stack const* stk, size_t first, size_t num) {
+    assert(stk);
+
+    if (!num) {
+        return true;
+    }
+    StackRun run = stack_run(stk, first);
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        if (!verify_poison(run.elems, run_num * stk->elem_sz)) {
+            return false;
+        }
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+    return true;
+}
+
+static const struct {
+    unsigned flag;
+    char const* name;
+} stack_flag_names[] = {
+    {STACK_USE_CANARY, "STACK_USE_CANARY"},
+    {STACK_USE_DATA_CANARY, "STACK_USE_DATA_CANARY"},
+    {STACK_USE_HASH_FAST, "STACK_USE_HASH_FAST"},
+    {STACK_USE_HASH_FULL, "STACK_USE_HASH_FULL"},
+    {STACK_USE_POISON, "STACK_USE_POISON"},
+    {STACK_USE_LOG, "STACK_USE_LOG"},
+    {STACK_SEGMENTED, "STACK_SEGMENTED"},
+    {STACK_GUARD_PAGES, "STACK_GUARD_PAGES"},
+    {STACK_SCRUB, "STACK_SCRUB"},
+    {STACK_MAPPED, "STACK_MAPPED"},
+    {STACK_TIMED, "STACK_TIMED"},
+    {STACK_HUGE_PAGES, "STACK_HUGE_PAGES"},
+    {STACK_PREFAULT, "STACK_PREFAULT"},
+};
+
+char* stack_options_string(unsigned flags, char* str, size_t str_sz) {
+    assert(str);
+    assert(str_sz);
+
+    size_t len = snprintf(str, str_sz, "This Stack uses ");
+    if (!(flags & STACK_USE_ALL)) {
+        len += snprintf(str + len, (len < str_sz) ? str_sz - len : 0, "no protections ");
+    }
+    for (size_t i = 0; i < ARR_LENGTH(stack_flag_names) && len < str_sz; i++) {
+        if (flags & stack_flag_names[i].flag) {
+            len += snprintf(str + len, str_sz - len, "%s ", stack_flag_names[i].name);
+        }
+    }
+
+    return str;
+}
+
+enum {
+    // Elements are formatted into a buffer of this size and written to the dump file a buffer at a time
+    STACK_DUMP_BUFFER_SIZE = 1 << 15,
+    STACK_DUMP_POISON_RUN = 8,
+    // A Stack that failed verification is dumped around its top, where the corruption most likely is
+    STACK_FAILURE_DUMP_ELEMS = 1024,
+    STACK_FAILURE_DUMP_BYTES = 1 << 20,
+};
+
+typedef struct stack_dump_writer_t {
+    FILE* file;
+    size_t len;
+    // Bytes of element lines written so far
+    size_t elem_bytes;
+    char buf[STACK_DUMP_BUFFER_SIZE];
+} StackDumpWriter;
+
+static const char stack_hex_digits[16] = "0123456789ABCDEF";
+
+void stack_dump_flush(StackDumpWriter* writer) {
+    assert(writer);
+
+    fwrite(writer->buf, 1, writer->len, writer->file);
+    writer->elem_bytes += writer->len;
+    writer->len = 0;
+}
+
+/*
+ * Get room for num more characters in the buffer, flushing it if needed. num must be at most STACK_DUMP_BUFFER_SIZE
+ */
+char* stack_dump_space(StackDumpWriter* writer, size_t num) {
+    assert(writer);
+    assert(num <= STACK_DUMP_BUFFER_SIZE);
+
+    if (writer->len + num > STACK_DUMP_BUFFER_SIZE) {
+        stack_dump_flush(writer);
+    }
+    return writer->buf + writer->len;
+}
+
+void stack_dump_str(StackDumpWriter* writer, char const* str) {
+    assert(writer);
+    assert(str);
+
+    size_t len = strlen(str);
+    memcpy(stack_dump_space(writer, len), str, len);
+    writer->len += len;
+}
+
+void stack_dump_index(StackDumpWriter* writer, size_t i) {
+    assert(writer);
+
+    char digits[3 * sizeof(i)];
+    size_t num = 0;
+    do {
+        digits[num++] = (char) ('0' + i % 10);
+        i /= 10;
+    } while (i);
+    char* dst = stack_dump_space(writer, num);
+    for (size_t j = 0; j < num; j++) {
+        dst[j] = digits[num - j - 1];
+    }
+    writer->len += num;
+}
+
+/*
+ * Write an element as a hexadecimal number, which is in the correct order only on little endian systems
+ */
+void stack_dump_hex(StackDumpWriter* writer, void const* elem_p, size_t elem_sz) {
+    assert(writer);
+    assert(elem_p);
+
+    stack_dump_str(writer, "0x");
+    unsigned char const* bytes = (unsigned char const*) elem_p + elem_sz;
+    while (elem_sz) {
+        size_t num = (STACK_DUMP_BUFFER_SIZE - writer->len) / 2;
+        if (!num) {
+            stack_dump_flush(writer);
+            continue;
+        }
+        num = (num < elem_sz) ? num : elem_sz;
+        char* dst = writer->buf + writer->len;
+        for (size_t i = 0; i < num; i++) {
+            unsigned char byte = *--bytes;
+            dst[2 * i] = stack_hex_digits[byte >> 4];
+            dst[2 * i + 1] = stack_hex_digits[byte & 0xF];
+        }
+        writer->len += 2 * num;
+        elem_sz -= num;
+    }
+}
+
+/*
+ * Write one line per element, as [i] if it's live and as (i) if it's unused capacity
+ */
+void stack_dump_elem(StackDumpWriter* writer, Stack const* stk, size_t i, void const* elem_p) {
+    assert(writer);
+    assert(stk);
+
+    stack_dump_str(writer, (i < stk->size) ? "[" : "(");
+    stack_dump_index(writer, i);
+    stack_dump_str(writer, (i < stk->size) ? "]: " : "): ");
+    stack_dump_hex(writer, elem_p, stk->elem_sz);
+    if (STACK_USES(stk, STACK_USE_POISON) && verify_poison(elem_p, stk->elem_sz)) {
+        stack_dump_str(writer, " (poison)");
+    }
+    stack_dump_str(writer, "\n");
+}
+
+/*
+ * Count the poisoned elements at the start of num contiguous elements
+ */
+size_t stack_poisoned_prefix(Stack const* stk, char const* elems, size_t num, size_t chunk) {
+    assert(stk);
+    assert(chunk);
+
+    // Unused capacity is normally poisoned all the way
+    if (verify_poison(elems, num * stk->elem_sz)) {
+        return num;
+    }
+    size_t poisoned = 0;
+    while (poisoned < num) {
+        size_t chunk_num = (num - poisoned < chunk) ? num - poisoned : chunk;
+        if (!verify_poison(elems + poisoned * stk->elem_sz, chunk_num * stk->elem_sz)) {
+            while (verify_poison(elems + poisoned * stk->elem_sz, stk->elem_sz)) {
+                poisoned++;
+            }
+            break;
+        }
+        poisoned += chunk_num;
+    }
+    return poisoned;
+}
+
+/*
+ * Write the elements from first up to end, summarizing runs of poisoned unused elements and stopping at max_bytes
+ */
+void stack_dump_elems(StackDumpWriter* writer, Stack const* stk, size_t first, size_t end,
+                      StackDumpOptions const* options) {
+    assert(writer);
+    assert(stk);
+    assert(options);
+
+    bool summarize = STACK_USES(stk, STACK_USE_POISON) && options->poison_run;
+    StackRun run = stack_run(stk, first);
+    size_t i = first;
+    while (i < end) {
+        if (i == run.first + run.num) {
+            stack_run_next(stk, &run);
+        }
+        if (options->max_bytes && writer->elem_bytes + writer->len >= options->max_bytes) {
+            stack_dump_str(writer, "Stopped dumping after ");
+            stack_dump_index(writer, options->max_bytes);
+            stack_dump_str(writer, " bytes, ");
+            stack_dump_index(writer, end - i);
+            stack_dump_str(writer, " elements were not dumped\n");
+            return;
+        }
+        char const* elem_p = run.elems + (i - run.first) * stk->elem_sz;
+        if (summarize && i >= stk->size) {
+            size_t run_end = (run.first + run.num < end) ? run.first + run.num : end;
+            size_t poisoned = stack_poisoned_prefix(stk, elem_p, run_end - i, options->poison_run);
+            if (poisoned >= options->poison_run) {
+                stack_dump_str(writer, "(");
+                stack_dump_index(writer, i);
+                stack_dump_str(writer, " to ");
+                stack_dump_index(writer, i + poisoned - 1);
+                stack_dump_str(writer, "): poison\n");
+                i += poisoned;
+                continue;
+            }
+            // A short run is printed as is, along with the element that broke it
+            size_t num = (poisoned < run_end - i) ? poisoned + 1 : poisoned;
+            for (size_t j = 0; j < num; j++) {
+                stack_dump_elem(writer, stk, i + j, elem_p + j * stk->elem_sz);
+            }
+            i += num;
+            continue;
+        }
+        stack_dump_elem(writer, stk, i, elem_p);
+        i++;
+    }
+}
+
+StackDumpOptions stack_dump_options() {
+    StackDumpOptions options = {
+        .first = 0,
+        .count = SIZE_MAX,
+        .live_only = false,
+        .poison_run = STACK_DUMP_POISON_RUN,
+        .max_bytes = 0,
+    };
+    return options;
+}
+
+void stack_dump(Stack* stk, FILE* dump_file) {
+    StackDumpOptions options = stack_dump_options();
+    stack_dump_ex(stk, dump_file, &options);
+}
+
+void stack_dump_ex(Stack* stk, FILE* dump_file, StackDumpOptions const* options) {
+    assert(stk);
+    assert(dump_file);
+    assert(options);
+
+    time_t tm = time(NULL);
+    fprintf(dump_file, "%s"
+                       "Dump for Stack at %p\n"
+                       "Stack status is: %d: %s\n",
+            ctime(&tm),
+            (void const*) stk,
+            stk->error, stack_error_string(stk->error));
+
+    const int canary_field_width = sizeof(canary_type) * CHAR_BIT / 4;
+    const int hash_field_width = sizeof(hash_type) * CHAR_BIT / 4;
+
+    char options_str[STACK_OPTIONS_STRING_SIZE];
+    fprintf(dump_file, "%s\n", stack_options_string(stk->flags, options_str, sizeof(options_str)));
+
+    if (STACK_USES(stk, STACK_USE_HASH_FAST)) {
+        fprintf(dump_file, "Stack stored metadata hash is: %.*llX\n"
+                           "Stack actual metadata hash is: %.*llX\n",
+                hash_field_width, stk->metadata_hash,
+                hash_field_width, stack_metadata_hash(stk));
+    }
+    if (STACK_USES(stk, STACK_USE_CANARY)) {
+        fprintf(dump_file, "Stack default canary value is: %.*llX\n"
+                           "Stack front canary is:         %.*llX\n"
+                           "Stack back canary is:          %.*llX\n",
+                canary_field_width, CANARY_VALUE,
+                canary_field_width, stk->front_canary,
+                canary_field_width, stk->back_canary);
+    }
+    fprintf(dump_file, "Stack element size is     %zu\n"
+                       "Stack minimum capacity is %zu\n"
+                       "Stack size is             %zu\n"
+                       "Stack capacity is         %zu\n"
+                       "Stack data is at: %p\n",
+            stk->elem_sz,
+            stk->min_capacity,
+            stk->size,
+            stk->capacity,
+            stk->data);
+    if (stk->data && stk->capacity <= stk->embedded_capacity) {
+        fprintf(dump_file, "Stack data is embedded before the header, which has room for %zu elements\n",
+                stk->embedded_capacity);
+    }
+    if (STACK_USES(stk, STACK_GUARD_PAGES) && stk->data) {
+        size_t page_size = stack_page_size();
+        size_t mapped_size = stack_paged_size(stk, stk->capacity);
+        fprintf(dump_file, "Stack data is mapped between guard pages at %p and %p\n"
+                           "Stack data mapping is %zu bytes in %zu byte pages, %zu bytes past the last element\n",
+                (void const*) ((char const*) stk->data - page_size),
+                (void const*) ((char const*) stk->data + mapped_size),
+                mapped_size, page_size, mapped_size - stk->capacity * stk->elem_sz);
+    }
+    if (stk->data && stack_huge_data(stk, stack_data_size(stk, stk->capacity))) {
+        size_t data_size = stack_data_size(stk, stk->capacity);
+        size_t mapped_size = (data_size + STACK_HUGE_PAGE_SIZE - 1) / STACK_HUGE_PAGE_SIZE * STACK_HUGE_PAGE_SIZE;
+        fprintf(dump_file, "Stack data mapping is %zu bytes in %zu byte huge pages, %zu bytes past the last element\n",
+                mapped_size, (size_t) STACK_HUGE_PAGE_SIZE, mapped_size - data_size + stack_data_canary_size(stk));
+    }
+    if (STACK_USES(stk, STACK_MAPPED) && stk->map_header) {
+        fprintf(dump_file, "Stack is mapped from file descriptor %d at %p, %zu bytes with the header\n"
+                           "Stack sync policy is %d, period %zu, %zu operations since the last sync\n",
+                stk->map_fd, (void const*) stk->map_header, stack_mapped_size(stk),
+                stk->sync_mode, stk->sync_period, stk->sync_ops);
+    }
+    fprintf(dump_file, "Stack verification policy is %d, period %zu, time budget %g, amortized bytes %zu\n",
+            stk->verify_policy.mode, stk->verify_policy.period, stk->verify_policy.time_budget,
+            stk->verify_policy.amortized_bytes);
+    fprintf(dump_file, "Stack resize policy is %d, delayed shrink for %zu of %zu operations\n"
+                       "Stack has grown %zu times, shrunk %zu times and copied %zu bytes when resizing\n",
+            stk->resize_policy.kind, stk->idle_ops, stk->resize_policy.shrink_delay,
+            atomic_load_explicit(&stk->counters.grow_count, memory_order_relaxed),
+            atomic_load_explicit(&stk->counters.shrink_count, memory_order_relaxed),
+            atomic_load_explicit(&stk->counters.bytes_copied, memory_order_relaxed));
+    StackStats stats;
+    stack_stats(stk, &stats);
+    fprintf(dump_file, "Stack has pushed %zu, poped %zu and peeked at %zu elements, and held at most %zu\n"
+                       "Stack was verified %zu times and failed %zu times\n",
+            stats.push_count, stats.pop_count, stats.top_count, stats.peak_size,
+            stats.verify_count, stats.verify_fail_count);
+    if (!stk->data) {
+        return;
+    }
+
+    if (STACK_USES(stk, STACK_USE_HASH_FULL)) {
+        fprintf(dump_file, "Stack stored data hash is:          %.*llX\n"
+                           "Stack actual data hash is:          %.*llX\n",
+                hash_field_width, stk->data_hash,
+                hash_field_width, stack_data_hash(stk));
+    }
+    if (STACK_USES(stk, STACK_USE_DATA_CANARY)) {
+        fprintf(dump_file, "Stack default data canary value is: %.*llX\n",
+                canary_field_width, CANARY_VALUE);
+    }
+    for (StackRun run = stack_run_near(stk, stk->segments, 0);; stack_run_next(stk, &run)) {
+        if (run.segment) {
+            fprintf(dump_file, "Stack segment of elements %zu to %zu is at: %p\n",
+                    run.first, run.first + run.num - 1, (void const*) run.segment);
+        }
+        if (STACK_USES(stk, STACK_USE_DATA_CANARY)) {
+            fprintf(dump_file, "Stack data front canary is:         %.*llX\n"
+                               "Stack data back canary is:          %.*llX\n",
+                    canary_field_width, *((canary_type const*) run.elems - 1),
+                    canary_field_width, stack_read_back_canary(run.elems + run.num * stk->elem_sz));
+        }
+        if (run.first + run.num == stk->capacity) {
+            break;
+        }
+    }
+
+    size_t end = options->live_only ? stk->size : stk->capacity;
+    if (options->count < end - options->first) {
+        end = options->first + options->count;
+    }
+    if (options->first >= end) {
+        fprintf(dump_file, "Stack data from %zu is empty\n", options->first);
+        return;
+    }
+    fprintf(dump_file, "Stack data from %zu to %zu is:\n", options->first, end - 1);
+    fflush(dump_file);
+    StackDumpWriter writer = {.file = dump_file};
+    stack_dump_elems(&writer, stk, options->first, end, options);
+    stack_dump_flush(&writer);
+}
+
+/*
+ * Elements of up to 8 bytes are logged as is, larger ones are logged as their hash
+ */
+uint64_t stack_elem_digest(Stack const* stk, void const* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    uint64_t digest = 0;
+    if (stk->elem_sz <= sizeof(digest)) {
+        memcpy(&digest, elem_p, stk->elem_sz);
+        return digest;
+    }
+    return stack_elem_hash(stk, elem_p, 0);
+}
+
+/*
+ * Log an event with the arguments described in its STACK_LOG_EVENTS entry
+ */
+void stack_log(Stack const* stk, STACK_LOG_EVENT event, ...) {
+    assert(stk);
+    assert(event < STACK_EVENT_COUNT);
+
+    uint64_t args[2] = {0, 0};
+    va_list arg_list;
+    va_start(arg_list, event);
+    switch (stack_log_events[event].args) {
+        case STACK_LOG_TWO_ARGS:
+            args[0] = va_arg(arg_list, size_t);
+            args[1] = va_arg(arg_list, size_t);
+            break;
+        case STACK_LOG_ONE_ARG:
+            args[0] = va_arg(arg_list, size_t);
+            break;
+        case STACK_LOG_ELEM_ARG:
+            args[0] = stack_elem_digest(stk, va_arg(arg_list, void const*));
+            args[1] = stk->elem_sz;
+            break;
+        case STACK_LOG_NO_ARGS:
+            break;
+    }
+    va_end(arg_list);
+
+    stack_log_write(stk, event, args[0], args[1]);
+}
+// ## before __VA_ARGS__ is a GCC/Clang/ICC extension
+#define STACK_LOG(stk, event, ...)                    \
+    do {                                              \
+        if (STACK_USES(stk, STACK_USE_LOG)) {         \
+            stack_log(stk, event, ##__VA_ARGS__);     \
+        }                                             \
+    } while (0)
+
+void stack_dump_to_file(Stack* stk) {
+    assert(stk);
+
+    StackDumpOptions options = stack_dump_options();
+    options.first = (stk->size > STACK_FAILURE_DUMP_ELEMS) ? stk->size - STACK_FAILURE_DUMP_ELEMS : 0;
+    options.count = 2 * STACK_FAILURE_DUMP_ELEMS;
+    options.max_bytes = STACK_FAILURE_DUMP_BYTES;
+    FILE* dump_file = fopen(STACK_DUMP_FILENAME, "a");
+    if (dump_file) {
+        stack_dump_ex(stk, dump_file, &options);
+        fclose(dump_file);
+    }
+}
+
+bool stack_error_recoverable(STACK_ERROR err) {
+    return err == STACK_OK || err == STACK_ALLOCATION_ERROR || err == STACK_OPERATION_ERROR;
+}
+
+bool stack_error_valid(STACK_ERROR err) {
+    return err >= STACK_OK && err <= STACK_CORRUPTION_ERROR;
+}
+
+/*
+ * Check the data hash and poison, checking the poison of at most poison_num unused elements.
+ * The elements are rehashed and compared with the data hash, which pushes and pops keep equal to the sum
+ * of the block hashes, unless round_robin asks for only two blocks to be checked
+ */
+STACK_ERROR stack_verify_data(Stack* stk, size_t poison_num, bool round_robin) {
+    assert(stk);
+
+    if (STACK_USES(stk, STACK_USE_HASH_FULL) && !round_robin) {
+        if (stack_data_hash(stk) != stk->data_hash) {
+            return STACK_DATA_HASH_ERROR;
+        }
+    } else if (STACK_USES(stk, STACK_USE_HASH_FULL)) {
+        // Check the top block, which is the one that is about to be used,
+        // and one other block in round-robin order,
+        // so that every block eventually gets checked
+        size_t block_count = stack_hash_block_count(stk->size);
+        if (block_count) {
+            if (stk->hash_cursor >= block_count) {
+                stk->hash_cursor = 0;
+            }
+            StackRun top_run = stack_run(stk, (block_count - 1) * STACK_HASH_BLOCK);
+            StackRun cursor_run = stack_run_near(stk, stk->hash_segment, stk->hash_cursor++ * STACK_HASH_BLOCK);
+            stk->hash_segment = cursor_run.segment;
+            if (!stack_block_hash_valid(stk, &top_run) || !stack_block_hash_valid(stk, &cursor_run)) {
+                return STACK_DATA_HASH_ERROR;
+            }
+        }
+    }
+
+    if (STACK_USES(stk, STACK_USE_POISON)) {
+        size_t first = stk->size;
+        size_t num = stk->capacity - stk->size;
+        // Check a slice of the unused elements, continuing from the last one
+        if (poison_num < num) {
+            if (stk->poison_cursor < stk->size || stk->poison_cursor >= stk->capacity) {
+                stk->poison_cursor = stk->size;
+            }
+            first = stk->poison_cursor;
+            num = (stk->capacity - first < poison_num) ? stk->capacity - first : poison_num;
+            stk->poison_cursor += num;
+        }
+        if (!stack_poison_valid(stk, first, num)) {
+            return STACK_POISON_OVERWRITE_ERROR;
+        }
+    }
+
+    return STACK_OK;
+}
+
+uint64_t stack_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * Get the histogram bucket a latency falls into.
+ * Below STACK_LATENCY_SUB_BUCKETS ns each value has its own bucket, above it the highest 3 bits after the leading one
+ * choose one of the buckets of the value's power of 2
+ */
+size_t stack_latency_bucket(uint64_t ns) {
+    if (ns < STACK_LATENCY_SUB_BUCKETS) {
+        return (size_t) ns;
+    }
+    unsigned exponent = 63 - (unsigned) __builtin_clzll(ns);
+    size_t bucket = (exponent - 2) * STACK_LATENCY_SUB_BUCKETS + ((ns >> (exponent - 3)) & (STACK_LATENCY_SUB_BUCKETS - 1));
+    return (bucket < STACK_LATENCY_BUCKETS) ? bucket : STACK_LATENCY_BUCKETS - 1;
+}
+
+uint64_t stack_latency_bucket_limit(size_t bucket) {
+    assert(bucket < STACK_LATENCY_BUCKETS);
+
+    if (bucket < STACK_LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned shift = (unsigned) (bucket / STACK_LATENCY_SUB_BUCKETS) - 1;
+    uint64_t first = (uint64_t) (STACK_LATENCY_SUB_BUCKETS + bucket % STACK_LATENCY_SUB_BUCKETS) << shift;
+    return first + ((uint64_t) 1 << shift) - 1;
+}
+
+/*
+ * Record the latency of an operation of a timed Stack that started at start_ns
+ */
+void stack_record_latency(Stack* stk, STACK_LATENCY_KIND kind, uint64_t start_ns) {
+    assert(stk);
+    assert(stk->histograms);
+    assert(kind < STACK_LATENCY_KINDS);
+
+    uint64_t ns = stack_time_ns() - start_ns;
+    StackHistogram* histogram = &stk->histograms[kind];
+    size_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    if (!count || ns < atomic_load_explicit(&histogram->min_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->min_ns, ns, memory_order_relaxed);
+    }
+    if (ns > atomic_load_explicit(&histogram->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max_ns, ns, memory_order_relaxed);
+    }
+    atomic_store_explicit(&histogram->total_ns, atomic_load_explicit(&histogram->total_ns, memory_order_relaxed) + ns,
+                          memory_order_relaxed);
+    stack_count(&histogram->buckets[stack_latency_bucket(ns)], 1);
+    stack_count(&histogram->count, 1);
+}
+// Time an operation or phase of a timed Stack, and fire its probe_begin and probe_done probes
+#define STACK_TIMER_START(stk, probe, start_ns)                              \
+    STACK_PROBE(probe##_begin, stk);                                         \
+    uint64_t start_ns = STACK_USES(stk, STACK_TIMED) ? stack_time_ns() : 0
+#define STACK_TIMER_STOP(stk, probe, kind, start_ns)                         \
+    do {                                                                     \
+        if (STACK_USES(stk, STACK_TIMED)) {                                  \
+            stack_record_latency(stk, kind, start_ns);                       \
+        }                                                                    \
+        STACK_PROBE(probe##_done, stk);                                      \
+    } while (0)
+
+/*
+ * Check as much of the data as the Stack's verification policy asks for on this operation
+ */
+STACK_ERROR stack_verify_scheduled_data(Stack* stk) {
+    assert(stk);
+
+    StackVerifyPolicy const* policy = &stk->verify_policy;
+    switch (policy->mode) {
+        case STACK_VERIFY_EVERY_NTH:
+            if (++stk->verify_ops < policy->period) {
+                return STACK_OK;
+            }
+            stk->verify_ops = 0;
+            return stack_verify_data(stk, SIZE_MAX, false);
+        case STACK_VERIFY_TIME_BUDGET: {
+            // The checks earn time_budget of the time that passes, and spend the time they take
+            uint64_t now = stack_time_ns();
+            stk->verify_credit_ns += (double) (now - stk->verify_time_ns) * policy->time_budget;
+            if (stk->verify_credit_ns > STACK_VERIFY_MAX_CREDIT_NS) {
+                stk->verify_credit_ns = STACK_VERIFY_MAX_CREDIT_NS;
+            }
+            stk->verify_time_ns = now;
+            if (stk->verify_credit_ns <= 0.0) {
+                return STACK_OK;
+            }
+            STACK_ERROR error = stack_verify_data(stk, SIZE_MAX, false);
+            stk->verify_time_ns = stack_time_ns();
+            stk->verify_credit_ns -= (double) (stk->verify_time_ns - now);
+            return error;
+        }
+        case STACK_VERIFY_AMORTIZED:
+        case STACK_VERIFY_ROUND_ROBIN: {
+            size_t poison_num = policy->amortized_bytes / stk->elem_sz;
+            return stack_verify_data(stk, (poison_num) ? poison_num : 1, policy->mode == STACK_VERIFY_ROUND_ROBIN);
+        }
+        case STACK_VERIFY_ALWAYS:
+        default:
+            return stack_verify_data(stk, SIZE_MAX, false);
+    }
+}
+
+/*
+ * Check the data canaries and the next slice of the data of a scrubbed Stack.
+ * The Stack must be locked
+ */
+STACK_ERROR stack_scrub_step(Stack* stk) {
+    assert(stk);
+
+    if (!stk->data) {
+        return STACK_OK;
+    }
+
+    if (STACK_USES(stk, STACK_USE_DATA_CANARY) && STACK_USES(stk, STACK_SEGMENTED)) {
+        // Verifications only check the canaries of the segments around the top, the scrubber checks all of them
+        for (StackSegment const* seg = stk->segments; seg; seg = seg->next) {
+            if (!stack_segment_canaries_valid(stk, seg)) {
+                return STACK_DATA_CANARY_OVERWRITE_ERROR;
+            }
+        }
+    } else if (STACK_USES(stk, STACK_USE_DATA_CANARY) && !stack_data_canaries_valid(stk)) {
+        return STACK_DATA_CANARY_OVERWRITE_ERROR;
+    }
+
+    if (!STACK_USES(stk, STACK_USE_HASH_FULL | STACK_USE_POISON)) {
+        return STACK_OK;
+    }
+    // Check whole hash blocks, the used part against its hash and the unused part for poison
+    size_t block_sz = STACK_HASH_BLOCK * stk->elem_sz;
+    size_t block_count = (block_sz < STACK_SCRUB_SLICE) ? STACK_SCRUB_SLICE / block_sz : 1;
+    for (size_t i = 0; i < block_count; i++) {
+        if (stk->scrub_cursor >= stk->capacity) {
+            stk->scrub_cursor = 0;
+        }
+        size_t first = stk->scrub_cursor;
+        size_t end = (stk->capacity - first < STACK_HASH_BLOCK) ? stk->capacity : first + STACK_HASH_BLOCK;
+        if (STACK_USES(stk, STACK_USE_HASH_FULL) && first < stk->size) {
+            StackRun run = stack_run_near(stk, stk->scrub_segment, first);
+            stk->scrub_segment = run.segment;
+            if (!run.block_hashes) {
+                return STACK_CORRUPTION_ERROR;
+            }
+            if (!stack_block_hash_valid(stk, &run)) {
+                return STACK_DATA_HASH_ERROR;
+            }
+        }
+        if (STACK_USES(stk, STACK_USE_POISON) && end > stk->size) {
+            size_t poison_first = (first > stk->size) ? first : stk->size;
+            if (!stack_poison_valid(stk, poison_first, end - poison_first)) {
+                return STACK_POISON_OVERWRITE_ERROR;
+            }
+        }
+        // The cursor must stay at the start of a block, even if the capacity is not a whole number of blocks
+        // and the Stack grows before the next pass
+        stk->scrub_cursor = (end == stk->capacity) ? 0 : end;
+    }
+    return STACK_OK;
+}
+
+void stack_verify(Stack* stk) {
+    assert(stk);
+
+    STACK_LOG(stk, STACK_EVENT_VERIFY_BEGIN);
+    stack_count(&stk->counters.verify_count, 1);
+
+    if (!stk->data && stk->size > 0) {
+        stack_fail(stk, STACK_CORRUPTION_ERROR);
+        goto error;
+    }
+
+    if (stk->size > stk->capacity) {
+        stack_fail(stk, STACK_CORRUPTION_ERROR);
+        goto error;
+    }
+
+    if (stk->capacity < STACK_DEFAULT_CAPACITY) {
+        stack_fail(stk, STACK_CORRUPTION_ERROR);
+        goto error;
+    }
+
+    if (!stk->elem_sz) {
+        stack_fail(stk, STACK_CORRUPTION_ERROR);
+        goto error;
+    }
+
+    if (!stack_error_valid(stk->error)) {
+        stack_fail(stk, STACK_CORRUPTION_ERROR);
+        goto error;
+    }
+
+    if (STACK_USES(stk, STACK_USE_HASH_FAST) && stk->metadata_hash != stack_metadata_hash(stk)) {
+        stack_fail(stk, STACK_METADATA_HASH_ERROR);
+        goto error;
+    }
+
+    if (STACK_USES(stk, STACK_USE_HASH_FULL) && stk->data && !stk->block_hashes &&
+        !STACK_USES(stk, STACK_SEGMENTED)) {
+        stack_fail(stk, STACK_CORRUPTION_ERROR);
+        goto error;
+    }
+
+    if (STACK_USES(stk, STACK_USE_CANARY) &&
+        (stk->front_canary != CANARY_VALUE || stk->back_canary != CANARY_VALUE)) {
+        stack_fail(stk, STACK_METADATA_CANARY_OVERWRITE_ERROR);
+        goto error;
+    }
+
+    // Only the segments around the top of a segmented Stack are checked
+    if (STACK_USES(stk, STACK_USE_DATA_CANARY) && stk->top_segment) {
+        StackSegment const* next = stk->top_segment->next;
+        if (!stack_segment_canaries_valid(stk, stk->top_segment) ||
+            (next && !stack_segment_canaries_valid(stk, next))) {
+            stack_fail(stk, STACK_DATA_CANARY_OVERWRITE_ERROR);
+            goto error;
+        }
+    } else if (STACK_USES(stk, STACK_USE_DATA_CANARY) && stk->data && !stack_data_canaries_valid(stk)) {
+        stack_fail(stk, STACK_DATA_CANARY_OVERWRITE_ERROR);
+        goto error;
+    }
+
+    if (STACK_USES(stk, STACK_SCRUB)) {
+        // The scrubber checks the data instead, and leaves what it found for the next verification
+        STACK_ERROR scrub_error = atomic_load_explicit(&stk->scrub_error, memory_order_acquire);
+        if (scrub_error != STACK_OK) {
+            stack_fail(stk, scrub_error);
+            goto error;
+        }
+    } else if (STACK_USES(stk, STACK_USE_HASH_FULL | STACK_USE_POISON) && stk->data) {
+        STACK_ERROR data_error = stack_verify_scheduled_data(stk);
+        if (data_error != STACK_OK) {
+            stack_fail(stk, data_error);
+            goto error;
+        }
+    }
+
+    STACK_LOG(stk, STACK_EVENT_VERIFY_OK);
+
+    return;
+
+error:
+    STACK_LOG(stk, STACK_EVENT_VERIFY_FAIL);
+    stack_count(&stk->counters.verify_fail_count, 1);
+    if (STACK_USES(stk, STACK_USE_LOG)) {
+        stack_dump_to_file(stk);
+    }
+}
+#ifndef NDEBUG
+// Stacks with no protections are never verified
+#define STACK_VERIFY(stk)                                                         \
+    do {                                                                          \
+        if (!STACK_UNCHECKED(stk)) {                                              \
+            STACK_TIMER_START(stk, verify, verify_start_ns);                      \
+            stack_verify(stk);                                                    \
+            STACK_TIMER_STOP(stk, verify, STACK_LATENCY_VERIFY, verify_start_ns); \
+        }                                                                         \
+    } while (0)
+#define STACK_VERIFY_RETURN(stk, val)           \
+    STACK_VERIFY(stk);                          \
+    if (!stack_error_recoverable(stk->error)) { \
+        return val;                             \
+    }
+#else
+#define STACK_VERIFY(stk) \
+    do {                  \
+    } while (0)
+#define STACK_VERIFY_RETURN(stk, val) \
+    do {                              \
+    } while (0)
+#endif
+
+char const* stack_error_string(STACK_ERROR error) {
+    switch (error) {
+        case STACK_OK:
+            return "No error";
+        case STACK_ALLOCATION_ERROR:
+            return "Internal memory allocation error";
+        case STACK_OPERATION_ERROR:
+            return "Invalid stack operation was requested by user";
+
+        case STACK_METADATA_CANARY_OVERWRITE_ERROR:
+            return "One of the stack's metadata canaries have been overwritten. "
+                   "Metadata is probably corrupted";
+
+        case STACK_METADATA_HASH_ERROR:
+            return "Stack metadata hash differs from the one stored. "
+                   "Metadata is probably corrupted";
+
+        case STACK_DATA_CANARY_OVERWRITE_ERROR:
+            return "One of the stack's data canaries have been overwritten. "
+                   "Data is possibly corrupted";
+
+        case STACK_DATA_HASH_ERROR:
+            return "Stack data hash differs from the one stored. "
+                   "Data is possibly corrupted";
+
+        case STACK_POISON_OVERWRITE_ERROR:
+            return "Stack unused data memory has been overwritten. "
+                   "Data is possibly corrupted";
+
+        case STACK_CORRUPTION_ERROR:
+            return "Stack memory has been corrupted";
+        default:
+            return "Unknown error";
+    }
+}
+
+#define TO_STRING(name) #name
+
+char const* get_stack_compilation_options() {
+    return "This stack was compiled with "
+#ifdef USE_CANARY
+        TO_STRING(USE_CANARY) " "
+#endif
+#ifdef USE_DATA_CANARY
+        TO_STRING(USE_DATA_CANARY) " "
+#endif
+#ifdef USE_HASH_FAST
+        TO_STRING(USE_HASH_FAST) " "
+#endif
+#ifdef USE_HASH_FULL
+        TO_STRING(USE_HASH_FULL) " "
+#endif
+#ifdef USE_POISON
+        TO_STRING(USE_POISON) " "
+#endif
+#ifdef USE_LOG
+        TO_STRING(USE_LOG) " with binary log file " STACK_LOG_FILENAME " "
+#endif
+#ifdef USE_GUARD_PAGES
+        TO_STRING(USE_GUARD_PAGES) " "
+#endif
+#if !defined(USE_CANARY) && !defined(USE_DATA_CANARY) && !defined(USE_HASH_FAST) && !defined(USE_HASH_FULL) && !defined(USE_POISON) && !defined(USE_LOG) && !defined(USE_GUARD_PAGES)
+                           "no protections "
+#endif
+        "and " STACK_HASH_NAME;
+}
+
+void stack_update_metadata_hash(Stack* stk) {
+    assert(stk);
+
+    STACK_TIMER_START(stk, rehash, start_ns);
+    stk->metadata_hash = stack_metadata_hash(stk);
+    STACK_TIMER_STOP(stk, rehash, STACK_LATENCY_REHASH, start_ns);
+    STACK_LOG(stk, STACK_EVENT_REHASH_METADATA);
+}
+#define STACK_REHASH_METADATA(stk)                   \
+    do {                                             \
+        if (STACK_USES(stk, STACK_USE_HASH_FAST)) {  \
+            stack_update_metadata_hash(stk);         \
+        }                                            \
+    } while (0)
+
+void stack_hash_add(Stack* stk, size_t first_elem, size_t num_elem) {
+    assert(stk);
+
+    STACK_TIMER_START(stk, rehash, start_ns);
+    hash_type range_hash = 0;
+    size_t num = num_elem;
+    StackRun run = num ? stack_run(stk, first_elem) : (StackRun) {0};
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        for (size_t j = 0; j < run_num; j++) {
+            hash_type elem_hash = stack_elem_hash(stk, run.elems + j * stk->elem_sz, run.first + j);
+            *stack_run_block_hash(&run, j) += elem_hash;
+            range_hash += elem_hash;
+        }
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+    stk->data_hash += range_hash;
+    STACK_TIMER_STOP(stk, rehash, STACK_LATENCY_REHASH, start_ns);
+    STACK_LOG(stk, STACK_EVENT_HASH_ADD, num_elem);
+}
+
+void stack_hash_remove(Stack* stk, size_t first_elem, size_t num_elem) {
+    assert(stk);
+
+    STACK_TIMER_START(stk, rehash, start_ns);
+    hash_type range_hash = 0;
+    size_t num = num_elem;
+    StackRun run = num ? stack_run(stk, first_elem) : (StackRun) {0};
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        for (size_t j = 0; j < run_num; j++) {
+            hash_type elem_hash = stack_elem_hash(stk, run.elems + j * stk->elem_sz, run.first + j);
+            *stack_run_block_hash(&run, j) -= elem_hash;
+            range_hash += elem_hash;
+        }
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+    stk->data_hash -= range_hash;
+    STACK_TIMER_STOP(stk, rehash, STACK_LATENCY_REHASH, start_ns);
+    STACK_LOG(stk, STACK_EVENT_HASH_REMOVE, num_elem);
+}
+#define STACK_HASH_ADD(stk, first_elem, num_elem)            \
+    do {                                                     \
+        if (STACK_USES(stk, STACK_USE_HASH_FULL)) {          \
+            stack_hash_add(stk, first_elem, num_elem);       \
+        }                                                    \
+    } while (0)
+#define STACK_HASH_REMOVE(stk, first_elem, num_elem)         \
+    do {                                                     \
+        if (STACK_USES(stk, STACK_USE_HASH_FULL)) {          \
+            stack_hash_remove(stk, first_elem, num_elem);    \
+        }                                                    \
+    } while (0)
+
+void stack_write_poison(Stack* stk, size_t first_elem, size_t num_elem) {
+    assert(stk);
+    assert(stk->data);
+    assert(first_elem >= stk->size);
+    assert(first_elem + num_elem <= stk->capacity);
+
+    STACK_TIMER_START(stk, poison, start_ns);
+    size_t num = num_elem;
+    StackRun run = num ? stack_run(stk, first_elem) : (StackRun) {0};
+    while (num) {
+        size_t run_num = (run.num < num) ? run.num : num;
+        write_poison(run.elems, run_num * stk->elem_sz);
+        num -= run_num;
+        if (num) {
+            stack_run_next(stk, &run);
+        }
+    }
+    STACK_TIMER_STOP(stk, poison, STACK_LATENCY_POISON, start_ns);
+    STACK_LOG(stk, STACK_EVENT_WRITE_POISON, num_elem * stk->elem_sz);
+}
+#define WRITE_POISON(stk, first_elem, num_elem)               \
+    do {                                                      \
+        if (STACK_USES(stk, STACK_USE_POISON)) {              \
+            stack_write_poison(stk, first_elem, num_elem);    \
+        }                                                     \
+    } while (0)
+
+void stack_set_data_canaries(Stack* stk) {
+    assert(stk);
+    assert(stk->data);
+
+    *((canary_type*) stk->data - 1) = CANARY_VALUE;
+    char* back_p = (char*) stk->data + stk->capacity * stk->elem_sz;
+    stack_write_back_canary(back_p);
+
+    STACK_LOG(stk, STACK_EVENT_SET_DATA_CANARIES);
+}
+#define SET_DATA_CANARIES(stk)                          \
+    do {                                                \
+        if (STACK_USES(stk, STACK_USE_DATA_CANARY)) {   \
+            stack_set_data_canaries(stk);               \
+        }                                               \
+    } while (0)
+
+/*
+ * Add or free segments at the end of a segmented Stack, so that its capacity becomes new_capacity.
+ * New segments come with their data canaries and poison already in place
+ */
+void stack_segments_resize(Stack* stk, size_t new_capacity) {
+    assert(stk);
+    assert(new_capacity % stk->segment_capacity == 0);
+
+    StackSegment* last = stk->top_segment;
+    while (last && last->next) {
+        last = last->next;
+    }
+
+    while (stk->capacity < new_capacity) {
+        StackSegment* seg = stk->allocator.allocate(stk->allocator.data, stack_segment_alloc_size(stk));
+        if (!seg) {
+            stack_fail(stk, STACK_ALLOCATION_ERROR);
+            return;
+        }
+        seg->prev = last;
+        seg->next = NULL;
+        seg->first = stk->capacity;
+        seg->block_hashes = NULL;
+        if (STACK_USES(stk, STACK_USE_HASH_FULL)) {
+            seg->block_hashes = (hash_type*) (seg + 1);
+            memset(seg->block_hashes, 0, stack_segment_block_hashes_size(stk));
+        }
+
+        char* elems = stack_segment_elems(stk, seg);
+        if (STACK_USES(stk, STACK_USE_DATA_CANARY)) {
+            *((canary_type*) elems - 1) = CANARY_VALUE;
+            stack_write_back_canary(elems + stk->segment_capacity * stk->elem_sz);
+        }
+        if (STACK_USES(stk, STACK_USE_POISON)) {
+            write_poison(elems, stk->segment_capacity * stk->elem_sz);
+        }
+
+        if (last) {
+            last->next = seg;
+        } else {
+            stk->segments = seg;
+            stk->top_segment = seg;
+            stk->data = elems;
+        }
+        last = seg;
+        stk->capacity += stk->segment_capacity;
+    }
+
+    // Segments past the new capacity hold no elements, so freeing them loses nothing
+    while (stk->capacity > new_capacity) {
+        StackSegment* prev = last->prev;
+        if (stk->top_segment == last) {
+            stk->top_segment = prev;
+        }
+        stk->allocator.free(stk->allocator.data, last, stack_segment_alloc_size(stk));
+        prev->next = NULL;
+        last = prev;
+        stk->capacity -= stk->segment_capacity;
+        stk->hash_segment = NULL;
+        stk->scrub_segment = NULL;
+    }
+}
+
+/*
+ * Resize the buffer of a contiguous Stack that isn't mapped, or allocate it if old_data is NULL,
+ * moving it when its new capacity is kept somewhere else: in the embedded storage, the allocator or a huge page mapping.
+ * Return NULL and leave old_data as it is if the buffer can't be resized
+ */
+void* stack_buffer_resize(Stack* stk, void* old_data, size_t new_capacity, bool* copied) {
+    assert(stk);
+    assert(copied);
+
+    STACK_BUFFER new_kind = stack_buffer_kind(stk, new_capacity);
+    size_t new_data_size = stack_data_size(stk, new_capacity);
+    if (!old_data) {
+        return stack_buffer_allocate(stk, new_kind, new_data_size);
+    }
+    STACK_BUFFER old_kind = stack_buffer_kind(stk, stk->capacity);
+    size_t old_data_size = stack_data_size(stk, stk->capacity);
+    if (old_kind == new_kind) {
+        switch (new_kind) {
+            case STACK_BUFFER_EMBEDDED:
+                return old_data;
+            case STACK_BUFFER_HUGE:
+                return stack_huge_remap(old_data, old_data_size, new_data_size, copied);
+            case STACK_BUFFER_ALLOCATED:
+            default:
+                return stk->allocator.reallocate(stk->allocator.data, old_data, old_data_size, new_data_size);
+        }
+    }
+    void* new_data = stack_buffer_allocate(stk, new_kind, new_data_size);
+    if (new_data) {
+        memcpy(new_data, old_data, (new_data_size < old_data_size) ? new_data_size : old_data_size);
+        stack_buffer_free(stk, old_kind, old_data, old_data_size);
+        *copied = true;
+    }
+    return new_data;
+}
+
+void stack_unsafe_resize(Stack* stk, size_t new_capacity) {
+    assert(stk);
+
+    STACK_LOG(stk, STACK_EVENT_RESIZE_BEGIN, new_capacity, stk->capacity);
+    if (STACK_USES(stk, STACK_SEGMENTED)) {
+        stack_segments_resize(stk, new_capacity);
+        return;
+    }
+    // Grow the block hashes first, so that a failure leaves the Stack untouched
+    bool use_block_hashes = STACK_USES(stk, STACK_USE_HASH_FULL);
+    size_t old_block_count = stk->block_hash_capacity;
+    size_t new_block_count = stack_hash_block_count(new_capacity);
+    size_t hash_sz = sizeof(*stk->block_hashes);
+    if (use_block_hashes && new_block_count > old_block_count) {
+        hash_type* new_block_hashes = stk->allocator.reallocate(stk->allocator.data, stk->block_hashes,
+                                                                old_block_count * hash_sz, new_block_count * hash_sz);
+        if (!new_block_hashes) {
+            stack_fail(stk, STACK_ALLOCATION_ERROR);
+            return;
+        }
+        memset(new_block_hashes + old_block_count, 0, (new_block_count - old_block_count) * hash_sz);
+        stk->block_hashes = new_block_hashes;
+        stk->block_hash_capacity = new_block_count;
+    }
+
+    size_t canary_size = stack_data_canary_size(stk);
+    // Check for unallocated stack
+    void* old_data = (stk->data) ? ((char*) stk->data - canary_size) : NULL;
+
+    void* new_data = NULL;
+    bool copied = true;
+    if (STACK_USES(stk, STACK_GUARD_PAGES)) {
+        assert(new_capacity == stack_paged_capacity(stk, new_capacity));
+        size_t old_data_size = (old_data) ? stack_paged_size(stk, stk->capacity) : 0;
+        new_data = stack_guarded_remap(old_data, old_data_size, stack_paged_size(stk, new_capacity), &copied);
+    } else if (STACK_USES(stk, STACK_MAPPED)) {
+        assert(new_capacity == stack_paged_capacity(stk, new_capacity));
+        // Resizing the mapping never copies, the elements stay in the file
+        copied = false;
+        size_t header_size = stack_page_size();
+        size_t old_data_size = (old_data) ? header_size + stack_paged_size(stk, stk->capacity) : 0;
+        char* mapping = stack_file_remap(stk->map_fd, stk->map_header, old_data_size,
+                                         header_size + stack_paged_size(stk, new_capacity));
+        if (mapping) {
+            stk->map_header = (StackMappedHeader*) mapping;
+            new_data = mapping + header_size;
+        }
+    } else {
+        new_data = stack_buffer_resize(stk, old_data, new_capacity, &copied);
+    }
+    if (!new_data) {
+        stack_fail(stk, STACK_ALLOCATION_ERROR);
+        return;
+    }
+    if (old_data && new_data != old_data && copied) {
+        size_t copied_capacity = (new_capacity < stk->capacity) ? new_capacity : stk->capacity;
+        stack_count(&stk->counters.bytes_copied, copied_capacity * stk->elem_sz);
+    }
+    stk->capacity = new_capacity;
+
+    stk->data = (char*) new_data + canary_size;
+    // The file has been resized, so the header must say so even if the operation doesn't finish
+    if (STACK_USES(stk, STACK_MAPPED)) {
+        stack_mapped_write_header(stk);
+    }
+
+    // Blocks past the new capacity hold no elements, so dropping them loses nothing
+    if (use_block_hashes && new_block_count < stk->block_hash_capacity) {
+        hash_type* new_block_hashes = stk->allocator.reallocate(stk->allocator.data, stk->block_hashes,
+                                                                stk->block_hash_capacity * hash_sz,
+                                                                new_block_count * hash_sz);
+        if (new_block_hashes) {
+            stk->block_hashes = new_block_hashes;
+            stk->block_hash_capacity = new_block_count;
+        }
+    }
+}
+
+void stack_resize(Stack* stk, size_t new_capacity) {
+    assert(stk);
+    assert(new_capacity && new_capacity >= stk->size);
+
+    size_t old_capacity = stk->capacity;
+    stack_unsafe_resize(stk, new_capacity);
+    // If resizing fails and new capacity if greater than current capacity + 1,
+    // try to add only one extra element.
+    // Segmented Stacks can not grow by less than one segment, and Stacks with paged storage by less than one page
+    if (stk->error == STACK_ALLOCATION_ERROR && new_capacity > stk->capacity + 1 &&
+        !STACK_USES(stk, STACK_SEGMENTED | STACK_PAGED_STORAGE)) {
+        new_capacity = stk->capacity + 1;
+        stack_unsafe_resize(stk, new_capacity);
+    }
+    if (stk->error == STACK_ALLOCATION_ERROR) {
+        return;
+    }
+    if (stk->capacity > old_capacity) {
+        stack_count(&stk->counters.grow_count, 1);
+    } else {
+        stack_count(&stk->counters.shrink_count, 1);
+    }
+    // New segments are set up when they are created
+    if (!STACK_USES(stk, STACK_SEGMENTED)) {
+        WRITE_POISON(stk, stk->size, stk->capacity - stk->size);
+        SET_DATA_CANARIES(stk);
+    }
+    STACK_LOG(stk, STACK_EVENT_RESIZE_DONE, stk->capacity);
+}
+
+/*
+ * Write a mapped Stack's file back to disk
+ */
+bool stack_mapped_sync(Stack* stk) {
+    assert(stk);
+    assert(stk->map_header);
+
+    stk->sync_ops = 0;
+    if (msync(stk->map_header, stack_mapped_size(stk), MS_SYNC)) {
+        STACK_LOG(stk, STACK_EVENT_SYNC_FAIL);
+        return false;
+    }
+    STACK_LOG(stk, STACK_EVENT_SYNC, stack_mapped_size(stk));
+    return true;
+}
+
+/*
+ * Update the header of a mapped Stack after an operation, and write the file back if the sync policy says so
+ */
+void stack_mapped_update(Stack* stk) {
+    assert(stk);
+
+    // Don't persist a Stack that has been found corrupted
+    if (!stk->map_header || !stack_error_recoverable(stk->error)) {
+        return;
+    }
+    stack_mapped_write_header(stk);
+    if (stk->sync_mode == STACK_SYNC_ALWAYS ||
+        (stk->sync_mode == STACK_SYNC_EVERY_NTH && ++stk->sync_ops >= stk->sync_period)) {
+        if (!stack_mapped_sync(stk)) {
+            stack_fail(stk, STACK_ALLOCATION_ERROR);
+        }
+    }
+}
+#define STACK_MAPPED_UPDATE(stk)                    \
+    do {                                            \
+        if (STACK_USES(stk, STACK_MAPPED)) {        \
+            stack_mapped_update(stk);               \
+        }                                           \
+    } while (0)
+
+bool stack_mapped_header_valid(Stack const* stk, StackMappedHeader const* header, size_t file_size) {
+    assert(stk);
+    assert(header);
+
+    if (header->magic != STACK_MAPPED_MAGIC || header->version != STACK_MAPPED_VERSION ||
+        header->front_canary != CANARY_VALUE || header->back_canary != CANARY_VALUE ||
+        header->header_hash != stack_mapped_header_hash(header)) {
+        return false;
+    }
+    if (header->flags != stk->flags || header->elem_sz != stk->elem_sz || header->size > header->capacity ||
+        header->capacity < STACK_DEFAULT_CAPACITY || header->capacity != stack_paged_capacity(stk, header->capacity)) {
+        return false;
+    }
+    // A resize that was cut short may leave the file larger, but never smaller
+    return file_size >= stack_page_size() + stack_paged_size(stk, header->capacity);
+}
+
+/*
+ * Map the file of a mapped Stack if it already holds a Stack, and check its header, data hash and poison
+ */
+void stack_mapped_restore(Stack* stk) {
+    assert(stk);
+
+    struct stat file_stat;
+    if (fstat(stk->map_fd, &file_stat)) {
+        stack_fail(stk, STACK_ALLOCATION_ERROR);
+        return;
+    }
+    if (!file_stat.st_size) {
+        return;
+    }
+
+    StackMappedHeader header;
+    if (pread(stk->map_fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        !stack_mapped_header_valid(stk, &header, (size_t) file_stat.st_size)) {
+        stack_fail(stk, STACK_CORRUPTION_ERROR);
+        return;
+    }
+    size_t mapped_size = stack_page_size() + stack_paged_size(stk, header.capacity);
+    char* mapping = stack_file_remap(stk->map_fd, NULL, (size_t) file_stat.st_size, mapped_size);
+    if (!mapping) {
+        stack_fail(stk, STACK_ALLOCATION_ERROR);
+        return;
+    }
+    stk->map_header = (StackMappedHeader*) mapping;
+    stk->data = mapping + stack_page_size();
+    stk->capacity = header.capacity;
+    stk->size = header.size;
+
+    // Block hashes are not stored, rebuilding them checks the whole data hash
+    if (STACK_USES(stk, STACK_USE_HASH_FULL)) {
+        size_t block_count = stack_hash_block_count(stk->capacity);
+        stk->block_hashes = stk->allocator.allocate(stk->allocator.data, block_count * sizeof(*stk->block_hashes));
+        if (!stk->block_hashes) {
+            stack_fail(stk, STACK_ALLOCATION_ERROR);
+            return;
+        }
+        memset(stk->block_hashes, 0, block_count * sizeof(*stk->block_hashes));
+        stk->block_hash_capacity = block_count;
+        stack_hash_add(stk, 0, stk->size);
+        if (stk->data_hash != header.data_hash) {
+            stack_fail(stk, STACK_DATA_HASH_ERROR);
+            return;
+        }
+    }
+    if (STACK_USES(stk, STACK_USE_POISON) && !stack_poison_valid(stk, stk->size, stk->capacity - stk->size)) {
+        stack_fail(stk, STACK_POISON_OVERWRITE_ERROR);
+    }
+}
+
+static const double STACK_GROW_FACTOR = 2.0;
+static const double STACK_SHRINK_FACTOR = 2.0 / 3.0;
+static const double STACK_SHRINK_THRESHOLD = 0.5;
+enum {
+    STACK_SHRINK_DELAY = 16,
+    STACK_IDLE_SHRINK_DELAY = 1024,
+};
+
+StackResizePolicy stack_resize_policy(STACK_RESIZE_POLICY kind) {
+    StackResizePolicy policy = {
+        .kind = kind,
+        .grow_factor = STACK_GROW_FACTOR,
+        .shrink_factor = STACK_SHRINK_FACTOR,
+        .shrink_threshold = STACK_SHRINK_THRESHOLD,
+        .shrink_delay = STACK_SHRINK_DELAY,
+        .callback = NULL,
+        .callback_data = NULL,
+    };
+    if (kind == STACK_RESIZE_IDLE_SHRINK) {
+        policy.shrink_delay = STACK_IDLE_SHRINK_DELAY;
+    }
+    return policy;
+}
+
+bool stack_resize_policy_valid(StackResizePolicy const* policy) {
+    assert(policy);
+
+    switch (policy->kind) {
+        case STACK_RESIZE_GEOMETRIC:
+        case STACK_RESIZE_NEVER_SHRINK:
+        case STACK_RESIZE_IDLE_SHRINK:
+            // A shrunk Stack must have room to spare, or it would grow back on the next push
+            return policy->grow_factor > 1.0 &&
+                   policy->shrink_factor > 0.0 && policy->shrink_factor < 1.0 &&
+                   policy->shrink_threshold >= 0.0 && policy->shrink_threshold < policy->shrink_factor;
+        case STACK_RESIZE_CUSTOM:
+            return policy->callback;
+        default:
+            return false;
+    }
+}
+
+StackVerifyPolicy stack_verify_policy(STACK_VERIFY_MODE mode) {
+    StackVerifyPolicy policy = {
+        .mode = mode,
+        .period = STACK_VERIFY_PERIOD,
+        .time_budget = STACK_VERIFY_DEFAULT_BUDGET,
+        .amortized_bytes = STACK_VERIFY_AMORTIZED_BYTES,
+    };
+    return policy;
+}
+
+bool stack_verify_policy_valid(StackVerifyPolicy const* policy) {
+    assert(policy);
+
+    switch (policy->mode) {
+        case STACK_VERIFY_ALWAYS:
+            return true;
+        case STACK_VERIFY_EVERY_NTH:
+            return policy->period >= 1;
+        case STACK_VERIFY_TIME_BUDGET:
+            return policy->time_budget > 0.0 && policy->time_budget <= 1.0;
+        case STACK_VERIFY_AMORTIZED:
+        case STACK_VERIFY_ROUND_ROBIN:
+            return policy->amortized_bytes >= 1;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Start a Stack's verification schedule over
+ */
+void stack_reset_verify_schedule(Stack* stk) {
+    assert(stk);
+
+    stk->verify_ops = 0;
+    stk->verify_credit_ns = 0.0;
+    stk->verify_time_ns = (stk->verify_policy.mode == STACK_VERIFY_TIME_BUDGET) ? stack_time_ns() : 0;
+    stk->poison_cursor = 0;
+}
+
+/*
+ * Capacity a segmented Stack needs to hold size elements
+ */
+size_t stack_segments_needed_capacity(Stack const* stk, size_t size) {
+    assert(stk);
+
+    size_t segment_capacity = stk->segment_capacity;
+    size_t needed = (size > stk->min_capacity) ? size : stk->min_capacity;
+    return (needed + segment_capacity - 1) / segment_capacity * segment_capacity;
+}
+
+/*
+ * Capacity a Stack must grow to, so that it can hold new_size elements.
+ * Segmented Stacks grow only by as many segments as they need
+ */
+size_t stack_grown_capacity(Stack const* stk, size_t new_size) {
+    assert(stk);
+
+    if (STACK_USES(stk, STACK_SEGMENTED)) {
+        size_t needed = stack_segments_needed_capacity(stk, new_size);
+        return (needed > stk->capacity) ? needed : stk->capacity;
+    }
+
+    size_t capacity = (stk->capacity < stk->min_capacity) ? stk->min_capacity : stk->capacity;
+    while (new_size > capacity) {
+        size_t grown_capacity = capacity * stk->resize_policy.grow_factor;
+        capacity = (grown_capacity > capacity) ? grown_capacity : capacity + 1;
+    }
+    return STACK_USES(stk, STACK_PAGED_STORAGE) ? stack_paged_capacity(stk, capacity) : capacity;
+}
+
+/*
+ * Capacity a Stack may shrink to, so that it still fits size elements with room to spare.
+ * Segmented Stacks keep one spare segment, which is only freed once two segments are unused,
+ * so that pushes and pops around a segment boundary do not allocate and free a segment each time
+ */
+size_t stack_shrunk_capacity(Stack const* stk, size_t size) {
+    assert(stk);
+
+    if (STACK_USES(stk, STACK_SEGMENTED)) {
+        size_t needed = stack_segments_needed_capacity(stk, size);
+        if (stk->capacity >= needed + 2 * stk->segment_capacity) {
+            return needed + stk->segment_capacity;
+        }
+        return stk->capacity;
+    }
+
+    size_t capacity = stk->capacity;
+    StackResizePolicy const* policy = &stk->resize_policy;
+    // Shrink only if new capacity will be greater than or equal to the minimum capacity
+    while (size <= capacity * policy->shrink_threshold &&
+           (size_t) (capacity * policy->shrink_factor) >= stk->min_capacity) {
+        capacity *= policy->shrink_factor;
+    }
+    // Rounding up to whole pages may leave the Stack as it is
+    return STACK_USES(stk, STACK_PAGED_STORAGE) ? stack_paged_capacity(stk, capacity) : capacity;
+}
+
+size_t stack_custom_capacity(Stack const* stk, size_t new_size) {
+    assert(stk);
+
+    StackResizePolicy const* policy = &stk->resize_policy;
+    size_t capacity = policy->callback(policy->callback_data, stk->capacity, new_size, stk->min_capacity);
+    if (capacity < new_size) {
+        capacity = new_size;
+    }
+    if (capacity < stk->min_capacity) {
+        capacity = stk->min_capacity;
+    }
+    if (STACK_USES(stk, STACK_SEGMENTED)) {
+        capacity = stack_segments_needed_capacity(stk, capacity);
+    } else if (STACK_USES(stk, STACK_PAGED_STORAGE)) {
+        capacity = stack_paged_capacity(stk, capacity);
+    }
+    return capacity;
+}
+
+/*
+ * Let the inline functions of stack_generic.h push and pop without calling into StackLib
+ * for as long as stack_adjust would leave the Stack as it is.
+ * This is only possible for Stacks with no protections, which are contiguous, whose last operation succeeded,
+ * and with resize policies that don't count operations while the Stack is not about to shrink
+ */
+void stack_update_inline_limits(Stack* stk, size_t size) {
+    assert(stk);
+
+    stk->inline_max = 0;
+    stk->inline_min = SIZE_MAX;
+    StackResizePolicy const* policy = &stk->resize_policy;
+    if (!STACK_UNCHECKED(stk) || stk->error != STACK_OK || stk->idle_ops ||
+        stk->capacity < stk->min_capacity || (policy->kind != STACK_RESIZE_GEOMETRIC && policy->kind != STACK_RESIZE_NEVER_SHRINK)) {
+        return;
+    }
+
+    // Sizes the Stack could shrink at count towards the shrink delay, so they must go through stack_adjust
+    size_t inline_min = 0;
+    if (policy->kind == STACK_RESIZE_GEOMETRIC &&
+        (size_t) (stk->capacity * policy->shrink_factor) >= stk->min_capacity) {
+        inline_min = (size_t) (stk->capacity * policy->shrink_threshold) + 1;
+    }
+    if (size < inline_min) {
+        return;
+    }
+    assert(policy->kind != STACK_RESIZE_GEOMETRIC || stack_shrunk_capacity(stk, inline_min) == stk->capacity);
+
+    stk->inline_max = stk->capacity;
+    stk->inline_min = inline_min;
+}
+
+/*
+ * Resize a Stack so that it can hold new_size elements.
+ * This is called by every operation that changes the Stack's size,
+ * so it also counts the operations that shrinking is delayed by
+ */
+void stack_adjust(Stack* stk, size_t new_size) {
+    assert(stk);
+
+    StackResizePolicy const* policy = &stk->resize_policy;
+    size_t new_capacity = stk->capacity;
+    if (policy->kind == STACK_RESIZE_CUSTOM) {
+        new_capacity = stack_custom_capacity(stk, new_size);
+    } else if (new_size > stk->capacity || stk->capacity < stk->min_capacity) {
+        new_capacity = stack_grown_capacity(stk, new_size);
+    } else if (policy->kind == STACK_RESIZE_GEOMETRIC) {
+        size_t shrunk_capacity = stack_shrunk_capacity(stk, new_size);
+        if (shrunk_capacity == stk->capacity) {
+            stk->idle_ops = 0;
+        } else if (++stk->idle_ops > policy->shrink_delay) {
+            new_capacity = shrunk_capacity;
+        }
+    } else if (policy->kind == STACK_RESIZE_IDLE_SHRINK) {
+        if (new_size > stk->peak_size) {
+            stk->peak_size = new_size;
+        }
+        if (++stk->idle_ops > policy->shrink_delay) {
+            new_capacity = stack_shrunk_capacity(stk, stk->peak_size);
+            stk->idle_ops = 0;
+            stk->peak_size = new_size;
+        }
+    }
+
+    // Elements poped while there are marks are likely to be pushed again
+    if (stk->mark_count && new_capacity < stk->capacity) {
+        new_capacity = stk->capacity;
+    }
+    if (new_capacity != stk->capacity) {
+        STACK_TIMER_START(stk, resize, start_ns);
+        stack_resize(stk, new_capacity);
+        STACK_TIMER_STOP(stk, resize, STACK_LATENCY_RESIZE, start_ns);
+        stk->idle_ops = 0;
+    }
+    stack_update_inline_limits(stk, new_size);
+}
+
+/*
+ * Free a Stack's storage and the Stack itself
+ */
+void stack_free_storage(Stack* stk) {
+    assert(stk);
+
+    // Free in the reverse order of allocation, so that an arena can reuse the memory
+    StackAllocator allocator = stk->allocator;
+    allocator.free(allocator.data, stk->marks, stk->mark_capacity * sizeof(*stk->marks));
+    allocator.free(allocator.data, stk->block_hashes, stk->block_hash_capacity * sizeof(*stk->block_hashes));
+    StackSegment* last = stk->segments;
+    while (last && last->next) {
+        last = last->next;
+    }
+    while (last) {
+        StackSegment* prev = last->prev;
+        allocator.free(allocator.data, last, stack_segment_alloc_size(stk));
+        last = prev;
+    }
+    if (STACK_USES(stk, STACK_GUARD_PAGES)) {
+        stack_guarded_unmap(stk->data, stack_paged_size(stk, stk->capacity));
+    } else if (STACK_USES(stk, STACK_MAPPED)) {
+        if (stk->map_header) {
+            if (stk->sync_mode != STACK_SYNC_NEVER && stack_error_recoverable(stk->error)) {
+                stack_mapped_sync(stk);
+            }
+            munmap(stk->map_header, stack_mapped_size(stk));
+        }
+        close(stk->map_fd);
+    } else if (stk->data && !STACK_USES(stk, STACK_SEGMENTED)) {
+        stack_buffer_free(stk, stack_buffer_kind(stk, stk->capacity), (char*) stk->data - stack_data_canary_size(stk),
+                          stack_data_size(stk, stk->capacity));
+    }
+    allocator.free(allocator.data, stk->histograms, (stk->histograms) ? STACK_LATENCY_KINDS * sizeof(*stk->histograms) : 0);
+    allocator.free(allocator.data, stack_header_start(stk), stack_header_size(stk));
+}
+
+typedef struct stack_cache_t {
+    // Lists of cached Stacks of each capacity class, linked through their registry links
+    Stack* classes[STACK_CACHE_CLASSES];
+    size_t stack_count;
+    size_t bytes;
+} StackCache;
+
+static atomic_size_t stack_cache_max_stacks = STACK_CACHE_MAX_STACKS;
+static atomic_size_t stack_cache_max_bytes = STACK_CACHE_MAX_BYTES;
+
+static pthread_once_t stack_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stack_cache_key;
+static _Thread_local StackCache* stack_thread_cache = NULL;
+
+void stack_cache_free(StackCache* cache) {
+    assert(cache);
+
+    for (size_t i = 0; i < STACK_CACHE_CLASSES; i++) {
+        while (cache->classes[i]) {
+            Stack* stk = cache->classes[i];
+            cache->classes[i] = stk->registry_next;
+            stack_free_storage(stk);
+        }
+    }
+    cache->stack_count = 0;
+    cache->bytes = 0;
+}
+
+void stack_cache_destroy(void* cache) {
+    stack_cache_free(cache);
+    free(cache);
+}
+
+void stack_cache_initialize() {
+    // Exiting threads free their caches. The main thread's cache is freed by stack_cache_drain at exit
+    pthread_key_create(&stack_cache_key, stack_cache_destroy);
+    atexit(stack_cache_drain);
+}
+
+StackCache* stack_get_thread_cache() {
+    if (!stack_thread_cache) {
+        pthread_once(&stack_cache_once, stack_cache_initialize);
+        stack_thread_cache = calloc(1, sizeof(*stack_thread_cache));
+        if (stack_thread_cache) {
+            pthread_setspecific(stack_cache_key, stack_thread_cache);
+        }
+    }
+    return stack_thread_cache;
+}
+
+size_t stack_cache_class(size_t capacity) {
+    size_t cache_class = 0;
+    for (capacity /= STACK_DEFAULT_CAPACITY; capacity > 1 && cache_class < STACK_CACHE_CLASSES - 1; capacity >>= 1) {
+        cache_class++;
+    }
+    return cache_class;
+}
+
+size_t stack_cache_size(Stack const* stk) {
+    assert(stk);
+
+    // Embedded elements are part of the header's allocation
+    size_t data_size = (stk->capacity > stk->embedded_capacity) ? stack_data_size(stk, stk->capacity) : 0;
+    return stack_header_size(stk) + data_size + stk->block_hash_capacity * sizeof(*stk->block_hashes);
+}
+
+bool stack_cacheable(Stack const* stk) {
+    assert(stk);
+
+    // Segments, mapped files and histograms are not worth keeping, and other allocators manage their own memory
+    return stk->data && !STACK_USES(stk, STACK_SEGMENTED | STACK_MAPPED | STACK_TIMED) &&
+           stk->allocator.allocate == stack_malloc_allocator.allocate && stk->allocator.data == stack_malloc_allocator.data;
+}
+
+/*
+ * Check that a Stack about to be freed is intact, so that its storage may be cached.
+ * The data is checked in full whatever the Stack's verification policy, and even when assertions are off,
+ * since the cache reuses the storage without setting it up again.
+ * Called before the Stack is unregistered, so that the verification is counted in its stats
+ */
+bool stack_cache_check(Stack* stk) {
+    assert(stk);
+
+    // Don't pay for the checks if the cache can't take the Stack anyway
+    size_t max_stacks = atomic_load_explicit(&stack_cache_max_stacks, memory_order_relaxed);
+    if (!stack_cacheable(stk) || !max_stacks || (stack_thread_cache && stack_thread_cache->stack_count >= max_stacks)) {
+        return false;
+    }
+    STACK_SCRUB_LOCK(stk);
+    stack_verify(stk);
+    // A policy that checks every operation has just checked the data
+    if (stk->error == STACK_OK && STACK_USES(stk, STACK_USE_HASH_FULL | STACK_USE_POISON) &&
+        (stk->verify_policy.mode != STACK_VERIFY_ALWAYS || STACK_USES(stk, STACK_SCRUB))) {
+        STACK_ERROR data_error = stack_verify_data(stk, SIZE_MAX, false);
+        if (data_error != STACK_OK) {
+            stack_fail(stk, data_error);
+        }
+    }
+    STACK_SCRUB_UNLOCK(stk);
+    return stk->error == STACK_OK;
+}
+
+/*
+ * Keep a freed Stack's storage in the calling thread's cache, returning false if it can't be kept.
+ * The Stack must have passed stack_cache_check.
+ * The Stack is emptied, so that its storage is in the state a new Stack's is
+ */
+bool stack_cache_put(Stack* stk) {
+    assert(stk);
+    assert(stk->size <= stk->capacity);
+
+    size_t bytes = stack_cache_size(stk);
+    StackCache* cache = stack_thread_cache;
+    if (!cache) {
+        if (!atomic_load_explicit(&stack_cache_max_stacks, memory_order_relaxed)) {
+            return false;
+        }
+        cache = stack_get_thread_cache();
+        if (!cache) {
+            return false;
+        }
+    }
+    if (cache->stack_count >= atomic_load_explicit(&stack_cache_max_stacks, memory_order_relaxed) ||
+        cache->bytes + bytes > atomic_load_explicit(&stack_cache_max_bytes, memory_order_relaxed)) {
+        return false;
+    }
+    // Outstanding marks are not kept, a reused Stack makes room for its own
+    stk->allocator.free(stk->allocator.data, stk->marks, stk->mark_capacity * sizeof(*stk->marks));
+    stk->marks = NULL;
+    stk->mark_capacity = 0;
+    // The unused elements are still poisoned
+    size_t size = stk->size;
+    stk->size = 0;
+    WRITE_POISON(stk, 0, size);
+    if (STACK_USES(stk, STACK_USE_HASH_FULL)) {
+        memset(stk->block_hashes, 0, stk->block_hash_capacity * sizeof(*stk->block_hashes));
+    }
+
+    size_t cache_class = stack_cache_class(stk->capacity);
+    stk->registry_next = cache->classes[cache_class];
+    cache->classes[cache_class] = stk;
+    cache->stack_count++;
+    cache->bytes += bytes;
+    return true;
+}
+
+/*
+ * Take the cached Stack with the smallest capacity whose storage suits elem_sz, flags and embedded_capacity,
+ * with everything but its storage cleared, or return NULL
+ */
+Stack* stack_cache_take(size_t elem_sz, unsigned flags, size_t embedded_capacity) {
+    StackCache* cache = stack_thread_cache;
+    if (!cache || !cache->stack_count) {
+        return NULL;
+    }
+    for (size_t i = 0; i < STACK_CACHE_CLASSES; i++) {
+        for (Stack** link = &cache->classes[i]; *link; link = &(*link)->registry_next) {
+            Stack* stk = *link;
+            // Flags decide where the canaries, poison and block hashes are
+            if (stk->elem_sz != elem_sz || stk->flags != flags || stk->embedded_capacity != embedded_capacity) {
+                continue;
+            }
+            *link = stk->registry_next;
+            cache->stack_count--;
+            cache->bytes -= stack_cache_size(stk);
+
+            void* data = stk->data;
+            size_t capacity = stk->capacity;
+            hash_type* block_hashes = stk->block_hashes;
+            size_t block_hash_capacity = stk->block_hash_capacity;
+            memset(stk, 0, sizeof(*stk));
+            stk->data = data;
+            stk->capacity = capacity;
+            stk->block_hashes = block_hashes;
+            stk->block_hash_capacity = block_hash_capacity;
+            stk->embedded_capacity = embedded_capacity;
+            return stk;
+        }
+    }
+    return NULL;
+}
+
+void stack_cache_set_limits(size_t max_stacks, size_t max_bytes) {
+    atomic_store_explicit(&stack_cache_max_stacks, max_stacks, memory_order_relaxed);
+    atomic_store_explicit(&stack_cache_max_bytes, max_bytes, memory_order_relaxed);
+}
+
+void stack_cache_drain() {
+    if (stack_thread_cache) {
+        stack_cache_free(stack_thread_cache);
+    }
+}
+
+Stack* stack_allocate(size_t stk_elem_sz) {
+    return stack_allocate_ex(stk_elem_sz, STACK_DEFAULT_FLAGS);
+}
+
+Stack* stack_allocate_ex(size_t stk_elem_sz, unsigned flags) {
+    return stack_allocate_in(NULL, stk_elem_sz, flags);
+}
+
+/*
+ * Allocate a Stack, which is mapped from map_fd if flags include STACK_MAPPED,
+ * and keeps up to embedded_capacity elements in the same allocation as its header
+ */
+Stack* stack_allocate_storage(StackAllocator const* allocator, size_t stk_elem_sz, unsigned flags,
+                              size_t embedded_capacity, int map_fd) {
+    assert(stk_elem_sz);
+    assert(!(flags & ~STACK_KNOWN_FLAGS));
+
+    if (!allocator) {
+        allocator = &stack_malloc_allocator;
+    }
+    // Data hashing relies on metadata hashing to protect the data hash
+    if (flags & STACK_USE_HASH_FULL) {
+        flags |= STACK_USE_HASH_FAST;
+    }
+    // Segments are allocated one by one, so they can't share guard pages
+    assert(!(flags & STACK_SEGMENTED) || !(flags & STACK_GUARD_PAGES));
+    if (flags & STACK_SEGMENTED) {
+        flags &= ~STACK_GUARD_PAGES;
+    }
+    // Guard pages catch the overflows that data canaries would only detect on the next verification
+    if (flags & STACK_GUARD_PAGES) {
+        flags &= ~STACK_USE_DATA_CANARY;
+    }
+    // The layout of a mapped Stack's file has no room for any of these
+    if (flags & STACK_MAPPED) {
+        flags &= ~(STACK_USE_DATA_CANARY | STACK_GUARD_PAGES | STACK_SEGMENTED);
+    }
+    // Huge pages only back contiguous buffers that aren't mapped already
+    if (flags & (STACK_SEGMENTED | STACK_GUARD_PAGES | STACK_MAPPED)) {
+        flags &= ~STACK_HUGE_PAGES;
+    }
+    flags &= STACK_KNOWN_FLAGS;
+
+    // Small Stacks keep their elements right before the header, in the same allocation
+    embedded_capacity = stack_embedded_capacity(stk_elem_sz, flags, embedded_capacity);
+    // A Stack freed by this thread may be reused as it is, its storage is already poisoned and has its canaries
+    Stack* stk = (allocator == &stack_malloc_allocator) ? stack_cache_take(stk_elem_sz, flags, embedded_capacity) : NULL;
+    if (!stk && embedded_capacity <= (SIZE_MAX / 2 - sizeof(*stk)) / stk_elem_sz) {
+        size_t embedded_size = stack_embedded_size(stk_elem_sz, flags, embedded_capacity);
+        char* storage = allocator->allocate(allocator->data, embedded_size + sizeof(*stk));
+        if (storage) {
+            stk = (Stack*) (storage + embedded_size);
+            memset(stk, 0, sizeof(*stk));
+            stk->embedded_capacity = embedded_capacity;
+        }
+    }
+    if (!stk) {
+        if (map_fd >= 0) {
+            close(map_fd);
+        }
+        return NULL;
+    }
+    stk->allocator = *allocator;
+    stk->flags = flags;
+    if (STACK_USES(stk, STACK_USE_LOG)) {
+        stack_log_open();
+    }
+    STACK_LOG(stk, STACK_EVENT_ALLOCATE_BEGIN, stack_global_count);
+    stack_global_count++;
+    if (STACK_USES(stk, STACK_USE_CANARY)) {
+        stk->front_canary = CANARY_VALUE;
+        stk->back_canary = CANARY_VALUE;
+    }
+    stk->error = STACK_OK;
+    stk->elem_sz = stk_elem_sz;
+    stk->size = 0;
+    stk->min_capacity = STACK_DEFAULT_CAPACITY;
+    stk->resize_policy = stack_resize_policy(STACK_RESIZE_GEOMETRIC);
+    stk->verify_policy = stack_get_default_verify_policy();
+    stack_reset_verify_schedule(stk);
+    stk->map_fd = map_fd;
+    stk->sync_mode = STACK_SYNC_NEVER;
+    stk->sync_period = STACK_SYNC_PERIOD;
+    if (STACK_USES(stk, STACK_TIMED)) {
+        stk->histograms = allocator->allocate(allocator->data, STACK_LATENCY_KINDS * sizeof(*stk->histograms));
+        if (stk->histograms) {
+            memset(stk->histograms, 0, STACK_LATENCY_KINDS * sizeof(*stk->histograms));
+        } else {
+            stack_fail(stk, STACK_ALLOCATION_ERROR);
+        }
+    }
+    if (STACK_USES(stk, STACK_SEGMENTED)) {
+        // Segments hold a whole number of hash blocks
+        size_t segment_capacity = STACK_SEGMENT_SIZE / stk_elem_sz / STACK_HASH_BLOCK * STACK_HASH_BLOCK;
+        stk->segment_capacity = (segment_capacity > STACK_HASH_BLOCK) ? segment_capacity : STACK_HASH_BLOCK;
+    }
+    // The scrubber may find the Stack as soon as it's registered, so it must wait for the storage to be allocated
+    if (STACK_USES(stk, STACK_SCRUB)) {
+        pthread_mutex_init(&stk->scrub_mutex, NULL);
+    }
+    atomic_init(&stk->scrub_error, STACK_OK);
+    STACK_SCRUB_LOCK(stk);
+    stack_register(stk);
+    // A mapped Stack's file may already hold its elements
+    if (STACK_USES(stk, STACK_MAPPED)) {
+        stack_mapped_restore(stk);
+    }
+    if (stk->error == STACK_OK) {
+        stack_adjust(stk, stk->size);
+    }
+    STACK_SCRUB_UNLOCK(stk);
+    if (stk->error != STACK_OK) {
+        stack_free(stk);
+        return NULL;
+    }
+    // The initial allocation is not counted as a resize
+    atomic_store_explicit(&stk->counters.grow_count, 0, memory_order_relaxed);
+    STACK_REHASH_METADATA(stk);
+    STACK_MAPPED_UPDATE(stk);
+    STACK_LOG(stk, STACK_EVENT_ALLOCATE_DONE, stk->elem_sz, stack_global_count);
+    return stk;
+}
+
+Stack* stack_open_mapped(char const* path, size_t stk_elem_sz) {
+    return stack_open_mapped_ex(path, stk_elem_sz, STACK_DEFAULT_FLAGS);
+}
+
+Stack* stack_open_mapped_ex(char const* path, size_t stk_elem_sz, unsigned flags) {
+    assert(path);
+    assert(!(flags & STACK_MAPPED));
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    // The Stack closes fd when it's freed, even if it fails to allocate
+    return stack_allocate_storage(NULL, stk_elem_sz, flags | STACK_MAPPED, 0, fd);
+}
+
+Stack* stack_allocate_in(StackAllocator const* allocator, size_t stk_elem_sz, unsigned flags) {
+    assert(!(flags & STACK_MAPPED));
+
+    return stack_allocate_storage(allocator, stk_elem_sz, flags & ~STACK_MAPPED, STACK_EMBEDDED_DEFAULT, -1);
+}
+
+Stack* stack_allocate_embedded(StackAllocator const* allocator, size_t stk_elem_sz, unsigned flags,
+                               size_t embedded_capacity) {
+    assert(!(flags & STACK_MAPPED));
+    assert(embedded_capacity != STACK_EMBEDDED_DEFAULT);
+
+    return stack_allocate_storage(allocator, stk_elem_sz, flags & ~STACK_MAPPED, embedded_capacity, -1);
+}
+
+void stack_free(Stack* stk) {
+    if (stk) {
+        bool cacheable = stack_cache_check(stk);
+        stack_unregister(stk);
+        stack_global_count--;
+        STACK_LOG(stk, STACK_EVENT_FREE, stack_global_count);
+        bool use_log = STACK_USES(stk, STACK_USE_LOG);
+
+        if (STACK_USES(stk, STACK_SCRUB)) {
+            pthread_mutex_destroy(&stk->scrub_mutex);
+        }
+        if (!cacheable || !stack_cache_put(stk)) {
+            stack_free_storage(stk);
+        }
+
+        if (use_log) {
+            stack_log_close();
+        }
+    }
+}
+
+/*
+ * Stacks with no protections are dispatched to the following functions,
+ * which do no verification, hashing, poisoning or logging
+ */
+void const* stack_unchecked_push(Stack* stk, void const* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    stk->error = STACK_OK;
+    // Pushes must reach stack_adjust even when there is room, so that they reset the shrink delay
+    stack_adjust(stk, stk->size + 1);
+    if (stk->error != STACK_OK) {
+        return NULL;
+    }
+
+    memcpy((char*) stk->data + ((stk->size)++ * stk->elem_sz), elem_p, stk->elem_sz);
+    stack_count(&stk->counters.push_count, 1);
+    stack_count_peak(&stk->counters, stk->size);
+
+    return elem_p;
+}
+
+void* stack_unchecked_top(Stack* stk, void* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    if (!stk->size) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        return NULL;
+    }
+
+    stk->error = STACK_OK;
+    memcpy(elem_p, (char const*) stk->data + (stk->size - 1) * stk->elem_sz, stk->elem_sz);
+    stack_count(&stk->counters.top_count, 1);
+
+    return elem_p;
+}
+
+void* stack_unchecked_pop(Stack* stk, void* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    if (!stk->size) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        return NULL;
+    }
+
+    stk->error = STACK_OK;
+    memcpy(elem_p, (char const*) stk->data + (--(stk->size)) * stk->elem_sz, stk->elem_sz);
+    stack_count(&stk->counters.pop_count, 1);
+    stack_adjust(stk, stk->size);
+
+    return elem_p;
+}
+
+/*
+ * The stack_checked_* functions access the data of Stacks with protections.
+ * Scrubbed Stacks only call them while they are locked
+ */
+void const* stack_checked_push(Stack* stk, void const* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    STACK_LOG(stk, STACK_EVENT_PUSH_BEGIN);
+    STACK_VERIFY_RETURN(stk, NULL);
+
+    stk->error = STACK_OK;
+    stack_adjust(stk, stk->size + 1);
+    if (stk->error != STACK_OK) {
+        STACK_REHASH_METADATA(stk);
+        return NULL;
+    }
+
+    assert(stk->size < stk->capacity);
+
+    stack_copy_in(stk, (stk->size)++, elem_p, 1);
+    STACK_HASH_ADD(stk, stk->size - 1, 1);
+    stack_count(&stk->counters.push_count, 1);
+    stack_count_peak(&stk->counters, stk->size);
+
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_PUSH_DONE, elem_p);
+
+    return elem_p;
+}
+
+void const* stack_push(Stack* stk, void const* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    if (STACK_UNCHECKED(stk)) {
+        return stack_unchecked_push(stk, elem_p);
+    }
+
+    STACK_TIMER_START(stk, push, start_ns);
+    STACK_SCRUB_LOCK(stk);
+    void const* pushed = stack_checked_push(stk, elem_p);
+    STACK_SCRUB_UNLOCK(stk);
+    STACK_MAPPED_UPDATE(stk);
+    STACK_TIMER_STOP(stk, push, STACK_LATENCY_PUSH, start_ns);
+    return pushed;
+}
+
+void* stack_checked_top(Stack* stk, void* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    STACK_LOG(stk, STACK_EVENT_TOP_BEGIN);
+    STACK_VERIFY_RETURN(stk, NULL);
+
+    if (!stk->size) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_TOP_EMPTY);
+        STACK_REHASH_METADATA(stk);
+        return NULL;
+    }
+
+    assert(stk->size);
+
+    stk->error = STACK_OK;
+    stack_copy_out(stk, stk->size - 1, elem_p, 1);
+    stack_count(&stk->counters.top_count, 1);
+
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_TOP_DONE, elem_p);
+
+    return elem_p;
+}
+
+void* stack_top(Stack* stk, void* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    if (STACK_UNCHECKED(stk)) {
+        return stack_unchecked_top(stk, elem_p);
+    }
+
+    STACK_TIMER_START(stk, top, start_ns);
+    STACK_SCRUB_LOCK(stk);
+    void* toped = stack_checked_top(stk, elem_p);
+    STACK_SCRUB_UNLOCK(stk);
+    STACK_TIMER_STOP(stk, top, STACK_LATENCY_TOP, start_ns);
+    return toped;
+}
+
+void* stack_checked_pop(Stack* stk, void* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    STACK_LOG(stk, STACK_EVENT_POP_BEGIN);
+    STACK_VERIFY_RETURN(stk, NULL);
+
+    if (!stk->size) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_POP_EMPTY);
+        STACK_REHASH_METADATA(stk);
+        return NULL;
+    }
+
+    assert(stk->size);
+
+    stk->error = STACK_OK;
+    stack_copy_out(stk, stk->size - 1, elem_p, 1);
+
+    STACK_HASH_REMOVE(stk, stk->size - 1, 1);
+    stk->size--;
+    stack_count(&stk->counters.pop_count, 1);
+    WRITE_POISON(stk, stk->size, 1);
+    stack_adjust(stk, stk->size);
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_POP_DONE, elem_p);
+
+    return elem_p;
+}
+
+void* stack_pop(Stack* stk, void* elem_p) {
+    assert(stk);
+    assert(elem_p);
+
+    if (STACK_UNCHECKED(stk)) {
+        return stack_unchecked_pop(stk, elem_p);
+    }
+
+    STACK_TIMER_START(stk, pop, start_ns);
+    STACK_SCRUB_LOCK(stk);
+    void* poped = stack_checked_pop(stk, elem_p);
+    STACK_SCRUB_UNLOCK(stk);
+    STACK_MAPPED_UPDATE(stk);
+    STACK_TIMER_STOP(stk, pop, STACK_LATENCY_POP, start_ns);
+    return poped;
+}
+
+void const* stack_checked_push_n(Stack* stk, void const* elems, size_t num) {
+    assert(stk);
+    assert(elems || !num);
+
+    STACK_LOG(stk, STACK_EVENT_PUSH_N_BEGIN, num);
+    STACK_VERIFY_RETURN(stk, NULL);
+
+    if (num > SIZE_MAX - stk->size) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_PUSH_N_OVERFLOW);
+        STACK_REHASH_METADATA(stk);
+        return NULL;
+    }
+
+    stk->error = STACK_OK;
+    stack_adjust(stk, stk->size + num);
+    if (stk->error != STACK_OK) {
+        STACK_REHASH_METADATA(stk);
+        return NULL;
+    }
+
+    assert(stk->size + num <= stk->capacity);
+
+    if (num) {
+        stack_copy_in(stk, stk->size, elems, num);
+    }
+    STACK_HASH_ADD(stk, stk->size, num);
+    stk->size += num;
+    stack_count(&stk->counters.push_count, num);
+    stack_count_peak(&stk->counters, stk->size);
+
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_PUSH_N_DONE, num);
+
+    return elems;
+}
+
+void const* stack_push_n(Stack* stk, void const* elems, size_t num) {
+    assert(stk);
+
+    STACK_TIMER_START(stk, push_n, start_ns);
+    STACK_SCRUB_LOCK(stk);
+    void const* pushed = stack_checked_push_n(stk, elems, num);
+    STACK_SCRUB_UNLOCK(stk);
+    STACK_MAPPED_UPDATE(stk);
+    STACK_TIMER_STOP(stk, push_n, STACK_LATENCY_PUSH_N, start_ns);
+    return pushed;
+}
+
+void* stack_checked_top_n(Stack* stk, void* elems, size_t num) {
+    assert(stk);
+    assert(elems || !num);
+
+    STACK_LOG(stk, STACK_EVENT_TOP_N_BEGIN, num);
+    STACK_VERIFY_RETURN(stk, NULL);
+
+    if (stk->size < num) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_TOP_N_UNDERFLOW);
+        STACK_REHASH_METADATA(stk);
+        return NULL;
+    }
+
+    stk->error = STACK_OK;
+    if (num) {
+        stack_copy_out(stk, stk->size - num, elems, num);
+    }
+    stack_count(&stk->counters.top_count, num);
+
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_TOP_N_DONE, num);
+
+    return elems;
+}
+
+void* stack_top_n(Stack* stk, void* elems, size_t num) {
+    assert(stk);
+
+    STACK_TIMER_START(stk, top_n, start_ns);
+    STACK_SCRUB_LOCK(stk);
+    void* toped = stack_checked_top_n(stk, elems, num);
+    STACK_SCRUB_UNLOCK(stk);
+    STACK_TIMER_STOP(stk, top_n, STACK_LATENCY_TOP_N, start_ns);
+    return toped;
+}
+
+void* stack_checked_pop_n(Stack* stk, void* elems, size_t num) {
+    assert(stk);
+    assert(elems || !num);
+
+    STACK_LOG(stk, STACK_EVENT_POP_N_BEGIN, num);
+    STACK_VERIFY_RETURN(stk, NULL);
+
+    if (stk->size < num) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_POP_N_UNDERFLOW);
+        STACK_REHASH_METADATA(stk);
+        return NULL;
+    }
+
+    stk->error = STACK_OK;
+    if (num) {
+        stack_copy_out(stk, stk->size - num, elems, num);
+    }
+
+    STACK_HASH_REMOVE(stk, stk->size - num, num);
+    stk->size -= num;
+    stack_count(&stk->counters.pop_count, num);
+    WRITE_POISON(stk, stk->size, num);
+    stack_adjust(stk, stk->size);
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_POP_N_DONE, num);
+
+    return elems;
+}
+
+void* stack_pop_n(Stack* stk, void* elems, size_t num) {
+    assert(stk);
+
+    STACK_TIMER_START(stk, pop_n, start_ns);
+    STACK_SCRUB_LOCK(stk);
+    void* poped = stack_checked_pop_n(stk, elems, num);
+    STACK_SCRUB_UNLOCK(stk);
+    STACK_MAPPED_UPDATE(stk);
+    STACK_TIMER_STOP(stk, pop_n, STACK_LATENCY_POP_N, start_ns);
+    return poped;
+}
+
+size_t stack_size(Stack* stk) {
+    assert(stk);
+
+    STACK_LOG(stk, STACK_EVENT_SIZE_BEGIN);
+    STACK_VERIFY_RETURN(stk, 0);
+    STACK_LOG(stk, STACK_EVENT_SIZE_DONE);
+
+    return stk->size;
+}
+
+size_t stack_capacity(Stack* stk) {
+    assert(stk);
+
+    STACK_LOG(stk, STACK_EVENT_CAPACITY_BEGIN);
+    STACK_VERIFY_RETURN(stk, 0);
+    STACK_LOG(stk, STACK_EVENT_CAPACITY_DONE);
+
+    return stk->capacity;
+}
+
+bool stack_empty(Stack* stk) {
+    assert(stk);
+
+    STACK_LOG(stk, STACK_EVENT_EMPTY_BEGIN);
+    STACK_VERIFY_RETURN(stk, true);
+    STACK_LOG(stk, STACK_EVENT_EMPTY_DONE);
+
+    return !stk->size;
+}
+
+StackMark stack_checked_mark(Stack* stk) {
+    assert(stk);
+
+    STACK_VERIFY_RETURN(stk, stk->size);
+
+    if (stk->mark_count == stk->mark_capacity) {
+        size_t new_capacity = (stk->mark_capacity) ? 2 * stk->mark_capacity : STACK_MARK_CAPACITY;
+        StackMark* new_marks = stk->allocator.reallocate(stk->allocator.data, stk->marks,
+                                                         stk->mark_capacity * sizeof(*stk->marks),
+                                                         new_capacity * sizeof(*stk->marks));
+        if (!new_marks) {
+            stack_fail(stk, STACK_ALLOCATION_ERROR);
+            STACK_REHASH_METADATA(stk);
+            return stk->size;
+        }
+        stk->marks = new_marks;
+        stk->mark_capacity = new_capacity;
+    }
+
+    stk->error = STACK_OK;
+    stk->marks[stk->mark_count++] = stk->size;
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_MARK, stk->size, stk->mark_count);
+
+    return stk->size;
 }
 
-#ifdef USE_HASH
-void stack_update_metadata_hash(Stack* stk) {
+StackMark stack_mark(Stack* stk) {
     assert(stk);
 
-    stk->metadata_hash = stack_metadata_hash(stk);
-    STACK_LOG(stk, "Update metadata hash");
+    STACK_SCRUB_LOCK(stk);
+    StackMark mark = stack_checked_mark(stk);
+    STACK_SCRUB_UNLOCK(stk);
+    return mark;
 }
-#define STACK_REHASH_METADATA(stk) stack_update_metadata_hash(stk)
-#else
-#define STACK_REHASH_METADATA(stk)
-#endif
 
-#ifdef USE_HASH_FULL
-void stack_update_data_hash(Stack* stk) {
+void stack_checked_rewind(Stack* stk, StackMark mark) {
     assert(stk);
 
-    stk->data_hash = stack_data_hash(stk);
-    STACK_LOG(stk, "Update data hash");
-}
-#define STACK_REHASH_DATA(stk) stack_update_data_hash(stk)
-#else
-#define STACK_REHASH_DATA(stk)
-#endif
+    STACK_LOG(stk, STACK_EVENT_REWIND_BEGIN, mark);
+    STACK_VERIFY_RETURN(stk, );
 
-#define STACK_REHASH(stk)       \
-    STACK_REHASH_METADATA(stk); \
-    STACK_REHASH_DATA(stk)
+    // Rewinding is usually to the innermost mark, so the outstanding marks are searched from it
+    size_t i = stk->mark_count;
+    while (i && stk->marks[i - 1] != mark) {
+        i--;
+    }
+    if (!i || mark > stk->size) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_REWIND_INVALID);
+        STACK_REHASH_METADATA(stk);
+        return;
+    }
 
-#ifdef USE_POISON
-void stack_write_poison(Stack* stk, size_t first_elem, size_t num_elem) {
-    assert(stk);
-    assert(stk->data);
-    assert(first_elem >= stk->size);
-    assert(first_elem + num_elem <= stk->capacity);
+    // The whole range is unhashed and poisoned at once, and the capacity is kept because of the mark
+    stk->error = STACK_OK;
+    size_t num = stk->size - mark;
+    STACK_HASH_REMOVE(stk, mark, num);
+    stk->size = mark;
+    stack_count(&stk->counters.pop_count, num);
+    WRITE_POISON(stk, stk->size, num);
+    stack_adjust(stk, stk->size);
+    STACK_REHASH_METADATA(stk);
 
-    size_t start = first_elem * stk->elem_sz;
-    size_t num = num_elem * stk->elem_sz;
-    write_poison((char*) stk->data + start, num);
-    STACK_LOG(stk, "Write %zu bytes of poison", num);
+    STACK_LOG(stk, STACK_EVENT_REWIND_DONE, num);
 }
-#define WRITE_POISON(stk, first_elem, num_elem) stack_write_poison(stk, first_elem, num_elem)
-#else
-#define WRITE_POISON(stk, first_elem, num_elem)
-#endif
 
-#ifdef USE_DATA_CANARY
-void stack_set_data_canaries(Stack* stk) {
+void stack_rewind(Stack* stk, StackMark mark) {
     assert(stk);
-    assert(stk->data);
-
-    *((canary_type*) stk->data - 1) = CANARY_VALUE;
-    char* back_p = (char*) stk->data + stk->capacity * stk->elem_sz;
-    *((canary_type*) back_p) = CANARY_VALUE;
 
-    STACK_LOG(stk, "Set data canaries");
+    STACK_TIMER_START(stk, rewind, start_ns);
+    STACK_SCRUB_LOCK(stk);
+    stack_checked_rewind(stk, mark);
+    STACK_SCRUB_UNLOCK(stk);
+    STACK_MAPPED_UPDATE(stk);
+    STACK_TIMER_STOP(stk, rewind, STACK_LATENCY_REWIND, start_ns);
 }
-#define SET_DATA_CANARIES(stk) stack_set_data_canaries(stk)
-#else
-#define SET_DATA_CANARIES(stk)
-#endif
 
-void stack_unsafe_resize(Stack* stk, size_t new_capacity) {
+void stack_checked_release(Stack* stk, StackMark mark) {
     assert(stk);
 
-    STACK_LOG(stk, "Attempt resize to %zu from %zu", new_capacity, stk->capacity);
-#ifdef USE_DATA_CANARY
-    // Check for unallocated stack
-    void* old_data = (stk->data) ? ((canary_type*) stk->data - 1) : NULL;
-    size_t new_data_size = new_capacity * stk->elem_sz + 2 * sizeof(canary_type);
-#else
-    void* old_data = stk->data;
-    size_t new_data_size = new_capacity * stk->elem_sz;
-#endif
+    STACK_VERIFY_RETURN(stk, );
 
-    void* new_data = realloc(old_data, new_data_size);
-    if (!new_data) {
-        stk->error = STACK_ALLOCATION_ERROR;
+    // Marks are released innermost first
+    if (!stk->mark_count || stk->marks[stk->mark_count - 1] != mark) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_RELEASE_INVALID);
+        STACK_REHASH_METADATA(stk);
         return;
     }
-    stk->capacity = new_capacity;
 
-#ifdef USE_DATA_CANARY
-    stk->data = (canary_type*) new_data + 1;
-#else
-    stk->data = new_data;
-#endif
+    stk->error = STACK_OK;
+    stk->mark_count--;
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_RELEASE, mark, stk->mark_count);
 }
 
-void stack_resize(Stack* stk, size_t new_capacity) {
+void stack_release(Stack* stk, StackMark mark) {
     assert(stk);
-    assert(new_capacity && new_capacity >= stk->size);
 
-    stack_unsafe_resize(stk, new_capacity);
-    // If resizing fails and new capacity if greater than current capacity + 1,
-    // try to add only one extra element
-    if (stk->error == STACK_ALLOCATION_ERROR && new_capacity > stk->capacity + 1) {
-        new_capacity = stk->capacity + 1;
-        stack_unsafe_resize(stk, new_capacity);
-    }
-    if (stk->error == STACK_ALLOCATION_ERROR) {
-        return;
-    }
-    WRITE_POISON(stk, stk->size, stk->capacity - stk->size);
-    SET_DATA_CANARIES(stk);
-    STACK_LOG(stk, "Capacity is now %zu", stk->capacity);
+    STACK_SCRUB_LOCK(stk);
+    stack_checked_release(stk, mark);
+    STACK_SCRUB_UNLOCK(stk);
 }
 
-static const double STACK_GROW_FACTOR = 2.0;
-static const double STACK_GROW_THRESHOLD = 1.0;
-static const double STACK_SHRINK_FACTOR = 2.0 / 3.0;
-static const double STACK_SHRINK_THRESHOLD = 0.5;
-
-size_t stack_recomended_capacity(Stack* stk) {
+size_t stack_checked_reserve(Stack* stk, size_t new_capacity) {
     assert(stk);
 
-    if (stk->capacity < stk->min_capacity) {
-        return stk->min_capacity;
+    STACK_LOG(stk, STACK_EVENT_RESERVE_BEGIN);
+    STACK_VERIFY_RETURN(stk, 0);
+
+    if (new_capacity < STACK_DEFAULT_CAPACITY) {
+        new_capacity = STACK_DEFAULT_CAPACITY;
     }
 
-    size_t recomended_capacity = stk->capacity;
-    // Shrink only if new capacity will be greater than or equal to the minimum capacity
-    if (stk->size <= stk->capacity * STACK_SHRINK_THRESHOLD &&
-        stk->capacity * STACK_SHRINK_FACTOR >= stk->min_capacity) {
-        recomended_capacity = stk->capacity * STACK_SHRINK_FACTOR;
-    } else if (stk->size >= stk->capacity * STACK_GROW_THRESHOLD) {
-        recomended_capacity = stk->capacity * STACK_GROW_FACTOR;
+    stk->min_capacity = new_capacity;
+    stack_adjust(stk, stk->size);
+    if (STACK_USES(stk, STACK_PREFAULT) && stk->error == STACK_OK) {
+        stack_prefault_elems(stk, stk->size, stk->capacity - stk->size);
     }
 
-    return recomended_capacity;
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_RESERVE_DONE, new_capacity);
+
+    return stk->min_capacity;
 }
 
-void stack_adjust(Stack* stk) {
+size_t stack_reserve(Stack* stk, size_t new_capacity) {
     assert(stk);
 
-    size_t recomended_capacity = stack_recomended_capacity(stk);
-    if (stk->capacity != recomended_capacity) {
-        stack_resize(stk, recomended_capacity);
-    }
+    STACK_TIMER_START(stk, reserve, start_ns);
+    STACK_SCRUB_LOCK(stk);
+    size_t reserved = stack_checked_reserve(stk, new_capacity);
+    STACK_SCRUB_UNLOCK(stk);
+    STACK_MAPPED_UPDATE(stk);
+    STACK_TIMER_STOP(stk, reserve, STACK_LATENCY_RESERVE, start_ns);
+    return reserved;
 }
 
-void initialize_stack_log() {
-    if (stack_global_log) {
-        return;
-    }
-    stack_global_log = fopen(STACK_LOG_FILENAME, "ab");
-    if (stack_global_log) {
-        setvbuf(stack_global_log, NULL, _IONBF, 0);
-    }
+STACK_ERROR stack_get_error(Stack* stk) {
+    assert(stk);
+
+    STACK_LOG(stk, STACK_EVENT_GET_ERROR_BEGIN);
+    STACK_VERIFY(stk);
+    STACK_LOG(stk, STACK_EVENT_GET_ERROR_DONE);
+
+    return stk->error;
 }
 
-void finalize_stack_log() {
-    if (!stack_global_count && stack_global_log) {
-        fclose(stack_global_log);
-    }
+StackResizePolicy stack_get_resize_policy(Stack* stk) {
+    assert(stk);
+
+    return stk->resize_policy;
 }
 
-Stack* stack_allocate(size_t stk_elem_sz) {
-    assert(stk_elem_sz);
+void stack_set_resize_policy(Stack* stk, StackResizePolicy const* policy) {
+    assert(stk);
+    assert(policy);
 
-    Stack* stk = calloc(1, sizeof(*stk));
-    if (!stk) {
-        return NULL;
+    STACK_LOG(stk, STACK_EVENT_SET_RESIZE_POLICY_BEGIN);
+    STACK_VERIFY_RETURN(stk, );
+
+    if (!stack_resize_policy_valid(policy)) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_SET_RESIZE_POLICY_INVALID);
+        STACK_REHASH_METADATA(stk);
+        return;
     }
-    initialize_stack_log();
-    STACK_LOG(stk, "Start new Stack allocation; there are %zu allocated Stacks", stack_global_count);
-    stack_global_count++;
-#ifdef USE_CANARY
-    stk->front_canary = CANARY_VALUE;
-    stk->back_canary = CANARY_VALUE;
-#endif
+
     stk->error = STACK_OK;
-    stk->elem_sz = stk_elem_sz;
-    stk->data = NULL;
-    stk->size = 0;
-    stk->capacity = 0;
-    stk->min_capacity = STACK_DEFAULT_CAPACITY;
-    stack_resize(stk, stk->min_capacity);
-    if (stk->error != STACK_OK) {
-        stack_free(stk);
-        return NULL;
-    }
-    STACK_REHASH(stk);
-    STACK_LOG(stk, "Allocated new Stack; there are %zu allocated Stacks", stack_global_count);
-    return stk;
+    stk->resize_policy = *policy;
+    stk->idle_ops = 0;
+    stk->peak_size = stk->size;
+    stack_update_inline_limits(stk, stk->size);
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_SET_RESIZE_POLICY_DONE, (size_t) policy->kind);
 }
 
-void stack_free(Stack* stk) {
-    if (stk) {
-        if (stk->data) {
-#ifdef USE_DATA_CANARY
-            free((canary_type*) stk->data - 1);
-#else
-            free(stk->data);
-#endif
-        }
-        free(stk);
+StackVerifyPolicy stack_get_verify_policy(Stack* stk) {
+    assert(stk);
 
-        stack_global_count--;
-        STACK_LOG(stk, "Freed Stack; there are %zu allocated Stacks", stack_global_count);
-        finalize_stack_log();
-    }
+    return stk->verify_policy;
 }
 
-void const* stack_push(Stack* stk, void const* elem_p) {
+void stack_set_verify_policy(Stack* stk, StackVerifyPolicy const* policy) {
     assert(stk);
-    assert(elem_p);
+    assert(policy);
 
-    STACK_LOG(stk, "Attempting to push element");
-    STACK_VERIFY_RETURN(stk, NULL);
+    STACK_LOG(stk, STACK_EVENT_SET_VERIFY_POLICY_BEGIN);
+    STACK_VERIFY_RETURN(stk, );
 
-    stk->error = STACK_OK;
-    stack_adjust(stk);
-    if (stk->error != STACK_OK) {
+    if (!stack_verify_policy_valid(policy)) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_SET_VERIFY_POLICY_INVALID);
         STACK_REHASH_METADATA(stk);
-        return NULL;
+        return;
     }
 
-    assert(stk->size < stk->capacity);
+    stk->error = STACK_OK;
+    stk->verify_policy = *policy;
+    stack_reset_verify_schedule(stk);
+    STACK_REHASH_METADATA(stk);
 
-    memcpy((char*) stk->data + ((stk->size)++ * stk->elem_sz), elem_p, stk->elem_sz);
+    STACK_LOG(stk, STACK_EVENT_SET_VERIFY_POLICY_DONE, (size_t) policy->mode);
+}
 
-    STACK_REHASH(stk);
+void stack_set_sync_policy(Stack* stk, STACK_SYNC_MODE mode, size_t period) {
+    assert(stk);
 
-#ifdef USE_LOG
-    char elem_str[elem_str_size(stk->elem_sz) + 1];
-    if (elem_to_str(elem_p, elem_str, stk->elem_sz, sizeof(elem_str))) {
-        STACK_LOG(stk, "Pushed element %s", elem_str);
-    } else {
-        STACK_LOG(stk, "Pushed unknown element", elem_str);
+    STACK_LOG(stk, STACK_EVENT_SET_SYNC_POLICY_BEGIN);
+    STACK_VERIFY_RETURN(stk, );
+
+    if (!STACK_USES(stk, STACK_MAPPED) || mode > STACK_SYNC_ALWAYS ||
+        (mode == STACK_SYNC_EVERY_NTH && !period)) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        STACK_LOG(stk, STACK_EVENT_SET_SYNC_POLICY_INVALID);
+        STACK_REHASH_METADATA(stk);
+        return;
     }
-#endif
 
-    return elem_p;
+    stk->error = STACK_OK;
+    stk->sync_mode = mode;
+    stk->sync_period = (mode == STACK_SYNC_EVERY_NTH) ? period : STACK_SYNC_PERIOD;
+    stk->sync_ops = 0;
+    STACK_REHASH_METADATA(stk);
+
+    STACK_LOG(stk, STACK_EVENT_SET_SYNC_POLICY_DONE, (size_t) mode);
 }
 
-void* stack_top(Stack* stk, void* elem_p) {
+bool stack_sync(Stack* stk) {
     assert(stk);
-    assert(elem_p);
-
-    STACK_LOG(stk, "Attempting to peek at top element");
-    STACK_VERIFY_RETURN(stk, NULL);
 
-    if (!stk->size) {
-        stk->error = STACK_OPERATION_ERROR;
-        STACK_LOG(stk, "Error: peeking at empty stack");
-        STACK_REHASH_METADATA(stk);
-        return NULL;
+    STACK_VERIFY_RETURN(stk, false);
+    if (!STACK_USES(stk, STACK_MAPPED)) {
+        stack_fail(stk, STACK_OPERATION_ERROR);
+        return false;
     }
+    stk->error = STACK_OK;
+    stack_mapped_write_header(stk);
+    return stack_mapped_sync(stk);
+}
 
-    assert(stk->size);
+hash_type stack_snapshot_header_hash(StackSnapshotHeader const* header) {
+    assert(header);
 
-    stk->error = STACK_OK;
-    memcpy(elem_p, (char const*) stk->data + (stk->size - 1) * stk->elem_sz, stk->elem_sz);
+    return stack_hash_bytes(header, offsetof(StackSnapshotHeader, header_hash), HASH_INITIAL_VALUE);
+}
 
-    STACK_REHASH_METADATA(stk);
+bool stack_save(Stack* stk, FILE* file) {
+    assert(stk);
+    assert(file);
+
+    STACK_LOG(stk, STACK_EVENT_SAVE_BEGIN);
+    STACK_SCRUB_LOCK(stk);
+    // A corrupted Stack must not be saved with a checksum that covers its corruption,
+    // so it's verified even when assertions are off, and its elements are rehashed,
+    // as the verification policy may have checked only some of them
+    stack_verify(stk);
+    if (!stack_error_recoverable(stk->error)) {
+        STACK_SCRUB_UNLOCK(stk);
+        return false;
+    }
+    hash_type checksum = stack_data_hash(stk);
+    if (STACK_USES(stk, STACK_USE_HASH_FULL) && checksum != stk->data_hash) {
+        stack_fail(stk, STACK_DATA_HASH_ERROR);
+        STACK_SCRUB_UNLOCK(stk);
+        return false;
+    }
 
-#ifdef USE_LOG
-    char elem_str[elem_str_size(stk->elem_sz) + 1];
-    if (elem_to_str(elem_p, elem_str, stk->elem_sz, sizeof(elem_str))) {
-        STACK_LOG(stk, "Toped element %s", elem_str);
-    } else {
-        STACK_LOG(stk, "Toped unknown element", elem_str);
+    StackSnapshotHeader header = {
+        .magic = STACK_SNAPSHOT_MAGIC,
+        .version = STACK_SNAPSHOT_VERSION,
+        // A loaded Stack is not kept in a file
+        .flags = stk->flags & ~STACK_MAPPED,
+        .elem_sz = stk->elem_sz,
+        .size = stk->size,
+        .checksum = checksum,
+    };
+    header.header_hash = stack_snapshot_header_hash(&header);
+    bool saved = fwrite(&header, sizeof(header), 1, file) == 1 && stack_write_out(stk, 0, file, stk->size);
+    STACK_SCRUB_UNLOCK(stk);
+
+    if (!saved) {
+        STACK_LOG(stk, STACK_EVENT_SAVE_FAIL);
+        return false;
     }
-#endif
+    STACK_LOG(stk, STACK_EVENT_SAVE_DONE, sizeof(header) + stk->size * stk->elem_sz);
+    return true;
+}
 
-    return elem_p;
+bool stack_snapshot_header_valid(StackSnapshotHeader const* header) {
+    assert(header);
+
+    // A Stack grown to the saved size may take up to twice its bytes, which must not overflow
+    return header->magic == STACK_SNAPSHOT_MAGIC && header->version == STACK_SNAPSHOT_VERSION &&
+           header->header_hash == stack_snapshot_header_hash(header) &&
+           !(header->flags & ~STACK_KNOWN_FLAGS) && !(header->flags & STACK_MAPPED) &&
+           header->elem_sz && (size_t) header->elem_sz == header->elem_sz &&
+           header->size <= SIZE_MAX / 4 / header->elem_sz;
 }
 
-void* stack_pop(Stack* stk, void* elem_p) {
-    assert(stk);
-    assert(elem_p);
+/*
+ * Check that a file has at least num_bytes left to read, if its size can be known
+ */
+bool stack_file_has_bytes(FILE* file, size_t num_bytes) {
+    assert(file);
 
-    STACK_LOG(stk, "Attempting to pop element");
-    STACK_VERIFY_RETURN(stk, NULL);
+    struct stat file_stat;
+    long position = ftell(file);
+    if (position < 0 || fstat(fileno(file), &file_stat) || !S_ISREG(file_stat.st_mode)) {
+        return true;
+    }
+    return file_stat.st_size >= position && (uintmax_t) (file_stat.st_size - position) >= num_bytes;
+}
 
-    if (!stk->size) {
-        stk->error = STACK_OPERATION_ERROR;
-        STACK_LOG(stk, "Error: poping empty stack");
-        STACK_REHASH_METADATA(stk);
+Stack* stack_load(FILE* file) {
+    assert(file);
+
+    StackSnapshotHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || !stack_snapshot_header_valid(&header) ||
+        !stack_file_has_bytes(file, header.size * header.elem_sz)) {
+        return NULL;
+    }
+    Stack* stk = stack_allocate_ex(header.elem_sz, header.flags);
+    if (!stk) {
         return NULL;
     }
 
-    assert(stk->size);
+    STACK_SCRUB_LOCK(stk);
+    // The Stack is grown to its saved size before it takes that size, so that it never holds more than it fits.
+    // The elements are then read straight into place and hashed once
+    stack_adjust(stk, header.size);
+    bool loaded = stk->error == STACK_OK && stk->capacity >= header.size;
+    if (loaded) {
+        stk->size = header.size;
+        loaded = stack_read_in(stk, 0, file, stk->size);
+    }
+    if (loaded) {
+        STACK_HASH_ADD(stk, 0, stk->size);
+        loaded = header.checksum == (STACK_USES(stk, STACK_USE_HASH_FULL) ? stk->data_hash : stack_data_hash(stk));
+    }
+    stack_count_peak(&stk->counters, stk->size);
+    STACK_REHASH_METADATA(stk);
+    STACK_SCRUB_UNLOCK(stk);
 
-    stk->error = STACK_OK;
-    memcpy(elem_p, (char const*) stk->data + (stk->size - 1) * stk->elem_sz, stk->elem_sz);
+    if (!loaded) {
+        stack_free(stk);
+        return NULL;
+    }
+    STACK_LOG(stk, STACK_EVENT_LOAD_DONE, stk->size);
+    return stk;
+}
 
-    stk->size--;
-    WRITE_POISON(stk, stk->size, 1);
-    stack_adjust(stk);
-    STACK_REHASH(stk);
+bool stack_set_default_verify_policy(StackVerifyPolicy const* policy) {
+    assert(policy);
 
-#ifdef USE_LOG
-    char elem_str[elem_str_size(stk->elem_sz) + 1];
-    if (elem_to_str(elem_p, elem_str, stk->elem_sz, sizeof(elem_str))) {
-        STACK_LOG(stk, "Poped element %s", elem_str);
-    } else {
-        STACK_LOG(stk, "Poped unknown element", elem_str);
+    if (!stack_verify_policy_valid(policy)) {
+        return false;
     }
-#endif
+    pthread_mutex_lock(&stack_registry_mutex);
+    stack_default_verify_policy = *policy;
+    stack_default_verify_policy_set = true;
+    pthread_mutex_unlock(&stack_registry_mutex);
+    return true;
+}
 
-    return elem_p;
+StackVerifyPolicy stack_get_default_verify_policy() {
+    pthread_mutex_lock(&stack_registry_mutex);
+    StackVerifyPolicy policy = (stack_default_verify_policy_set) ? stack_default_verify_policy
+                                                                 : stack_verify_policy(STACK_VERIFY_ALWAYS);
+    pthread_mutex_unlock(&stack_registry_mutex);
+    return policy;
 }
 
-size_t stack_size(Stack* stk) {
+StackResizeStats stack_get_resize_stats(Stack* stk) {
     assert(stk);
 
-    STACK_LOG(stk, "Attempting to get size");
-    STACK_VERIFY_RETURN(stk, 0);
-    STACK_LOG(stk, "Return size");
-
-    return stk->size;
+    StackResizeStats resize_stats = {
+        .grow_count = atomic_load_explicit(&stk->counters.grow_count, memory_order_relaxed),
+        .shrink_count = atomic_load_explicit(&stk->counters.shrink_count, memory_order_relaxed),
+        .bytes_copied = atomic_load_explicit(&stk->counters.bytes_copied, memory_order_relaxed),
+    };
+    return resize_stats;
 }
 
-size_t stack_capacity(Stack* stk) {
+void stack_stats(Stack* stk, StackStats* stats) {
     assert(stk);
+    assert(stats);
 
-    STACK_LOG(stk, "Attempting to get capacity");
-    STACK_VERIFY_RETURN(stk, 0);
-    STACK_LOG(stk, "Return capacity");
+    memset(stats, 0, sizeof(*stats));
+    stack_add_counters(stats, stk);
+    stats->stack_count = 1;
+}
 
-    return stk->capacity;
+void stack_global_stats(StackStats* stats) {
+    assert(stats);
+
+    pthread_mutex_lock(&stack_registry_mutex);
+    *stats = stack_retired_stats;
+    stats->stack_count = 0;
+    for (Stack const* stk = stack_registry; stk; stk = stk->registry_next) {
+        stack_add_counters(stats, stk);
+        stats->stack_count++;
+    }
+    for (StackArena const* arena = stack_arenas; arena; arena = arena->next) {
+        for (Stack const* stk = arena->stacks; stk; stk = stk->registry_next) {
+            stack_add_counters(stats, stk);
+            stats->stack_count++;
+        }
+    }
+    pthread_mutex_unlock(&stack_registry_mutex);
 }
 
-bool stack_empty(Stack* stk) {
+void stack_latency(Stack* stk, STACK_LATENCY_KIND kind, StackLatency* latency) {
     assert(stk);
+    assert(kind < STACK_LATENCY_KINDS);
+    assert(latency);
 
-    STACK_LOG(stk, "Attempting to check if empty");
-    STACK_VERIFY_RETURN(stk, true);
-    STACK_LOG(stk, "Return empty status");
+    memset(latency, 0, sizeof(*latency));
+    if (stk->histograms) {
+        stack_add_latency(latency, &stk->histograms[kind]);
+    }
+}
 
-    return !stk->size;
+void stack_global_latency(STACK_LATENCY_KIND kind, StackLatency* latency) {
+    assert(kind < STACK_LATENCY_KINDS);
+    assert(latency);
+
+    pthread_mutex_lock(&stack_registry_mutex);
+    *latency = stack_retired_latency[kind];
+    for (Stack const* stk = stack_registry; stk; stk = stk->registry_next) {
+        if (stk->histograms) {
+            stack_add_latency(latency, &stk->histograms[kind]);
+        }
+    }
+    for (StackArena const* arena = stack_arenas; arena; arena = arena->next) {
+        for (Stack const* stk = arena->stacks; stk; stk = stk->registry_next) {
+            if (stk->histograms) {
+                stack_add_latency(latency, &stk->histograms[kind]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&stack_registry_mutex);
 }
 
-size_t stack_reserve(Stack* stk, size_t new_capacity) {
+uint64_t stack_latency_percentile(StackLatency const* latency, double percentile) {
+    assert(latency);
+    assert(percentile >= 0.0 && percentile <= 100.0);
+
+    if (!latency->count) {
+        return 0;
+    }
+    // Rank of the latency at the percentile, counting from 1
+    size_t rank = (size_t) (percentile / 100.0 * (double) latency->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    size_t seen = 0;
+    for (size_t i = 0; i < STACK_LATENCY_BUCKETS; i++) {
+        seen += latency->buckets[i];
+        if (seen >= rank) {
+            uint64_t limit = stack_latency_bucket_limit(i);
+            return (limit < latency->max_ns) ? limit : latency->max_ns;
+        }
+    }
+    return latency->max_ns;
+}
+
+char const* stack_latency_kind_name(STACK_LATENCY_KIND kind) {
+    static char const* const names[] = {
+        [STACK_LATENCY_PUSH] = "push",
+        [STACK_LATENCY_POP] = "pop",
+        [STACK_LATENCY_TOP] = "top",
+        [STACK_LATENCY_PUSH_N] = "push_n",
+        [STACK_LATENCY_POP_N] = "pop_n",
+        [STACK_LATENCY_TOP_N] = "top_n",
+        [STACK_LATENCY_REWIND] = "rewind",
+        [STACK_LATENCY_RESERVE] = "reserve",
+        [STACK_LATENCY_VERIFY] = "verify",
+        [STACK_LATENCY_RESIZE] = "resize",
+        [STACK_LATENCY_REHASH] = "rehash",
+        [STACK_LATENCY_POISON] = "poison",
+    };
+    _Static_assert(ARR_LENGTH(names) == STACK_LATENCY_KINDS, "Every latency kind needs a name");
+
+    return (kind < STACK_LATENCY_KINDS) ? names[kind] : "unknown";
+}
+
+unsigned stack_get_flags(Stack* stk) {
     assert(stk);
 
-    STACK_LOG(stk, "Attempting to reserve capacity");
-    STACK_VERIFY_RETURN(stk, 0);
+    return stk->flags;
+}
 
-    if (new_capacity < STACK_DEFAULT_CAPACITY) {
-        new_capacity = STACK_DEFAULT_CAPACITY;
+char* stack_get_options(Stack* stk, char* str, size_t str_sz) {
+    assert(stk);
+
+    return stack_options_string(stk->flags, str, str_sz);
+}
+
+/*
+ * Scrub the Stacks of a list, which must be locked against changes
+ */
+size_t stack_scrub_list(Stack* list, stack_scrub_callback callback, void* data) {
+    size_t error_count = 0;
+    for (Stack* stk = list; stk; stk = stk->registry_next) {
+        // Stacks that are being changed are scrubbed on the next pass instead of being waited for
+        if (!STACK_USES(stk, STACK_SCRUB) ||
+            atomic_load_explicit(&stk->scrub_error, memory_order_relaxed) != STACK_OK ||
+            pthread_mutex_trylock(&stk->scrub_mutex)) {
+            continue;
+        }
+        STACK_ERROR error = stack_scrub_step(stk);
+        if (error != STACK_OK) {
+            atomic_store_explicit(&stk->scrub_error, error, memory_order_release);
+            STACK_LOG(stk, STACK_EVENT_SCRUB_FAIL, (size_t) error);
+        }
+        pthread_mutex_unlock(&stk->scrub_mutex);
+
+        if (error != STACK_OK) {
+            error_count++;
+            if (callback) {
+                callback(data, stk, error);
+            }
+        }
     }
+    return error_count;
+}
 
-    stk->min_capacity = new_capacity;
-    stack_adjust(stk);
+size_t stack_scrub(stack_scrub_callback callback, void* data) {
+    // Holding the registry keeps the Stacks from being freed while they are scrubbed
+    pthread_mutex_lock(&stack_registry_mutex);
+    size_t error_count = stack_scrub_list(stack_registry, callback, data);
+    for (StackArena* arena = stack_arenas; arena; arena = arena->next) {
+        error_count += stack_scrub_list(arena->stacks, callback, data);
+    }
+    pthread_mutex_unlock(&stack_registry_mutex);
+    return error_count;
+}
 
-    STACK_REHASH(stk);
+// Protects the scrubber thread's settings and its stop request
+static pthread_mutex_t stack_scrubber_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stack_scrubber_cond = PTHREAD_COND_INITIALIZER;
+static bool stack_scrubber_running = false;
+static bool stack_scrubber_stopping = false;
+static pthread_t stack_scrubber_thread;
+static stack_scrub_callback stack_scrubber_callback = NULL;
+static void* stack_scrubber_data = NULL;
+static unsigned stack_scrubber_interval_us = 0;
+
+void* stack_scrubber(void* arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&stack_scrubber_mutex);
+    while (!stack_scrubber_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += stack_scrubber_interval_us / 1000000u;
+        deadline.tv_nsec += (long) (stack_scrubber_interval_us % 1000000u) * 1000l;
+        if (deadline.tv_nsec >= 1000000000l) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000l;
+        }
+        pthread_cond_timedwait(&stack_scrubber_cond, &stack_scrubber_mutex, &deadline);
+        if (!stack_scrubber_stopping) {
+            stack_scrub(stack_scrubber_callback, stack_scrubber_data);
+        }
+    }
+    pthread_mutex_unlock(&stack_scrubber_mutex);
 
-    STACK_LOG(stk, "Reserved capacity for %zu elements", new_capacity);
+    return NULL;
+}
 
-    return stk->min_capacity;
+bool stack_scrubber_start(stack_scrub_callback callback, void* data, unsigned interval_us) {
+    pthread_mutex_lock(&stack_scrubber_mutex);
+    if (stack_scrubber_running) {
+        pthread_mutex_unlock(&stack_scrubber_mutex);
+        return false;
+    }
+    stack_scrubber_callback = callback;
+    stack_scrubber_data = data;
+    stack_scrubber_interval_us = interval_us;
+    stack_scrubber_stopping = false;
+    stack_scrubber_running = !pthread_create(&stack_scrubber_thread, NULL, stack_scrubber, NULL);
+    bool started = stack_scrubber_running;
+    pthread_mutex_unlock(&stack_scrubber_mutex);
+    return started;
 }
 
-STACK_ERROR stack_get_error(Stack* stk) {
-    assert(stk);
+void stack_scrubber_stop() {
+    pthread_mutex_lock(&stack_scrubber_mutex);
+    if (!stack_scrubber_running) {
+        pthread_mutex_unlock(&stack_scrubber_mutex);
+        return;
+    }
+    stack_scrubber_stopping = true;
+    pthread_cond_signal(&stack_scrubber_cond);
+    pthread_mutex_unlock(&stack_scrubber_mutex);
 
-    STACK_LOG(stk, "Attempting to get error state");
-    STACK_VERIFY(stk);
-    STACK_LOG(stk, "Return error state");
+    pthread_join(stack_scrubber_thread, NULL);
 
-    return stk->error;
+    pthread_mutex_lock(&stack_scrubber_mutex);
+    stack_scrubber_running = false;
+    pthread_mutex_unlock(&stack_scrubber_mutex);
 }
@@ -0,0 +1,549 @@
+// mremap and MAP_ANONYMOUS are extensions
+#define _GNU_SOURCE
+
+#include "stack_allocator.h"
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void* stack_malloc_allocate(void* data, size_t size) {
+    (void) data;
+    return malloc(size);
+}
+
+void* stack_malloc_reallocate(void* data, void* p, size_t old_size, size_t new_size) {
+    (void) data;
+    (void) old_size;
+    return realloc(p, new_size);
+}
+
+void stack_malloc_free(void* data, void* p, size_t size) {
+    (void) data;
+    (void) size;
+    free(p);
+}
+
+const StackAllocator stack_malloc_allocator = {
+    .allocate = stack_malloc_allocate,
+    .reallocate = stack_malloc_reallocate,
+    .free = stack_malloc_free,
+    .data = NULL,
+};
+
+/*
+ * Arenas hand out memory from a list of blocks by bumping an offset.
+ * Blocks are kept when the arena is reset, so that an arena that is reset after each request
+ * stops calling malloc once it has grown to the size a request needs
+ */
+
+enum { STACK_ARENA_ALIGN = alignof(max_align_t) };
+enum { STACK_ARENA_DEFAULT_BLOCK_SIZE = 1u << 16 };
+
+struct stack_arena_block_t {
+    StackArenaBlock* next;
+    // Usable bytes that follow the header
+    size_t size;
+    size_t used;
+};
+
+// Keep the memory that follows a block header aligned
+#define STACK_ARENA_HEADER_SIZE \
+    ((sizeof(StackArenaBlock) + STACK_ARENA_ALIGN - 1) / STACK_ARENA_ALIGN * STACK_ARENA_ALIGN)
+
+size_t stack_arena_round(size_t size) {
+    return (size) ? (size + STACK_ARENA_ALIGN - 1) / STACK_ARENA_ALIGN * STACK_ARENA_ALIGN : STACK_ARENA_ALIGN;
+}
+
+char* stack_arena_block_memory(StackArenaBlock* block) {
+    assert(block);
+
+    return (char*) block + STACK_ARENA_HEADER_SIZE;
+}
+
+void* stack_arena_allocate(void* data, size_t size) {
+    StackArena* arena = data;
+    assert(arena);
+
+    size = stack_arena_round(size);
+    // Blocks after the current one were used before the last reset and are free now
+    StackArenaBlock* block = arena->current;
+    while (block && block->size - block->used < size) {
+        block = block->next;
+        if (block) {
+            block->used = 0;
+        }
+    }
+
+    if (!block) {
+        size_t block_size = (size > arena->block_size) ? size : arena->block_size;
+        block = malloc(STACK_ARENA_HEADER_SIZE + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = 0;
+        if (arena->current) {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        } else {
+            block->next = arena->first;
+            arena->first = block;
+        }
+    }
+
+    arena->current = block;
+    void* p = stack_arena_block_memory(block) + block->used;
+    block->used += size;
+    arena->last = p;
+    return p;
+}
+
+void* stack_arena_reallocate(void* data, void* p, size_t old_size, size_t new_size) {
+    StackArena* arena = data;
+    assert(arena);
+
+    if (!p) {
+        return stack_arena_allocate(arena, new_size);
+    }
+    // The most recent allocation can be resized in place if its block has room
+    StackArenaBlock* block = arena->current;
+    if (p == arena->last) {
+        size_t offset = (size_t) ((char*) p - stack_arena_block_memory(block));
+        if (offset + stack_arena_round(new_size) <= block->size) {
+            block->used = offset + stack_arena_round(new_size);
+            return p;
+        }
+    } else if (new_size <= old_size) {
+        return p;
+    }
+
+    void* new_p = stack_arena_allocate(arena, new_size);
+    if (new_p) {
+        memcpy(new_p, p, (old_size < new_size) ? old_size : new_size);
+    }
+    return new_p;
+}
+
+void stack_arena_free(void* data, void* p, size_t size) {
+    StackArena* arena = data;
+    assert(arena);
+
+    // Only the most recent allocation can be given back before the arena is reset
+    if (p && p == arena->last) {
+        arena->current->used -= stack_arena_round(size);
+        arena->last = NULL;
+    }
+}
+
+StackArena* stack_arena_create(size_t block_size) {
+    StackArena* arena = calloc(1, sizeof(*arena));
+    if (!arena) {
+        return NULL;
+    }
+    arena->block_size = (block_size) ? stack_arena_round(block_size) : STACK_ARENA_DEFAULT_BLOCK_SIZE;
+    stack_register_arena(arena);
+    return arena;
+}
+
+void stack_arena_reset(StackArena* arena) {
+    assert(arena);
+
+    stack_release_arena_stacks(arena);
+    arena->current = arena->first;
+    if (arena->current) {
+        arena->current->used = 0;
+    }
+    arena->last = NULL;
+}
+
+void stack_arena_destroy(StackArena* arena) {
+    if (arena) {
+        stack_release_arena_stacks(arena);
+        stack_unregister_arena(arena);
+        while (arena->first) {
+            StackArenaBlock* next = arena->first->next;
+            free(arena->first);
+            arena->first = next;
+        }
+        free(arena);
+    }
+}
+
+StackAllocator stack_arena_allocator(StackArena* arena) {
+    assert(arena);
+
+    StackAllocator allocator = {
+        .allocate = stack_arena_allocate,
+        .reallocate = stack_arena_reallocate,
+        .free = stack_arena_free,
+        .data = arena,
+    };
+    return allocator;
+}
+
+StackArena* stack_allocator_arena(StackAllocator const* allocator) {
+    assert(allocator);
+
+    return (allocator->allocate == stack_arena_allocate) ? allocator->data : NULL;
+}
+
+/*
+ * Pools keep freed memory in lists of power of 2 size classes and reuse it for later allocations of the same class.
+ * Allocations larger than the largest class go straight to malloc
+ */
+
+enum {
+    STACK_POOL_MIN_SHIFT = 4,
+    STACK_POOL_MAX_SHIFT = 16,
+    STACK_POOL_CLASS_COUNT = STACK_POOL_MAX_SHIFT - STACK_POOL_MIN_SHIFT + 1,
+};
+
+typedef struct stack_pool_chunk_t {
+    struct stack_pool_chunk_t* next;
+} StackPoolChunk;
+
+struct stack_pool_t {
+    StackPoolChunk* free_lists[STACK_POOL_CLASS_COUNT];
+};
+
+/*
+ * Get the size class of an allocation, or STACK_POOL_CLASS_COUNT if it's too large to be pooled
+ */
+unsigned stack_pool_class(size_t size) {
+    unsigned shift = STACK_POOL_MIN_SHIFT;
+    while (shift <= STACK_POOL_MAX_SHIFT && ((size_t) 1 << shift) < size) {
+        shift++;
+    }
+    return shift - STACK_POOL_MIN_SHIFT;
+}
+
+void* stack_pool_allocate(void* data, size_t size) {
+    StackPool* pool = data;
+    assert(pool);
+
+    unsigned size_class = stack_pool_class(size);
+    if (size_class == STACK_POOL_CLASS_COUNT) {
+        return malloc(size);
+    }
+    StackPoolChunk* chunk = pool->free_lists[size_class];
+    if (chunk) {
+        pool->free_lists[size_class] = chunk->next;
+        return chunk;
+    }
+    return malloc((size_t) 1 << (size_class + STACK_POOL_MIN_SHIFT));
+}
+
+void stack_pool_free(void* data, void* p, size_t size) {
+    StackPool* pool = data;
+    assert(pool);
+
+    if (!p) {
+        return;
+    }
+    unsigned size_class = stack_pool_class(size);
+    if (size_class == STACK_POOL_CLASS_COUNT) {
+        free(p);
+        return;
+    }
+    StackPoolChunk* chunk = p;
+    chunk->next = pool->free_lists[size_class];
+    pool->free_lists[size_class] = chunk;
+}
+
+void* stack_pool_reallocate(void* data, void* p, size_t old_size, size_t new_size) {
+    StackPool* pool = data;
+    assert(pool);
+
+    if (!p) {
+        return stack_pool_allocate(pool, new_size);
+    }
+    unsigned old_class = stack_pool_class(old_size);
+    unsigned new_class = stack_pool_class(new_size);
+    if (old_class == STACK_POOL_CLASS_COUNT && new_class == STACK_POOL_CLASS_COUNT) {
+        return realloc(p, new_size);
+    }
+    if (old_class == new_class) {
+        return p;
+    }
+
+    void* new_p = stack_pool_allocate(pool, new_size);
+    if (new_p) {
+        memcpy(new_p, p, (old_size < new_size) ? old_size : new_size);
+        stack_pool_free(pool, p, old_size);
+    }
+    return new_p;
+}
+
+StackPool* stack_pool_create() {
+    return calloc(1, sizeof(StackPool));
+}
+
+void stack_pool_destroy(StackPool* pool) {
+    if (pool) {
+        for (unsigned i = 0; i < STACK_POOL_CLASS_COUNT; i++) {
+            while (pool->free_lists[i]) {
+                StackPoolChunk* next = pool->free_lists[i]->next;
+                free(pool->free_lists[i]);
+                pool->free_lists[i] = next;
+            }
+        }
+        free(pool);
+    }
+}
+
+StackAllocator stack_pool_allocator(StackPool* pool) {
+    assert(pool);
+
+    StackAllocator allocator = {
+        .allocate = stack_pool_allocate,
+        .reallocate = stack_pool_reallocate,
+        .free = stack_pool_free,
+        .data = pool,
+    };
+    return allocator;
+}
+
+/*
+ * Guarded buffers are mappings of their own, with an inaccessible guard page on each side,
+ * so that accessing memory right before or after them faults immediately
+ */
+
+size_t stack_page_size() {
+    static atomic_size_t page_size = 0;
+
+    size_t size = atomic_load_explicit(&page_size, memory_order_relaxed);
+    if (!size) {
+        size = (size_t) sysconf(_SC_PAGESIZE);
+        atomic_store_explicit(&page_size, size, memory_order_relaxed);
+    }
+    return size;
+}
+
+void* stack_guarded_map(size_t size) {
+    size_t page_size = stack_page_size();
+    assert(size && size % page_size == 0);
+
+    char* base = mmap(NULL, size + 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(base, page_size, PROT_NONE) || mprotect(base + page_size + size, page_size, PROT_NONE)) {
+        munmap(base, size + 2 * page_size);
+        return NULL;
+    }
+    return base + page_size;
+}
+
+void* stack_guarded_remap(void* p, size_t old_size, size_t new_size, bool* copied) {
+    assert(copied);
+
+    *copied = false;
+    if (!p) {
+        return stack_guarded_map(new_size);
+    }
+    size_t page_size = stack_page_size();
+    assert(old_size % page_size == 0 && new_size % page_size == 0);
+    char* base = (char*) p - page_size;
+
+    // Shrinking only moves the back guard page and unmaps the pages past it
+    if (new_size <= old_size) {
+        if (new_size < old_size) {
+            if (mprotect(base + page_size + new_size, page_size, PROT_NONE)) {
+                return NULL;
+            }
+            munmap(base + 2 * page_size + new_size, old_size - new_size);
+        }
+        return p;
+    }
+
+#ifdef __linux__
+    // With the guard pages made accessible the buffer is a single mapping again,
+    // which mremap can grow or move by remapping its pages instead of copying them
+    if (!mprotect(base, old_size + 2 * page_size, PROT_READ | PROT_WRITE)) {
+        char* new_base = mremap(base, old_size + 2 * page_size, new_size + 2 * page_size, MREMAP_MAYMOVE);
+        if (new_base != MAP_FAILED) {
+            mprotect(new_base, page_size, PROT_NONE);
+            mprotect(new_base + page_size + new_size, page_size, PROT_NONE);
+            return new_base + page_size;
+        }
+        mprotect(base, page_size, PROT_NONE);
+        mprotect(base + page_size + old_size, page_size, PROT_NONE);
+    }
+#endif
+
+    char* new_p = stack_guarded_map(new_size);
+    if (new_p) {
+        memcpy(new_p, p, old_size);
+        stack_guarded_unmap(p, old_size);
+        *copied = true;
+    }
+    return new_p;
+}
+
+void stack_guarded_unmap(void* p, size_t size) {
+    if (p) {
+        size_t page_size = stack_page_size();
+        munmap((char*) p - page_size, size + 2 * page_size);
+    }
+}
+
+/*
+ * Huge page buffers are anonymous mappings aligned to STACK_HUGE_PAGE_SIZE and advised to be backed by
+ * transparent huge pages, so that they are made of whole huge pages. Their sizes are rounded up to match
+ */
+
+size_t stack_huge_size(size_t size) {
+    return (size + STACK_HUGE_PAGE_SIZE - 1) / STACK_HUGE_PAGE_SIZE * STACK_HUGE_PAGE_SIZE;
+}
+
+void stack_huge_advise(void* p, size_t size) {
+#ifdef MADV_HUGEPAGE
+    // Without transparent huge pages the advice fails, and the buffer is backed by normal pages
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+}
+
+/*
+ * Map size bytes, a whole number of huge pages, at an address aligned to STACK_HUGE_PAGE_SIZE
+ */
+char* stack_huge_reserve(size_t size) {
+    assert(size && size % STACK_HUGE_PAGE_SIZE == 0);
+
+    // Map an extra huge page and trim the mapping down to its aligned part
+    size_t map_size = size + STACK_HUGE_PAGE_SIZE;
+    char* base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    char* p = (char*) stack_huge_size((uintptr_t) base);
+    if (p > base) {
+        munmap(base, (size_t) (p - base));
+    }
+    if (p + size < base + map_size) {
+        munmap(p + size, (size_t) (base + map_size - (p + size)));
+    }
+    return p;
+}
+
+void* stack_huge_map(size_t size) {
+    size = stack_huge_size(size);
+    char* p = stack_huge_reserve(size);
+    if (p) {
+        stack_huge_advise(p, size);
+    }
+    return p;
+}
+
+void* stack_huge_remap(void* p, size_t old_size, size_t new_size, bool* copied) {
+    assert(copied);
+
+    *copied = false;
+    if (!p) {
+        return stack_huge_map(new_size);
+    }
+    old_size = stack_huge_size(old_size);
+    new_size = stack_huge_size(new_size);
+    assert(new_size);
+
+    // Sizes are rounded to whole huge pages, so most resizes fit in the mapping the buffer already has
+    if (new_size <= old_size) {
+        if (new_size < old_size) {
+            munmap((char*) p + new_size, old_size - new_size);
+        }
+        return p;
+    }
+
+#ifdef __linux__
+    // Grow the mapping in place if nothing is mapped after it,
+    // otherwise move its pages to the start of a new aligned mapping instead of copying them
+    char* new_p = mremap(p, old_size, new_size, 0);
+    if (new_p != MAP_FAILED) {
+        stack_huge_advise(new_p, new_size);
+        return new_p;
+    }
+    new_p = stack_huge_reserve(new_size);
+    if (new_p) {
+        if (mremap(p, old_size, old_size, MREMAP_MAYMOVE | MREMAP_FIXED, new_p) != MAP_FAILED) {
+            stack_huge_advise(new_p, new_size);
+            return new_p;
+        }
+        munmap(new_p, new_size);
+    }
+#endif
+
+    char* copy = stack_huge_map(new_size);
+    if (copy) {
+        memcpy(copy, p, old_size);
+        munmap(p, old_size);
+        *copied = true;
+    }
+    return copy;
+}
+
+void stack_huge_unmap(void* p, size_t size) {
+    if (p) {
+        munmap(p, stack_huge_size(size));
+    }
+}
+
+void stack_prefault(void* p, size_t size) {
+    if (!size) {
+        return;
+    }
+    assert(p);
+
+    size_t page_size = stack_page_size();
+    char* first_page = (char*) ((uintptr_t) p / page_size * page_size);
+    char* end = (char*) p + size;
+#ifdef MADV_POPULATE_WRITE
+    // Populating a range works like MAP_POPULATE does for a new mapping, and is supported from Linux 5.14
+    size_t populate_size = ((size_t) (end - first_page) + page_size - 1) / page_size * page_size;
+    if (!madvise(first_page, populate_size, MADV_POPULATE_WRITE)) {
+        return;
+    }
+#endif
+    // Writing back a byte of each page faults it in for writing
+    for (char* page = first_page; page < end; page += page_size) {
+        volatile char* byte = (page < (char*) p) ? (char*) p : page;
+        *byte = *byte;
+    }
+}
+
+void* stack_file_remap(int fd, void* p, size_t old_size, size_t new_size) {
+    assert(new_size);
+
+    // The file must be grown before the pages past its old end are mapped
+    if (new_size > old_size && ftruncate(fd, (off_t) new_size)) {
+        return NULL;
+    }
+    char* new_p = MAP_FAILED;
+    if (!p) {
+        new_p = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+#ifdef __linux__
+        new_p = mremap(p, old_size, new_size, MREMAP_MAYMOVE);
+#else
+        // The pages are the file's, so mapping it anew loses nothing
+        new_p = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (new_p != MAP_FAILED) {
+            munmap(p, old_size);
+        }
+#endif
+    }
+    if (new_p == MAP_FAILED) {
+        if (new_size > old_size && p) {
+            ftruncate(fd, (off_t) old_size);
+        }
+        return NULL;
+    }
+    if (new_size < old_size) {
+        ftruncate(fd, (off_t) new_size);
+    }
+    return new_p;
+}
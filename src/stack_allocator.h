@@ -0,0 +1,86 @@
+/*
+ * Allocators shared by StackLib's translation units
+ */
+#pragma once
+
+#include "stack.h"
+
+typedef struct stack_arena_block_t StackArenaBlock;
+
+struct stack_arena_t {
+    StackArenaBlock* first;
+    // Block that allocations are currently made from
+    StackArenaBlock* current;
+    size_t block_size;
+    // The most recent allocation, which can be grown or freed in place
+    void* last;
+
+    // Stacks allocated in the arena and not freed yet, linked through their registry links
+    Stack* stacks;
+    // Links in the list of all arenas
+    struct stack_arena_t* next;
+    struct stack_arena_t** pprev;
+};
+
+// Allocator used by Stacks that are allocated without one
+extern const StackAllocator stack_malloc_allocator;
+
+size_t stack_page_size();
+
+/*
+ * Map size bytes between two guard pages. size must be a multiple of the page size
+ */
+void* stack_guarded_map(size_t size);
+
+/*
+ * Resize a guarded buffer, or map a new one if p is NULL.
+ * Return NULL and leave p mapped if the buffer can't be resized.
+ * copied is set if the contents had to be copied because the pages couldn't be remapped
+ */
+void* stack_guarded_remap(void* p, size_t old_size, size_t new_size, bool* copied);
+
+void stack_guarded_unmap(void* p, size_t size);
+
+// Size and alignment of the mappings that hold huge page buffers
+enum { STACK_HUGE_PAGE_SIZE = 1u << 21 };
+
+/*
+ * Map a buffer of at least size bytes aligned to STACK_HUGE_PAGE_SIZE and advised to be backed by huge pages
+ */
+void* stack_huge_map(size_t size);
+
+/*
+ * Resize a huge page buffer, or map a new one if p is NULL.
+ * Return NULL and leave p mapped if the buffer can't be resized.
+ * copied is set if the contents had to be copied because the pages couldn't be remapped
+ */
+void* stack_huge_remap(void* p, size_t old_size, size_t new_size, bool* copied);
+
+void stack_huge_unmap(void* p, size_t size);
+
+/*
+ * Fault in the pages that hold size bytes at p for writing, without changing them
+ */
+void stack_prefault(void* p, size_t size);
+
+/*
+ * Resize the shared mapping of a file, or map it if p is NULL, resizing the file to match.
+ * Return NULL and leave p mapped if the mapping can't be resized
+ */
+void* stack_file_remap(int fd, void* p, size_t old_size, size_t new_size);
+
+/*
+ * Get the arena an allocator allocates from, or NULL if it's not an arena's allocator
+ */
+StackArena* stack_allocator_arena(StackAllocator const* allocator);
+
+// Defined in stack.c, which keeps the list of all Stacks
+
+void stack_register_arena(StackArena* arena);
+
+/*
+ * Drop the Stacks that are still allocated in an arena, keeping their counters in the global totals
+ */
+void stack_release_arena_stacks(StackArena* arena);
+
+void stack_unregister_arena(StackArena* arena);
@@ -0,0 +1,18 @@
+/*
+ * Definitions shared by the Stack implementations
+ */
+#pragma once
+
+#include <limits.h>
+
+typedef unsigned long long canary_type;
+#define CANARY_VALUE 0xF072E3546BAD189Cull
+
+typedef unsigned long long hash_type;
+#define HASH_INITIAL_VALUE 0x600D4A54ull
+
+static inline hash_type rotate_left(hash_type value) {
+    return value << 1 | value >> (sizeof(value) * CHAR_BIT - 1);
+}
+
+#define ARR_LENGTH(arr) (sizeof(arr) / sizeof(*arr))
@@ -0,0 +1,223 @@
+/*
+ * Hash functions used for the metadata and data hashes.
+ * One of them is chosen at build time:
+ *  - STACK_HASH_WYHASH (the default) hashes 8 bytes at a time with 64x64->128 bit multiplications
+ *  - STACK_HASH_CRC32C uses the CRC32C instructions of SSE4.2 on x86 and of ARMv8 when they are available
+ *  - STACK_HASH_ROTATE is the original byte at a time rotate and xor hash
+ */
+#pragma once
+
+#include "stack_common.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define STACK_HASH_CRC32C_X86
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if !defined(STACK_HASH_WYHASH) && !defined(STACK_HASH_CRC32C) && !defined(STACK_HASH_ROTATE)
+#define STACK_HASH_WYHASH
+#endif
+
+static inline uint64_t stack_hash_read64(unsigned char const* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t stack_hash_read32(unsigned char const* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/*
+ * Original hash, every byte is a step of a serial dependency chain.
+ * Flipping the same bit of two bytes that are 64 bytes apart, or bits one apart in neighbouring bytes,
+ * leaves the hash unchanged
+ */
+static inline hash_type stack_hash_rotate(void const* p, size_t num, hash_type seed) {
+    unsigned char const* bytes = p;
+    hash_type hash_value = seed;
+    for (size_t i = 0; i < num; i++) {
+        hash_value = rotate_left(hash_value) ^ bytes[i];
+    }
+    return hash_value;
+}
+
+/*
+ * Replace a and b with the low and high halves of their 128 bit product
+ */
+static inline void stack_hash_multiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t) *a * *b;
+    *a = (uint64_t) product;
+    *b = (uint64_t) (product >> 64);
+#else
+    uint64_t a_lo = (uint32_t) *a, a_hi = *a >> 32;
+    uint64_t b_lo = (uint32_t) *b, b_hi = *b >> 32;
+    uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (uint32_t) hi_lo + lo_hi;
+    *a = (cross << 32) | (uint32_t) lo_lo;
+    *b = hi_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+}
+
+/*
+ * Multiply two 64 bit values and fold the 128 bit product
+ */
+static inline uint64_t stack_hash_mix(uint64_t a, uint64_t b) {
+    stack_hash_multiply(&a, &b);
+    return a ^ b;
+}
+
+static const uint64_t stack_hash_secret[4] = {
+    0xa0761d6478bd642full,
+    0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull,
+    0x589965cc75374cc3ull,
+};
+
+/*
+ * wyhash: inputs of up to 16 bytes take two loads and three multiplications,
+ * longer inputs are consumed 48 bytes at a time by three independent lanes
+ */
+static inline hash_type stack_hash_wyhash(void const* p, size_t num, hash_type seed) {
+    unsigned char const* bytes = p;
+    uint64_t a = 0;
+    uint64_t b = 0;
+    seed ^= stack_hash_mix(seed ^ stack_hash_secret[0], stack_hash_secret[1]);
+    if (num <= 16) {
+        if (num >= 4) {
+            size_t offset = (num >> 3) << 2;
+            a = (stack_hash_read32(bytes) << 32) | stack_hash_read32(bytes + offset);
+            b = (stack_hash_read32(bytes + num - 4) << 32) | stack_hash_read32(bytes + num - 4 - offset);
+        } else if (num) {
+            a = ((uint64_t) bytes[0] << 16) | ((uint64_t) bytes[num >> 1] << 8) | bytes[num - 1];
+        }
+    } else {
+        size_t left = num;
+        if (left > 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = stack_hash_mix(stack_hash_read64(bytes) ^ stack_hash_secret[1],
+                                      stack_hash_read64(bytes + 8) ^ seed);
+                seed1 = stack_hash_mix(stack_hash_read64(bytes + 16) ^ stack_hash_secret[2],
+                                       stack_hash_read64(bytes + 24) ^ seed1);
+                seed2 = stack_hash_mix(stack_hash_read64(bytes + 32) ^ stack_hash_secret[3],
+                                       stack_hash_read64(bytes + 40) ^ seed2);
+                bytes += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (left > 16) {
+            seed = stack_hash_mix(stack_hash_read64(bytes) ^ stack_hash_secret[1], stack_hash_read64(bytes + 8) ^ seed);
+            bytes += 16;
+            left -= 16;
+        }
+        a = stack_hash_read64(bytes + left - 16);
+        b = stack_hash_read64(bytes + left - 8);
+    }
+    a ^= stack_hash_secret[1];
+    b ^= seed;
+    stack_hash_multiply(&a, &b);
+    return stack_hash_mix(a ^ stack_hash_secret[0] ^ num, b ^ stack_hash_secret[1]);
+}
+
+static inline uint32_t stack_hash_crc32c_u8(uint32_t crc, unsigned char byte) {
+#if defined(__ARM_FEATURE_CRC32)
+    return __crc32cb(crc, byte);
+#else
+    crc ^= byte;
+    for (int i = 0; i < 8; i++) {
+        crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+    }
+    return crc;
+#endif
+}
+
+static inline uint32_t stack_hash_crc32c_u64(uint32_t crc, uint64_t word) {
+#if defined(__ARM_FEATURE_CRC32)
+    return __crc32cd(crc, word);
+#else
+    for (int i = 0; i < 8; i++) {
+        crc = stack_hash_crc32c_u8(crc, (unsigned char) (word >> (8 * i)));
+    }
+    return crc;
+#endif
+}
+
+static inline uint32_t stack_hash_crc32c_sw(uint32_t crc, unsigned char const* bytes, size_t num) {
+    for (; num >= 8; num -= 8, bytes += 8) {
+        crc = stack_hash_crc32c_u64(crc, stack_hash_read64(bytes));
+    }
+    for (; num; num--, bytes++) {
+        crc = stack_hash_crc32c_u8(crc, *bytes);
+    }
+    return crc;
+}
+
+#ifdef STACK_HASH_CRC32C_X86
+// SSE4.2 is checked for at run time, so that the library doesn't have to be built for it
+__attribute__((target("sse4.2"))) static inline uint32_t stack_hash_crc32c_sse42(uint32_t crc, unsigned char const* bytes,
+                                                                                  size_t num) {
+#ifdef __x86_64__
+    for (; num >= 8; num -= 8, bytes += 8) {
+        crc = (uint32_t) _mm_crc32_u64(crc, stack_hash_read64(bytes));
+    }
+#endif
+    for (; num >= 4; num -= 4, bytes += 4) {
+        crc = _mm_crc32_u32(crc, (uint32_t) stack_hash_read32(bytes));
+    }
+    for (; num; num--, bytes++) {
+        crc = _mm_crc32_u8(crc, *bytes);
+    }
+    return crc;
+}
+#endif
+
+/*
+ * CRC32C detects every error burst of up to 32 bits, but only has 32 bits,
+ * so it's spread over the 64 bits of a hash by a final multiplication
+ */
+static inline hash_type stack_hash_crc32c(void const* p, size_t num, hash_type seed) {
+    uint32_t crc = (uint32_t) seed ^ (uint32_t) (seed >> 32);
+#ifdef STACK_HASH_CRC32C_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc = stack_hash_crc32c_sse42(crc, p, num);
+    } else {
+        crc = stack_hash_crc32c_sw(crc, p, num);
+    }
+#else
+    crc = stack_hash_crc32c_sw(crc, p, num);
+#endif
+    return stack_hash_mix(crc ^ seed ^ stack_hash_secret[0], stack_hash_secret[1]);
+}
+
+/*
+ * Hash num bytes with the hash chosen at build time
+ */
+static inline hash_type stack_hash_bytes(void const* p, size_t num, hash_type seed) {
+#if defined(STACK_HASH_CRC32C)
+    return stack_hash_crc32c(p, num, seed);
+#elif defined(STACK_HASH_ROTATE)
+    return stack_hash_rotate(p, num, seed);
+#else
+    return stack_hash_wyhash(p, num, seed);
+#endif
+}
+
+#if defined(STACK_HASH_CRC32C)
+#define STACK_HASH_NAME "STACK_HASH_CRC32C"
+#elif defined(STACK_HASH_ROTATE)
+#define STACK_HASH_NAME "STACK_HASH_ROTATE"
+#else
+#define STACK_HASH_NAME "STACK_HASH_WYHASH"
+#endif
@@ -0,0 +1,269 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stack_log.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Number of records each thread can buffer, must be a power of 2
+enum { STACK_LOG_RING_SIZE = 1u << 14 };
+enum { STACK_LOG_FLUSH_INTERVAL_MS = 10 };
+enum { STACK_LOG_FILE_BUFFER_SIZE = 1u << 16 };
+
+/*
+ * Single producer, single consumer ring of records.
+ * The owning thread advances head, the flusher thread advances tail
+ */
+typedef struct stack_log_ring_t {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    // Records dropped because the ring was full
+    atomic_size_t dropped;
+    // Set when the owning thread exits, so that the flusher frees the ring once it's drained
+    atomic_bool orphaned;
+    uint32_t thread;
+    struct stack_log_ring_t* next;
+    StackLogRecord records[STACK_LOG_RING_SIZE];
+} StackLogRing;
+
+// Protects the list of rings and the flusher's stop request
+static pthread_mutex_t stack_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stack_log_cond = PTHREAD_COND_INITIALIZER;
+static StackLogRing* stack_log_rings = NULL;
+static uint32_t stack_log_thread_count = 0;
+static bool stack_log_stopping = false;
+
+// Protects starting and stopping the flusher
+static pthread_mutex_t stack_log_users_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Number of Stacks that write to the log
+static size_t stack_log_users = 0;
+static bool stack_log_running = false;
+static pthread_t stack_log_flusher_thread;
+// Only used by the flusher while it's running
+static FILE* stack_log_file = NULL;
+
+static pthread_once_t stack_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stack_log_key;
+static _Thread_local StackLogRing* stack_log_ring = NULL;
+
+uint64_t stack_log_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+void stack_log_orphan_ring(void* ring) {
+    atomic_store_explicit(&((StackLogRing*) ring)->orphaned, true, memory_order_release);
+}
+
+void stack_log_finalize();
+
+void stack_log_initialize() {
+    pthread_key_create(&stack_log_key, stack_log_orphan_ring);
+    // Write out what is buffered if the process exits with Stacks still allocated
+    atexit(stack_log_finalize);
+}
+
+StackLogRing* stack_log_register_ring() {
+    pthread_once(&stack_log_once, stack_log_initialize);
+
+    StackLogRing* ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->orphaned, false);
+
+    pthread_mutex_lock(&stack_log_mutex);
+    ring->thread = stack_log_thread_count++;
+    ring->next = stack_log_rings;
+    stack_log_rings = ring;
+    pthread_mutex_unlock(&stack_log_mutex);
+
+    pthread_setspecific(stack_log_key, ring);
+    stack_log_ring = ring;
+    return ring;
+}
+
+void stack_log_write(void const* stk, STACK_LOG_EVENT event, uint64_t arg0, uint64_t arg1) {
+    StackLogRing* ring = stack_log_ring;
+    if (!ring) {
+        ring = stack_log_register_ring();
+        if (!ring) {
+            return;
+        }
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == STACK_LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    StackLogRecord* record = &ring->records[head & (STACK_LOG_RING_SIZE - 1)];
+    record->timestamp = stack_log_clock(CLOCK_MONOTONIC);
+    record->stack = (uint64_t) (uintptr_t) stk;
+    record->event = event;
+    record->thread = ring->thread;
+    record->arg0 = arg0;
+    record->arg1 = arg1;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    // Wake the flusher early once the ring is half full, instead of waiting for the flush interval
+    if (head - tail == STACK_LOG_RING_SIZE / 2) {
+        pthread_cond_signal(&stack_log_cond);
+    }
+}
+
+/*
+ * Write a ring's records to the log file.
+ * Returns true if the ring is orphaned and has nothing left to write
+ */
+bool stack_log_drain_ring(StackLogRing* ring) {
+    assert(ring);
+
+    bool orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while (tail != head) {
+        size_t first = tail & (STACK_LOG_RING_SIZE - 1);
+        size_t num = head - tail;
+        if (num > STACK_LOG_RING_SIZE - first) {
+            num = STACK_LOG_RING_SIZE - first;
+        }
+        fwrite(&ring->records[first], sizeof(*ring->records), num, stack_log_file);
+        tail += num;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    size_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped) {
+        StackLogRecord record = {
+            .timestamp = stack_log_clock(CLOCK_MONOTONIC),
+            .stack = 0,
+            .event = STACK_EVENT_LOG_DROPPED,
+            .thread = ring->thread,
+            .arg0 = dropped,
+            .arg1 = 0,
+        };
+        fwrite(&record, sizeof(record), 1, stack_log_file);
+    }
+
+    return orphaned;
+}
+
+// Must be called with stack_log_mutex held
+void stack_log_drain() {
+    for (StackLogRing** ring_p = &stack_log_rings; *ring_p;) {
+        StackLogRing* ring = *ring_p;
+        if (stack_log_drain_ring(ring)) {
+            *ring_p = ring->next;
+            free(ring);
+        } else {
+            ring_p = &ring->next;
+        }
+    }
+    fflush(stack_log_file);
+}
+
+void* stack_log_flusher(void* arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&stack_log_mutex);
+    while (!stack_log_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += STACK_LOG_FLUSH_INTERVAL_MS * 1000000l;
+        if (deadline.tv_nsec >= 1000000000l) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000l;
+        }
+        pthread_cond_timedwait(&stack_log_cond, &stack_log_mutex, &deadline);
+        stack_log_drain();
+    }
+    // The log may be stopped before the flusher first gets the lock, so the rings are drained once more
+    stack_log_drain();
+    pthread_mutex_unlock(&stack_log_mutex);
+
+    return NULL;
+}
+
+// Must be called with stack_log_users_mutex held
+void stack_log_start() {
+    stack_log_file = fopen(STACK_LOG_FILENAME, "ab");
+    if (!stack_log_file) {
+        return;
+    }
+    setvbuf(stack_log_file, NULL, _IOFBF, STACK_LOG_FILE_BUFFER_SIZE);
+
+    StackLogHeader header = {
+        .magic = STACK_LOG_MAGIC,
+        .version = STACK_LOG_VERSION,
+        .record_size = sizeof(StackLogRecord),
+        .realtime = stack_log_clock(CLOCK_REALTIME),
+        .monotonic = stack_log_clock(CLOCK_MONOTONIC),
+        .reserved = 0,
+    };
+    fwrite(&header, sizeof(header), 1, stack_log_file);
+
+    stack_log_stopping = false;
+    if (pthread_create(&stack_log_flusher_thread, NULL, stack_log_flusher, NULL)) {
+        fclose(stack_log_file);
+        stack_log_file = NULL;
+        return;
+    }
+    stack_log_running = true;
+}
+
+// Must be called with stack_log_users_mutex held
+void stack_log_stop() {
+    if (!stack_log_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&stack_log_mutex);
+    stack_log_stopping = true;
+    pthread_cond_signal(&stack_log_cond);
+    pthread_mutex_unlock(&stack_log_mutex);
+
+    // The flusher drains all rings once more before exiting
+    pthread_join(stack_log_flusher_thread, NULL);
+    stack_log_running = false;
+
+    fclose(stack_log_file);
+    stack_log_file = NULL;
+}
+
+void stack_log_finalize() {
+    pthread_mutex_lock(&stack_log_users_mutex);
+    stack_log_stop();
+    pthread_mutex_unlock(&stack_log_users_mutex);
+}
+
+void stack_log_open() {
+    pthread_once(&stack_log_once, stack_log_initialize);
+
+    pthread_mutex_lock(&stack_log_users_mutex);
+    stack_log_users++;
+    if (!stack_log_running) {
+        stack_log_start();
+    }
+    pthread_mutex_unlock(&stack_log_users_mutex);
+}
+
+void stack_log_close() {
+    pthread_mutex_lock(&stack_log_users_mutex);
+    assert(stack_log_users);
+    if (!--stack_log_users) {
+        stack_log_stop();
+    }
+    pthread_mutex_unlock(&stack_log_users_mutex);
+}
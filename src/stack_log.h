@@ -0,0 +1,161 @@
+/*
+ * Binary event log shared by StackLib and StackLogDecode.
+ *
+ * A log file is a sequence of 40 byte entries.
+ * Each time the log is opened, a StackLogHeader is appended,
+ * followed by the StackLogRecords that were written while it was open.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef STACK_LOG_FILENAME
+#define STACK_LOG_FILENAME "stack_log"
+#endif
+
+// Stacks that fail verification are dumped to this file in text form
+#ifndef STACK_DUMP_FILENAME
+#define STACK_DUMP_FILENAME STACK_LOG_FILENAME ".dump"
+#endif
+
+#define STACK_LOG_MAGIC "STACKLOG"
+// Version 2 added the element size to STACK_EVENT_ALLOCATE_DONE
+enum { STACK_LOG_VERSION = 2 };
+
+typedef struct stack_log_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    // Wall clock and monotonic clock read at the same moment, in nanoseconds,
+    // used to convert record timestamps to wall clock time
+    uint64_t realtime;
+    uint64_t monotonic;
+    uint64_t reserved;
+} StackLogHeader;
+
+typedef struct stack_log_record_t {
+    // Monotonic clock, in nanoseconds
+    uint64_t timestamp;
+    uint64_t stack;
+    uint32_t event;
+    // Index of the logging thread, in order of first log write
+    uint32_t thread;
+    uint64_t arg0;
+    uint64_t arg1;
+} StackLogRecord;
+
+_Static_assert(sizeof(StackLogHeader) == 40, "StackLogHeader must be 40 bytes");
+_Static_assert(sizeof(StackLogRecord) == 40, "StackLogRecord must be 40 bytes");
+
+/*
+ * How an event's arguments are passed to stack_log and stored in a record.
+ * Element events store a digest of the element in arg0 and the element size in arg1.
+ * Elements of up to 8 bytes are stored as is
+ */
+typedef enum stack_log_args_e {
+    STACK_LOG_NO_ARGS,
+    STACK_LOG_ONE_ARG,
+    STACK_LOG_TWO_ARGS,
+    STACK_LOG_ELEM_ARG,
+} STACK_LOG_ARGS;
+
+// Numeric arguments are size_t, and are printed with the event's format
+#define STACK_LOG_EVENTS(X)                                                                                  \
+    X(STACK_EVENT_VERIFY_BEGIN, STACK_LOG_NO_ARGS, "Begin verification")                                     \
+    X(STACK_EVENT_VERIFY_OK, STACK_LOG_NO_ARGS, "Verification successful")                                   \
+    X(STACK_EVENT_VERIFY_FAIL, STACK_LOG_NO_ARGS, "Verification failed")                                     \
+    X(STACK_EVENT_REHASH_METADATA, STACK_LOG_NO_ARGS, "Update metadata hash")                                \
+    X(STACK_EVENT_HASH_ADD, STACK_LOG_ONE_ARG, "Add %zu elements to data hash")                              \
+    X(STACK_EVENT_HASH_REMOVE, STACK_LOG_ONE_ARG, "Remove %zu elements from data hash")                      \
+    X(STACK_EVENT_WRITE_POISON, STACK_LOG_ONE_ARG, "Write %zu bytes of poison")                              \
+    X(STACK_EVENT_SET_DATA_CANARIES, STACK_LOG_NO_ARGS, "Set data canaries")                                 \
+    X(STACK_EVENT_RESIZE_BEGIN, STACK_LOG_TWO_ARGS, "Attempt resize to %zu from %zu")                        \
+    X(STACK_EVENT_RESIZE_DONE, STACK_LOG_ONE_ARG, "Capacity is now %zu")                                     \
+    X(STACK_EVENT_ALLOCATE_BEGIN, STACK_LOG_ONE_ARG, "Start new Stack allocation; there are %zu allocated Stacks") \
+    X(STACK_EVENT_ALLOCATE_DONE, STACK_LOG_TWO_ARGS, "Allocated new Stack of %zu byte elements; there are %zu allocated Stacks") \
+    X(STACK_EVENT_FREE, STACK_LOG_ONE_ARG, "Freed Stack; there are %zu allocated Stacks")                    \
+    X(STACK_EVENT_PUSH_BEGIN, STACK_LOG_NO_ARGS, "Attempting to push element")                               \
+    X(STACK_EVENT_PUSH_DONE, STACK_LOG_ELEM_ARG, "Pushed element %s")                                        \
+    X(STACK_EVENT_TOP_BEGIN, STACK_LOG_NO_ARGS, "Attempting to peek at top element")                         \
+    X(STACK_EVENT_TOP_EMPTY, STACK_LOG_NO_ARGS, "Error: peeking at empty stack")                             \
+    X(STACK_EVENT_TOP_DONE, STACK_LOG_ELEM_ARG, "Toped element %s")                                          \
+    X(STACK_EVENT_POP_BEGIN, STACK_LOG_NO_ARGS, "Attempting to pop element")                                 \
+    X(STACK_EVENT_POP_EMPTY, STACK_LOG_NO_ARGS, "Error: poping empty stack")                                 \
+    X(STACK_EVENT_POP_DONE, STACK_LOG_ELEM_ARG, "Poped element %s")                                          \
+    X(STACK_EVENT_PUSH_N_BEGIN, STACK_LOG_ONE_ARG, "Attempting to push %zu elements")                        \
+    X(STACK_EVENT_PUSH_N_OVERFLOW, STACK_LOG_NO_ARGS, "Error: pushing too many elements")                    \
+    X(STACK_EVENT_PUSH_N_DONE, STACK_LOG_ONE_ARG, "Pushed %zu elements")                                     \
+    X(STACK_EVENT_TOP_N_BEGIN, STACK_LOG_ONE_ARG, "Attempting to peek at %zu top elements")                  \
+    X(STACK_EVENT_TOP_N_UNDERFLOW, STACK_LOG_NO_ARGS, "Error: peeking at more elements than there are in stack") \
+    X(STACK_EVENT_TOP_N_DONE, STACK_LOG_ONE_ARG, "Toped %zu elements")                                       \
+    X(STACK_EVENT_POP_N_BEGIN, STACK_LOG_ONE_ARG, "Attempting to pop %zu elements")                          \
+    X(STACK_EVENT_POP_N_UNDERFLOW, STACK_LOG_NO_ARGS, "Error: poping more elements than there are in stack") \
+    X(STACK_EVENT_POP_N_DONE, STACK_LOG_ONE_ARG, "Poped %zu elements")                                       \
+    X(STACK_EVENT_SIZE_BEGIN, STACK_LOG_NO_ARGS, "Attempting to get size")                                   \
+    X(STACK_EVENT_SIZE_DONE, STACK_LOG_NO_ARGS, "Return size")                                               \
+    X(STACK_EVENT_CAPACITY_BEGIN, STACK_LOG_NO_ARGS, "Attempting to get capacity")                           \
+    X(STACK_EVENT_CAPACITY_DONE, STACK_LOG_NO_ARGS, "Return capacity")                                       \
+    X(STACK_EVENT_EMPTY_BEGIN, STACK_LOG_NO_ARGS, "Attempting to check if empty")                            \
+    X(STACK_EVENT_EMPTY_DONE, STACK_LOG_NO_ARGS, "Return empty status")                                      \
+    X(STACK_EVENT_RESERVE_BEGIN, STACK_LOG_NO_ARGS, "Attempting to reserve capacity")                        \
+    X(STACK_EVENT_RESERVE_DONE, STACK_LOG_ONE_ARG, "Reserved capacity for %zu elements")                     \
+    X(STACK_EVENT_GET_ERROR_BEGIN, STACK_LOG_NO_ARGS, "Attempting to get error state")                       \
+    X(STACK_EVENT_GET_ERROR_DONE, STACK_LOG_NO_ARGS, "Return error state")                                   \
+    X(STACK_EVENT_SET_RESIZE_POLICY_BEGIN, STACK_LOG_NO_ARGS, "Attempting to set resize policy")             \
+    X(STACK_EVENT_SET_RESIZE_POLICY_INVALID, STACK_LOG_NO_ARGS, "Error: invalid resize policy")              \
+    X(STACK_EVENT_SET_RESIZE_POLICY_DONE, STACK_LOG_ONE_ARG, "Set resize policy %zu")                        \
+    X(STACK_EVENT_LOG_DROPPED, STACK_LOG_ONE_ARG, "Log dropped %zu records of this thread")                  \
+    X(STACK_EVENT_SET_VERIFY_POLICY_BEGIN, STACK_LOG_NO_ARGS, "Attempting to set verification policy")       \
+    X(STACK_EVENT_SET_VERIFY_POLICY_INVALID, STACK_LOG_NO_ARGS, "Error: invalid verification policy")        \
+    X(STACK_EVENT_SET_VERIFY_POLICY_DONE, STACK_LOG_ONE_ARG, "Set verification policy %zu")                  \
+    X(STACK_EVENT_SCRUB_FAIL, STACK_LOG_ONE_ARG, "Error: scrubber found error %zu")                          \
+    X(STACK_EVENT_SET_SYNC_POLICY_BEGIN, STACK_LOG_NO_ARGS, "Attempting to set sync policy")                 \
+    X(STACK_EVENT_SET_SYNC_POLICY_INVALID, STACK_LOG_NO_ARGS, "Error: invalid sync policy")                  \
+    X(STACK_EVENT_SET_SYNC_POLICY_DONE, STACK_LOG_ONE_ARG, "Set sync policy %zu")                            \
+    X(STACK_EVENT_SYNC, STACK_LOG_ONE_ARG, "Wrote back %zu bytes of the mapped file")                        \
+    X(STACK_EVENT_SYNC_FAIL, STACK_LOG_NO_ARGS, "Error: failed to write back the mapped file")               \
+    X(STACK_EVENT_SAVE_BEGIN, STACK_LOG_NO_ARGS, "Attempting to save")                                       \
+    X(STACK_EVENT_SAVE_DONE, STACK_LOG_ONE_ARG, "Saved %zu bytes")                                           \
+    X(STACK_EVENT_SAVE_FAIL, STACK_LOG_NO_ARGS, "Error: failed to write the saved Stack")                    \
+    X(STACK_EVENT_LOAD_DONE, STACK_LOG_ONE_ARG, "Loaded %zu elements")                                       \
+    X(STACK_EVENT_MARK, STACK_LOG_TWO_ARGS, "Marked size %zu, %zu marks outstanding")                        \
+    X(STACK_EVENT_REWIND_BEGIN, STACK_LOG_ONE_ARG, "Attempting to rewind to %zu")                            \
+    X(STACK_EVENT_REWIND_INVALID, STACK_LOG_NO_ARGS, "Error: rewinding to an invalid mark")                  \
+    X(STACK_EVENT_REWIND_DONE, STACK_LOG_ONE_ARG, "Rewound %zu elements")                                    \
+    X(STACK_EVENT_RELEASE, STACK_LOG_TWO_ARGS, "Released mark %zu, %zu marks outstanding")                   \
+    X(STACK_EVENT_RELEASE_INVALID, STACK_LOG_NO_ARGS, "Error: releasing a mark that isn't the innermost one")
+
+#define STACK_LOG_EVENT_ENUM(name, args, format) name,
+typedef enum stack_log_event_e {
+    STACK_LOG_EVENTS(STACK_LOG_EVENT_ENUM)
+    STACK_EVENT_COUNT,
+} STACK_LOG_EVENT;
+#undef STACK_LOG_EVENT_ENUM
+
+#define STACK_LOG_EVENT_INFO(name, args, format) {args, format},
+static const struct {
+    STACK_LOG_ARGS args;
+    char const* format;
+} stack_log_events[] = {
+    STACK_LOG_EVENTS(STACK_LOG_EVENT_INFO)
+};
+#undef STACK_LOG_EVENT_INFO
+
+/*
+ * Start writing the log file, if this is its first user.
+ * Records are written by a background thread
+ */
+void stack_log_open();
+
+/*
+ * Stop writing the log file once it has no users, after all buffered records have been written
+ */
+void stack_log_close();
+
+/*
+ * Buffer a record for the background thread without blocking.
+ * If the calling thread's buffer is full, the record is dropped and counted
+ */
+void stack_log_write(void const* stk, STACK_LOG_EVENT event, uint64_t arg0, uint64_t arg1);
@@ -0,0 +1,90 @@
+#include "stack_log_reader.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int stack_log_compare_entries(void const* lhs_p, void const* rhs_p) {
+    StackLogEntry const* lhs = lhs_p;
+    StackLogEntry const* rhs = rhs_p;
+    if (lhs->record.timestamp != rhs->record.timestamp) {
+        return (lhs->record.timestamp < rhs->record.timestamp) ? -1 : 1;
+    }
+    return (lhs->index < rhs->index) ? -1 : (lhs->index > rhs->index);
+}
+
+bool stack_log_read(char const* filename, stack_log_session_callback callback, void* data) {
+    assert(filename);
+    assert(callback);
+
+    FILE* log_file = fopen(filename, "rb");
+    if (!log_file) {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        return false;
+    }
+
+    size_t capacity = 1024;
+    size_t num = 0;
+    StackLogEntry* entries = malloc(capacity * sizeof(*entries));
+    if (!entries) {
+        fprintf(stderr, "Out of memory\n");
+        fclose(log_file);
+        return false;
+    }
+
+    bool ok = true;
+    bool stopped = false;
+    StackLogHeader header;
+    bool have_header = false;
+    unsigned char entry[sizeof(StackLogRecord)];
+    for (size_t index = 0; fread(entry, sizeof(entry), 1, log_file) == 1; index++) {
+        if (memcmp(entry, STACK_LOG_MAGIC, sizeof(header.magic)) == 0) {
+            if (have_header) {
+                qsort(entries, num, sizeof(*entries), stack_log_compare_entries);
+                if (!callback(data, &header, entries, num)) {
+                    stopped = true;
+                    break;
+                }
+            }
+            num = 0;
+            memcpy(&header, entry, sizeof(header));
+            have_header = true;
+            if (header.version != STACK_LOG_VERSION || header.record_size != sizeof(StackLogRecord)) {
+                fprintf(stderr, "Unsupported log version %" PRIu32 "\n", header.version);
+                have_header = false;
+                ok = false;
+                break;
+            }
+            continue;
+        }
+        if (!have_header) {
+            fprintf(stderr, "%s is not a Stack log\n", filename);
+            ok = false;
+            break;
+        }
+
+        if (num == capacity) {
+            capacity *= 2;
+            StackLogEntry* new_entries = realloc(entries, capacity * sizeof(*entries));
+            if (!new_entries) {
+                fprintf(stderr, "Out of memory\n");
+                ok = false;
+                break;
+            }
+            entries = new_entries;
+        }
+        memcpy(&entries[num].record, entry, sizeof(entry));
+        entries[num].index = index;
+        num++;
+    }
+    if (have_header && !stopped) {
+        qsort(entries, num, sizeof(*entries), stack_log_compare_entries);
+        callback(data, &header, entries, num);
+    }
+
+    free(entries);
+    fclose(log_file);
+    return ok;
+}
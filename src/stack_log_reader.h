@@ -0,0 +1,28 @@
+/*
+ * Reading binary event logs, shared by StackLogDecode and StackReplay
+ */
+#pragma once
+
+#include "stack_log.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct stack_log_entry_t {
+    StackLogRecord record;
+    // Position in the file, so that records with equal timestamps keep their order
+    size_t index;
+} StackLogEntry;
+
+/*
+ * Called with the records that were written while the log was open once, in timestamp order.
+ * Returns false to stop reading
+ */
+typedef bool (*stack_log_session_callback)(void* data, StackLogHeader const* header, StackLogEntry const* entries,
+                                           size_t num);
+
+/*
+ * Read a log file one session at a time.
+ * Returns false, after printing why to stderr, if the file can't be read or isn't a log of this version
+ */
+bool stack_log_read(char const* filename, stack_log_session_callback callback, void* data);
@@ -0,0 +1,22 @@
+/*
+ * USDT probes at the start and end of every operation and phase that timed Stacks record the latency of.
+ * With <sys/sdt.h> (systemtap-sdt-dev) each probe compiles to a single nop that perf and bpftrace can attach to,
+ * for example as usdt:libStackLib.so:stacklib:push_begin. Without it, or with STACK_NO_PROBES defined, probes compile to nothing
+ */
+#pragma once
+
+#if defined(__has_include) && !defined(STACK_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#define STACK_PROBES
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifdef STACK_PROBES
+// The probe's argument is the Stack
+#define STACK_PROBE(name, stk) STAP_PROBE1(stacklib, name, stk)
+#else
+#define STACK_PROBE(name, stk) \
+    do {                       \
+    } while (0)
+#endif
@@ -0,0 +1,164 @@
+#include "stack.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+    THREAD_COUNT = 4,
+    THREAD_OPS = 1u << 18,
+    // Values encode the pushing thread in their high bits
+    THREAD_SHIFT = 24,
+};
+
+typedef struct thread_args_t {
+    ConcurrentStack* stk;
+    Stack* locked_stk;
+    pthread_mutex_t* mutex;
+    uint32_t thread;
+    // Values this thread poped
+    uint32_t* poped;
+    size_t poped_count;
+} ThreadArgs;
+
+double get_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Push THREAD_OPS values and pop one value after every second push
+ */
+void* concurrent_worker(void* arg) {
+    ThreadArgs* args = arg;
+    for (uint32_t i = 0; i < THREAD_OPS; i++) {
+        uint32_t value = args->thread << THREAD_SHIFT | i;
+        STACK_ERROR error = concurrent_stack_push(args->stk, &value);
+        assert(error == STACK_OK);
+        (void) error;
+        if (i % 2) {
+            uint32_t poped_value = 0;
+            if (concurrent_stack_pop(args->stk, &poped_value) == STACK_OK) {
+                args->poped[args->poped_count++] = poped_value;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The same workload on a Stack protected by a mutex, for comparison
+ */
+void* locked_worker(void* arg) {
+    ThreadArgs* args = arg;
+    for (uint32_t i = 0; i < THREAD_OPS; i++) {
+        uint32_t value = args->thread << THREAD_SHIFT | i;
+        pthread_mutex_lock(args->mutex);
+        stack_push(args->locked_stk, &value);
+        pthread_mutex_unlock(args->mutex);
+        if (i % 2) {
+            uint32_t poped_value = 0;
+            pthread_mutex_lock(args->mutex);
+            stack_pop(args->locked_stk, &poped_value);
+            pthread_mutex_unlock(args->mutex);
+        }
+    }
+    return NULL;
+}
+
+double run_threads(void* (*worker)(void*), ThreadArgs* args) {
+    pthread_t threads[THREAD_COUNT];
+    double start = get_time();
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        int res = pthread_create(&threads[i], NULL, worker, &args[i]);
+        assert(!res);
+        (void) res;
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return get_time() - start;
+}
+
+/*
+ * Check that every pushed value was poped exactly once, either by a worker or while draining
+ */
+void test_concurrent_stack(unsigned flags) {
+    ConcurrentStack* stk = concurrent_stack_allocate(sizeof(uint32_t), flags);
+    assert(stk);
+
+    ThreadArgs args[THREAD_COUNT];
+    for (uint32_t i = 0; i < THREAD_COUNT; i++) {
+        args[i] = (ThreadArgs) {
+            .stk = stk,
+            .thread = i,
+            .poped = malloc(THREAD_OPS / 2 * sizeof(uint32_t)),
+            .poped_count = 0,
+        };
+        assert(args[i].poped);
+    }
+    double time = run_threads(concurrent_worker, args);
+
+    unsigned char* seen = calloc((size_t) THREAD_COUNT * THREAD_OPS, 1);
+    assert(seen);
+    size_t total = 0;
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        for (size_t j = 0; j < args[i].poped_count; j++) {
+            uint32_t value = args[i].poped[j];
+            seen[(value >> THREAD_SHIFT) * THREAD_OPS + (value & ((1u << THREAD_SHIFT) - 1))]++;
+        }
+        total += args[i].poped_count;
+        free(args[i].poped);
+    }
+    assert(concurrent_stack_size(stk) == (size_t) THREAD_COUNT * THREAD_OPS - total);
+    uint32_t value = 0;
+    while (concurrent_stack_pop(stk, &value) == STACK_OK) {
+        seen[(value >> THREAD_SHIFT) * THREAD_OPS + (value & ((1u << THREAD_SHIFT) - 1))]++;
+    }
+    assert(concurrent_stack_get_error(stk) == STACK_OK);
+    assert(!concurrent_stack_size(stk));
+    for (size_t i = 0; i < (size_t) THREAD_COUNT * THREAD_OPS; i++) {
+        assert(seen[i] == 1);
+    }
+    free(seen);
+
+    size_t ops = (size_t) THREAD_COUNT * THREAD_OPS * 3 / 2;
+    printf("%-30s %15.0f ops/s\n", (flags) ? "lock-free with integrity" : "lock-free", ops / time);
+
+    concurrent_stack_free(stk);
+}
+
+void bench_locked_stack() {
+    Stack* stk = stack_allocate_ex(sizeof(uint32_t), STACK_NO_PROTECTION);
+    assert(stk);
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    ThreadArgs args[THREAD_COUNT];
+    for (uint32_t i = 0; i < THREAD_COUNT; i++) {
+        args[i] = (ThreadArgs) {
+            .locked_stk = stk,
+            .mutex = &mutex,
+            .thread = i,
+        };
+    }
+    double time = run_threads(locked_worker, args);
+    assert(stack_size(stk) == (size_t) THREAD_COUNT * THREAD_OPS / 2);
+
+    size_t ops = (size_t) THREAD_COUNT * THREAD_OPS * 3 / 2;
+    printf("%-30s %15.0f ops/s\n", "mutex", ops / time);
+
+    stack_free(stk);
+}
+
+int main() {
+    printf("Start concurrent stack testing with %d threads\n", THREAD_COUNT);
+    test_concurrent_stack(STACK_NO_PROTECTION);
+    test_concurrent_stack(STACK_CONCURRENT_FLAGS);
+    bench_locked_stack();
+    printf("Concurrent tests passed\n");
+    return 0;
+}
@@ -1,16 +1,68 @@
 #define STACK_ELEM_TYPE int
 #include "stack_generic.h"
+#include "stack_hash.h"
+#include "stack_log.h"
+
+// An element type that needs more alignment than pointers do
+typedef long double wide;
+#define STACK_ELEM_TYPE wide
+#include "stack_generic.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 enum {
     INS_DEL_STEPS = 1000,
     INS_AMOUNT = 20,
     DEL_AMOUNT = 10,
     DEL_STEPS = INS_DEL_STEPS + 5,
+    BULK_STEPS = 100,
+    BULK_INS_AMOUNT = 50,
+    BULK_DEL_AMOUNT = 30,
+    SEGMENTED_SIZE = 100000,
+    SEGMENTED_CHUNK = 777,
+    CUSTOM_CAPACITY_STEP = 100,
+    ALLOCATOR_ROUNDS = 10,
+    VERIFY_PERIOD = 8,
+    HASH_DETECTION_SIZE = 1000,
+    // Elements of well over 4 KiB
+    HASH_DETECTION_LARGE_SIZE = 10000,
+    // Elements per data hash block
+    HASH_BLOCK_SIZE = 16,
+    SCRUB_SIZE = 5000,
+    SCRUB_INTERVAL_US = 100,
+    HASH_TEST_SIZE = 128,
+    MAPPED_SIZE = 3000,
+    MAPPED_SYNC_PERIOD = 16,
+    SAVE_SIZE = 20000,
+    DUMP_SIZE = 100,
+    DUMP_BUFFER_SIZE = 1 << 16,
+    CACHE_SIZE = 100,
+    CACHE_ROUNDS = 1000,
+    REWIND_BASE = 10,
+    REWIND_SIZE = 5000,
+    LATENCY_SIZE = 1000,
+    LOG_SIZE = 100,
+    LOG_ROUNDS = 16,
+    // Large enough for the elements to move into a huge page mapping
+    HUGE_SIZE = 1 << 20,
+    // Few enough ints to stay in a Stack's embedded storage
+    EMBEDDED_SIZE = 20,
+    // Few enough long doubles for a new Stack to keep them in its embedded storage, also with data canaries
+    EMBEDDED_WIDE_SIZE = 10,
+    // Embedded capacity chosen at allocation
+    EMBEDDED_CAPACITY = 100,
 };
 
+#define ARR_LENGTH(arr) (sizeof(arr) / sizeof(*arr))
+
 void push_test(Stack_int* stk, size_t* const counter) {
     assert(stk);
     assert(counter);
@@ -70,7 +122,1497 @@ void test_stack() {
     printf("Tests passed\n");
 }
 
+void test_stack_bulk() {
+    Stack_int* stk = StackAllocate_int();
+    assert(stk);
+
+    printf("Start bulk stack testing\n");
+
+    int push_vals[BULK_INS_AMOUNT];
+    int pop_vals[BULK_INS_AMOUNT];
+    size_t counter = 0;
+    for (size_t i = 0; i < BULK_STEPS; i++) {
+        for (size_t j = 0; j < BULK_INS_AMOUNT; j++) {
+            push_vals[j] = rand();
+        }
+        StackPushN_int(stk, push_vals, BULK_INS_AMOUNT);
+        counter += BULK_INS_AMOUNT;
+        assert(StackSize_int(stk) == counter);
+        int top = StackTop_int(stk);
+        assert(top == push_vals[BULK_INS_AMOUNT - 1]);
+
+        int* top_vals = StackTopN_int(stk, pop_vals, BULK_INS_AMOUNT);
+        assert(top_vals == pop_vals);
+        assert(memcmp(pop_vals, push_vals, sizeof(push_vals)) == 0);
+
+        int* poped_vals = StackPopN_int(stk, pop_vals, BULK_DEL_AMOUNT);
+        assert(poped_vals == pop_vals);
+        counter -= BULK_DEL_AMOUNT;
+        assert(StackSize_int(stk) == counter);
+        assert(memcmp(pop_vals, push_vals + BULK_INS_AMOUNT - BULK_DEL_AMOUNT, BULK_DEL_AMOUNT * sizeof(*pop_vals)) == 0);
+    }
+
+    int* all_vals = malloc(counter * sizeof(*all_vals));
+    assert(all_vals);
+    int* poped_vals = StackPopN_int(stk, all_vals, counter + 1);
+    assert(!poped_vals);
+    assert(StackGetError_int(stk) == STACK_OPERATION_ERROR);
+    assert(StackSize_int(stk) == counter);
+    poped_vals = StackPopN_int(stk, all_vals, counter);
+    assert(poped_vals == all_vals);
+    assert(StackEmpty_int(stk));
+    free(all_vals);
+
+    StackFree_int(stk);
+
+    printf("Bulk tests passed\n");
+}
+
+void test_stack_segmented() {
+    Stack_int* stk = StackAllocateEx_int(STACK_SEGMENTED | (STACK_USE_ALL & ~STACK_USE_LOG));
+    assert(stk);
+    // Rehashing the whole Stack on every pop would make the test quadratic
+    StackVerifyPolicy verify_policy = stack_verify_policy(STACK_VERIFY_ROUND_ROBIN);
+    StackSetVerifyPolicy_int(stk, &verify_policy);
+
+    printf("Start segmented stack testing\n");
+
+    int* vals = malloc(SEGMENTED_SIZE * sizeof(*vals));
+    int* out_vals = malloc(SEGMENTED_SIZE * sizeof(*out_vals));
+    assert(vals && out_vals);
+    for (size_t i = 0; i < SEGMENTED_SIZE; i++) {
+        vals[i] = rand();
+    }
+
+    // Bulk operations cross segment boundaries
+    for (size_t i = 0; i < SEGMENTED_SIZE; i += SEGMENTED_CHUNK) {
+        size_t num = (SEGMENTED_SIZE - i < SEGMENTED_CHUNK) ? SEGMENTED_SIZE - i : SEGMENTED_CHUNK;
+        StackPushN_int(stk, vals + i, num);
+        assert(StackSize_int(stk) == i + num);
+    }
+    int* top_vals = StackTopN_int(stk, out_vals, SEGMENTED_SIZE);
+    assert(top_vals == out_vals);
+    assert(memcmp(out_vals, vals, SEGMENTED_SIZE * sizeof(*vals)) == 0);
+
+    // Single operations go back and forth over segment boundaries
+    for (size_t i = SEGMENTED_SIZE; i > 0; i--) {
+        int pop_val = StackPop_int(stk);
+        assert(pop_val == vals[i - 1]);
+        if (i % 2) {
+            StackPush_int(stk, pop_val);
+            pop_val = StackPop_int(stk);
+            assert(pop_val == vals[i - 1]);
+        }
+    }
+    assert(StackEmpty_int(stk));
+    assert(StackGetError_int(stk) == STACK_OK);
+
+    free(out_vals);
+    free(vals);
+    StackFree_int(stk);
+
+    printf("Segmented tests passed\n");
+}
+
+StackResizeStats test_resize_policy(StackResizePolicy const* policy) {
+    assert(policy);
+
+    Stack_int* stk = StackAllocate_int();
+    assert(stk);
+    StackSetResizePolicy_int(stk, policy);
+    assert(StackGetError_int(stk) == STACK_OK);
+
+    size_t counter = 0;
+    for (size_t i = 0; i < INS_DEL_STEPS; i++) {
+        pop_test(stk, &counter);
+        push_test(stk, &counter);
+        if (policy->kind == STACK_RESIZE_CUSTOM) {
+            assert(StackCapacity_int(stk) % CUSTOM_CAPACITY_STEP == 0);
+        }
+    }
+    for (size_t i = 0; i < DEL_STEPS; i++) {
+        pop_test(stk, &counter);
+    }
+
+    StackResizeStats stats = StackGetResizeStats_int(stk);
+    StackFree_int(stk);
+    return stats;
+}
+
+size_t round_capacity(void* data, size_t capacity, size_t new_size, size_t min_capacity) {
+    (void) data;
+    (void) capacity;
+    (void) min_capacity;
+    return (new_size / CUSTOM_CAPACITY_STEP + 1) * CUSTOM_CAPACITY_STEP;
+}
+
+void test_stack_resize_policies() {
+    printf("Start resize policy testing\n");
+
+    StackResizePolicy policy = stack_resize_policy(STACK_RESIZE_GEOMETRIC);
+    StackResizeStats delayed_stats = test_resize_policy(&policy);
+    policy.shrink_delay = 0;
+    StackResizeStats eager_stats = test_resize_policy(&policy);
+    assert(delayed_stats.shrink_count <= eager_stats.shrink_count);
+    assert(delayed_stats.shrink_count);
+
+    policy = stack_resize_policy(STACK_RESIZE_NEVER_SHRINK);
+    StackResizeStats never_stats = test_resize_policy(&policy);
+    assert(!never_stats.shrink_count);
+    assert(never_stats.grow_count);
+
+    policy = stack_resize_policy(STACK_RESIZE_IDLE_SHRINK);
+    policy.shrink_delay = INS_AMOUNT + DEL_AMOUNT;
+    StackResizeStats idle_stats = test_resize_policy(&policy);
+    assert(idle_stats.shrink_count);
+
+    policy = stack_resize_policy(STACK_RESIZE_CUSTOM);
+    policy.callback = round_capacity;
+    test_resize_policy(&policy);
+
+    Stack_int* stk = StackAllocate_int();
+    assert(stk);
+    policy = stack_resize_policy(STACK_RESIZE_GEOMETRIC);
+    policy.shrink_threshold = policy.shrink_factor;
+    StackSetResizePolicy_int(stk, &policy);
+    assert(StackGetError_int(stk) == STACK_OPERATION_ERROR);
+    StackFree_int(stk);
+
+    printf("Resize policy tests passed\n");
+}
+
+void test_stats(unsigned flags) {
+    StackStats global_before;
+    stack_global_stats(&global_before);
+
+    Stack_int* stk = StackAllocateEx_int(flags);
+    assert(stk);
+    int vals[BULK_INS_AMOUNT] = {0};
+    for (size_t i = 0; i < INS_AMOUNT; i++) {
+        StackPush_int(stk, (int) i);
+    }
+    StackPushN_int(stk, vals, BULK_INS_AMOUNT);
+    StackTop_int(stk);
+    StackTopN_int(stk, vals, BULK_DEL_AMOUNT);
+    for (size_t i = 0; i < DEL_AMOUNT; i++) {
+        StackPop_int(stk);
+    }
+    StackPopN_int(stk, vals, BULK_DEL_AMOUNT);
+    assert(StackGetError_int(stk) == STACK_OK);
+
+    StackStats stats;
+    StackStats_int(stk, &stats);
+    assert(stats.push_count == INS_AMOUNT + BULK_INS_AMOUNT);
+    assert(stats.pop_count == DEL_AMOUNT + BULK_DEL_AMOUNT);
+    assert(stats.top_count == 1 + BULK_DEL_AMOUNT);
+    assert(stats.peak_size == INS_AMOUNT + BULK_INS_AMOUNT);
+    assert(stats.grow_count == StackGetResizeStats_int(stk).grow_count);
+    assert(!stats.verify_fail_count);
+    assert(!(flags & STACK_USE_ALL) == !stats.verify_count);
+    assert(stats.stack_count == 1);
+
+    StackStats global;
+    stack_global_stats(&global);
+    assert(global.stack_count == global_before.stack_count + 1);
+    assert(global.push_count == global_before.push_count + stats.push_count);
+
+    // Freed Stacks stay counted in the global totals
+    StackFree_int(stk);
+    stack_global_stats(&global);
+    assert(global.stack_count == global_before.stack_count);
+    assert(global.push_count == global_before.push_count + stats.push_count);
+    assert(global.pop_count == global_before.pop_count + stats.pop_count);
+}
+
+void test_stack_stats() {
+    printf("Start stats testing\n");
+
+    // Operations done inline are counted too
+    test_stats(STACK_NO_PROTECTION);
+    test_stats(STACK_USE_ALL & ~STACK_USE_LOG);
+
+    printf("Stats tests passed\n");
+}
+
+/*
+ * Do the same operations on one Stack through the inline functions of stack_generic.h
+ * and on another through StackLib, and check that both resize the same way
+ */
+void test_inline(StackResizePolicy const* policy) {
+    // Both Stacks must start out with the same capacity, not with that of a reused Stack
+    stack_cache_drain();
+    Stack_int* inline_stk = StackAllocateEx_int(STACK_NO_PROTECTION);
+    Stack* lib_stk = stack_allocate_ex(sizeof(int), STACK_NO_PROTECTION);
+    assert(inline_stk && lib_stk);
+    StackSetResizePolicy_int(inline_stk, policy);
+    stack_set_resize_policy(lib_stk, policy);
+
+    unsigned state = 1;
+    for (size_t i = 0; i < INS_DEL_STEPS * INS_AMOUNT; i++) {
+        // Drift up and then down, so that the Stacks both grow and shrink
+        state = state * 1103515245u + 12345u;
+        bool push = (state >> 16) % 8 < ((i < INS_DEL_STEPS * INS_AMOUNT / 2) ? 5u : 3u);
+        if (push) {
+            int val = (int) i;
+            StackPush_int(inline_stk, val);
+            stack_push(lib_stk, &val);
+        } else {
+            int lib_val = 0;
+            int inline_val = StackPop_int(inline_stk);
+            stack_pop(lib_stk, &lib_val);
+            assert(inline_val == lib_val);
+            assert(StackGetError_int(inline_stk) == stack_get_error(lib_stk));
+        }
+        if (StackSize_int(inline_stk)) {
+            int lib_val = 0;
+            stack_top(lib_stk, &lib_val);
+            int inline_val = StackTop_int(inline_stk);
+            assert(inline_val == lib_val);
+        }
+        assert(StackSize_int(inline_stk) == stack_size(lib_stk));
+        assert(StackCapacity_int(inline_stk) == stack_capacity(lib_stk));
+    }
+
+    StackResizeStats inline_stats = StackGetResizeStats_int(inline_stk);
+    StackResizeStats lib_stats = stack_get_resize_stats(lib_stk);
+    assert(inline_stats.grow_count == lib_stats.grow_count);
+    assert(inline_stats.shrink_count == lib_stats.shrink_count);
+    // Operations done inline are counted like the ones StackLib does
+    StackStats inline_counters, lib_counters;
+    StackStats_int(inline_stk, &inline_counters);
+    stack_stats(lib_stk, &lib_counters);
+    assert(inline_counters.push_count == lib_counters.push_count);
+    assert(inline_counters.pop_count == lib_counters.pop_count);
+    assert(inline_counters.top_count == lib_counters.top_count);
+    assert(inline_counters.peak_size == lib_counters.peak_size);
+
+    StackFree_int(inline_stk);
+    stack_free(lib_stk);
+}
+
+void test_stack_inline() {
+    printf("Start inline testing\n");
+
+    for (STACK_RESIZE_POLICY kind = STACK_RESIZE_GEOMETRIC; kind <= STACK_RESIZE_IDLE_SHRINK; kind++) {
+        StackResizePolicy policy = stack_resize_policy(kind);
+        test_inline(&policy);
+    }
+
+    // The inline functions don't reset the error, so they must leave a failed Stack to StackLib
+    Stack_int* stk = StackAllocate_int();
+    assert(stk);
+    StackPush_int(stk, 1);
+    int elem = StackPop_int(stk);
+    assert(elem == 1);
+    int missing = StackPop_int(stk);
+    assert(missing == 0 && StackGetError_int(stk) == STACK_OPERATION_ERROR);
+    StackPush_int(stk, 2);
+    assert(StackGetError_int(stk) == STACK_OK);
+    StackFree_int(stk);
+
+    printf("Inline tests passed\n");
+}
+
+/*
+ * Push and pop enough elements that a Stack grows and shrinks a few times
+ */
+void exercise_stack(Stack_int* stk) {
+    size_t counter = 0;
+    for (size_t i = 0; i < BULK_STEPS; i++) {
+        push_test(stk, &counter);
+    }
+    for (size_t i = 0; i < BULK_STEPS * INS_AMOUNT / DEL_AMOUNT; i++) {
+        pop_test(stk, &counter);
+    }
+    assert(StackGetError_int(stk) == STACK_OK);
+    assert(StackEmpty_int(stk));
+}
+
+void test_stack_allocators() {
+    printf("Start allocator testing\n");
+
+    const unsigned flag_sets[] = {
+        STACK_NO_PROTECTION,
+        STACK_USE_ALL & ~STACK_USE_LOG,
+        STACK_SEGMENTED | (STACK_USE_ALL & ~STACK_USE_LOG),
+        STACK_GUARD_PAGES,
+    };
+    StackStats global_before;
+    stack_global_stats(&global_before);
+
+    StackArena* arena = stack_arena_create(0);
+    assert(arena);
+    StackAllocator arena_allocator = stack_arena_allocator(arena);
+    for (size_t round = 0; round < ALLOCATOR_ROUNDS; round++) {
+        for (size_t i = 0; i < ARR_LENGTH(flag_sets); i++) {
+            Stack_int* stk = (Stack_int*) stack_allocate_in(&arena_allocator, sizeof(int), flag_sets[i]);
+            assert(stk);
+            exercise_stack(stk);
+            // Stacks in an arena may still be freed one by one
+            if (round % 2) {
+                StackFree_int(stk);
+            }
+        }
+        StackStats global;
+        stack_global_stats(&global);
+        assert(global.stack_count == global_before.stack_count + ((round % 2) ? 0 : ARR_LENGTH(flag_sets)));
+        stack_arena_reset(arena);
+        stack_global_stats(&global);
+        assert(global.stack_count == global_before.stack_count);
+    }
+    stack_arena_destroy(arena);
+
+    StackPool* pool = stack_pool_create();
+    assert(pool);
+    StackAllocator pool_allocator = stack_pool_allocator(pool);
+    for (size_t round = 0; round < ALLOCATOR_ROUNDS; round++) {
+        for (size_t i = 0; i < ARR_LENGTH(flag_sets); i++) {
+            Stack_int* stk = (Stack_int*) stack_allocate_in(&pool_allocator, sizeof(int), flag_sets[i]);
+            assert(stk);
+            exercise_stack(stk);
+            StackFree_int(stk);
+        }
+    }
+    stack_pool_destroy(pool);
+
+    printf("Allocator tests passed\n");
+}
+
+/*
+ * Write to the int at offset from a Stack's data in a child process, and check that the write faults
+ */
+void test_guard_page_fault(Stack_int* stk, ptrdiff_t offset) {
+    assert(stk);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (!pid) {
+        // Sanitizers catch the fault themselves otherwise
+        signal(SIGSEGV, SIG_DFL);
+        signal(SIGBUS, SIG_DFL);
+        volatile int* data = ((StackInline*) stk)->data;
+        data[offset] = 0;
+        _exit(0);
+    }
+    int status = 0;
+    pid_t waited = waitpid(pid, &status, 0);
+    assert(waited == pid);
+    assert(WIFSIGNALED(status) && (WTERMSIG(status) == SIGSEGV || WTERMSIG(status) == SIGBUS));
+}
+
+void test_stack_guard_pages() {
+    printf("Start guard page testing\n");
+
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    const unsigned flag_sets[] = {
+        STACK_GUARD_PAGES,
+        STACK_GUARD_PAGES | (STACK_USE_ALL & ~STACK_USE_LOG),
+    };
+    int* vals = malloc(SEGMENTED_SIZE * sizeof(*vals));
+    int* out_vals = malloc(SEGMENTED_SIZE * sizeof(*out_vals));
+    assert(vals && out_vals);
+    for (size_t i = 0; i < SEGMENTED_SIZE; i++) {
+        vals[i] = rand();
+    }
+
+    StackVerifyPolicy verify_policy = stack_verify_policy(STACK_VERIFY_ROUND_ROBIN);
+    for (size_t i = 0; i < ARR_LENGTH(flag_sets); i++) {
+        Stack_int* stk = StackAllocateEx_int(flag_sets[i]);
+        assert(stk);
+        StackSetVerifyPolicy_int(stk, &verify_policy);
+        // Guard pages replace data canaries
+        assert(!(StackGetFlags_int(stk) & STACK_USE_DATA_CANARY));
+        exercise_stack(stk);
+
+        for (size_t j = 0; j < SEGMENTED_SIZE; j += SEGMENTED_CHUNK) {
+            size_t num = (SEGMENTED_SIZE - j < SEGMENTED_CHUNK) ? SEGMENTED_SIZE - j : SEGMENTED_CHUNK;
+            StackPushN_int(stk, vals + j, num);
+            // The elements fill whole pages, so the back guard page directly follows the last one
+            assert(StackCapacity_int(stk) * sizeof(int) % page_size == 0);
+        }
+        int* top_vals = StackTopN_int(stk, out_vals, SEGMENTED_SIZE);
+        assert(top_vals == out_vals);
+        assert(memcmp(out_vals, vals, SEGMENTED_SIZE * sizeof(*vals)) == 0);
+
+        test_guard_page_fault(stk, -1);
+        test_guard_page_fault(stk, (ptrdiff_t) StackCapacity_int(stk));
+
+        for (size_t j = SEGMENTED_SIZE; j > 0; j--) {
+            int pop_val = StackPop_int(stk);
+            assert(pop_val == vals[j - 1]);
+        }
+        assert(StackGetError_int(stk) == STACK_OK);
+        assert(StackCapacity_int(stk) * sizeof(int) % page_size == 0);
+#ifdef __linux__
+        // Growing remaps pages instead of copying them
+        assert(StackGetResizeStats_int(stk).bytes_copied == 0);
+#endif
+        StackFree_int(stk);
+    }
+
+    free(out_vals);
+    free(vals);
+
+    printf("Guard page tests passed\n");
+}
+
+/*
+ * Overwrite the poison of a Stack's last unused element,
+ * and check that the corruption is found as soon as the policy promises
+ */
+void test_poison_detection(StackVerifyPolicy const* policy) {
+    assert(policy);
+
+    Stack_int* stk = StackAllocateEx_int(STACK_USE_ALL & ~STACK_USE_LOG);
+    assert(stk);
+    StackSetVerifyPolicy_int(stk, policy);
+    StackPush_int(stk, rand());
+    assert(StackGetError_int(stk) == STACK_OK);
+    size_t max_ops = policy->period;
+    if (policy->mode == STACK_VERIFY_AMORTIZED || policy->mode == STACK_VERIFY_ROUND_ROBIN) {
+        max_ops = StackCapacity_int(stk) * sizeof(int) / policy->amortized_bytes + 1;
+    }
+
+    StackInline* inl = (StackInline*) stk;
+    ((char*) inl->data)[StackCapacity_int(stk) * sizeof(int) - 1] ^= 1;
+    size_t ops = 0;
+    STACK_ERROR error = StackGetError_int(stk);
+    while (ops < max_ops && error == STACK_OK) {
+        ops++;
+        error = StackGetError_int(stk);
+    }
+    assert(error == STACK_POISON_OVERWRITE_ERROR);
+    StackFree_int(stk);
+}
+
+/*
+ * Overwrite the bottom element of a Stack of size elements,
+ * and check that the corruption is found after at most max_ops verifications
+ */
+void test_data_hash_detection(StackVerifyPolicy const* policy, int size, size_t max_ops) {
+    assert(policy);
+
+    Stack_int* stk = StackAllocateEx_int(STACK_USE_ALL & ~STACK_USE_LOG);
+    assert(stk);
+    StackSetVerifyPolicy_int(stk, policy);
+    for (int i = 0; i < size; i++) {
+        StackPush_int(stk, i);
+    }
+    assert(StackGetError_int(stk) == STACK_OK);
+
+    StackInline* inl = (StackInline*) stk;
+    ((int*) inl->data)[0] ^= 1;
+    size_t ops = 1;
+    STACK_ERROR error = StackGetError_int(stk);
+    while (ops < max_ops && error == STACK_OK) {
+        ops++;
+        error = StackGetError_int(stk);
+    }
+    assert(error == STACK_DATA_HASH_ERROR);
+    StackFree_int(stk);
+}
+
+void test_stack_verify_policies() {
+    printf("Start verification policy testing\n");
+
+    for (STACK_VERIFY_MODE mode = STACK_VERIFY_ALWAYS; mode <= STACK_VERIFY_ROUND_ROBIN; mode++) {
+        Stack_int* stk = StackAllocateEx_int(STACK_USE_ALL & ~STACK_USE_LOG);
+        assert(stk);
+        StackVerifyPolicy policy = stack_verify_policy(mode);
+        policy.period = VERIFY_PERIOD;
+        StackSetVerifyPolicy_int(stk, &policy);
+        assert(StackGetError_int(stk) == STACK_OK);
+        assert(stack_get_verify_policy((Stack*) stk).mode == mode);
+        exercise_stack(stk);
+
+#ifndef NDEBUG
+        // Metadata is checked on every operation, whatever the policy
+        StackInline* inl = (StackInline*) stk;
+        inl->size = StackCapacity_int(stk) + 1;
+        assert(StackGetError_int(stk) != STACK_OK);
+#endif
+        StackFree_int(stk);
+    }
+
+    StackVerifyPolicy policy = stack_verify_policy(STACK_VERIFY_EVERY_NTH);
+    // Corruption is only detected by builds that verify
+#ifndef NDEBUG
+    policy.period = VERIFY_PERIOD;
+    test_poison_detection(&policy);
+    policy = stack_verify_policy(STACK_VERIFY_AMORTIZED);
+    policy.amortized_bytes = sizeof(int);
+    test_poison_detection(&policy);
+    policy.mode = STACK_VERIFY_ROUND_ROBIN;
+    test_poison_detection(&policy);
+
+    // Tampering deep in the Stack is found by the next verification, however large the Stack is,
+    // unless only a few blocks are checked at a time
+    policy = stack_verify_policy(STACK_VERIFY_ALWAYS);
+    test_data_hash_detection(&policy, HASH_DETECTION_SIZE, 1);
+    test_data_hash_detection(&policy, HASH_DETECTION_LARGE_SIZE, 1);
+    policy = stack_verify_policy(STACK_VERIFY_AMORTIZED);
+    test_data_hash_detection(&policy, HASH_DETECTION_SIZE, 1);
+    test_data_hash_detection(&policy, HASH_DETECTION_LARGE_SIZE, 1);
+    policy = stack_verify_policy(STACK_VERIFY_EVERY_NTH);
+    test_data_hash_detection(&policy, HASH_DETECTION_LARGE_SIZE, policy.period);
+    policy = stack_verify_policy(STACK_VERIFY_ROUND_ROBIN);
+    test_data_hash_detection(&policy, HASH_DETECTION_SIZE, HASH_DETECTION_SIZE / HASH_BLOCK_SIZE + 1);
+#endif
+
+    // Invalid policies are rejected
+    Stack_int* stk = StackAllocateEx_int(STACK_USE_ALL & ~STACK_USE_LOG);
+    assert(stk);
+    policy = stack_verify_policy(STACK_VERIFY_EVERY_NTH);
+    policy.period = 0;
+    StackSetVerifyPolicy_int(stk, &policy);
+    assert(StackGetError_int(stk) == STACK_OPERATION_ERROR);
+    assert(stack_get_verify_policy((Stack*) stk).mode == STACK_VERIFY_ALWAYS);
+    StackFree_int(stk);
+    bool set = stack_set_default_verify_policy(&policy);
+    assert(!set);
+
+    // The default policy applies to Stacks allocated after it is set
+    policy = stack_verify_policy(STACK_VERIFY_TIME_BUDGET);
+    set = stack_set_default_verify_policy(&policy);
+    assert(set);
+    stk = StackAllocateEx_int(STACK_USE_ALL & ~STACK_USE_LOG);
+    assert(stk);
+    assert(stack_get_verify_policy((Stack*) stk).mode == STACK_VERIFY_TIME_BUDGET);
+    exercise_stack(stk);
+    StackFree_int(stk);
+    policy = stack_verify_policy(STACK_VERIFY_ALWAYS);
+    set = stack_set_default_verify_policy(&policy);
+    assert(set);
+
+    printf("Verification policy tests passed\n");
+}
+
+void count_scrub_error(void* data, Stack* stk, STACK_ERROR error) {
+    (void) stk;
+    (void) error;
+    (*(size_t*) data)++;
+}
+
+/*
+ * Corrupt a byte of a scrubbed Stack and check that scrubbing finds it within one sweep of the Stack
+ */
+void test_scrub_detection(unsigned flags, size_t offset, STACK_ERROR expected) {
+    Stack_int* stk = StackAllocateEx_int(flags | STACK_SCRUB);
+    assert(stk);
+    for (size_t i = 0; i < SCRUB_SIZE; i++) {
+        StackPush_int(stk, rand());
+    }
+    assert(StackGetError_int(stk) == STACK_OK);
+    size_t max_passes = StackCapacity_int(stk) * sizeof(int) / 4096 + 1;
+
+    StackInline* inl = (StackInline*) stk;
+    ((char*) inl->data)[offset] ^= 1;
+    size_t error_count = 0;
+    size_t passes = 0;
+    while (!error_count) {
+        size_t found = stack_scrub(count_scrub_error, &error_count);
+        assert(found == error_count);
+        passes++;
+        assert(passes <= max_passes);
+    }
+    // The next operation reports what the scrubber found
+    assert(StackGetError_int(stk) == expected);
+    size_t size = inl->size;
+    StackPush_int(stk, rand());
+    assert(inl->size == size);
+    StackFree_int(stk);
+}
+
+void test_stack_scrub() {
+    printf("Start scrubber testing\n");
+
+    // Scrubbed Stacks can be changed while the scrubber runs
+    size_t error_count = 0;
+    bool started = stack_scrubber_start(count_scrub_error, &error_count, SCRUB_INTERVAL_US);
+    assert(started);
+    started = stack_scrubber_start(count_scrub_error, &error_count, SCRUB_INTERVAL_US);
+    assert(!started);
+    unsigned const flags[] = {
+        STACK_USE_ALL & ~STACK_USE_LOG,
+        (STACK_USE_ALL & ~STACK_USE_LOG) | STACK_SEGMENTED,
+        STACK_NO_PROTECTION,
+    };
+    for (size_t i = 0; i < ARR_LENGTH(flags); i++) {
+        Stack_int* stk = StackAllocateEx_int(flags[i] | STACK_SCRUB);
+        assert(stk);
+        exercise_stack(stk);
+        StackFree_int(stk);
+    }
+    stack_scrubber_stop();
+    assert(!error_count);
+
+    // Corrupted poison and data deep down the Stack, which verifications leave to the scrubber
+    test_scrub_detection(STACK_USE_POISON, SCRUB_SIZE * sizeof(int) + 1, STACK_POISON_OVERWRITE_ERROR);
+    test_scrub_detection(STACK_USE_HASH_FULL, 0, STACK_DATA_HASH_ERROR);
+    test_scrub_detection(STACK_USE_HASH_FULL | STACK_SEGMENTED, 0, STACK_DATA_HASH_ERROR);
+
+    printf("Scrubber tests passed\n");
+}
+
+/*
+ * Check that the original hash misses a corruption that the other hashes catch
+ */
+void test_hash_miss(unsigned char const* original, unsigned char const* corrupted) {
+    assert(stack_hash_rotate(original, HASH_TEST_SIZE, HASH_INITIAL_VALUE) ==
+           stack_hash_rotate(corrupted, HASH_TEST_SIZE, HASH_INITIAL_VALUE));
+    assert(stack_hash_wyhash(original, HASH_TEST_SIZE, HASH_INITIAL_VALUE) !=
+           stack_hash_wyhash(corrupted, HASH_TEST_SIZE, HASH_INITIAL_VALUE));
+    assert(stack_hash_crc32c(original, HASH_TEST_SIZE, HASH_INITIAL_VALUE) !=
+           stack_hash_crc32c(corrupted, HASH_TEST_SIZE, HASH_INITIAL_VALUE));
+}
+
+void test_stack_hash() {
+    printf("Start hash testing\n");
+
+    unsigned char original[HASH_TEST_SIZE];
+    unsigned char corrupted[HASH_TEST_SIZE];
+    for (size_t i = 0; i < HASH_TEST_SIZE; i++) {
+        original[i] = (unsigned char) (i * 7 + 1);
+    }
+
+    // Bytes 64 apart are rotated by the same amount, so flipping the same bit of both cancels out
+    memcpy(corrupted, original, HASH_TEST_SIZE);
+    corrupted[3] ^= 0x10;
+    corrupted[67] ^= 0x10;
+    test_hash_miss(original, corrupted);
+
+    // So does swapping them
+    memcpy(corrupted, original, HASH_TEST_SIZE);
+    corrupted[5] = original[69];
+    corrupted[69] = original[5];
+    assert(memcmp(original, corrupted, HASH_TEST_SIZE));
+    test_hash_miss(original, corrupted);
+
+    // Neighbouring bytes are rotated one bit apart
+    memcpy(corrupted, original, HASH_TEST_SIZE);
+    corrupted[10] ^= 0x01;
+    corrupted[11] ^= 0x02;
+    test_hash_miss(original, corrupted);
+
+    // A Stack hashing with anything but the original hash catches the corruption in its data
+    Stack* stk = stack_allocate_ex(HASH_TEST_SIZE, STACK_USE_HASH_FULL);
+    assert(stk);
+    stack_push(stk, original);
+    assert(stack_get_error(stk) == STACK_OK);
+    StackInline* inl = (StackInline*) stk;
+    unsigned char* elem = inl->data;
+    elem[3] ^= 0x10;
+    elem[67] ^= 0x10;
+    if (!strstr(get_stack_compilation_options(), "STACK_HASH_ROTATE")) {
+        assert(stack_get_error(stk) == STACK_DATA_HASH_ERROR);
+    }
+    stack_free(stk);
+
+    printf("Hash tests passed\n");
+}
+
+/*
+ * Fill the file at path with a fresh mapped Stack
+ */
+void write_mapped_stack(char const* path, unsigned flags) {
+    unlink(path);
+    Stack* stk = stack_open_mapped_ex(path, sizeof(int), flags);
+    assert(stk);
+    assert(stack_get_flags(stk) & STACK_MAPPED);
+    stack_set_sync_policy(stk, STACK_SYNC_EVERY_NTH, MAPPED_SYNC_PERIOD);
+    assert(stack_get_error(stk) == STACK_OK);
+    for (int i = 0; i < MAPPED_SIZE; i++) {
+        stack_push(stk, &i);
+    }
+    assert(stack_get_error(stk) == STACK_OK);
+    stack_free(stk);
+}
+
+/*
+ * Flip a bit of the file at path, and check that the Stack in it can't be opened any more
+ */
+void test_mapped_corruption(char const* path, unsigned flags, off_t offset) {
+    write_mapped_stack(path, flags);
+    int fd = open(path, O_RDWR);
+    assert(fd >= 0);
+    unsigned char byte = 0;
+    ssize_t done = pread(fd, &byte, 1, offset);
+    assert(done == 1);
+    byte ^= 1;
+    done = pwrite(fd, &byte, 1, offset);
+    assert(done == 1);
+    close(fd);
+    Stack* stk = stack_open_mapped_ex(path, sizeof(int), flags);
+    assert(!stk);
+    stack_free(stk);
+}
+
+void test_stack_mapped() {
+    printf("Start mapped Stack testing\n");
+
+    char path[] = "/tmp/stack_mapped_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    off_t page_size = sysconf(_SC_PAGESIZE);
+
+    unsigned const flags[] = {
+        STACK_NO_PROTECTION,
+        STACK_USE_ALL & ~STACK_USE_LOG,
+    };
+    for (size_t i = 0; i < ARR_LENGTH(flags); i++) {
+        // The elements survive the Stack being freed and opened again
+        write_mapped_stack(path, flags[i]);
+        Stack* stk = stack_open_mapped_ex(path, sizeof(int), flags[i]);
+        assert(stk);
+        assert(stack_get_error(stk) == STACK_OK);
+        assert(stack_size(stk) == MAPPED_SIZE);
+        for (int j = MAPPED_SIZE / 2; j--;) {
+            int elem = 0;
+            stack_pop(stk, &elem);
+            assert(elem == MAPPED_SIZE / 2 + j);
+        }
+        stack_set_sync_policy(stk, STACK_SYNC_ALWAYS, 0);
+        assert(stack_get_error(stk) == STACK_OK);
+        stack_free(stk);
+
+        stk = stack_open_mapped_ex(path, sizeof(int), flags[i]);
+        assert(stk);
+        assert(stack_size(stk) == MAPPED_SIZE / 2);
+        for (int j = MAPPED_SIZE / 2; j--;) {
+            int elem = 0;
+            stack_pop(stk, &elem);
+            assert(elem == j);
+        }
+        bool synced = stack_sync(stk);
+        assert(synced);
+        stack_free(stk);
+
+        // Opening the file as a Stack of a different kind fails
+        stk = stack_open_mapped_ex(path, sizeof(long long), flags[i]);
+        assert(!stk);
+        stack_free(stk);
+        stk = stack_open_mapped_ex(path, sizeof(int), flags[i] ^ STACK_USE_CANARY);
+        assert(!stk);
+        stack_free(stk);
+
+        // So does corrupting its header
+        test_mapped_corruption(path, flags[i], 0);
+        test_mapped_corruption(path, flags[i], 3 * sizeof(long long));
+    }
+    // Corrupted elements and unused capacity are found when the file is opened
+    test_mapped_corruption(path, STACK_USE_HASH_FULL, page_size);
+    test_mapped_corruption(path, STACK_USE_POISON, page_size + MAPPED_SIZE * sizeof(int) + 1);
+
+    // Only mapped Stacks have a sync policy
+    Stack* stk = stack_allocate_ex(sizeof(int), STACK_NO_PROTECTION);
+    assert(stk);
+    stack_set_sync_policy(stk, STACK_SYNC_ALWAYS, 0);
+    assert(stack_get_error(stk) == STACK_OPERATION_ERROR);
+    stack_free(stk);
+    unlink(path);
+
+    printf("Mapped Stack tests passed\n");
+}
+
+/*
+ * Save a Stack of SAVE_SIZE elements to a temporary file, and rewind the file.
+ * The flags the Stack ended up with are stored in saved_flags
+ */
+FILE* save_stack(unsigned flags, unsigned* saved_flags) {
+    Stack* stk = stack_allocate_ex(sizeof(int), flags);
+    assert(stk);
+    *saved_flags = stack_get_flags(stk);
+    for (int i = 0; i < SAVE_SIZE; i++) {
+        stack_push(stk, &i);
+    }
+    FILE* file = tmpfile();
+    assert(file);
+    bool saved = stack_save(stk, file);
+    assert(saved);
+    stack_free(stk);
+    rewind(file);
+    return file;
+}
+
+void test_stack_save() {
+    printf("Start save and load testing\n");
+
+    unsigned const flags[] = {
+        STACK_NO_PROTECTION,
+        STACK_USE_ALL & ~STACK_USE_LOG,
+        (STACK_USE_ALL & ~STACK_USE_LOG) | STACK_SEGMENTED,
+        STACK_GUARD_PAGES | STACK_USE_HASH_FULL,
+    };
+    for (size_t i = 0; i < ARR_LENGTH(flags); i++) {
+        // A loaded Stack has the saved Stack's elements and flags, and can be used like any other
+        unsigned saved_flags = 0;
+        FILE* file = save_stack(flags[i], &saved_flags);
+        Stack* stk = stack_load(file);
+        assert(stk);
+        assert(stack_get_error(stk) == STACK_OK);
+        assert(stack_get_flags(stk) == saved_flags && stack_size(stk) == SAVE_SIZE);
+        int elem = SAVE_SIZE;
+        stack_push(stk, &elem);
+        for (int j = SAVE_SIZE + 1; j--;) {
+            stack_pop(stk, &elem);
+            assert(elem == j);
+        }
+        assert(stack_get_error(stk) == STACK_OK);
+        stack_free(stk);
+
+        // A corrupted element or a file cut short is found when loading
+        fseek(file, -1, SEEK_END);
+        int byte = fgetc(file);
+        fseek(file, -1, SEEK_END);
+        fputc(byte ^ 1, file);
+        rewind(file);
+        stk = stack_load(file);
+        assert(!stk);
+        stack_free(stk);
+        fclose(file);
+    }
+
+    unsigned saved_flags = 0;
+    FILE* file = save_stack(STACK_NO_PROTECTION, &saved_flags);
+    int fd = fileno(file);
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    int truncated = ftruncate(fd, file_size - 1);
+    assert(!truncated);
+    rewind(file);
+    Stack* stk = stack_load(file);
+    assert(!stk);
+    stack_free(stk);
+    fclose(file);
+
+    // So is a corrupted header
+    file = save_stack(STACK_NO_PROTECTION, &saved_flags);
+    fseek(file, sizeof(long long), SEEK_SET);
+    fputc(2, file);
+    rewind(file);
+    stk = stack_load(file);
+    assert(!stk);
+    stack_free(stk);
+    fclose(file);
+
+    // So is a size larger than the file, even when its header hash is right
+    for (int i = 0; i < 2; i++) {
+        file = save_stack(STACK_NO_PROTECTION, &saved_flags);
+        unsigned long long header[6];
+        size_t read = fread(header, sizeof(header), 1, file);
+        assert(read == 1);
+        header[3] = (i) ? SIZE_MAX / sizeof(int) : SAVE_SIZE + 1;
+        header[5] = stack_hash_bytes(header, 5 * sizeof(*header), HASH_INITIAL_VALUE);
+        rewind(file);
+        fwrite(header, sizeof(header), 1, file);
+        rewind(file);
+        stk = stack_load(file);
+        assert(!stk);
+        stack_free(stk);
+        fclose(file);
+    }
+
+    // A Stack whose elements were tampered with is not saved, even if its verifications haven't reached them yet
+    stk = stack_allocate_ex(sizeof(int), STACK_USE_ALL & ~STACK_USE_LOG);
+    assert(stk);
+    for (int i = 0; i < SAVE_SIZE; i++) {
+        stack_push(stk, &i);
+    }
+    ((int*) ((StackInline*) stk)->data)[SAVE_SIZE / 2] ^= 1;
+    file = tmpfile();
+    assert(file);
+    bool saved = stack_save(stk, file);
+    assert(!saved);
+    STACK_ERROR error = stack_get_error(stk);
+    assert(error == STACK_DATA_HASH_ERROR);
+    stack_free(stk);
+    fclose(file);
+
+    printf("Save and load tests passed\n");
+}
+
+/*
+ * Dump a Stack into buf, which must be DUMP_BUFFER_SIZE bytes long
+ */
+char* dump_stack(Stack_int* stk, StackDumpOptions const* options, char* buf) {
+    FILE* file = tmpfile();
+    assert(file);
+    StackDumpEx_int(stk, file, options);
+    rewind(file);
+    size_t len = fread(buf, 1, DUMP_BUFFER_SIZE - 1, file);
+    assert(len < DUMP_BUFFER_SIZE - 1);
+    buf[len] = '\0';
+    fclose(file);
+    return buf;
+}
+
+void test_stack_dump() {
+    printf("Start dump testing\n");
+
+    static char buf[DUMP_BUFFER_SIZE];
+    Stack_int* stk = StackAllocateEx_int(STACK_USE_POISON);
+    assert(stk);
+    for (int i = 0; i < DUMP_SIZE; i++) {
+        StackPush_int(stk, 0x12345600 + i);
+    }
+    StackReserve_int(stk, 4 * DUMP_SIZE);
+    size_t capacity = StackCapacity_int(stk);
+
+    // The unused capacity is one line
+    StackDumpOptions options = stack_dump_options();
+    dump_stack(stk, &options, buf);
+    assert(strstr(buf, "[0]: 0x12345600\n"));
+    assert(strstr(buf, "[99]: 0x12345663\n"));
+    char line[64];
+    snprintf(line, sizeof(line), "(%d to %zu): poison\n", DUMP_SIZE, capacity - 1);
+    assert(strstr(buf, line));
+
+    // Unless every element is printed
+    options.poison_run = 0;
+    dump_stack(stk, &options, buf);
+    snprintf(line, sizeof(line), "(%zu): 0x", capacity - 1);
+    assert(strstr(buf, line) && strstr(buf, " (poison)\n"));
+
+    // A corrupted unused element breaks the run
+    StackInline* inl = (StackInline*) stk;
+    ((int*) inl->data)[DUMP_SIZE + 20] = 0;
+    options = stack_dump_options();
+    dump_stack(stk, &options, buf);
+    snprintf(line, sizeof(line), "(%d to %d): poison\n(%d): 0x00000000\n", DUMP_SIZE, DUMP_SIZE + 19, DUMP_SIZE + 20);
+    assert(strstr(buf, line));
+    unsigned char* corrupted = (unsigned char*) ((int*) inl->data + DUMP_SIZE + 20);
+    for (size_t i = 0; i < sizeof(int); i++) {
+        corrupted[i] = (unsigned char) (uintptr_t) (corrupted + i);
+    }
+
+    // Ranges, the live elements only and limited dumps
+    options.first = 10;
+    options.count = 5;
+    dump_stack(stk, &options, buf);
+    assert(strstr(buf, "[10]: ") && strstr(buf, "[14]: ") && !strstr(buf, "[15]: ") && !strstr(buf, "[9]: "));
+    options = stack_dump_options();
+    options.live_only = true;
+    dump_stack(stk, &options, buf);
+    assert(strstr(buf, "[99]: ") && !strstr(buf, "(100"));
+    options.max_bytes = 100;
+    dump_stack(stk, &options, buf);
+    assert(strstr(buf, "Stopped dumping after 100 bytes") && !strstr(buf, "[99]: "));
+    StackFree_int(stk);
+
+    printf("Dump tests passed\n");
+}
+
+void* cache_thread(void* arg) {
+    unsigned flags = *(unsigned const*) arg;
+    // Rehashing the whole Stack on every operation would make the rounds quadratic
+    StackVerifyPolicy verify_policy = stack_verify_policy(STACK_VERIFY_ROUND_ROBIN);
+    for (size_t i = 0; i < CACHE_ROUNDS; i++) {
+        Stack_int* stk = StackAllocateEx_int(flags);
+        assert(stk);
+        StackSetVerifyPolicy_int(stk, &verify_policy);
+        exercise_stack(stk);
+        StackFree_int(stk);
+    }
+    // The thread's cache is freed when it exits
+    return NULL;
+}
+
+void test_stack_cache() {
+    printf("Start cache testing\n");
+
+    unsigned const flags[] = {
+        STACK_NO_PROTECTION,
+        STACK_USE_ALL & ~STACK_USE_LOG,
+        STACK_GUARD_PAGES | STACK_USE_HASH_FULL | STACK_USE_POISON,
+    };
+    for (size_t i = 0; i < ARR_LENGTH(flags); i++) {
+        stack_cache_drain();
+        Stack_int* stk = StackAllocateEx_int(flags[i]);
+        assert(stk);
+        for (int j = 0; j < CACHE_SIZE; j++) {
+            StackPush_int(stk, j);
+        }
+        void* data = ((StackInline*) stk)->data;
+        size_t capacity = StackCapacity_int(stk);
+        StackFree_int(stk);
+
+        // A Stack of a different kind doesn't get the freed Stack's storage
+        Stack* other = stack_allocate_ex(sizeof(long long), flags[i]);
+        assert(other);
+        assert(((StackInline*) other)->data != data);
+
+        // The next Stack of the same kind does, emptied and with fresh counters
+        stk = StackAllocateEx_int(flags[i]);
+        assert(stk);
+        assert(((StackInline*) stk)->data == data);
+        assert(StackCapacity_int(stk) == capacity && StackEmpty_int(stk));
+        StackStats stats;
+        StackStats_int(stk, &stats);
+        assert(!stats.push_count && stats.peak_size == 0);
+        exercise_stack(stk);
+        assert(StackGetError_int(stk) == STACK_OK);
+        StackFree_int(stk);
+        stack_free(other);
+    }
+
+    // A Stack that fails verification isn't kept, even if its policy wouldn't have checked the data yet
+    STACK_VERIFY_MODE const modes[] = {STACK_VERIFY_ALWAYS, STACK_VERIFY_EVERY_NTH};
+    for (size_t i = 0; i < ARR_LENGTH(modes); i++) {
+        stack_cache_drain();
+        Stack_int* stk = StackAllocateEx_int(STACK_USE_POISON);
+        assert(stk);
+        StackVerifyPolicy policy = stack_verify_policy(modes[i]);
+        StackSetVerifyPolicy_int(stk, &policy);
+        StackInline* inl = (StackInline*) stk;
+        ((char*) inl->data)[0] ^= 1;
+        StackFree_int(stk);
+        stk = StackAllocateEx_int(STACK_USE_POISON);
+        assert(stk);
+        StackPush_int(stk, 0);
+        assert(StackGetError_int(stk) == STACK_OK);
+        StackFree_int(stk);
+    }
+
+    // Nor is any Stack while the cache is off
+    stack_cache_drain();
+    stack_cache_set_limits(0, 0);
+    Stack_int* stk = StackAllocateEx_int(STACK_NO_PROTECTION);
+    assert(stk);
+    StackFree_int(stk);
+    stack_cache_set_limits(16, 1u << 20);
+
+    pthread_t threads[4];
+    for (size_t i = 0; i < ARR_LENGTH(threads); i++) {
+        int created = pthread_create(&threads[i], NULL, cache_thread, (void*) &flags[i % ARR_LENGTH(flags)]);
+        assert(!created);
+    }
+    for (size_t i = 0; i < ARR_LENGTH(threads); i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("Cache tests passed\n");
+}
+
+/*
+ * Count the records of event in a log file that was opened once
+ */
+size_t count_log_records(FILE* file, STACK_LOG_EVENT event) {
+    assert(file);
+
+    StackLogHeader header;
+    size_t read = fread(&header, sizeof(header), 1, file);
+    assert(read == 1);
+    assert(!memcmp(header.magic, STACK_LOG_MAGIC, sizeof(header.magic)));
+    size_t count = 0;
+    StackLogRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        count += record.event == event;
+    }
+    return count;
+}
+
+void test_stack_log() {
+    printf("Start log testing\n");
+
+    // Every record written while the log was open is in the file once it's closed,
+    // even if the log is closed right after it's opened
+    for (size_t i = 0; i < LOG_ROUNDS; i++) {
+        remove(STACK_LOG_FILENAME);
+        Stack_int* stk = StackAllocateEx_int(STACK_USE_LOG);
+        assert(stk);
+        for (int j = 0; j < LOG_SIZE; j++) {
+            StackPush_int(stk, j);
+        }
+        StackFree_int(stk);
+
+        FILE* file = fopen(STACK_LOG_FILENAME, "rb");
+        assert(file);
+        size_t push_count = count_log_records(file, STACK_EVENT_PUSH_DONE);
+        assert(push_count == LOG_SIZE);
+        fclose(file);
+    }
+    remove(STACK_LOG_FILENAME);
+
+    printf("Log tests passed\n");
+}
+
+void test_stack_rewind() {
+    printf("Start rewind testing\n");
+
+    unsigned const flags[] = {
+        STACK_NO_PROTECTION,
+        STACK_USE_ALL & ~STACK_USE_LOG,
+        STACK_SEGMENTED | (STACK_USE_ALL & ~STACK_USE_LOG),
+        STACK_GUARD_PAGES | STACK_USE_HASH_FULL | STACK_USE_POISON,
+    };
+    for (size_t i = 0; i < ARR_LENGTH(flags); i++) {
+        Stack_int* stk = StackAllocateEx_int(flags[i]);
+        assert(stk);
+        for (int j = 0; j < REWIND_BASE; j++) {
+            StackPush_int(stk, j);
+        }
+
+        // Rewinding drops everything pushed since the mark without shrinking
+        StackMark mark = StackMark_int(stk);
+        assert(mark == REWIND_BASE);
+        for (int j = 0; j < REWIND_SIZE; j++) {
+            StackPush_int(stk, -j);
+        }
+        StackMark nested = StackMark_int(stk);
+        StackPush_int(stk, 0);
+        StackRewind_int(stk, nested);
+        assert(StackGetError_int(stk) == STACK_OK && StackSize_int(stk) == REWIND_BASE + REWIND_SIZE);
+        StackRelease_int(stk, nested);
+        size_t capacity = StackCapacity_int(stk);
+        StackRewind_int(stk, mark);
+        assert(StackGetError_int(stk) == STACK_OK);
+        int top = StackTop_int(stk);
+        assert(StackSize_int(stk) == REWIND_BASE && top == REWIND_BASE - 1);
+        assert(StackCapacity_int(stk) == capacity);
+
+        // Marks are released innermost first, and released marks can't be rewound to
+        StackPush_int(stk, 0);
+        nested = StackMark_int(stk);
+        StackRelease_int(stk, mark);
+        assert(StackGetError_int(stk) == STACK_OPERATION_ERROR);
+        StackRelease_int(stk, nested);
+        assert(StackGetError_int(stk) == STACK_OK);
+        StackRewind_int(stk, nested);
+        assert(StackGetError_int(stk) == STACK_OPERATION_ERROR);
+        StackPop_int(stk);
+
+        // The mark stays valid, and pops don't shrink either
+        for (int j = 0; j < REWIND_SIZE; j++) {
+            StackPush_int(stk, j);
+        }
+        StackRewind_int(stk, mark);
+        for (int j = 0; j < REWIND_BASE; j++) {
+            int elem = StackPop_int(stk);
+            assert(elem == REWIND_BASE - 1 - j);
+        }
+        assert(StackGetError_int(stk) == STACK_OK && StackCapacity_int(stk) == capacity);
+
+        // Rewinding past the top is an error
+        StackRewind_int(stk, mark);
+        assert(StackGetError_int(stk) == STACK_OPERATION_ERROR);
+        StackRelease_int(stk, mark);
+        assert(StackGetError_int(stk) == STACK_OK);
+
+        // And so is rewinding or releasing without marks
+        StackRewind_int(stk, 0);
+        assert(StackGetError_int(stk) == STACK_OPERATION_ERROR);
+        StackRelease_int(stk, 0);
+        assert(StackGetError_int(stk) == STACK_OPERATION_ERROR);
+
+        // The Stack shrinks again once the marks are released
+        for (int j = 0; j < 2 * CUSTOM_CAPACITY_STEP; j++) {
+            StackPush_int(stk, j);
+            StackPop_int(stk);
+        }
+        assert(StackGetError_int(stk) == STACK_OK && StackCapacity_int(stk) < capacity);
+        exercise_stack(stk);
+        assert(StackGetError_int(stk) == STACK_OK);
+        StackFree_int(stk);
+    }
+
+    printf("Rewind tests passed\n");
+}
+
+void test_stack_latency() {
+    printf("Start latency testing\n");
+
+    // Buckets follow each other, and none is wider than a sub-bucket of its power of 2
+    for (size_t i = 1; i < STACK_LATENCY_BUCKETS; i++) {
+        uint64_t width = stack_latency_bucket_limit(i) - stack_latency_bucket_limit(i - 1);
+        assert(width >= 1 && width <= stack_latency_bucket_limit(i) / STACK_LATENCY_SUB_BUCKETS + 1);
+    }
+
+    StackLatency before;
+    stack_global_latency(STACK_LATENCY_PUSH, &before);
+    unsigned const flags[] = {
+        STACK_TIMED,
+        STACK_TIMED | (STACK_USE_ALL & ~STACK_USE_LOG),
+        STACK_TIMED | STACK_SEGMENTED | STACK_USE_HASH_FULL | STACK_USE_POISON,
+    };
+    for (size_t i = 0; i < ARR_LENGTH(flags); i++) {
+        Stack_int* stk = StackAllocateEx_int(flags[i]);
+        assert(stk);
+        // Timed Stacks are never pushed to inline, so every push is timed
+        for (int j = 0; j < LATENCY_SIZE; j++) {
+            StackPush_int(stk, j);
+        }
+        for (int j = 0; j < LATENCY_SIZE; j++) {
+            StackPop_int(stk);
+        }
+        assert(StackGetError_int(stk) == STACK_OK);
+
+        StackLatency latency;
+        StackLatency_int(stk, STACK_LATENCY_PUSH, &latency);
+        assert(latency.count == LATENCY_SIZE);
+        size_t total = 0;
+        for (size_t j = 0; j < STACK_LATENCY_BUCKETS; j++) {
+            total += latency.buckets[j];
+        }
+        assert(total == latency.count && latency.min_ns <= latency.max_ns);
+        uint64_t p50 = stack_latency_percentile(&latency, 50.0);
+        uint64_t p99 = stack_latency_percentile(&latency, 99.0);
+        assert(latency.min_ns <= p50 && p50 <= p99 && p99 <= latency.max_ns);
+        assert(stack_latency_percentile(&latency, 100.0) == latency.max_ns);
+        StackLatency_int(stk, STACK_LATENCY_POP, &latency);
+        assert(latency.count == LATENCY_SIZE);
+        StackLatency_int(stk, STACK_LATENCY_RESIZE, &latency);
+        assert(latency.count);
+        StackLatency_int(stk, STACK_LATENCY_REHASH, &latency);
+        assert(!latency.count == !(StackGetFlags_int(stk) & STACK_USE_HASH_FAST));
+        StackLatency_int(stk, STACK_LATENCY_POISON, &latency);
+        assert(!latency.count == !(StackGetFlags_int(stk) & STACK_USE_POISON));
+        StackFree_int(stk);
+    }
+
+    // Freed Stacks' latencies are kept in the global histograms, and untimed Stacks don't record any
+    Stack_int* stk = StackAllocateEx_int(STACK_USE_ALL & ~STACK_USE_LOG);
+    assert(stk);
+    StackPush_int(stk, 0);
+    StackLatency latency;
+    StackLatency_int(stk, STACK_LATENCY_PUSH, &latency);
+    assert(!latency.count && !stack_latency_percentile(&latency, 50.0));
+    StackFree_int(stk);
+    stack_global_latency(STACK_LATENCY_PUSH, &latency);
+    assert(latency.count == before.count + ARR_LENGTH(flags) * LATENCY_SIZE);
+
+    printf("Latency tests passed\n");
+}
+
+void test_stack_huge_pages() {
+    printf("Start huge page testing\n");
+
+    unsigned const flags[] = {
+        STACK_HUGE_PAGES,
+        STACK_HUGE_PAGES | STACK_PREFAULT | (STACK_USE_ALL & ~STACK_USE_LOG),
+        STACK_HUGE_PAGES | STACK_USE_DATA_CANARY | STACK_USE_POISON,
+    };
+    StackVerifyPolicy verify_policy = stack_verify_policy(STACK_VERIFY_ROUND_ROBIN);
+    for (size_t i = 0; i < ARR_LENGTH(flags); i++) {
+        Stack_int* stk = StackAllocateEx_int(flags[i]);
+        assert(stk);
+        assert(StackGetFlags_int(stk) & STACK_HUGE_PAGES);
+        StackSetVerifyPolicy_int(stk, &verify_policy);
+        if (flags[i] & STACK_PREFAULT) {
+            size_t reserved = StackReserve_int(stk, HUGE_SIZE);
+            assert(reserved == HUGE_SIZE);
+            assert(StackCapacity_int(stk) >= HUGE_SIZE);
+            StackReserve_int(stk, 0);
+        }
+
+        // The elements move into a huge page mapping as they grow and back out as they shrink
+        for (int j = 0; j < HUGE_SIZE; j++) {
+            StackPush_int(stk, j);
+        }
+        assert(StackGetError_int(stk) == STACK_OK && StackSize_int(stk) == HUGE_SIZE);
+        for (int j = HUGE_SIZE - 1; j >= 0; j--) {
+            int elem = StackPop_int(stk);
+            assert(elem == j);
+        }
+        assert(StackGetError_int(stk) == STACK_OK);
+        assert(StackCapacity_int(stk) * sizeof(int) < (1u << 21));
+        for (int j = 0; j < HUGE_SIZE / 2; j++) {
+            StackPush_int(stk, j);
+        }
+        assert(StackGetError_int(stk) == STACK_OK);
+        int top = StackTop_int(stk);
+        assert(top == HUGE_SIZE / 2 - 1);
+        StackFree_int(stk);
+    }
+
+    // Storage that is mapped already ignores huge pages
+    Stack_int* stk = StackAllocateEx_int(STACK_SEGMENTED | STACK_HUGE_PAGES);
+    assert(stk && !(StackGetFlags_int(stk) & STACK_HUGE_PAGES));
+    StackFree_int(stk);
+    stk = StackAllocateEx_int(STACK_GUARD_PAGES | STACK_HUGE_PAGES);
+    assert(stk && !(StackGetFlags_int(stk) & STACK_HUGE_PAGES));
+    StackFree_int(stk);
+
+    // Resetting an arena unmaps the huge pages of the Stacks still allocated in it
+    StackArena* arena = stack_arena_create(0);
+    assert(arena);
+    StackAllocator arena_allocator = stack_arena_allocator(arena);
+    stk = (Stack_int*) stack_allocate_in(&arena_allocator, sizeof(int), STACK_HUGE_PAGES | STACK_USE_CANARY);
+    assert(stk);
+    for (int j = 0; j < HUGE_SIZE; j++) {
+        StackPush_int(stk, j);
+    }
+    assert(StackGetError_int(stk) == STACK_OK);
+    stack_arena_reset(arena);
+    stack_arena_destroy(arena);
+
+    printf("Huge page tests passed\n");
+}
+
+typedef struct counting_allocator_t {
+    size_t allocations;
+    size_t live;
+} CountingAllocator;
+
+void* counting_allocate(void* data, size_t size) {
+    CountingAllocator* counts = data;
+    counts->allocations++;
+    counts->live++;
+    return malloc(size);
+}
+
+void* counting_reallocate(void* data, void* p, size_t old_size, size_t new_size) {
+    (void) old_size;
+    CountingAllocator* counts = data;
+    if (!p) {
+        counts->allocations++;
+        counts->live++;
+    }
+    return realloc(p, new_size);
+}
+
+void counting_free(void* data, void* p, size_t size) {
+    (void) size;
+    CountingAllocator* counts = data;
+    if (p) {
+        counts->live--;
+    }
+    free(p);
+}
+
+void test_stack_embedded() {
+    printf("Start embedded storage testing\n");
+
+    unsigned const flags[] = {
+        STACK_NO_PROTECTION,
+        STACK_USE_CANARY | STACK_USE_DATA_CANARY | STACK_USE_HASH_FAST | STACK_USE_POISON,
+    };
+    for (size_t i = 0; i < ARR_LENGTH(flags); i++) {
+        CountingAllocator counts = {0};
+        StackAllocator allocator = {
+            .allocate = counting_allocate,
+            .reallocate = counting_reallocate,
+            .free = counting_free,
+            .data = &counts,
+        };
+        Stack_int* stk = (Stack_int*) stack_allocate_in(&allocator, sizeof(int), flags[i]);
+        assert(stk);
+
+        // Small Stacks are a single allocation
+        for (int j = 0; j < EMBEDDED_SIZE; j++) {
+            StackPush_int(stk, j);
+        }
+        assert(StackGetError_int(stk) == STACK_OK);
+        assert(counts.allocations == 1 && counts.live == 1);
+
+        // Growing moves the elements out, and shrinking moves them back in
+        for (int j = EMBEDDED_SIZE; j < 100 * EMBEDDED_SIZE; j++) {
+            StackPush_int(stk, j);
+        }
+        assert(counts.live == 2);
+        for (int j = 100 * EMBEDDED_SIZE - 1; j >= EMBEDDED_SIZE; j--) {
+            int elem = StackPop_int(stk);
+            assert(elem == j);
+        }
+        size_t shrink_delay = stack_resize_policy(STACK_RESIZE_GEOMETRIC).shrink_delay;
+        for (size_t j = 0; j < 10 * shrink_delay && counts.live > 1; j++) {
+            StackPush_int(stk, 0);
+            StackPop_int(stk);
+        }
+        assert(StackGetError_int(stk) == STACK_OK && counts.live == 1);
+        int top = StackTop_int(stk);
+        assert(top == EMBEDDED_SIZE - 1);
+        StackFree_int(stk);
+        assert(counts.live == 0);
+
+        // The embedded capacity may be chosen at allocation, and 0 leaves it out
+        stk = (Stack_int*) stack_allocate_embedded(&allocator, sizeof(int), flags[i], EMBEDDED_CAPACITY);
+        assert(stk);
+        // Growing geometrically could skip over the embedded capacity
+        size_t reserved = StackReserve_int(stk, EMBEDDED_CAPACITY);
+        assert(reserved == EMBEDDED_CAPACITY);
+        for (int j = 0; j < EMBEDDED_CAPACITY; j++) {
+            StackPush_int(stk, j);
+        }
+        assert(StackGetError_int(stk) == STACK_OK && counts.live == 1);
+        StackPush_int(stk, EMBEDDED_CAPACITY);
+        assert(StackGetError_int(stk) == STACK_OK && counts.live == 2);
+        StackFree_int(stk);
+        stk = (Stack_int*) stack_allocate_embedded(&allocator, sizeof(int), flags[i], 0);
+        assert(stk && counts.live == 2);
+        StackFree_int(stk);
+        assert(counts.live == 0);
+
+        // Embedded elements are aligned for any type, also behind a data canary
+        struct wide_align {
+            char c;
+            wide elem;
+        };
+        Stack_wide* wide_stk = StackAllocateEx_wide(flags[i]);
+        assert(wide_stk);
+        for (int j = 0; j < EMBEDDED_WIDE_SIZE; j++) {
+            StackPush_wide(wide_stk, (wide) j / 3);
+            assert((uintptr_t) ((StackInline*) wide_stk)->data % offsetof(struct wide_align, elem) == 0);
+        }
+        for (int j = EMBEDDED_WIDE_SIZE - 1; j >= 0; j--) {
+            wide elem = StackPop_wide(wide_stk);
+            assert(elem == (wide) j / 3);
+        }
+        assert(StackGetError_wide(wide_stk) == STACK_OK);
+        StackFree_wide(wide_stk);
+    }
+
+    // Cached Stacks are only reused with the same embedded capacity
+    stack_cache_drain();
+    Stack* stk = stack_allocate_embedded(NULL, sizeof(int), STACK_NO_PROTECTION, EMBEDDED_CAPACITY);
+    assert(stk);
+    size_t reserved = stack_reserve(stk, EMBEDDED_CAPACITY);
+    assert(reserved >= EMBEDDED_CAPACITY);
+    stack_free(stk);
+    stk = stack_allocate(sizeof(int));
+    assert(stk && stack_capacity(stk) < EMBEDDED_CAPACITY);
+    stack_free(stk);
+    stk = stack_allocate_embedded(NULL, sizeof(int), STACK_NO_PROTECTION, EMBEDDED_CAPACITY);
+    assert(stk && stack_capacity(stk) >= EMBEDDED_CAPACITY);
+    stack_free(stk);
+
+    // Poison and data canaries cover the embedded storage too, of new Stacks rather than cached ones
+    stack_cache_drain();
+    const STACK_ERROR errors[] = {STACK_POISON_OVERWRITE_ERROR, STACK_DATA_CANARY_OVERWRITE_ERROR};
+    for (size_t i = 0; i < ARR_LENGTH(errors); i++) {
+        Stack_int* stk = StackAllocateEx_int(flags[1]);
+        assert(stk);
+        StackPush_int(stk, 0);
+        // The last byte of the unused elements, or the first byte of the back canary
+        StackInline* inl = (StackInline*) stk;
+        ((char*) inl->data)[StackCapacity_int(stk) * sizeof(int) - 1 + i] ^= 1;
+        assert(StackGetError_int(stk) == errors[i]);
+        StackFree_int(stk);
+    }
+
+    printf("Embedded storage tests passed\n");
+}
+
 int main() {
     test_stack();
+    test_stack_bulk();
+    test_stack_segmented();
+    test_stack_resize_policies();
+    test_stack_stats();
+    test_stack_inline();
+    test_stack_allocators();
+    test_stack_guard_pages();
+    test_stack_verify_policies();
+    test_stack_scrub();
+    test_stack_hash();
+    test_stack_mapped();
+    test_stack_save();
+    test_stack_dump();
+    test_stack_cache();
+    test_stack_log();
+    test_stack_rewind();
+    test_stack_latency();
+    test_stack_huge_pages();
+    test_stack_embedded();
     return 0;
 }